@@ -0,0 +1,179 @@
+/**
+ * @file dual.h
+ *
+ * @brief Header-only forward-mode automatic differentiation with dual numbers.
+ *
+ * A dual number carries a value together with its partial derivatives
+ * w.r.t. N independent variables (e.g. the optimization variables).
+ * Functions templated on the scalar type (polynomial coefficients,
+ * racket contact model, ball flight model) then return exact gradients
+ * in a single pass when called with dual numbers, without a tape and
+ * without any allocation.
+ *
+ * Does not use ARMADILLO.
+ */
+
+#ifndef DUAL_H_
+#define DUAL_H_
+
+#include <math.h>
+
+namespace optim {
+
+// overloads below should not hide the math functions for doubles
+using ::sqrt;
+using ::pow;
+using ::fabs;
+using ::fmax;
+using ::fmin;
+
+/**
+ * @brief Value and its derivatives w.r.t. N variables.
+ *
+ * Comparisons only consider the values, hence branches
+ * (e.g. fmax) select the derivatives of the active branch.
+ */
+template <int N>
+struct dual {
+
+	double val; //!< value
+	double der[N]; //!< partial derivatives
+
+	/** @brief Constant (all derivatives are zero). */
+	dual(const double v = 0.0) : val(v) {
+		for (int i = 0; i < N; i++)
+			der[i] = 0.0;
+	}
+
+	/** @brief Independent variable with index idx (seed). */
+	static dual variable(const double v, const int idx) {
+		dual d(v);
+		d.der[idx] = 1.0;
+		return d;
+	}
+
+	dual & operator+=(const dual & b) {
+		val += b.val;
+		for (int i = 0; i < N; i++)
+			der[i] += b.der[i];
+		return *this;
+	}
+
+	dual & operator-=(const dual & b) {
+		val -= b.val;
+		for (int i = 0; i < N; i++)
+			der[i] -= b.der[i];
+		return *this;
+	}
+
+	dual & operator*=(const dual & b) {
+		for (int i = 0; i < N; i++)
+			der[i] = der[i] * b.val + val * b.der[i];
+		val *= b.val;
+		return *this;
+	}
+
+	dual & operator/=(const dual & b) {
+		const double inv = 1.0 / b.val;
+		val *= inv;
+		for (int i = 0; i < N; i++)
+			der[i] = (der[i] - val * b.der[i]) * inv;
+		return *this;
+	}
+
+	dual & operator+=(const double b) { val += b; return *this; }
+	dual & operator-=(const double b) { val -= b; return *this; }
+
+	dual & operator*=(const double b) {
+		val *= b;
+		for (int i = 0; i < N; i++)
+			der[i] *= b;
+		return *this;
+	}
+
+	dual & operator/=(const double b) { return (*this *= 1.0/b); }
+};
+
+template <int N>
+inline dual<N> operator-(const dual<N> & a) { return dual<N>(a) *= -1.0; }
+
+template <int N>
+inline dual<N> operator+(dual<N> a, const dual<N> & b) { return a += b; }
+template <int N>
+inline dual<N> operator+(dual<N> a, const double b) { return a += b; }
+template <int N>
+inline dual<N> operator+(const double a, dual<N> b) { return b += a; }
+
+template <int N>
+inline dual<N> operator-(dual<N> a, const dual<N> & b) { return a -= b; }
+template <int N>
+inline dual<N> operator-(dual<N> a, const double b) { return a -= b; }
+template <int N>
+inline dual<N> operator-(const double a, const dual<N> & b) { return -b + a; }
+
+template <int N>
+inline dual<N> operator*(dual<N> a, const dual<N> & b) { return a *= b; }
+template <int N>
+inline dual<N> operator*(dual<N> a, const double b) { return a *= b; }
+template <int N>
+inline dual<N> operator*(const double a, dual<N> b) { return b *= a; }
+
+template <int N>
+inline dual<N> operator/(dual<N> a, const dual<N> & b) { return a /= b; }
+template <int N>
+inline dual<N> operator/(dual<N> a, const double b) { return a /= b; }
+template <int N>
+inline dual<N> operator/(const double a, const dual<N> & b) { return dual<N>(a) /= b; }
+
+template <int N>
+inline bool operator<(const dual<N> & a, const dual<N> & b) { return a.val < b.val; }
+template <int N>
+inline bool operator<(const dual<N> & a, const double b) { return a.val < b; }
+template <int N>
+inline bool operator<(const double a, const dual<N> & b) { return a < b.val; }
+template <int N>
+inline bool operator>(const dual<N> & a, const dual<N> & b) { return a.val > b.val; }
+template <int N>
+inline bool operator>(const dual<N> & a, const double b) { return a.val > b; }
+template <int N>
+inline bool operator>(const double a, const dual<N> & b) { return a > b.val; }
+
+/** @brief Chain rule for a scalar function f with value f(a) and derivative f'(a). */
+template <int N>
+inline dual<N> chain(const dual<N> & a, const double f, const double df) {
+	dual<N> d(f);
+	for (int i = 0; i < N; i++)
+		d.der[i] = df * a.der[i];
+	return d;
+}
+
+template <int N>
+inline dual<N> sqrt(const dual<N> & a) {
+	const double s = ::sqrt(a.val);
+	return chain(a, s, 0.5 / s);
+}
+
+template <int N>
+inline dual<N> pow(const dual<N> & a, const double p) {
+	const double ap = ::pow(a.val, p);
+	return chain(a, ap, p * ::pow(a.val, p - 1.0));
+}
+
+template <int N>
+inline dual<N> fabs(const dual<N> & a) {
+	return (a.val < 0.0) ? -a : a;
+}
+
+template <int N>
+inline dual<N> fmax(const dual<N> & a, const dual<N> & b) {
+	return (a.val < b.val) ? b : a;
+}
+
+template <int N>
+inline dual<N> fmin(const dual<N> & a, const dual<N> & b) {
+	return (b.val < a.val) ? b : a;
+}
+
+}
+
+#endif /* DUAL_H_ */
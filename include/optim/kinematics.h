@@ -93,6 +93,33 @@ void calc_racket_state(const double q[NDOF],
                         double normal[NCART],
                         double jacobi[2*NCART][NDOF]);
 
+/**
+ * @brief Calculates racket pos, vel and normal and their derivatives
+ * w.r.t. joint positions.
+ *
+ * Derivatives are computed in closed form from the geometric jacobian
+ * (revolute joints of a serial chain), without additional kinematics calls.
+ * The derivative of the racket velocities w.r.t. joint velocities is equal
+ * to the derivative of the racket positions w.r.t. joint positions.
+ *
+ * @param q Joint positions.
+ * @param qdot Joint velocities.
+ * @param pos Racket positions.
+ * @param vel Racket velocities.
+ * @param normal Racket normals.
+ * @param dpos Derivatives of racket positions w.r.t. q.
+ * @param dvel Derivatives of racket velocities w.r.t. q.
+ * @param dnormal Derivatives of racket normals w.r.t. q.
+ */
+void calc_racket_state(const double q[NDOF],
+                       const double qdot[NDOF],
+                       double pos[NCART],
+                       double vel[NCART],
+                       double normal[NCART],
+                       double dpos[NCART][NDOF],
+                       double dvel[NCART][NDOF],
+                       double dnormal[NCART][NDOF]);
+
 /** @brief Returns the cartesian racket positions */
 void get_position(double q[NDOF]);
 
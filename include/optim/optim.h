@@ -14,12 +14,18 @@
 #define OPTIMPOLY_H_
 
 // optimization and math libraries
-#include <thread>
+#include <memory>
+#include <future>
+#include <atomic>
 #include <math.h>
 #include <nlopt.h>
 #include "string.h" //for bzero
 #include "constants.h"
 #include "kalman.h" // for estimate_prior
+#include "snapshot.h"
+#include "worker_pool.h"
+#include "thread_pool.h"
+#include "dual.h"
 
 // defines
 const int EQ_CONSTR_DIM = 3*NCART;
@@ -32,6 +38,10 @@ using arma::vec;
 using arma::zeros;
 using arma::vec7;
 
+namespace player {
+class BallPath;
+}
+
 namespace optim {
 
 /**
@@ -42,6 +52,9 @@ namespace optim {
  * For FP, we compute desired racket positions, velocities and normals
  * based on predicted ball path inside robot workspace.
  * For DP, we only use the ball predicted positions and velocities.
+ *
+ * If a dense ball path is given, the matrices store only the initial
+ * ball/racket values and the optimizers query the path at any hitting time.
  */
 struct optim_des {
 	mat racket_pos = zeros<mat>(NCART,1); //!< racket desired pos
@@ -49,8 +62,13 @@ struct optim_des {
 	mat racket_normal = zeros<mat>(NCART,1); //!< racket desired normals
 	mat ball_pos = zeros<mat>(NCART,1); //!< incoming ball predicted pos.
 	mat ball_vel = zeros<mat>(NCART,1); //!< incoming ball predicted vels.
+	mat ball_pos_cov; //!< packed predicted ball pos. covariances (xx,yy,zz,xy,xz,yz), empty if not predicted
+	int cov_decim = 1; //!< prediction steps between each column of ball_pos_cov
 	double dt = DT; //!< time step between each prediction
 	int Nmax = 1; //!< max number of time steps for prediction
+	const player::BallPath *ball_path = nullptr; //!< dense ball path, if not NULL used instead of the matrices
+	double ball_land_des[2] = {0.0}; //!< desired landing position (used with ball_path)
+	double time_land_des = 0.8; //!< desired landing time (used with ball_path)
 };
 
 /**
@@ -62,10 +80,62 @@ struct optim_des {
  */
 struct spline_params {
 	double time2hit = 1.0; //!< free-final time (for hitting ball)
+	double cost = 0.0; //!< objective value of the optim. solution
 	mat a = zeros<mat>(NDOF,4); //!< strike poly params of 3rd order
 	mat b = zeros<mat>(NDOF,4); //!< return poly params of 3rd order
 };
 
+/**
+ * @brief Hitting joint state and time found by the optimizer.
+ *
+ * Published by the (detached) optimization thread as a whole
+ * and read in get_params() by the player.
+ */
+struct optim_soln {
+	double qf[NDOF]; //!< joint positions at hitting time
+	double qfdot[NDOF]; //!< joint velocities at hitting time
+	double T; //!< hitting time
+	double cost; //!< objective value of the solution
+};
+
+/**
+ * @brief Last iterate evaluated by NLOPT (anytime optim).
+ *
+ * The objective callback records the iterate and its cost, the constraint
+ * callbacks evaluated at the same iterate record the max. constraint violation.
+ */
+struct optim_iterate {
+	double x[2*NDOF+1]; //!< optim. variables
+	double cost; //!< objective value
+	double violation; //!< max. constraint violation (abs. for equality constraints)
+	bool pending; //!< not yet checked for feasibility
+};
+
+/**
+ * @brief Outcome of the last multi-start optim.
+ *
+ * Written by the racing threads, valid once the optim job has finished.
+ */
+struct race_result {
+	int winner = -1; //!< start that won the race, -1 if none
+	double time_won = 0.0; //!< time (ms) at which the race was won
+	std::vector<int> exit_codes; //!< NLOPT exit code of each start, 0 if the start was skipped
+	std::vector<double> stop_times; //!< time (ms) at which each start returned
+};
+
+/**
+ * @brief Initial ball state (and topspin) estimated in another thread.
+ *
+ * Published by estimate_prior() for the player to initialize its filter.
+ */
+struct ball_prior {
+	int id; //!< id of the request (player drops estimates of earlier balls)
+	double time; //!< time of the estimate (time of the last observation)
+	double x[2*NCART]; //!< ball state
+	double P[2*NCART][2*NCART]; //!< covariance of the ball state
+	double topspin; //!< estimated topspin (revolutions/sec)
+};
+
 /**
  * @brief Desired/actual joint positions, velocities, accelerations.
  *
@@ -116,15 +186,57 @@ protected:
 	bool lookup = false; //!< use lookup table methods to init. optim params.
 	bool verbose = true; //!< verbose output printed
 	bool moving = false; //!< robot is already moving so use last computed values to init.
-	bool update = false; //!< optim finished and soln. seems valid
-	bool running = false; //!< optim still RUNNING
-	bool detach = false; //!< detach optim in another thread
+	bool detach = false; //!< do not wait for the optim job to finish
 	mat lookup_table; //!< lookup table used to init. optim values
 	nlopt_opt opt; //!< optimizer from NLOPT library
 
 	double qf[NDOF] = {0.0}; //!< saved joint positions after optim
 	double qfdot[NDOF] = {0.0}; //!< saved joint velocities after optim
 	double T = 1.0; //!< saved hitting time after optim terminates
+	player::Snapshot<optim_soln> soln; //!< last valid qf,qfdot,T (and cost) published by the optim thread
+	unsigned long soln_version = 0; //!< version of the last soln. used (or dropped) by the player
+	std::shared_ptr<player::WorkerPool> pool; //!< workers running the optim jobs (shared with the player)
+	std::shared_future<bool> job; //!< last optim job, ready when the optim has finished
+	int num_starts = 1; //!< number of initial guesses raced by the multi-start optim
+	double start_deadline = 0.1; //!< max. time (sec.) of the multi-start optim, shared by all starts
+	std::shared_ptr<player::ThreadPool> start_pool; //!< threads racing the initial guesses
+	std::vector<std::shared_ptr<Optim>> racers; //!< copies racing the initial guesses, created once
+	const std::atomic<bool> *race_stop = nullptr; //!< NLOPT of a racer stops once set (race is won)
+	race_result race; //!< outcome of the last multi-start optim
+	bool anytime = false; //!< optim within the time-to-hit and publish the best feasible iterate
+	double act_margin = 0.05; //!< time (sec.) left for actuation before the predicted hit (anytime)
+	bool tracking = false; //!< iterates are tracked in the NLOPT callbacks (anytime optim running)
+	optim_iterate iterate; //!< last iterate evaluated by NLOPT
+	double best_cost = 0.0; //!< cost of the last published solution (best feasible iterate for the anytime optim)
+	double t_start = 0.0; //!< start time of the anytime optim
+
+	/**
+	 * @brief Time until the predicted ball reaches the racket at rest posture.
+	 *
+	 * Used as the time budget of the anytime optim. Returns the prediction horizon
+	 * if the ball does not reach the racket.
+	 */
+	virtual double predict_time2hit() const;
+
+	/**
+	 * @brief Publish the last iterate if it is feasible and better than the last published.
+	 *
+	 * The last iterate is checked with test_soln() once the next iterate is
+	 * evaluated (i.e. all of its constraints are evaluated) or the optim terminates.
+	 */
+	void check_iterate();
+
+	/** @brief Publish qf,qfdot and the given hitting time as a valid solution (optim thread). */
+	void publish_soln(const double T_hit);
+
+	/**
+	 * @brief Submit a job to the worker pool and wait for it unless detached.
+	 *
+	 * A pool with one worker is started if none was set.
+	 */
+	std::shared_future<bool> submit(const std::function<void()> & fun,
+	                                const int priority,
+	                                const double timeout = 0.0);
 
 	/** @brief Initialize optimization parameters using a lookup table.
 	 *
@@ -139,6 +251,46 @@ protected:
 	virtual double test_soln(const double *x) const = 0;
 	virtual void finalize_soln(const double *x, const double dt) = 0;
 
+	/**
+	 * @brief Copy of the optimizer with its own NLOPT instance.
+	 *
+	 * NLOPT callbacks of the copy use the copy, so that the copies
+	 * can be optimized concurrently (multi-start).
+	 */
+	virtual Optim* clone() const = 0;
+
+	/**
+	 * @brief Copy the problem to solve to a copy made with clone().
+	 *
+	 * Copies the initial and rest states, the desired racket/ball parameters
+	 * and the last solution, i.e. what may change between two optims.
+	 * Configuration (e.g. weights of DP) is copied only by clone().
+	 */
+	virtual void copy_problem(Optim & racer) const;
+
+	/**
+	 * @brief Initial guesses for the multi-start optim.
+	 *
+	 * In order: rest posture, last solution (if moving), kNN lookup
+	 * neighbours (if lookup is on) and random perturbations of these,
+	 * until num_starts guesses are available.
+	 *
+	 * @param starts Initial guesses, one column each (output).
+	 */
+	void init_multi_start(mat & starts);
+
+	/**
+	 * @brief Race NLOPT instances started from different initial guesses.
+	 *
+	 * The first solution that passes test_soln() wins and the other instances
+	 * stop at their next callback (see race_stop). Instances that do not converge
+	 * return their best solution at the deadline, which is then tested as well.
+	 * The starts share the deadline: a start gets the time left when it is
+	 * launched and is skipped if no time is left.
+	 * The racers are cloned at the first multi-start optim and reused afterwards.
+	 */
+	void optim_multi_start();
+
 	/**
 	 * @brief Resting posture optimization that tries to find good resting joint positions
 	 *
@@ -175,16 +327,16 @@ public:
 	/**
 	 * @brief If the optimization was successful notify the Player class
 	 *
-	 * If the optimization was successful, update is turned ON and the table tennis
+	 * If the optimization published a solution that is not used yet, the table tennis
 	 * player can launch/update the polynomial trajectories.
-	 * @return update
+	 * @return TRUE if there is a new solution
 	 */
 	bool check_update();
 
 	/**
-	 * @brief Tells the player optimization thread is still BUSY.
+	 * @brief Tells the player optimization job is still BUSY (queued or running).
 	 *
-	 * If the (detached) thread is still running then table tennis player does not
+	 * If the (detached) job is still running then table tennis player does not
 	 * update/launch new trajectories.
 	 * @return running
 	 */
@@ -208,15 +360,63 @@ public:
 	 */
 	void set_detach(bool flag);
 
+	/**
+	 * @brief Run the optimizations on the given (long-lived) workers.
+	 * @param pool Worker pool, e.g. shared with the player.
+	 */
+	void set_worker_pool(const std::shared_ptr<player::WorkerPool> & pool);
+
 	/** @brief Print verbose optimization output (detailed optimization results are printed) */
 	void set_verbose(bool flag);
 
+	/**
+	 * @brief Race several initial guesses concurrently (multi-start mode).
+	 *
+	 * @param num_starts Number of initial guesses (multi-start is OFF if one).
+	 * @param num_threads Number of threads racing the guesses (including the optim job).
+	 * @param deadline Max. time of the race (sec.), shared by all starts.
+	 */
+	void set_multi_start(const int num_starts, const int num_threads, const double deadline);
+
+	/** @brief Outcome of the last multi-start optim (call once the optim job has finished). */
+	race_result get_race_result() const;
+
+	/**
+	 * @brief Deadline-driven (anytime) optimization.
+	 *
+	 * NLOPT runs at most until the predicted time-to-hit minus the actuation margin.
+	 * Every feasible iterate that improves the cost is published as soon as it is
+	 * found, hence the player can launch the strike before NLOPT terminates.
+	 *
+	 * @param flag Turn anytime optim ON/OFF.
+	 * @param margin Time (sec.) left for actuation before the predicted hit.
+	 */
+	void set_anytime(bool flag, const double margin);
+
+	/** @brief Time (sec.) the anytime optim is allowed to run: predicted time-to-hit minus actuation margin. */
+	double get_anytime_budget() const;
+
+	/**
+	 * @brief Record the cost of an iterate (called by the NLOPT objective).
+	 *
+	 * Also stops NLOPT if the instance is a racer and the race is won.
+	 */
+	void track_cost(const double *x, const double cost);
+
+	/**
+	 * @brief Record the constraint violations of the last iterate (called by the NLOPT constraints).
+	 * @param eq TRUE for equality constraints (violation is the absolute value).
+	 */
+	void track_violation(const double *x, const unsigned m, const double *result, const bool eq);
+
 	/**
 	 * @brief If optimization succeeded, update polynomial parameters p
 	 *
 	 * If the optimizers finished running and terminated successfully,
 	 * then generates the striking and returning polynomial parameters
-	 * from qf, qfdot and T, and given the actual joint states qact, qactdot
+	 * from qf, qfdot and T, and given the actual joint states qact, qactdot.
+	 * The solution is read from the snapshot published by the optim thread,
+	 * hence the player never reads a half-written solution.
 	 *
 	 */
 	bool get_params(const joint & qact, spline_params & p);
@@ -224,7 +424,9 @@ public:
 	/**
 	 * @brief Run q_rest optimization to find a suitable resting posture
 	 *
-	 * Detaches the optimization if detach is set to true
+	 * Detaches the optimization if detach is set to true.
+	 * Runs with low priority and is dropped if it cannot start
+	 * before the robot returns to rest (time2return).
 	 */
 	void run_qrest_optim(vec7 & q_rest_des);
 
@@ -249,7 +451,9 @@ public:
 	 * @brief Runs the optimization.
 	 *
 	 * Detaches the optimization if detach is set to TRUE. The
-	 * optimization method is shared by all Optim class descendants (VHP,FP,DP).
+	 * optimization method is shared by all Optim class descendants (VHP,FP,DP)
+	 * and runs as a job on the worker pool.
+	 * Solutions of earlier runs that are not used yet are dropped.
 	 */
 	void run();
 };
@@ -301,6 +505,14 @@ protected:
 	 */
 	virtual void finalize_soln(const double x[], const double time_elapsed);
 
+	virtual Optim* clone() const;
+
+	/** @brief Hitting time is fixed by the predicted ball crossing the hitting plane. */
+	virtual double predict_time2hit() const;
+
+	/** @brief Create the NLOPT instance (equality constrained COBYLA) */
+	void init_nlopt();
+
 public:
 	double limit_avg[NDOF];
 
@@ -360,6 +572,11 @@ protected:
 	 */
 	virtual void finalize_soln(const double x[], const double time_elapsed);
 
+	virtual Optim* clone() const;
+
+	/** @brief Create the NLOPT instance (SLSQP with kinematics and joint limit constraints) */
+	void init_nlopt();
+
 public:
 
 	/** @brief Constructor useful for lazy player (subclass) */
@@ -367,6 +584,10 @@ public:
 
 	/**
 	 * @brief Initialize the NLOPT optimization procedure here for FP
+	 *
+	 * Gradient-based SLSQP is used, since the gradients of the cost and the
+	 * kinematics constraints are available in closed form.
+	 *
 	 * @param qrest_ Fixed resting posture
 	 * @param lb_ Fixed joint lower limits
 	 * @param ub_ Fixed joint upper limits
@@ -410,19 +631,26 @@ private:
 	 */
 	virtual void finalize_soln(const double x[],
 	                            const double time_elapsed);
+
+	virtual Optim* clone() const;
+
+	/** @brief Copy the problem to a racer and drop its cached ball landing. */
+	virtual void copy_problem(Optim & racer) const;
+
 	std::vector<double> mult_vel = {0.9,0.8,0.83};
 
 public:
 
 	bool land; //!< compute strikes for landing if true or hitting only if false
 	weights w; //!< weights of optimization
+	typedef dual<OPTIM_DIM> dvar; //!< value with derivatives w.r.t. optim params
 	double x_last[OPTIM_DIM] = {0.0}; //!< last iteration values
-	double t_land = -1.0; //!< computed landing time
-	double t_net = -1.0; //!< computed net passing time
-	double x_land[NCART] = {0.0}; //!< computed ball landing pos.
-	double x_net[NCART] = {0.0}; //!< computed ball net pass. pos.
-	double dist_b2r_norm = 1.0; //!< normal dist. from ball to racket
-	double dist_b2r_proj = 1.0; //!< dist. from ball to racket proj. to racket plane
+	dvar t_land = -1.0; //!< computed landing time
+	dvar t_net = -1.0; //!< computed net passing time
+	dvar x_land[NCART]; //!< computed ball landing pos.
+	dvar x_net[NCART]; //!< computed ball net pass. pos.
+	dvar dist_b2r_norm = 1.0; //!< normal dist. from ball to racket
+	dvar dist_b2r_proj = 1.0; //!< dist. from ball to racket proj. to racket plane
 	std::vector<double> penalty_loc = {0.0, 0.23, 0.0, -3.22}; //!< penalty locations for landing and net
 
 	/**
@@ -448,8 +676,9 @@ public:
 	 * also calculate the costs for passing it over to a desired net location (x,z loc)
 	 * and landing to a desired landing point (x,y loc.)
 	 * @return hitting and landing penalties (if land is turned on combined, else only hitting)
+	 * and their derivatives w.r.t. optim params
 	 */
-	double calc_punishment();
+	dvar calc_punishment();
 
 	/**
 	 * @brief Calculate the net hitting time and the landing time
@@ -460,6 +689,8 @@ public:
 	 * landTime and netTime variables and return these when the optimization
 	 * variable is the same (meaning optimization algorithm did not update it yet).
 	 *
+	 * Times and ball positions are computed with their (exact) derivatives
+	 * w.r.t. the optim params for the gradients of the cost and the constraints.
 	 */
 	void calc_times(const double x[]);
 
@@ -471,9 +702,26 @@ public:
 	 * For satisfying hitting constraints.
 	 *
 	 */
-	void calc_hit_distance(const double bp[],
-	                        const double rp[],
-	                        const double n[]);
+	void calc_hit_distance(const dvar bp[],
+	                        const dvar rp[],
+	                        const dvar n[]);
+
+	/**
+	 * @brief Evaluate the cost (NLOPT objective), e.g. to check its gradient.
+	 * @param x Optim params
+	 * @param grad Gradient of the cost (output, not computed if NULL)
+	 * @return Cost
+	 */
+	double calc_cost(const double x[], double grad[]);
+
+	/**
+	 * @brief Evaluate the landing (if land is true) or hitting inequality constraints.
+	 * @param x Optim params
+	 * @param result Constraint values (output)
+	 * @param grad Row-major jacobian of the constraints (output, not computed if NULL)
+	 * @return Number of constraints
+	 */
+	int calc_ineq_constr(const double x[], double result[], double grad[]);
 
 	/**
 	 * @brief Initialize Defensive Player
@@ -504,12 +752,24 @@ void joint_limits_ineq_constr(unsigned m,
 /**
  * @brief Calculate the polynomial coefficients from the optimized variables qf,qfdot,T
  * p(t) = a1*t^3 + a2*t^2 + a3*t + a4
+ *
+ * Scalar type can be a dual number to differentiate the coefficients
+ * w.r.t. the optimized variables.
  */
+template <typename Scalar>
 void calc_strike_poly_coeff(const double *q0,
                             const double *q0dot,
-                            const double *x,
-		                    double *a1,
-		                    double *a2);
+                            const Scalar *x,
+		                    Scalar *a1,
+		                    Scalar *a2) {
+
+	const Scalar & T = x[2*NDOF];
+
+	for (int i = 0; i < NDOF; i++) {
+		a1[i] = (2/pow(T,3))*(q0[i]-x[i]) + (1/(T*T))*(q0dot[i] + x[i+NDOF]);
+		a2[i] = (3/(T*T))*(x[i]-q0[i]) - (1/T)*(x[i+NDOF] + 2*q0dot[i]);
+	}
+}
 
 /**
  * @brief Calculate the returning polynomial coefficients from the optimized variables qf,qfdot
@@ -581,6 +841,39 @@ optim_des calc_racket_strategy(const mat & balls_predicted,
                                const double time_land_des,
                                optim_des & racket_params);
 
+/**
+ * @brief Compute desired racket strategy on a dense ball path.
+ *
+ * Instead of computing the racket pos,vel,normals for each predicted ball,
+ * the path and the desired landing are stored in racket_params and
+ * the racket values are computed on demand at the hitting time.
+ * Only the first column (t = 0) of the matrices is filled.
+ * The ball path should not be modified while optimization is running.
+ */
+optim_des calc_racket_strategy(const player::BallPath & ball_path,
+                               const arma::vec2 & ball_land_des,
+                               const double time_land_des,
+                               optim_des & racket_params);
+
+/**
+ * @brief Compute desired racket pos,vel,normal for a single incoming ball.
+ *
+ * Same strategy as calc_racket_strategy() (outgoing ball velocity
+ * with the air drag hack, mirror law) using plain arrays.
+ *
+ * @param ball_pos Incoming ball position (racket centre is placed here)
+ * @param ball_vel Incoming ball velocity
+ * @param ball_land_des Desired landing position of the ball
+ * @param time_land_des Desired landing time
+ */
+void calc_racket_des(const double ball_pos[NCART],
+                     const double ball_vel[NCART],
+                     const double ball_land_des[2],
+                     const double time_land_des,
+                     double racket_pos[NCART],
+                     double racket_vel[NCART],
+                     double racket_normal[NCART]);
+
 /**
  * @brief Compute desired racket pos,vel,normals and/or ball positions, vels. assuming spin model
  * Function that calculates a racket strategy : positions, velocities and racket normal
@@ -600,17 +893,48 @@ optim_des calc_spin_racket_strategy(const mat & balls_predicted,
 /**
  * @brief Estimates initial ball state + ball topspin
  *
+ * Fits the spin model to the observations (least squares) with a
+ * fixed-size Levenberg-Marquardt loop. The Jacobian is formed from the
+ * sensitivities of the ball positions w.r.t. initial state and topspin,
+ * propagated along the integration with the ball kernel.
+ *
  * @param observations Ball positions
  * @param times Ball time stamps for each position observation
  * @param verbose Verbose output for estimation if true
- * @param NLOPT_FINISHED If detached, the thread will communicate that it has finished
+ * @param init_ball Set to true once the filter is initialized
  * @param filter Filter state will be initialized after estimation
+ * @param topspin Estimated topspin (output). Filter keeps a pointer to it,
+ * hence it should outlive the filter predictions.
  */
 void estimate_prior(const mat & observations,
                     const mat & times,
                     const int & verbose,
                     bool & init_ball,
-                    player::EKF & filter);
+                    player::EKF & filter,
+                    double & topspin);
+
+/**
+ * @brief Estimates initial ball state + ball topspin in another thread.
+ *
+ * Same estimation as above, but a copy of the filter is initialized
+ * and its state at the last observation is published to the snapshot,
+ * so that the player (reading the snapshot) is never blocked and never
+ * sees a half-initialized filter. Arguments other than the snapshot
+ * should be passed by value to the thread.
+ *
+ * @param observations Ball positions
+ * @param times Ball time stamps for each position observation
+ * @param verbose Verbose output for estimation if true
+ * @param id Id of the request copied to the published estimate
+ * @param filter Filter (copied) used for the estimation
+ * @param prior Snapshot the estimate is published to
+ */
+void estimate_prior_snapshot(const mat & observations,
+                             const mat & times,
+                             const int verbose,
+                             const int id,
+                             const player::EKF & filter,
+                             player::Snapshot<ball_prior> & prior);
 }
 
 #endif /* OPTIMPOLY_H_ */
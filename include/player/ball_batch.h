@@ -0,0 +1,122 @@
+/**
+ * @file ball_batch.h
+ *
+ * @brief Batched table tennis ball simulator (structure-of-arrays).
+ *
+ * Integrates N balls together with the same flight and contact models
+ * as the TableTennis class. Useful for Monte Carlo landing statistics,
+ * propagating sigma points and offline lookup table generation.
+ */
+
+#ifndef BALL_BATCH_H_
+#define BALL_BATCH_H_
+
+#include <vector>
+#include "tabletennis.h"
+
+namespace player {
+
+/**
+ * @brief Batched table tennis ball simulator.
+ *
+ * Ball positions, velocities and spins are stored dimension by dimension
+ * (structure-of-arrays) so that one integration step over all balls is
+ * a single branch-free loop that the compiler can vectorize.
+ * Contacts are resolved with masks (select instead of branching) and
+ * per-ball statistics follow the same rules as the TableTennis class.
+ */
+class BallBatch {
+
+private:
+
+	bool SPIN_MODE; // turn on prediction with a spin model
+	int N; // number of balls
+	ball_params params; // ball prediction parameters
+
+	std::vector<double> pos[NCART]; // ball positions
+	std::vector<double> vel[NCART]; // ball velocities
+	std::vector<double> spin[NCART]; // ball angular velocities, zero if spin mode is OFF
+
+	std::vector<int> contacts; // contacts during the last step (bitwise OR of contact flags)
+	std::vector<int> hit; // status flags, see struct status
+	std::vector<int> has_bounced;
+	std::vector<int> legal_bounce;
+	std::vector<int> has_landed;
+	std::vector<int> legal_land;
+	std::vector<int> touched_ground;
+
+	/**
+	 * @brief Integrate all balls dt seconds with symplectic Euler and check contacts.
+	 *
+	 * @param robot Racket to check for contact, or nullptr to skip racket contact.
+	 * @param dt Prediction horizon.
+	 */
+	void step(const racket *robot, const double dt);
+
+public:
+
+	/**
+	 * @brief Initialize N balls with zero positions, velocities and spin.
+	 *
+	 * @param num_balls Number of balls in the batch.
+	 * @param spin_flag Turn ON for spin modelling.
+	 * @param params Ball prediction parameters shared by all balls.
+	 */
+	BallBatch(const int num_balls,
+	          const bool spin_flag = false,
+	          const ball_params & params = ball_params());
+
+	/** @return Number of balls in the batch. */
+	int size() const { return N; }
+
+	/** @brief Set the state of ball idx as a 6-vector. */
+	void set_ball_state(const int idx, const vec6 & ball_state);
+
+	/** @return State of ball idx as a 6-vector. */
+	vec6 get_ball_state(const int idx) const;
+
+	/**
+	 * @brief Set the states of all the balls.
+	 * @param ball_states 6 x N matrix of ball positions and velocities.
+	 */
+	void set_ball_states(const mat & ball_states);
+
+	/** @return 6 x N matrix of ball positions and velocities. */
+	mat get_ball_states() const;
+
+	/** @brief Set topspin of all the balls equal to argument (revolutions/sec) */
+	void set_topspin(const double val);
+
+	/** @brief Set angular velocity of ball idx. Turns ON spin mode. */
+	void set_spin(const int idx, const vec3 & ball_spin);
+
+	/** @brief Reset statistics of all the balls. */
+	void reset_stats();
+
+	/**
+	 * @brief Integrate all the balls dt seconds.
+	 *
+	 * Checks contacts with table, net and ground.
+	 */
+	void integrate_ball_states(const double dt);
+
+	/**
+	 * @brief Integrate all the balls dt seconds.
+	 *
+	 * Checks contacts with table, net, the (shared) robot racket and ground.
+	 */
+	void integrate_ball_states(const racket & robot, const double dt);
+
+	/** @return Contacts of ball idx during the last step (bitwise OR of contact flags). */
+	int get_contacts(const int idx) const { return contacts[idx]; }
+
+	/** @return Game statistics of ball idx. */
+	status get_status(const int idx) const;
+
+	/** @return Number of balls that have landed legally. */
+	int count_legal_lands() const;
+};
+
+}
+
+#endif /* BALL_BATCH_H_ */
@@ -0,0 +1,515 @@
+/**
+ * @file ball_kernel.h
+ *
+ * @brief Allocation-free ball stepping kernel.
+ *
+ * Plain-old-data ball state and inlined flight and contact models.
+ * TableTennis class, the EKF function pointers (calc_next_ball, calc_spin_ball)
+ * and predict_till_net all integrate the ball through these functions,
+ * so that predicting one step does not construct any ARMADILLO objects.
+ *
+ * Does not use ARMADILLO.
+ */
+
+#ifndef BALL_KERNEL_H_
+#define BALL_KERNEL_H_
+
+#include <math.h>
+#include "constants.h"
+#include "table.h"
+
+namespace player {
+
+/**
+ * @brief Ball parameters used to predict future ball path
+ * and to calculate desired racket parameters.
+ */
+struct ball_params {
+
+	/* Contact Coefficients */
+	double CRT = 0.88; //!< coefficient of restitution for the table (i.e. rebound z-velocity multiplier)
+	double CFTY = 0.72; //!< coefficient of table contact model on Y-direction
+	double CFTX = 0.68; //!< coefficient of table contact model on X-direction
+	double CRR = 0.78; //!< coefficent of restitution for racket
+
+	double Cdrag = 0.1414; 	//!< Air drag coefficient
+	double gravity = -9.802; //!< gravity
+	double Clift = 0.001; //!< coefficient of lift for the magnus force
+	double mu = 0.10; //!< dynamic coefficient of friction
+	double init_topspin = -50.0; //!< initial topspin amount
+};
+
+/**
+ * @brief Ball positions and velocities as plain arrays.
+ *
+ * Same memory layout as the 6-dim. ball state vectors [pos,vel].
+ * Scalar type can be a dual number to differentiate the flight model.
+ */
+template <typename T>
+struct basic_ball_pod {
+	T pos[NCART]; //!< ball positions
+	T vel[NCART]; //!< ball velocities
+};
+
+typedef basic_ball_pod<double> ball_pod;
+
+/**
+ * @brief Contacts detected by the kernel during one step.
+ *
+ * ball_step() returns a bitwise OR of these flags.
+ */
+enum contact {
+	NO_CONTACT = 0,
+	TABLE_CONTACT = 1,
+	NET_CONTACT = 2,
+	RACKET_CONTACT = 4,
+	GROUND_CONTACT = 8,
+};
+
+/** @brief Z-level of the ball centre when touching the table */
+static const double contact_table_level = floor_level - table_height + ball_radius;
+
+/** @brief Y-location of the net */
+static const double net_y = dist_to_table - 0.5 * table_length;
+
+/**
+ * @brief Ball accelerations due to gravity, air drag and (if spin is not NULL)
+ * the Magnus force.
+ *
+ * @param params Ball parameters.
+ * @param spin Ball angular velocity or nullptr for the spin-free model.
+ * @param vel Ball velocity.
+ * @param acc Ball accelerations (output).
+ */
+template <typename T>
+inline void ball_flight_model(const ball_params & params,
+                              const double *spin,
+                              const T vel[NCART],
+                              T acc[NCART]) {
+
+	const T speed = sqrt(vel[X]*vel[X] + vel[Y]*vel[Y] + vel[Z]*vel[Z]);
+	acc[X] = -vel[X] * params.Cdrag * speed;
+	acc[Y] = -vel[Y] * params.Cdrag * speed;
+	acc[Z] = params.gravity - vel[Z] * params.Cdrag * speed;
+	if (spin != nullptr) { // add Magnus force
+		acc[X] += params.Clift * (spin[Y]*vel[Z] - spin[Z]*vel[Y]);
+		acc[Y] += params.Clift * (spin[Z]*vel[X] - spin[X]*vel[Z]);
+		acc[Z] += params.Clift * (spin[X]*vel[Y] - spin[Y]*vel[X]);
+	}
+}
+
+/**
+ * @brief FIRST ORDER Symplectic Euler integration for dt seconds.
+ *
+ * Velocities are integrated first and the updated velocities are used
+ * to integrate the positions. Contacts are not checked.
+ */
+template <typename T>
+inline void ball_symplectic_euler(const ball_params & params,
+                                  const double *spin,
+                                  const double dt,
+                                  const basic_ball_pod<T> & ball,
+                                  basic_ball_pod<T> & cand) {
+
+	T acc[NCART];
+	ball_flight_model(params,spin,ball.vel,acc);
+	for (int i = 0; i < NCART; i++) {
+		cand.vel[i] = ball.vel[i] + acc[i] * dt;
+		cand.pos[i] = ball.pos[i] + cand.vel[i] * dt;
+	}
+}
+
+/**
+ * @brief Condition to determine if ball hits the table coming from above.
+ */
+inline bool ball_hits_table(const double pos[NCART], const double vel[NCART]) {
+
+	static const double table_human_end = dist_to_table - table_length;
+	return (pos[Y] > table_human_end) && (pos[Y] < dist_to_table) &&
+	       (fabs(pos[X] - table_center) <= table_width/2.0) &&
+	       (pos[Z] <= contact_table_level) && (vel[Z] < 0.0);
+}
+
+/**
+ * @brief Table contact model that updates the rebound velocities only.
+ *
+ * Uses the spin model (roll/slide type contact) if spin is not NULL.
+ * Spin itself is not changed!
+ */
+inline void ball_table_rebound(const ball_params & params,
+                               const double *spin,
+                               double vel[NCART]) {
+
+	if (spin != nullptr) {
+		const double vbx = vel[X] - ball_radius * spin[Y];
+		const double vby = vel[Y] + ball_radius * spin[X];
+		const double alpha = params.mu * (1 + params.CRT) * fabs(vel[Z]) /
+		                     sqrt(vbx*vbx + vby*vby);
+		vel[X] = (1.0 - alpha) * vel[X] + alpha * ball_radius * spin[Y];
+		vel[Y] = (1.0 - alpha) * vel[Y] - alpha * ball_radius * spin[X];
+		vel[Z] = -params.CRT * vel[Z];
+	}
+	else {
+		vel[X] *= params.CFTX;
+		vel[Y] *= params.CFTY;
+		vel[Z] *= -params.CRT;
+	}
+}
+
+/**
+ * @brief Checks contact with net.
+ *
+ * If the net's distance to the last y-state and to the candidate y-state
+ * do not have the same sign, the ball is in contact with the net and
+ * the candidate is reflected with a (simplistic) net contact model.
+ *
+ * @return TRUE if the ball touches the net.
+ */
+inline bool ball_net_contact(const double last_pos_y, ball_pod & cand) {
+
+	if ((cand.pos[Z] <= contact_table_level + net_height) &&
+			(fabs(cand.pos[X]) <= table_width/2.0 + net_overhang)) {
+		const double dist_state_net = net_y - last_pos_y;
+		const double dist_cand_net = net_y - cand.pos[Y];
+		if (dist_state_net >= 0.0 && dist_cand_net < 0.0) { // reflect to front
+			cand.vel[Y] *= -net_restitution;
+			cand.pos[Y] = net_y + (0.5 * net_thickness + ball_radius);
+			return true;
+		}
+		else if (dist_state_net < 0.0 && dist_cand_net >= 0.0) { // reflect to back
+			cand.vel[Y] *= -net_restitution;
+			cand.pos[Y] = net_y - (0.5 * net_thickness + ball_radius);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Checks contact with racket and applies the (mirror law) racket contact model.
+ *
+ * The racket contact model in vector form is O = I + (1 + eps_R)*N*N'*(V - I)
+ *
+ * @return TRUE if the ball touches the racket.
+ */
+inline bool ball_racket_contact(const ball_params & params,
+                                const double racket_pos[NCART],
+                                const double racket_vel[NCART],
+                                const double racket_normal[NCART],
+                                ball_pod & cand) {
+
+	double racket2ball[NCART];
+	double normal_dist = 0.0, sq_dist = 0.0;
+	for (int i = 0; i < NCART; i++) {
+		racket2ball[i] = racket_pos[i] - cand.pos[i];
+		normal_dist += racket_normal[i] * racket2ball[i];
+		sq_dist += racket2ball[i] * racket2ball[i];
+	}
+	const double parallel_dist = sqrt(fabs(sq_dist - normal_dist*normal_dist));
+	if (parallel_dist < racket_radius && fabs(normal_dist) < ball_radius) {
+		double speed = 0.0;
+		for (int i = 0; i < NCART; i++)
+			speed += racket_normal[i] * (racket_vel[i] - cand.vel[i]);
+		speed *= (1 + params.CRR);
+		for (int i = 0; i < NCART; i++)
+			cand.vel[i] += speed * racket_normal[i];
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Checks contact with ground, zeros the velocities and sets the
+ * candidate to the last position on floor level.
+ *
+ * @return TRUE if the ball touches the ground.
+ */
+inline bool ball_ground_contact(const ball_pod & ball, ball_pod & cand) {
+
+	if (cand.pos[Z] <= floor_level) {
+		for (int i = 0; i < NCART; i++) {
+			cand.vel[i] = 0.0;
+			cand.pos[i] = ball.pos[i];
+		}
+		cand.pos[Z] = floor_level;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Integrate the ball state dt seconds later in place.
+ *
+ * Checks contacts with table, net and ground (not the racket!)
+ * in the same order as TableTennis::integrate_ball_state().
+ *
+ * @param params Ball parameters.
+ * @param spin Ball angular velocity or nullptr for the spin-free model.
+ * @param dt Prediction horizon.
+ * @param ball Ball state, updated in place.
+ * @return Bitwise OR of the contacts that occurred.
+ */
+inline int ball_step(const ball_params & params,
+                     const double *spin,
+                     const double dt,
+                     ball_pod & ball) {
+
+	int contacts = NO_CONTACT;
+	ball_pod cand;
+	ball_symplectic_euler(params,spin,dt,ball,cand);
+	if (ball_hits_table(cand.pos,cand.vel)) {
+		ball_table_rebound(params,spin,cand.vel);
+		contacts |= TABLE_CONTACT;
+	}
+	if (ball_net_contact(ball.pos[Y],cand))
+		contacts |= NET_CONTACT;
+	if (ball_ground_contact(ball,cand))
+		contacts |= GROUND_CONTACT;
+	ball = cand;
+	return contacts;
+}
+
+/**
+ * @brief Jacobian of the flight model accelerations w.r.t. ball velocities.
+ *
+ * Drag term gives -Cdrag * (|v| I + v v'/|v|), the Magnus term (if spin is
+ * not NULL) adds Clift * [spin]_x.
+ *
+ * @param dadv Jacobian (output), dadv[i][j] = d acc[i] / d vel[j].
+ */
+inline void ball_flight_jacobian(const ball_params & params,
+                                 const double *spin,
+                                 const double vel[NCART],
+                                 double dadv[NCART][NCART]) {
+
+	const double speed = sqrt(vel[X]*vel[X] + vel[Y]*vel[Y] + vel[Z]*vel[Z]);
+	for (int i = 0; i < NCART; i++) {
+		for (int j = 0; j < NCART; j++) {
+			dadv[i][j] = (speed > 0.0) ? -params.Cdrag * vel[i] * vel[j] / speed : 0.0;
+		}
+		dadv[i][i] -= params.Cdrag * speed;
+	}
+	if (spin != nullptr) {
+		dadv[X][Y] -= params.Clift * spin[Z];
+		dadv[X][Z] += params.Clift * spin[Y];
+		dadv[Y][X] += params.Clift * spin[Z];
+		dadv[Y][Z] -= params.Clift * spin[X];
+		dadv[Z][X] -= params.Clift * spin[Y];
+		dadv[Z][Y] += params.Clift * spin[X];
+	}
+}
+
+/**
+ * @brief Jacobian of the symplectic Euler step w.r.t. the ball state.
+ *
+ * @param vel Ball velocity before the step.
+ * @param J Jacobian (output), J[i][j] = d cand[i] / d ball[j] with [pos,vel] ordering.
+ */
+inline void ball_symplectic_euler_jacobian(const ball_params & params,
+                                           const double *spin,
+                                           const double dt,
+                                           const double vel[NCART],
+                                           double J[2*NCART][2*NCART]) {
+
+	double dadv[NCART][NCART];
+	ball_flight_jacobian(params,spin,vel,dadv);
+	for (int i = 0; i < NCART; i++) {
+		for (int j = 0; j < NCART; j++) {
+			const double jv = (i == j) + dt * dadv[i][j];
+			J[i][j] = (i == j);
+			J[i][j+NCART] = dt * jv;
+			J[i+NCART][j] = 0.0;
+			J[i+NCART][j+NCART] = jv;
+		}
+	}
+}
+
+/**
+ * @brief Jacobian of the table contact model w.r.t. the incoming velocities.
+ *
+ * @param vel Incoming (pre-bounce) ball velocity.
+ * @param dvdv Jacobian (output), dvdv[i][j] = d vel_out[i] / d vel[j].
+ */
+inline void ball_table_rebound_jacobian(const ball_params & params,
+                                        const double *spin,
+                                        const double vel[NCART],
+                                        double dvdv[NCART][NCART]) {
+
+	for (int i = 0; i < NCART; i++)
+		for (int j = 0; j < NCART; j++)
+			dvdv[i][j] = 0.0;
+	dvdv[Z][Z] = -params.CRT;
+	if (spin != nullptr) {
+		// v_out = v - alpha * vb for X and Y, where vb is the contact point velocity
+		const double vb[2] = {vel[X] - ball_radius * spin[Y],
+		                      vel[Y] + ball_radius * spin[X]};
+		const double k = params.mu * (1 + params.CRT);
+		const double s2 = vb[X]*vb[X] + vb[Y]*vb[Y];
+		const double s = sqrt(s2);
+		const double alpha = k * fabs(vel[Z]) / s;
+		const double dalpha[NCART] = {-alpha * vb[X] / s2,
+		                              -alpha * vb[Y] / s2,
+		                              (vel[Z] < 0.0 ? -k : k) / s};
+		for (int i = X; i <= Y; i++) {
+			for (int j = 0; j < NCART; j++)
+				dvdv[i][j] = -vb[i] * dalpha[j];
+			dvdv[i][i] += 1.0 - alpha;
+		}
+	}
+	else {
+		dvdv[X][X] = params.CFTX;
+		dvdv[Y][Y] = params.CFTY;
+	}
+}
+
+/**
+ * @brief Integrate the ball state dt seconds later in place and
+ * compute the Jacobian of the step w.r.t. the (old) ball state.
+ *
+ * Same step as ball_step(). The Jacobian chains the symplectic Euler
+ * step with the linearized contact models (contact times are held fixed).
+ *
+ * @param jac 6x6 Jacobian in column-major order (output),
+ * e.g. ARMADILLO memptr() of a 6x6 matrix.
+ * @return Bitwise OR of the contacts that occurred.
+ */
+inline int ball_step_jacobian(const ball_params & params,
+                              const double *spin,
+                              const double dt,
+                              ball_pod & ball,
+                              double *jac) {
+
+	const int N = 2*NCART;
+	int contacts = NO_CONTACT;
+	double J[N][N];
+	ball_symplectic_euler_jacobian(params,spin,dt,ball.vel,J);
+
+	ball_pod cand;
+	ball_symplectic_euler(params,spin,dt,ball,cand);
+	if (ball_hits_table(cand.pos,cand.vel)) {
+		double dvdv[NCART][NCART];
+		double vel_rows[NCART][N];
+		ball_table_rebound_jacobian(params,spin,cand.vel,dvdv);
+		for (int i = 0; i < NCART; i++)
+			for (int j = 0; j < N; j++) {
+				vel_rows[i][j] = 0.0;
+				for (int k = 0; k < NCART; k++)
+					vel_rows[i][j] += dvdv[i][k] * J[k+NCART][j];
+			}
+		for (int i = 0; i < NCART; i++)
+			for (int j = 0; j < N; j++)
+				J[i+NCART][j] = vel_rows[i][j];
+		ball_table_rebound(params,spin,cand.vel);
+		contacts |= TABLE_CONTACT;
+	}
+	if (ball_net_contact(ball.pos[Y],cand)) {
+		for (int j = 0; j < N; j++) {
+			J[Y][j] = 0.0;
+			J[DY][j] *= -net_restitution;
+		}
+		contacts |= NET_CONTACT;
+	}
+	if (ball_ground_contact(ball,cand)) {
+		for (int i = 0; i < N; i++)
+			for (int j = 0; j < N; j++)
+				J[i][j] = 0.0;
+		J[X][X] = 1.0;
+		J[Y][Y] = 1.0;
+		contacts |= GROUND_CONTACT;
+	}
+	ball = cand;
+
+	for (int j = 0; j < N; j++)
+		for (int i = 0; i < N; i++)
+			jac[i + N*j] = J[i][j];
+	return contacts;
+}
+
+/**
+ * @brief Derivative of the step (ball_step()) w.r.t. the spin around the X-axis.
+ *
+ * Spin enters the step through the Magnus force and the (spin model)
+ * table contact. Contact times are held fixed as in ball_step_jacobian().
+ *
+ * @param spin Ball angular velocity (spin model only).
+ * @param ball Ball state before the step (not changed).
+ * @param dxdw Derivative of the stepped [pos,vel] w.r.t. spin[X] (output).
+ */
+inline void ball_step_spin_derivative(const ball_params & params,
+                                      const double spin[NCART],
+                                      const double dt,
+                                      const ball_pod & ball,
+                                      double dxdw[2*NCART]) {
+
+	double *dpos = dxdw;
+	double *dvel = dxdw + NCART;
+	dvel[X] = 0.0;
+	dvel[Y] = -params.Clift * ball.vel[Z] * dt;
+	dvel[Z] = params.Clift * ball.vel[Y] * dt;
+	for (int i = 0; i < NCART; i++)
+		dpos[i] = dvel[i] * dt;
+
+	ball_pod cand;
+	ball_symplectic_euler(params,spin,dt,ball,cand);
+	if (ball_hits_table(cand.pos,cand.vel)) {
+		double dvdv[NCART][NCART];
+		double dvel_out[NCART];
+		ball_table_rebound_jacobian(params,spin,cand.vel,dvdv);
+		for (int i = 0; i < NCART; i++) {
+			dvel_out[i] = 0.0;
+			for (int k = 0; k < NCART; k++)
+				dvel_out[i] += dvdv[i][k] * dvel[k];
+		}
+		// rebound depends on the spin also through the contact point velocity
+		const double vbx = cand.vel[X] - ball_radius * spin[Y];
+		const double vby = cand.vel[Y] + ball_radius * spin[X];
+		const double s2 = vbx*vbx + vby*vby;
+		const double alpha = params.mu * (1 + params.CRT) * fabs(cand.vel[Z]) / sqrt(s2);
+		const double dalpha = -alpha * vby * ball_radius / s2;
+		dvel_out[X] -= vbx * dalpha;
+		dvel_out[Y] -= vby * dalpha + alpha * ball_radius;
+		for (int i = 0; i < NCART; i++)
+			dvel[i] = dvel_out[i];
+		ball_table_rebound(params,spin,cand.vel);
+	}
+	if (ball_net_contact(ball.pos[Y],cand)) {
+		dpos[Y] = 0.0;
+		dvel[Y] *= -net_restitution;
+	}
+	if (ball_ground_contact(ball,cand)) {
+		for (int i = 0; i < 2*NCART; i++)
+			dxdw[i] = 0.0;
+	}
+}
+
+/** @brief Load ball pod from a 6-dim. [pos,vel] array. */
+inline void ball_from_array(const double *x, ball_pod & ball) {
+
+	for (int i = 0; i < NCART; i++) {
+		ball.pos[i] = x[i];
+		ball.vel[i] = x[i+NCART];
+	}
+}
+
+/** @brief Store ball pod into a 6-dim. [pos,vel] array. */
+inline void ball_to_array(const ball_pod & ball, double *x) {
+
+	for (int i = 0; i < NCART; i++) {
+		x[i] = ball.pos[i];
+		x[i+NCART] = ball.vel[i];
+	}
+}
+
+/**
+ * @brief Topspin (revolutions/sec) to ball angular velocity.
+ */
+inline void topspin_to_spin(const double topspin, double spin[NCART]) {
+
+	spin[X] = topspin * 2 * M_PI;
+	spin[Y] = 0.0;
+	spin[Z] = 0.0;
+}
+
+}
+
+#endif /* BALL_KERNEL_H_ */
@@ -0,0 +1,67 @@
+/**
+ * @file ball_log.h
+ *
+ * @brief Offline processing of recorded ball data.
+ *
+ * Ball logs (balls.txt saved by the SL interface) are split into rallies
+ * and each rally is smoothed with the RTS smoother of the ball filter.
+ * Rallies are independent, so they are smoothed in parallel.
+ */
+
+#ifndef BALL_LOG_H_
+#define BALL_LOG_H_
+
+#include <vector>
+#include "kalman.h"
+
+namespace player {
+
+/**
+ * @brief Ball observations from a ball log.
+ *
+ * Each row of the log contains the status and positions of the two blobs
+ * followed by the filter estimate. Blobs are fused as in the SL interface
+ * (cameras 3 and 4 are preferred).
+ *
+ * @param log Ball log loaded as a matrix (one row per tick).
+ * @return 3 x N observations, one column per row of the log.
+ */
+mat ball_log_observations(const mat & log);
+
+/**
+ * @brief Split the observations into rallies (new balls).
+ *
+ * A new rally starts when the observed ball jumps more than jump_tol
+ * meters between two consecutive ticks (e.g. next ball out of the ball gun).
+ * Rallies with fewer observations than min_length are dropped.
+ *
+ * @param observations 3 x N observations (DT seconds apart).
+ * @param jump_tol Distance threshold between consecutive observations.
+ * @param min_length Min. number of observations in a rally.
+ * @return Observations of each rally.
+ */
+std::vector<mat> segment_rallies(const mat & observations,
+                                 const double jump_tol = 0.3,
+                                 const int min_length = 20);
+
+/**
+ * @brief Smooth the rallies in parallel with the RTS smoother.
+ *
+ * Every thread smooths one rally at a time with its own copy of the filter.
+ * Prior of each rally is the finite-difference estimate of the first two
+ * observations with a large covariance.
+ *
+ * @param rallies Observations of each rally.
+ * @param filter Filter (e.g. from init_filter) to smooth with.
+ * @param dt Time between observations.
+ * @param num_threads Number of threads, all hardware threads if zero.
+ * @return Smoothed ball states of each rally (6 x N).
+ */
+std::vector<mat> smooth_rallies(const std::vector<mat> & rallies,
+                                const EKF & filter,
+                                const double dt,
+                                const int num_threads = 0);
+
+}
+
+#endif /* BALL_LOG_H_ */
@@ -0,0 +1,233 @@
+/**
+ * @file ball_model.h
+ *
+ * @brief Compile-time specialized ball models and an EKF templated on them.
+ *
+ * The spin and contact options of the ball model are template parameters,
+ * so that the (inlined) ball kernel is compiled without branching on them.
+ * The EKF specialized on a model calls the model directly, i.e. without
+ * the function pointers (and ARMADILLO vectors) of the runtime EKF class.
+ * The runtime EKF can still be used as before (see init_filter).
+ */
+
+#ifndef BALL_MODEL_H_
+#define BALL_MODEL_H_
+
+#include "kalman.h"
+#include "ball_kernel.h"
+
+namespace player {
+
+/**
+ * @brief Table tennis ball model specialized at compile time.
+ *
+ * @tparam Spin Use the Magnus force and the spin-based table contact model
+ * with a constant angular velocity.
+ * @tparam Contacts Check contacts with table, net and ground during each step.
+ */
+template <bool Spin, bool Contacts>
+class BallModel {
+
+private:
+
+	ball_params params; // ball prediction parameters
+	double spin[NCART]; // constant angular velocity (used only if Spin is true)
+
+	/** @brief Spin passed to the kernel, known to be NULL at compile time for spin-free models. */
+	const double *spin_ptr() const { return Spin ? spin : nullptr; }
+
+public:
+
+	static const bool SPIN = Spin; //!< spin model is used
+	static const bool CONTACTS = Contacts; //!< contacts are checked
+
+	/** @brief Initialize model parameters and set topspin to its initial value. */
+	BallModel(const ball_params & params_ = ball_params()) : params(params_) {
+		topspin_to_spin(params.init_topspin,spin);
+	}
+
+	/** @brief Set topspin equal to argument (revolutions/sec). */
+	void set_topspin(const double val) {
+		topspin_to_spin(val,spin);
+	}
+
+	/** @return Ball prediction parameters. */
+	const ball_params & get_params() const { return params; }
+
+	/**
+	 * @brief Integrate the ball state dt seconds later in place.
+	 * @return Bitwise OR of the contacts that occurred.
+	 */
+	int step(const double dt, ball_pod & ball) const {
+		if (Contacts) {
+			return ball_step(params,spin_ptr(),dt,ball);
+		}
+		ball_pod cand;
+		ball_symplectic_euler(params,spin_ptr(),dt,ball,cand);
+		ball = cand;
+		return NO_CONTACT;
+	}
+
+	/**
+	 * @brief Integrate the ball state dt seconds later in place and
+	 * compute the Jacobian of the step w.r.t. the (old) ball state.
+	 *
+	 * @param jac 6x6 Jacobian in column-major order (output).
+	 * @return Bitwise OR of the contacts that occurred.
+	 */
+	int step_jacobian(const double dt, ball_pod & ball, double *jac) const {
+		if (Contacts) {
+			return ball_step_jacobian(params,spin_ptr(),dt,ball,jac);
+		}
+		const int N = 2*NCART;
+		double J[N][N];
+		ball_symplectic_euler_jacobian(params,spin_ptr(),dt,ball.vel,J);
+		ball_pod cand;
+		ball_symplectic_euler(params,spin_ptr(),dt,ball,cand);
+		ball = cand;
+		for (int j = 0; j < N; j++)
+			for (int i = 0; i < N; i++)
+				jac[i + N*j] = J[i][j];
+		return NO_CONTACT;
+	}
+
+	/**
+	 * @brief Function with the signature of the runtime EKF function pointer.
+	 *
+	 * @param fp Pointer to the model (const BallModel*), default model if NULL.
+	 */
+	static vec calc_next(const vec & xnow, const double dt, const void *fp) {
+		static const BallModel default_model;
+		const BallModel *model = (fp != nullptr) ? (const BallModel*)fp : &default_model;
+		ball_pod ball;
+		ball_from_array(xnow.memptr(),ball);
+		model->step(dt,ball);
+		vec next(2*NCART);
+		ball_to_array(ball,next.memptr());
+		return next;
+	}
+
+	/** @brief Jacobian with the signature of the runtime EKF jacobian pointer. */
+	static mat calc_jacobian(const vec & xnow, const double dt, const void *fp) {
+		static const BallModel default_model;
+		const BallModel *model = (fp != nullptr) ? (const BallModel*)fp : &default_model;
+		ball_pod ball;
+		ball_from_array(xnow.memptr(),ball);
+		mat jac(2*NCART,2*NCART);
+		model->step_jacobian(dt,ball,jac.memptr());
+		return jac;
+	}
+};
+
+typedef BallModel<false,true> DragBallModel; //!< spin-free model with contacts (calc_next_ball)
+typedef BallModel<true,true> SpinBallModel; //!< spin model with contacts (calc_spin_ball)
+typedef BallModel<false,false> DragFlightModel; //!< spin-free model without contacts
+typedef BallModel<true,false> SpinFlightModel; //!< spin model without contacts
+
+/**
+ * @brief Extended Kalman Filter specialized on a ball model.
+ *
+ * Overrides predict() and hides predict_path() of the runtime EKF with
+ * versions that call the (inlined) model directly and compute the closed-form
+ * Jacobian during the same step.
+ * The base class is initialized with the static model functions, so that
+ * the filter can also be used through an EKF reference.
+ */
+template <typename Model>
+class ModelEKF : public EKF {
+
+private:
+
+	Model model; // ball model used for prediction
+
+public:
+
+	/**
+	 * @brief Initialize the filter with given model, observation matrix and
+	 * noise covariance matrices. State is left uninitialized.
+	 */
+	ModelEKF(const Model & model_,
+	         mat & Cin,
+	         mat & Qin,
+	         mat & Rin,
+	         double rej_mult = 2.0)
+	         : EKF(Model::calc_next,Cin,Qin,Rin,rej_mult), model(model_) {
+		set_jacobian(Model::calc_jacobian);
+		EKF::set_fun_params((void*)&model);
+	}
+
+	/** @brief Copy filter and point the base class function parameters to own model. */
+	ModelEKF(const ModelEKF & other) : EKF(other), model(other.model) {
+		EKF::set_fun_params((void*)&model);
+	}
+
+	/** @brief Copy filter and point the base class function parameters to own model. */
+	ModelEKF & operator=(const ModelEKF & other) {
+		EKF::operator=(other);
+		model = other.model;
+		EKF::set_fun_params((void*)&model);
+		return *this;
+	}
+
+	/** @return Ball model used for prediction. */
+	const Model & get_model() const { return model; }
+
+	/** @brief Set topspin of the ball model (revolutions/sec). */
+	void set_topspin(const double val) { model.set_topspin(val); }
+
+	/**
+	 * @brief Set topspin estimate (params points to a double).
+	 *
+	 * Function parameters of the EKF keep pointing to the own model.
+	 */
+	void set_fun_params(void *params) {
+		if (params != nullptr)
+			set_topspin(*(const double*)params);
+		EKF::set_fun_params((void*)&model);
+	}
+
+	/**
+	 * @brief Predict dt seconds for mean x and (if flag is true) variance P.
+	 *
+	 * Linearizes around the current x (before prediction).
+	 */
+	void predict(const double dt, const bool lin_flag = true) {
+		ball_pod ball;
+		ball_from_array(x.memptr(),ball);
+		if (lin_flag) {
+			arma::mat66 A;
+			model.step_jacobian(dt,ball,A.memptr());
+			if (SQRT_MODE)
+				predict_sqrt(A);
+			else
+				P = A * P * A.t() + Q;
+		}
+		else {
+			model.step(dt,ball);
+		}
+		ball_to_array(ball,x.memptr());
+	}
+
+	/**
+	 * @brief Predict future path of the ball up to a horizon size N.
+	 *
+	 * Does not update covariances!
+	 */
+	mat predict_path(const double dt, const int N) const {
+		mat XX(2*NCART,N);
+		ball_pod ball;
+		ball_from_array(x.memptr(),ball);
+		for (int i = 0; i < N; i++) {
+			model.step(dt,ball);
+			ball_to_array(ball,XX.colptr(i));
+		}
+		return XX;
+	}
+};
+
+typedef ModelEKF<DragBallModel> DragBallEKF; //!< EKF with the spin-free model
+typedef ModelEKF<SpinBallModel> SpinBallEKF; //!< EKF with the spin model
+
+}
+
+#endif /* BALL_MODEL_H_ */
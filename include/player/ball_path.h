@@ -0,0 +1,126 @@
+/**
+ * @file ball_path.h
+ *
+ * @brief Adaptive-step ball prediction with contact events and dense output.
+ *
+ * Instead of integrating the ball with a fixed DT and storing
+ * every predicted state, the ball is integrated with an error-controlled
+ * Runge-Kutta method. Contact times (table, net, racket plane and ground)
+ * are located by root-finding and the predicted path is returned as a
+ * piecewise cubic Hermite interpolant that can be queried at any time.
+ */
+
+#ifndef BALL_PATH_H_
+#define BALL_PATH_H_
+
+#include <vector>
+#include "tabletennis.h"
+
+namespace player {
+
+/**
+ * @brief Contact event located on the predicted ball path.
+ */
+struct ball_event {
+	double time; //!< time of contact (from start of prediction)
+	contact type; //!< type of contact
+};
+
+/**
+ * @brief Dense-output ball path predicted with an adaptive step size.
+ *
+ * The ball is integrated with the Bogacki-Shampine 3(2) pair and the
+ * accepted steps are stored as knots (time, state and time derivative).
+ * Between the knots the path is a cubic Hermite interpolant.
+ * Contacts are located exactly (up to root-finding tolerance)
+ * and stored as a pair of knots with the same time (before and after contact).
+ * After touching the ground the ball stays there.
+ */
+class BallPath {
+
+private:
+
+	bool SPIN_MODE; // use spin model for prediction
+	double tol; // absolute and relative tolerance of the local error
+	ball_params params; // ball prediction parameters
+	double spin[NCART]; // constant angular velocity if SPIN_MODE is ON
+	std::vector<double> times; // knot times
+	std::vector<ball_pod> states; // ball states at knots
+	std::vector<ball_pod> derivs; // time derivatives (vel,acc) at knots
+	std::vector<ball_event> events; // contacts located during prediction
+	int num_evals = 0; // number of flight model evaluations in last prediction
+
+	/** @brief Time derivative of the ball state (velocities, accelerations). */
+	void calc_deriv(const ball_pod & ball, ball_pod & deriv);
+
+	/** @brief Store a new knot. */
+	void add_knot(const double t, const ball_pod & ball, const ball_pod & deriv);
+
+	/** @brief Hermite interpolation on segment [t0,t1] between given knots. */
+	void interp(const double t0, const ball_pod & x0, const ball_pod & f0,
+	            const double t1, const ball_pod & x1, const ball_pod & f1,
+	            const double t, ball_pod & ball) const;
+
+public:
+
+	/**
+	 * @brief Initialize an empty ball path.
+	 *
+	 * @param spin_flag Turn ON for spin modelling (constant spin).
+	 * @param tolerance Absolute and relative tolerance of the local error.
+	 */
+	BallPath(const bool spin_flag = false, const double tolerance = 1e-4);
+
+	/** @brief Set topspin equal to argument (revolutions/sec) and turn ON spin. */
+	void set_topspin(const double val);
+
+	/**
+	 * @brief Predict ball path starting from given ball state.
+	 *
+	 * @param ball_est Initial ball state (pos and vel).
+	 * @param time_pred Prediction horizon.
+	 * @param robot If not NULL, the ball is checked for contact with
+	 * the (static) racket plane as well.
+	 */
+	void predict(const vec6 & ball_est, const double time_pred,
+	             const racket *robot = nullptr);
+
+	/**
+	 * @brief Evaluate the ball positions and velocities at time t.
+	 *
+	 * Times outside the predicted horizon are clamped to the horizon.
+	 * At contact times the state after the contact is returned.
+	 */
+	void eval(const double t, double pos[NCART], double vel[NCART]) const;
+
+	/** @return Ball state as a 6-vector at time t. */
+	vec6 get_ball_state(const double t) const;
+
+	/**
+	 * @brief Sample ball path at times dt, 2*dt, ..., N*dt.
+	 * @return 6 x N matrix as returned by EKF::predict_path().
+	 */
+	mat sample(const double dt, const int N) const;
+
+	/** @return Contacts located on the predicted path. */
+	const std::vector<ball_event> & get_events() const { return events; }
+
+	/** @return Number of contacts of given type on the predicted path. */
+	int count_events(const contact type) const;
+
+	/** @return Prediction horizon (shorter than requested if ball touched the ground). */
+	double get_horizon() const;
+
+	/** @return Number of knots stored in the path. */
+	int get_num_knots() const { return times.size(); }
+
+	/** @return Number of flight model evaluations used by the last prediction. */
+	int get_num_evals() const { return num_evals; }
+
+	/** @return TRUE if nothing was predicted yet. */
+	bool empty() const { return times.empty(); }
+};
+
+}
+
+#endif /* BALL_PATH_H_ */
@@ -0,0 +1,135 @@
+/**
+ * @file ball_tracker.h
+ *
+ * @brief Multi-ball tracker with gated nearest-neighbour data association.
+ *
+ * The ball gun fires bursts with several balls in the air, whereas the
+ * Player class filters one ball. The tracker keeps one track (filter) per
+ * ball and associates each batch of observations (one camera frame)
+ * with the tracks, so that the Player can follow one of the balls.
+ */
+
+#ifndef BALL_TRACKER_H_
+#define BALL_TRACKER_H_
+
+#include <vector>
+#include "kalman_fixed.h"
+#include "stream_prior.h"
+#include "obs_queue.h"
+
+namespace player {
+
+/**
+ * @brief Track of one ball.
+ *
+ * A track is tentative until min_obs observations are associated with it.
+ * Until then the observations are folded into a streaming fit, which then
+ * gives the prior of the (fixed-size) ball filter of the confirmed track.
+ */
+struct ball_track {
+	int id; //!< unique id of the track
+	bool confirmed = false; //!< filter is initialized
+	double t_filter = 0.0; //!< time of the filter estimate (confirmed track)
+	double t_last_obs = 0.0; //!< time of the last associated observation
+	double last_obs[NCART] = {0.0}; //!< last associated observation
+	StreamPrior prior; //!< fit of the first observations (tentative track)
+	DragBallFixedEKF filter; //!< ball filter (confirmed track)
+
+	ball_track(const int id_, const StreamPrior & prior_, const DragBallFixedEKF & filter_)
+	           : id(id_), prior(prior_), filter(filter_) {}
+};
+
+/**
+ * @brief Tracker with a fixed-capacity, contiguous pool of ball tracks.
+ *
+ * On each batch of observations (same capture time), the confirmed tracks
+ * are predicted to the capture time and the Mahalanobis distances between
+ * the predicted and observed ball positions are gated. Observations are
+ * then assigned greedily in the order of increasing distance (global
+ * nearest neighbour). Unassigned observations start new (tentative) tracks,
+ * tracks without observations for t_lost seconds are dropped.
+ * Cost per batch is O(tracks x observations) for the distances plus
+ * the greedy assignment, and the pool does not allocate after construction.
+ */
+class BallTracker {
+
+public:
+
+	static const int MAX_TRACKS = 8; //!< max. capacity of the track pool
+	static const int MAX_BATCH = 8; //!< max. number of observations per batch
+
+private:
+
+	int max_tracks; // capacity of the track pool
+	int min_obs; // number of observations to confirm a track
+	double var_noise; // observation noise variance
+	double t_lost; // tracks without observations for this many seconds are dropped
+	double gate; // max. squared Mahalanobis distance for association
+	int next_id = 0; // id of the next new track
+	double t_batch = -1.0; // capture time of the last batch
+	std::vector<ball_track> tracks; // contiguous pool of tracks
+	DragBallFixedEKF filter_init; // filter (noise covariances) of new tracks
+
+	/** @brief Squared Mahalanobis distance of the observation to the predicted track. */
+	double calc_distance(const ball_track & track, const ball_obs & obs) const;
+
+	/** @brief Add the associated observation to the track (update or fit). */
+	void associate(ball_track & track, const ball_obs & obs);
+
+public:
+
+	/**
+	 * @brief Initialize an empty tracker.
+	 *
+	 * @param var_model Process noise variance of the track filters.
+	 * @param var_noise Observation noise variance.
+	 * @param max_tracks Max. number of simultaneous tracks (at most MAX_TRACKS).
+	 * @param min_obs Number of observations to confirm a track (at least 2).
+	 * @param t_lost Tracks without observations for this many seconds are dropped.
+	 * @param gate Max. squared Mahalanobis distance (chi-square with 3 dof.) for association.
+	 */
+	BallTracker(const double var_model = 0.001,
+	            const double var_noise = 0.001,
+	            const int max_tracks = 4,
+	            const int min_obs = 3,
+	            const double t_lost = 0.3,
+	            const double gate = 16.0);
+
+	/** @brief Drop all tracks. */
+	void reset() { tracks.clear(); t_batch = -1.0; }
+
+	/**
+	 * @brief Associate a batch of observations with the tracks.
+	 *
+	 * Observations of the batch should have the same capture time (one frame)
+	 * and batches should arrive in time order (older batches are dropped).
+	 *
+	 * @param obs Observations.
+	 * @param num_obs Number of observations (at most MAX_BATCH are used).
+	 */
+	void update(const ball_obs obs[], const int num_obs);
+
+	/** @return Number of (tentative and confirmed) tracks. */
+	int num_tracks() const { return tracks.size(); }
+
+	/** @return Index of the track with given id, -1 if not tracked. */
+	int find_track(const int id) const;
+
+	/** @return Track given its index (indices change when tracks are dropped, ids do not). */
+	const ball_track & get_track(const int idx) const { return tracks[idx]; }
+
+	/**
+	 * @brief Ball state of a confirmed track predicted to given time.
+	 *
+	 * @param idx Index of the track.
+	 * @param time Prediction time (not earlier than the last observation).
+	 * @param x Ball state (output).
+	 * @param P Ball state covariance (output).
+	 * @return FALSE if the track is tentative.
+	 */
+	bool get_state(const int idx, const double time, arma::vec6 & x, arma::mat66 & P) const;
+};
+
+}
+
+#endif /* BALL_TRACKER_H_ */
@@ -0,0 +1,101 @@
+/**
+ * @file filter_history.h
+ *
+ * @brief Short history of filter estimates for delayed (out-of-sequence) observations.
+ *
+ * Vision observations reach the player with some latency, so when they
+ * arrive the filter has usually been predicted past their capture time.
+ * The history keeps the last filter estimates together with the observations
+ * that produced them, so that a delayed observation can be applied at its
+ * capture time and the later observations replayed on top of it.
+ */
+
+#ifndef FILTER_HISTORY_H_
+#define FILTER_HISTORY_H_
+
+#include "kalman.h"
+
+using arma::vec3;
+using arma::vec6;
+using arma::mat66;
+
+namespace player {
+
+/**
+ * @brief Fixed-size ring of past filter estimates and observations.
+ *
+ * Entries are sorted in time. The ring never allocates: mean and covariance
+ * are stored in fixed-size matrices, and the oldest entry is overwritten
+ * when the ring is full. Replay cost is bounded by the ring size.
+ */
+class FilterHistory {
+
+public:
+
+	static const int SIZE = 32; //!< max. number of stored estimates
+
+private:
+
+	struct entry {
+		double time; // capture time of the observation
+		vec3 obs; // observation applied at that time
+		vec6 x; // filter mean after the update
+		mat66 P; // filter covariance after the update
+	};
+	entry ring[SIZE];
+	int first = 0; // ring index of the oldest entry
+	int num = 0; // number of entries
+
+	/** @brief Entry given its position in time (0 is the oldest). */
+	entry & at(const int idx) { return ring[(first + idx) % SIZE]; }
+
+	/** @brief Store the estimate of the filter (at the entry time). */
+	static void save(const KF & filter, entry & e);
+
+public:
+
+	/** @brief Remove all entries (e.g. when the filter is reset). */
+	void clear() { first = 0; num = 0; }
+
+	/** @return Number of stored estimates. */
+	int size() const { return num; }
+
+	/**
+	 * @brief Store the filter estimate right after an in-sequence update.
+	 *
+	 * @param time Capture time of the observation (newest so far).
+	 * @param obs Observation the filter was just updated with.
+	 * @param filter Updated filter.
+	 */
+	void push(const double time, const vec3 & obs, const KF & filter);
+
+	/**
+	 * @brief Apply a delayed observation at its capture time.
+	 *
+	 * The filter is restored to the last stored estimate before the capture
+	 * time, predicted to it and updated. The later stored observations are
+	 * then replayed (their estimates are overwritten) and the filter is
+	 * predicted to the current time. Filters with an internal state beyond
+	 * mean and covariance are restored through set_prior(), which resamples
+	 * the particles of ParticleFilter and resets the model probabilities of IMM.
+	 *
+	 * @param time Capture time of the delayed observation.
+	 * @param obs Delayed observation.
+	 * @param time_now Time of the current filter estimate.
+	 * @param filter Filter, at time_now.
+	 * @param outlier_detection Reject the observation if it is an outlier at capture time.
+	 * @return FALSE if the observation is older than the history, was
+	 * already applied or is rejected as an outlier. Mean and covariance are
+	 * then unchanged, but a rejected outlier still re-initializes the particles
+	 * (or model probabilities) of the filter through set_prior().
+	 */
+	bool apply_delayed(const double time,
+	                   const vec3 & obs,
+	                   const double time_now,
+	                   EKF & filter,
+	                   const bool outlier_detection = false);
+};
+
+}
+
+#endif /* FILTER_HISTORY_H_ */
@@ -0,0 +1,115 @@
+/**
+ * @file imm.h
+ *
+ * @brief Interacting multiple model (IMM) estimator for the ball.
+ *
+ * Runs a spin-free and a spin model filter side by side and mixes
+ * them according to their observation likelihoods, instead of choosing
+ * one ball model once (spin flag of init_filter).
+ */
+
+#ifndef IMM_H_
+#define IMM_H_
+
+#include "kalman_fixed.h"
+
+namespace player {
+
+/**
+ * @brief IMM estimator with a spin-free and a spin model EKF.
+ *
+ * The model filters are the fixed-size (allocation-free) EKFs, so that
+ * the two filters together cost less per tick than one runtime EKF.
+ * The combined mean and covariance are kept in the EKF state, so the
+ * estimator can be used through an EKF reference (e.g. by the Player class).
+ * predict_path() and predict() with lin_flag FALSE use the more probable model.
+ */
+class IMM : public EKF {
+
+public:
+
+	static const int NUM_MODELS = 2; //!< number of ball models
+	enum model_idx {
+		DRAG = 0, //!< spin-free model
+		SPIN = 1, //!< spin model
+	};
+
+private:
+
+	static const int DIMX = 2*NCART; // state dimension
+
+	double trans[NUM_MODELS][NUM_MODELS]; // Markov model transition probabilities (from row to col)
+	double mu[NUM_MODELS]; // model probabilities
+	double topspin; // topspin of the spin model, function parameters point here
+	DragBallModel drag_model; // for mean prediction
+	SpinBallModel spin_model; // for mean prediction
+	DragBallFixedEKF drag_filter;
+	SpinBallFixedEKF spin_filter;
+
+	/** @brief Model filter given its index (as FixedKF). */
+	FixedKF & model_filter(const int idx);
+
+	/** @brief Combine the model filter estimates (weighted with model probabilities) into x and P. */
+	void combine();
+
+public:
+
+	/**
+	 * @brief Initialize the IMM with given noise covariance matrices.
+	 *
+	 * State is left uninitialized. Both models start equally probable.
+	 *
+	 * @param Cin Observation matrix C (3 x 6).
+	 * @param Qin Process noise covariance Q, same for both models.
+	 * @param Rin Observation noise covariance R.
+	 * @param rej_mult Outlier rejection standard deviation multiplier.
+	 * @param prob_stay Probability of staying in the same model between two ticks.
+	 */
+	IMM(mat & Cin,
+	    mat & Qin,
+	    mat & Rin,
+	    double rej_mult = 2.0,
+	    double prob_stay = 0.98);
+
+	/** @brief Copy estimator and point the function parameters to own topspin. */
+	IMM(const IMM & other);
+
+	/** @brief Copy estimator and point the function parameters to own topspin. */
+	IMM & operator=(const IMM & other);
+
+	/** @brief Initialize both model filters with the same prior. Resets model probabilities. */
+	void set_prior(const vec & x0, const mat & P0);
+
+	/** @brief Set topspin of the spin model (params points to a double). */
+	void set_fun_params(void *params);
+
+	/**
+	 * @brief Mix the model estimates and predict both filters dt seconds.
+	 *
+	 * @param dt Prediction horizon.
+	 * @param lin_flag If false, only the mean is predicted with the more probable model.
+	 */
+	void predict(const double dt, const bool lin_flag = true);
+
+	/** @brief Update both filters and the model probabilities with the observation likelihoods. */
+	void update(const vec & y);
+
+	/** @return Probability of the model (DRAG or SPIN). */
+	double get_model_prob(const int idx) const { return mu[idx]; }
+
+	/** @return Index of the more probable (active) model. */
+	int get_active_model() const { return mu[SPIN] > mu[DRAG] ? SPIN : DRAG; }
+};
+
+/**
+ * @brief Initialize an IMM estimator (same noise arguments as init_filter).
+ *
+ * @return IMM estimator (state uninitialized!)
+ */
+IMM init_imm(const double var_model = 0.001,
+             const double var_noise = 0.001,
+             const double out_reject_mult = 2.0);
+
+}
+
+#endif /* IMM_H_ */
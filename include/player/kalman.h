@@ -46,6 +46,11 @@ protected:
 	mat Q; //!< covariance of the process noise (discrete)
 	mat R; //!< covariance of the observation noise (discrete)
 
+	bool SQRT_MODE = false; //!< propagate the Cholesky factor of P instead of P
+	mat S; //!< upper triangular factor of the covariance, P = S' * S (if SQRT_MODE)
+	mat Qsqrt; //!< upper triangular factor of Q (if SQRT_MODE)
+	mat Rsqrt; //!< upper triangular factor of R (if SQRT_MODE)
+
 	/**
 	 * @brief Check if the matrix is symmetric positive semidefinite
 	 *
@@ -65,6 +70,33 @@ protected:
 	 */
 	mat chol_semi(const mat & M) const;
 
+	/**
+	 * @brief Propagate the covariance factor S with drift matrix A.
+	 *
+	 * Triangularizes [S * A'; Qsqrt] with a QR decomposition,
+	 * so that P = S' * S = A * P * A' + Q stays positive semidefinite.
+	 * P is recomputed from the new factor.
+	 */
+	void predict_sqrt(const mat & A);
+
+	/**
+	 * @brief Square-root form of the measurement update.
+	 *
+	 * Triangularizes the pre-array [Rsqrt, 0; S * C', S] with a QR decomposition.
+	 * The upper left block gives the factor of the innovation covariance,
+	 * the upper right block the (scaled) Kalman gain and the lower right block
+	 * the updated covariance factor. The innovation covariance is never inverted.
+	 */
+	void update_sqrt(const vec & y);
+
+	/**
+	 * @brief Predict mean and covariance one step (used by smoothen()).
+	 *
+	 * @param dt Prediction horizon (the discrete KF model ignores it).
+	 * @return Drift matrix used to propagate the covariance.
+	 */
+	virtual mat predict_step(const double dt);
+
 public:
 
 	/**
@@ -132,7 +164,32 @@ public:
 	 * @param P0 initial covariance.
 	 *
 	 */
-	void set_prior(const vec & x0, const mat & P0);
+	virtual void set_prior(const vec & x0, const mat & P0);
+
+	/**
+	 * @brief Set the state uninitialized (e.g. to track a new ball).
+	 *
+	 * Model, noise covariances and function parameters are kept.
+	 * Filters with an internal state beyond mean and covariance
+	 * reinitialize it with the next set_prior().
+	 */
+	virtual void reset();
+
+	/**
+	 * @brief Turn ON/OFF the square-root (Cholesky factor) form of the filter.
+	 *
+	 * In square-root form the covariance is propagated as an upper triangular
+	 * factor S (P = S' * S) using orthogonal transformations only, so that the
+	 * covariance remains positive semidefinite (and symmetric) after long
+	 * filtering sequences. P is still kept up to date for get_covar(), outlier
+	 * checks etc.
+	 *
+	 * @param flag Turns square-root form ON if TRUE.
+	 */
+	void set_sqrt_mode(const bool flag = true);
+
+	/** @return TRUE if covariance is propagated in square-root form. */
+	bool get_sqrt_mode() const { return SQRT_MODE; }
 
 	/**
 	 * @brief Get state mean.
@@ -203,7 +260,7 @@ public:
 	 * @param y observations. Must have the same size as rows of C.
 	 *
 	 */
-	void update(const vec & y);
+	virtual void update(const vec & y);
 
 	/**
 	 * @brief Sample observations up to a horizon size N.
@@ -213,9 +270,22 @@ public:
 	mat sample_observations(int N) const;
 
 	/**
-	 * TODO: Not implemented yet.
+	 * @brief Rauch-Tung-Striebel smoother.
+	 *
+	 * Filters the observations forward starting from the current prior
+	 * (the first observation updates the prior), storing the predicted and
+	 * filtered means and covariances, and then smooths them backwards.
+	 * Works for the EKF as well (with the linearizations of the forward pass).
+	 * Filter state is restored afterwards.
+	 *
+	 * @param observations Observations as columns (dt seconds apart).
+	 * @param dt Time between observations (the discrete KF model ignores it).
+	 * @return Smoothed state means as columns.
+	 * @throw Exception if prior was not set before!
 	 */
-	mat smoothen(const mat & observations);
+	mat smoothen(const mat & observations, const double dt);
+
+	virtual ~KF() {}
 };
 
 /**
@@ -240,15 +310,24 @@ private:
 	// function pointer
 	vec (*f)(const vec &, const double, const void *p);
 
+	// closed-form jacobian of f (optional)
+	mat (*df)(const vec &, const double, const void *p) = nullptr;
+
 	/**
 	 * @brief Linearize the discrete function (that integrates a continuous functions dt seconds)
 	 * to get Ad matrix
 	 *
-	 * Using 'TWO-SIDED-SECANT' to do a stable linearization
+	 * Uses the closed-form jacobian if it was set, otherwise
+	 * using 'TWO-SIDED-SECANT' to do a stable linearization
 	 *
 	 */
 	mat linearize(const double dt, const double h) const;
 
+protected:
+
+	/** @brief Linearize, propagate the covariance and predict the mean with the function pointer. */
+	mat predict_step(const double dt);
+
 public:
 
 	/**
@@ -279,17 +358,26 @@ public:
 	    double rej_mult = 2.0);
 
 	/** @brief Set function co-parameters for predicting */
-	void set_fun_params(void *params) { fparams = params; };
+	virtual void set_fun_params(void *params) { fparams = params; };
+
+	/**
+	 * @brief Set closed-form jacobian of the function pointer.
+	 *
+	 * If set, linearize() calls it instead of taking finite differences.
+	 * It receives the same arguments as the function pointer.
+	 */
+	void set_jacobian(mat (*dfp)(const vec & state, const double dt, const void *p)) { df = dfp; };
 
 	/**
 	 * @brief Predict dt seconds for mean x and (if flag is true) variance P.
 	 *
 	 * @param dt Prediction horizon.
 	 * @param lin_flag If true, will linearize the nonlinear function
-	 * around current x and make the covariance update. Useful to turn off for debugging.
+	 * around current x (before prediction) and make the covariance update. Useful to turn off for debugging.
 	 *
+	 * Virtual so that other ball filters (e.g. UKF) can be used through an EKF reference.
 	 */
-	void predict(const double dt, const bool lin_flag = true);
+	virtual void predict(const double dt, const bool lin_flag = true);
 
 	/**
 	 * @brief Predict future path of the estimated object
@@ -303,6 +391,23 @@ public:
 	 */
 	mat predict_path(const double dt, const int N);
 
+	/**
+	 * @brief Predict future path of the estimated ball together with
+	 * the position covariances along the path (uncertainty tube).
+	 *
+	 * Mean is predicted as in predict_path(). The covariance is propagated
+	 * with the linearization of the model (closed-form ball kernel jacobian
+	 * if set) in fixed-size matrices. Filter state and covariance are not changed.
+	 *
+	 * @param dt Prediction step
+	 * @param N Number of (small) prediction steps.
+	 * @param pos_cov Packed position covariances (xx,yy,zz,xy,xz,yz) as columns,
+	 * column j is after (j+1)*decim prediction steps (output).
+	 * @param decim Number of prediction steps between each stored covariance.
+	 * @return Matrix of ball means as columns.
+	 */
+	mat predict_path(const double dt, const int N, mat & pos_cov, const int decim = 1);
+
 	/**
 	 * @brief Checks to see if the ball observation could be an
 	 * outlier.
@@ -331,13 +436,15 @@ public:
  * @param out_reject_mult Mult. for outlier rejection.
  * @param topspin Set topspin parameter (NOT state!) for kalman filter prediction
  * if spin is TRUE
+ * @param sqrt_form Propagate the covariance in square-root form if TRUE
  * @return EKF Extended Kalman Filter (state uninitialized!)
  */
 EKF init_filter(const double var_model = 0.001,
                 const double var_noise = 0.001,
                 const bool spin = false,
                 const double out_reject_mult = 2.0,
-                const double *topspin = nullptr);
+                const double *topspin = nullptr,
+                const bool sqrt_form = false);
 
 /**
  * @brief Checks to see if the observation is new (updated)
@@ -0,0 +1,172 @@
+/**
+ * @file kalman_fixed.h
+ *
+ * @brief Fixed-size (6-state, 3-observation) Kalman filters for the ball.
+ *
+ * Same predict/update/check_outlier interface as KF/EKF, but the mean,
+ * covariances and observation matrix are stored as plain arrays, so that
+ * filtering does not use the heap after construction.
+ * Kalman gain is computed with a Cholesky solve (instead of inverting
+ * the innovation covariance) and covariance is updated in Joseph form.
+ */
+
+#ifndef KALMAN_FIXED_H_
+#define KALMAN_FIXED_H_
+
+#include "ball_model.h"
+
+namespace player {
+
+/**
+ * @brief Fixed-size discrete Kalman filter (measurement update only).
+ *
+ * Prediction is left to the subclasses, which propagate the covariance
+ * with predict_covar() given the (linearized) drift matrix.
+ */
+class FixedKF {
+
+protected:
+
+	static const int DIMX = 2*NCART; //!< state dimension
+	static const int DIMY = NCART; //!< observation dimension
+
+	bool init = false; //!< prior was set
+	double x[DIMX]; //!< state
+	double P[DIMX][DIMX]; //!< covariance of the state
+	double C[DIMY][DIMX]; //!< observation matrix
+	double Q[DIMX][DIMX]; //!< covariance of the process noise (discrete)
+	double R[DIMY][DIMY]; //!< covariance of the observation noise (discrete)
+	double outlier_reject_mult; //!< standard deviation multiplier to reject outliers
+	double loglik = 0.0; //!< log-likelihood of the last observation
+
+	/**
+	 * @brief Propagate the covariance P = A * P * A' + Q
+	 * @param A Drift matrix in column-major order (e.g. ARMADILLO memptr()).
+	 */
+	void predict_covar(const double *A);
+
+public:
+
+	/**
+	 * @brief Initialize the filter with given observation matrix
+	 * and noise covariance matrices. State is left uninitialized.
+	 *
+	 * @param Cin Observation matrix C (3 x 6).
+	 * @param Qin Process noise covariance Q (6 x 6).
+	 * @param Rin Observation noise covariance R (3 x 3).
+	 * @param rej_mult Outlier rejection standard deviation multiplier.
+	 */
+	FixedKF(const mat & Cin, const mat & Qin, const mat & Rin, const double rej_mult = 2.0);
+
+	/** @brief Initialize the filter state and the covariance. */
+	void set_prior(const vec & x0, const mat & P0);
+
+	/** @brief Initialize the filter state and the covariance given as plain arrays. */
+	void set_prior(const double x0[DIMX], const double P0[DIMX][DIMX]);
+
+	/** @brief Copy the state mean and covariance to plain arrays. */
+	void get_state(double xout[DIMX], double Pout[DIMX][DIMX]) const;
+
+	/**
+	 * @brief Get state mean.
+	 * @throw Exception if prior was not set before!
+	 */
+	vec get_mean() const;
+
+	/**
+	 * @brief Get state covariance.
+	 * @throw Exception if prior was not set before!
+	 */
+	mat get_covar() const;
+
+	/**
+	 * @brief Update the mean and variance of the state
+	 * after making an observation.
+	 *
+	 * @param y Observations (3-vector).
+	 * @throw Exception if the innovation covariance is not positive definite.
+	 */
+	void update(const vec & y);
+
+	/** @brief Update with observations given as a plain array. */
+	void update(const double y[DIMY]);
+
+	/** @return Log-likelihood of the last observation (given the predicted state). */
+	double get_log_likelihood() const { return loglik; }
+
+	/**
+	 * @brief Checks to see if the ball observation could be an outlier.
+	 *
+	 * Same test as EKF::check_outlier().
+	 * @return TRUE if outlier is detected.
+	 */
+	bool check_outlier(const vec & y, const bool verbose = false) const;
+};
+
+/**
+ * @brief Fixed-size Extended Kalman filter specialized on a ball model.
+ *
+ * Predicts with the (templated) ball model and its closed-form Jacobian.
+ */
+template <typename Model>
+class FixedEKF : public FixedKF {
+
+private:
+
+	Model model; // ball model used for prediction
+
+public:
+
+	/** @brief Initialize the filter with given model, observation matrix and noise covariances. */
+	FixedEKF(const Model & model_,
+	         const mat & Cin,
+	         const mat & Qin,
+	         const mat & Rin,
+	         const double rej_mult = 2.0)
+	         : FixedKF(Cin,Qin,Rin,rej_mult), model(model_) {}
+
+	/** @brief Set topspin of the ball model (revolutions/sec). */
+	void set_topspin(const double val) { model.set_topspin(val); }
+
+	/**
+	 * @brief Predict dt seconds for mean x and (if flag is true) variance P.
+	 *
+	 * Linearizes around the current x (before prediction).
+	 */
+	void predict(const double dt, const bool lin_flag = true) {
+		ball_pod ball;
+		ball_from_array(x,ball);
+		if (lin_flag) {
+			double A[DIMX*DIMX];
+			model.step_jacobian(dt,ball,A);
+			predict_covar(A);
+		}
+		else {
+			model.step(dt,ball);
+		}
+		ball_to_array(ball,x);
+	}
+
+	/**
+	 * @brief Predict future path of the ball up to a horizon size N.
+	 *
+	 * Does not update covariances!
+	 */
+	mat predict_path(const double dt, const int N) const {
+		mat XX(DIMX,N);
+		ball_pod ball;
+		ball_from_array(x,ball);
+		for (int i = 0; i < N; i++) {
+			model.step(dt,ball);
+			ball_to_array(ball,XX.colptr(i));
+		}
+		return XX;
+	}
+};
+
+typedef FixedEKF<DragBallModel> DragBallFixedEKF; //!< fixed-size EKF with the spin-free model
+typedef FixedEKF<SpinBallModel> SpinBallFixedEKF; //!< fixed-size EKF with the spin model
+
+}
+
+#endif /* KALMAN_FIXED_H_ */
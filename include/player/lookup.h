@@ -60,6 +60,19 @@ void knn(const mat & lookupt,
          const int k,
          vec & params);
 
+/**
+ * @brief K-nearest-neighbours without averaging.
+ *
+ * @param lookupt Training set with each row = [coparams,params]
+ * @param testpoint Test time co-parameters
+ * @param k Value of the K-nearest-neighbor
+ * @param params Parameters (qf,qfdot,T) of the neighbours, one column per neighbour (output)
+ */
+void knn_neighbours(const mat & lookupt,
+                    const vec & testpoint,
+                    const int k,
+                    mat & params);
+
 }
 
 #endif /* PLAYER_INCLUDE_LOOKUP_H_ */
@@ -0,0 +1,101 @@
+/**
+ * @file obs_queue.h
+ *
+ * @brief Wait-free single-producer/single-consumer queue of ball observations.
+ *
+ * A vision (camera) thread pushes time-stamped ball observations and the
+ * player drains all pending observations every tick, so that the vision rate
+ * is decoupled from the servo rate without locks.
+ */
+
+#ifndef OBS_QUEUE_H_
+#define OBS_QUEUE_H_
+
+#include <atomic>
+#include "constants.h"
+
+namespace player {
+
+/**
+ * @brief Time-stamped ball observation.
+ */
+struct ball_obs {
+	double time = 0.0; //!< capture time (seconds)
+	double pos[NCART] = {0.0}; //!< observed ball position
+};
+
+/**
+ * @brief Fixed-capacity single-producer/single-consumer ring buffer.
+ *
+ * push() must only be called from one (producer) thread and pop() from one
+ * (consumer) thread. Both are wait-free: they never block and
+ * never allocate. Head and tail indices are on separate cache lines.
+ *
+ * @tparam T Element type (copied in and out).
+ * @tparam Capacity Max. number of elements, must be a power of two.
+ */
+template <typename T, unsigned long Capacity>
+class SPSCQueue {
+
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+	              "Capacity of the queue must be a power of two!");
+
+private:
+
+	static const unsigned long MASK = Capacity - 1;
+
+	std::atomic<unsigned long> head; // next element to pop (written by consumer)
+	char pad_head[64 - sizeof(std::atomic<unsigned long>)];
+	std::atomic<unsigned long> tail; // next free slot (written by producer)
+	char pad_tail[64 - sizeof(std::atomic<unsigned long>)];
+	T buffer[Capacity];
+
+public:
+
+	SPSCQueue() : head(0), tail(0) {}
+
+	SPSCQueue(const SPSCQueue &) = delete;
+	SPSCQueue & operator=(const SPSCQueue &) = delete;
+
+	/**
+	 * @brief Add an element to the queue (producer only).
+	 * @return FALSE if the queue is full (element is not added).
+	 */
+	bool push(const T & elem) {
+		const unsigned long t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == Capacity) {
+			return false;
+		}
+		buffer[t & MASK] = elem;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @brief Remove the oldest element from the queue (consumer only).
+	 * @return FALSE if the queue is empty.
+	 */
+	bool pop(T & elem) {
+		const unsigned long h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		elem = buffer[h & MASK];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** @return Number of elements in the queue (exact only if called by producer or consumer). */
+	unsigned long size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	/** @return Max. number of elements. */
+	static unsigned long capacity() { return Capacity; }
+};
+
+typedef SPSCQueue<ball_obs,256> ObsQueue; //!< queue between vision thread and player
+
+}
+
+#endif /* OBS_QUEUE_H_ */
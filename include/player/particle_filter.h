@@ -0,0 +1,178 @@
+/**
+ * @file particle_filter.h
+ *
+ * @brief Particle filter estimating the ball state and topspin.
+ *
+ * Spinning balls and balls bouncing near the table edges have
+ * multimodal / non-Gaussian state distributions that the EKF
+ * cannot represent. The particle filter propagates every particle
+ * through the (nonlinear) ball model with its own topspin.
+ * Propagation, weighting and moment computations are split across
+ * a pool of threads.
+ */
+
+#ifndef PARTICLE_FILTER_H_
+#define PARTICLE_FILTER_H_
+
+#include <vector>
+#include <random>
+#include <memory>
+#include "kalman.h"
+#include "ball_kernel.h"
+#include "thread_pool.h"
+
+namespace player {
+
+/**
+ * @brief Particle filter (sequential importance resampling) for the ball.
+ *
+ * Each particle holds a ball state and a topspin. Weights are updated
+ * with the (Gaussian) observation likelihood and the particles are
+ * resampled systematically when the effective sample size drops.
+ *
+ * The weighted mean and covariance of the ball states are kept in the
+ * EKF state, so the filter can be used through an EKF reference
+ * (e.g. by the Player class): get_mean(), get_covar(), check_outlier()
+ * and predict_path() work as before. Function parameters set with
+ * set_fun_params() (e.g. by estimate_prior()) are taken as the topspin
+ * estimate and the topspins of the particles are shifted accordingly.
+ */
+class ParticleFilter : public EKF {
+
+private:
+
+	static const int DIMX = 2*NCART; // ball state dimension
+	static const int DIMP = DIMX + 1; // particle dimension (ball state and topspin)
+
+	/** @brief Partial sums computed by each thread (padded against false sharing). */
+	struct partial_sums {
+		double max_loglik;
+		double sum_w;
+		double sum_w2;
+		double sum_wx[DIMP];
+		double sum_wxx[DIMX][DIMX];
+		char pad[64];
+	};
+
+	int N; // number of particles
+	double var_topspin; // prior variance of the topspin
+	double var_topspin_walk; // variance of the topspin random walk per second
+	double resample_thresh; // resample if effective sample size < thresh * N
+	double topspin_prior; // prior mean of the topspin
+	double topspin; // weighted mean of the topspin, function parameters point here
+	double eff_sample_size; // effective sample size after the last update
+	int num_resamples = 0; // number of resampling steps
+	ball_params params; // ball prediction parameters
+	double Lq[DIMX][DIMX]; // lower triangular factor of Q
+	double Rinv[NCART][NCART]; // inverse of R
+	double Cd[NCART][DIMX]; // observation matrix
+	std::vector<double> particles; // particle i is stored in [i*DIMP,(i+1)*DIMP)
+	std::vector<double> particles_resampled; // buffer for resampling
+	std::vector<double> weights; // normalized weights
+	std::vector<double> loglik; // log-likelihood of the last observation
+	std::vector<std::mt19937> rngs; // one random number generator per thread
+	std::vector<partial_sums> partials; // one per thread
+	std::shared_ptr<ThreadPool> pool; // shared by the copies of the filter
+
+	/** @brief Compute weighted mean and covariance of the ball states and the mean topspin. */
+	void calc_moments();
+
+	/** @brief Systematic resampling. Weights are set to 1/N. */
+	void resample();
+
+public:
+
+	/**
+	 * @brief Initialize the particle filter with given noise covariance matrices.
+	 *
+	 * Particles are left uninitialized (see set_prior()).
+	 *
+	 * @param Cin Observation matrix C.
+	 * @param Qin Process noise covariance Q (discrete, added every prediction).
+	 * @param Rin Observation noise covariance R.
+	 * @param num_particles Number of particles.
+	 * @param num_threads Number of threads, all hardware threads if zero.
+	 * @param rej_mult Outlier rejection standard deviation multiplier.
+	 * @param var_topspin Prior variance of the topspin.
+	 * @param var_topspin_walk Variance of the topspin random walk per second.
+	 * @param seed Seed of the random number generators.
+	 */
+	ParticleFilter(mat & Cin,
+	               mat & Qin,
+	               mat & Rin,
+	               const int num_particles = 1000,
+	               const int num_threads = 0,
+	               const double rej_mult = 2.0,
+	               const double var_topspin = 100.0,
+	               const double var_topspin_walk = 10.0,
+	               const unsigned seed = 1);
+
+	/** @brief Copy filter and point the function parameters to own topspin. */
+	ParticleFilter(const ParticleFilter & other);
+
+	/** @brief Copy filter and point the function parameters to own topspin. */
+	ParticleFilter & operator=(const ParticleFilter & other);
+
+	/**
+	 * @brief Sample the particles around the prior mean and covariance.
+	 *
+	 * Topspins are sampled around the topspin estimate.
+	 */
+	void set_prior(const vec & x0, const mat & P0);
+
+	/**
+	 * @brief Set topspin estimate (params points to a double).
+	 *
+	 * Topspins of the particles are shifted to the new estimate.
+	 * Function parameters of the EKF keep pointing to the filter's own topspin.
+	 */
+	void set_fun_params(void *params);
+
+	/**
+	 * @brief Propagate the particles dt seconds and add process noise.
+	 *
+	 * @param dt Prediction horizon.
+	 * @param lin_flag If false, only the mean is predicted (as in EKF).
+	 */
+	void predict(const double dt, const bool lin_flag = true);
+
+	/**
+	 * @brief Update the weights with the observation likelihood
+	 * and resample if necessary.
+	 *
+	 * @param y Observations. Must have the same size as rows of C.
+	 */
+	void update(const vec & y);
+
+	/** @return Weighted mean of the topspin of the particles. */
+	double get_topspin() const { return topspin; }
+
+	/** @return Number of particles. */
+	int get_num_particles() const { return N; }
+
+	/** @return Effective sample size after the last update. */
+	double get_eff_sample_size() const { return eff_sample_size; }
+
+	/** @return Number of resampling steps since construction. */
+	int get_num_resamples() const { return num_resamples; }
+};
+
+/**
+ * @brief Initialize a particle filter (same noise arguments as init_filter).
+ *
+ * @param var_model Process noise multiplier for identity matrix.
+ * @param var_noise Observation noise mult. for identity matrix.
+ * @param num_particles Number of particles.
+ * @param num_threads Number of threads, all hardware threads if zero.
+ * @param out_reject_mult Mult. for outlier rejection.
+ * @return Particle filter (state uninitialized!)
+ */
+ParticleFilter init_particle_filter(const double var_model = 0.001,
+                                    const double var_noise = 0.001,
+                                    const int num_particles = 1000,
+                                    const int num_threads = 0,
+                                    const double out_reject_mult = 2.0);
+
+}
+
+#endif /* PARTICLE_FILTER_H_ */
@@ -12,6 +12,13 @@
 
 #include "kalman.h"
 #include "optim.h"
+#include "ball_path.h"
+#include "pred_cache.h"
+#include "obs_queue.h"
+#include "filter_history.h"
+#include "stream_prior.h"
+#include "ball_tracker.h"
+#include "worker_pool.h"
 
 using arma::vec;
 using arma::zeros;
@@ -49,11 +56,26 @@ struct player_flags {
 	bool reset = true; //!< reinitializing player class
 	bool save = false; //!< saving ball/robot data
 	bool spin = false; //!< turn on and off spin-based prediction models
+	bool dense_pred = false; //!< adaptive-step dense ball prediction instead of fixed DT prediction
+	bool sqrt_filter = false; //!< propagate the filter covariance in square-root form
+	bool ukf = false; //!< unscented (instead of extended) Kalman filter for the ball
+	bool particle_filter = false; //!< particle filter for the ball state and topspin
+	bool imm = false; //!< interacting multiple model estimator (spin and spin-free filters)
+	bool obs_queue = false; //!< drain time-stamped observations pushed by a vision thread (SL interface)
+	bool stream_prior = false; //!< start filter from a streaming fit of the first min_obs observations (instead of estimate_prior)
+	bool multi_ball = false; //!< track several balls in the air (observation queue) and play the incoming ball closest to the robot
 	bool optim_rest_posture = false; //!< turn on rest posture optimization
+	bool anytime = false; //!< optim within the predicted time-to-hit and publish the best feasible iterates
 	algo alg = FOCUS; //!< algorithm for trajectory generation
 	int verbosity = 0; //!< OFF, LOW, HIGH, ALL
 	int freq_mpc = 1; //!< frequency of mpc updates if turned on
 	int min_obs = 5; //!< number of observations to initialize filter
+	int num_particles = 1000; //!< number of particles if particle filter is ON
+	int max_tracks = 4; //!< max. number of balls tracked if multi_ball is ON
+	int num_workers = 2; //!< number of worker threads running optimizations (ball state estimation has its own)
+	int prior_cpu = -1; //!< core the ball state estimation worker is pinned to (not pinned if negative)
+	int num_starts = 1; //!< number of initial guesses raced by the hitting optim (multi-start OFF if one)
+	int start_threads = 2; //!< number of threads racing the initial guesses (multi-start)
 	double out_reject_mult = 2.0; //!< multiplier of variance for outlier detection
 	double ball_land_des_offset[2] = {0.0}; //!< desired ball landing offsets (w.r.t center of opponent court)
 	double time_land_des = 0.8; //!< desired ball landing time
@@ -62,10 +84,16 @@ struct player_flags {
 	double var_noise = 0.001; //!< variance of noise process (R)
 	double var_model = 0.001; //!< variance of process noise (Q)
 	double t_reset_thresh = 0.3; //!< resetting Kalman filter after this many seconds pass without getting valid obs.
+	double vision_latency = 0.0; //!< time between capturing and pushing the ball observations (observation queue)
 	double VHPY = -0.3; //!< location of hitting plane for VHP method
+	double pred_cache_tol = 1e-3; //!< max. filter correction to keep shifting the cached ball prediction
+	double start_deadline = 0.1; //!< max. time of the race of initial guesses, shared by all (multi-start)
+	double act_margin = 0.05; //!< time left for actuation before the predicted hit (anytime optim)
+	double max_pred_std = 0.0; //!< max. std. of the predicted ball pos. on the VHP to start optim (OFF if zero)
 	std::vector<double> weights = {0.0, 0.0, 0.0}; //!< hit,net,land weights for DP (lazy player)
 	std::vector<double> mult_vel = {0.9, 0.8, 0.83}; //!< vel. mult. for DP
 	std::vector<double> penalty_loc = {0.0, 0.23, 0.0, -3.22}; //!< penalty locations for DP
+	std::vector<int> worker_cpus; //!< cores the worker threads are pinned to (not pinned if empty)
 };
 
 /**
@@ -84,16 +112,31 @@ private:
 	arma::vec2 ball_land_des = zeros<vec>(2); // desired landing position
 	arma::vec7 q_rest_des; // desired resting joint state
 	double t_obs = 0.0; // counting time stamps for resetting filter
+	double t_filter = 0.0; // time of the filter estimate (observation queue)
+	double t_first_obs = 0.0; // time of the first observation used to initialize filter (observation queue)
+	double t_last_obs = -1.0; // time of the last observation popped from the queue, negative if none
 	double t_poly = 0.0; // time passed on the hitting spline
 	bool valid_obs = true; // ball observed is valid (new ball and not an outlier)
 	int num_obs = 0; // number of observations received
 	game game_state = AWAITING;
 	player_flags pflags;
 	optim::optim_des pred_params;
+	BallPath ball_path; // dense ball prediction used if dense_pred flag is ON
+	PredictionCache pred_cache; // rolling ball prediction (and racket strategy) for fixed DT prediction
+	FilterHistory history; // past filter estimates to apply delayed observations (observation queue)
+	StreamPrior stream_prior; // streaming estimate of the initial ball state
+	BallTracker tracker; // tracks of the balls in the air (multi_ball)
+	Snapshot<optim::ball_prior> prior_est; // initial ball state published by the estimate_prior thread
+	int prior_id = 0; // id of the last estimate_prior request
+	double topspin = 0.0; // topspin estimated with the initial ball state
+	int target_id = -1; // id of the track played by the robot, negative if none
+	int num_ticks = 0; // number of calls to play() or cheat()
 	mat observations; // for initializing filter
 	mat times; // for initializing filter
 	optim::spline_params poly;
 	mat lookup_table;
+	std::shared_ptr<WorkerPool> pool; // workers running the optimizations
+	std::shared_ptr<WorkerPool> prior_pool; // own worker running estimate_prior (not queued behind optimizations)
 	optim::Optim *opt; // optimizer
 
 	/**
@@ -112,6 +155,71 @@ private:
 	 */
 	void estimate_ball_state(const arma::vec3 & obs);
 
+	/**
+	 * @brief Filter all pending observations of the queue with their timestamps.
+	 *
+	 * Observations are popped in order and the filter is predicted
+	 * to the capture time of each observation before updating, instead
+	 * of assuming DT between observations. Observations captured before the
+	 * current filter time (latency, out of order) are applied at their capture
+	 * time and the later observations are replayed (see FilterHistory).
+	 * Duplicate observations are dropped. Filter is reset if no observation arrived for
+	 * t_reset_thresh seconds. Finally the filter is predicted to the current time.
+	 *
+	 * @param obs_queue Queue filled by the vision thread (Player is the consumer).
+	 * @param time Current time, same clock as the observation timestamps.
+	 */
+	void estimate_ball_state(ObsQueue & obs_queue, const double time);
+
+	/**
+	 * @brief Initialize the filter once min_obs observations are collected.
+	 *
+	 * With the stream_prior flag the filter starts immediately from the
+	 * streaming fit of the observations. Otherwise estimate_prior is run
+	 * on a copy of the buffered observations (on its own worker if detached)
+	 * and the estimate is picked up with check_prior_estimate().
+	 *
+	 * @param time Time of the last observation (same clock as the buffered times).
+	 */
+	void start_filter(const double time);
+
+	/**
+	 * @brief Initialize the filter if the estimate_prior thread published
+	 * the estimate for the last request.
+	 *
+	 * Reads the snapshot without blocking, hence returns FALSE also if
+	 * the estimate is being published (it is picked up in the next call).
+	 *
+	 * @param time Time of the estimate (output, same clock as the buffered times).
+	 * @return TRUE if the filter is initialized with the estimate.
+	 */
+	bool check_prior_estimate(double & time);
+
+	/**
+	 * @brief Track all balls in the air and filter the ball to be played.
+	 *
+	 * Observations with the same capture time (one camera frame) are
+	 * associated as a batch with the ball tracks. The target ball is the
+	 * incoming confirmed track closest to the robot, and it is kept until it
+	 * is lost or no longer incoming. The filter is primed with the state of
+	 * the target track only when the target changes (set_prior() resamples the
+	 * particles or resets the IMM), afterwards it is updated with the observations
+	 * associated with the target and predicted to the current time.
+	 *
+	 * @param obs_queue Queue filled by the vision thread (Player is the consumer).
+	 * @param time Current time, same clock as the observation timestamps.
+	 */
+	void track_balls(ObsQueue & obs_queue, const double time);
+
+	/**
+	 * @brief Update the filter with the observation of the target in the last batch.
+	 *
+	 * Delayed observations are applied at their capture time through the
+	 * filter history, as for the single ball observation queue.
+	 * @param t_batch Capture time of the batch associated by the tracker.
+	 */
+	void filter_target(const double t_batch);
+
 	/**
 	 * @brief Run optimizer for FOCUSED PLAYER
 	 *
@@ -143,6 +251,11 @@ private:
 	 */
 	void optim_vhp_param(const optim::joint & qact);
 
+	/**
+	 * @brief Run the optimizer of the algorithm (FP, VHP or DP) if an update is needed.
+	 *
+	 * Shared by play() (with or without the observation queue) and cheat().
+	 */
 	void calc_opt_params(const optim::joint & qact);
 
 	/**
@@ -170,6 +283,17 @@ private:
 	 */
 	void calc_next_state(const optim::joint & qact, optim::joint & qdes);
 
+	/**
+	 * @brief Check if the ball prediction is certain enough to start optimization.
+	 *
+	 * If max_pred_std flag is set, the uncertainty tube of the predicted
+	 * ball path is stored in the optimization parameters and the optimization
+	 * is delayed while the predicted ball position on the VHP is too uncertain.
+	 * The covariance is propagated only until the rolling prediction
+	 * (see PredictionCache) crosses the VHP.
+	 */
+	bool check_uncertainty();
+
 	/** @brief Start moving pre-optim based on lookup if lookup flag is turned ON. */
 	void lookup_soln(const arma::vec6 & ball_state, const int k, const optim::joint & qact);
 
@@ -208,6 +332,21 @@ public:
 	 */
 	arma::vec6 filt_ball_state(const arma::vec3 & obs);
 
+	/**
+	 * @brief Public interface for estimating ball state from an observation queue.
+	 *
+	 * @param obs_queue Time-stamped ball observations (drained).
+	 * @param time Current time, same clock as the observation timestamps.
+	 * @return Ball state at given time as a 6-vector, zeroes if filter is not initialized.
+	 */
+	arma::vec6 filt_ball_state(ObsQueue & obs_queue, const double time);
+
+	/** @brief Ball tracks (multi_ball flag). */
+	const BallTracker & get_tracker() const { return tracker; }
+
+	/** @return Id of the ball track played by the robot, negative if none (multi_ball flag). */
+	int get_target_id() const { return target_id; }
+
 	/**
 	 * @brief If filter is initialized returns true
 	 */
@@ -218,9 +357,10 @@ public:
 	 *
 	 * Using many balls in simulation requires fast resetting
 	 * Setting a time threshold as a resetting condition won't work in this case.
+	 * The filter (given in the constructor) keeps its model and noise covariances.
 	 *
 	 */
-	void reset_filter(double std_model, double std_noise);
+	void reset_filter();
 
 	/** @brief Get players strategy (if exists) */
 	void get_strategy(arma::vec2 & ball_des, double & des_land_time);
@@ -238,6 +378,21 @@ public:
 	 */
 	void play(const optim::joint & qact, const arma::vec3 & ball_obs, optim::joint & qdes);
 
+	/**
+	 * @brief Play Table Tennis with observations drained from a queue.
+	 *
+	 * Same as play() above, but the ball observations are pushed
+	 * (with their capture timestamps) by another (vision) thread,
+	 * which may run at a different rate than the servo loop.
+	 *
+	 * @param qact Actual joint positions, velocities, accelerations.
+	 * @param obs_queue Time-stamped ball observations.
+	 * @param time Current time, same clock as the observation timestamps.
+	 * @param qdes Desired joint positions, velocities, accelerations.
+	 */
+	void play(const optim::joint & qact, ObsQueue & obs_queue,
+	          const double time, optim::joint & qdes);
+
 	/**
 	 * @brief Cheat Table Tennis by getting the exact ball state in simulation.
 	 *
@@ -251,6 +406,9 @@ public:
 	 */
 	void cheat(const optim::joint & qact, const arma::vec6 & ballstate, optim::joint & qdes);
 
+	/** @brief Get hit and recompute statistics of the ball prediction cache */
+	const cache_stats & get_pred_cache_stats() const { return pred_cache.get_stats(); }
+
 };
 
 /**
@@ -319,6 +477,14 @@ void gen_3rd_poly(const arma::rowvec & times,
  */
 void predict_ball(const double & time_pred, mat & balls_pred, EKF & filter);
 
+/**
+ * @brief Predict ball with an adaptive step size from the filter mean
+ *
+ * Table, net and ground contacts are located exactly and the path
+ * can be queried at any time (see BallPath).
+ */
+void predict_ball(const double & time_pred, BallPath & ball_path, const EKF & filter);
+
 /**
  * @brief Predict hitting point on the Virtual Hitting Plane (VHP)
  *
@@ -348,6 +514,29 @@ bool check_legal_ball(const arma::vec6 & ball_est,
                         const mat & balls_predicted,
                         game & game_state);
 
+/**
+ * @brief Check if the table tennis trial is LEGAL using the dense ball path.
+ *
+ * Same as above, the bounces are counted from the predicted table contacts.
+ */
+bool check_legal_ball(const arma::vec6 & ball_est,
+                        const BallPath & ball_path,
+                        game & game_state);
+
+/**
+ * @brief Check the uncertainty of the predicted ball where it reaches the VHP.
+ *
+ * @param balls_pred Predicted ball path (every DT seconds).
+ * @param pred_params Uncertainty tube of the path (ball_pos_cov and cov_decim).
+ * @param vhpy Location of the hitting plane.
+ * @param max_std Max. standard deviation (square root of the trace of position covariance).
+ * @return TRUE if the ball reaches the VHP with small enough uncertainty.
+ */
+bool check_pred_uncertainty(const mat & balls_pred,
+                            const optim::optim_des & pred_params,
+                            const double vhpy,
+                            const double max_std);
+
 /**
  * @brief Checks for legal ball bounce
  * If an incoming ball has bounced before
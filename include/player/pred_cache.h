@@ -0,0 +1,119 @@
+/**
+ * @file pred_cache.h
+ *
+ * @brief Rolling ball prediction cache used by the Player class.
+ *
+ * In MPC mode the optimizers are relaunched many times during a trial.
+ * Instead of predicting the ball path (and the racket strategy) from
+ * scratch at every activation, the cached path is shifted forward
+ * by the elapsed ticks and extended at the end, as long as the filter
+ * corrections stay small.
+ */
+
+#ifndef PRED_CACHE_H_
+#define PRED_CACHE_H_
+
+#include "tabletennis.h"
+#include "optim.h"
+
+namespace player {
+
+/**
+ * @brief Statistics of the prediction cache.
+ */
+struct cache_stats {
+	int num_hits = 0; //!< cached path was shifted and extended
+	int num_recomputes = 0; //!< path was predicted from scratch
+	int num_racket_recomputes = 0; //!< racket strategy computed for the whole path
+	int num_racket_extends = 0; //!< racket strategy computed only for the new columns
+	double max_correction = 0.0; //!< largest filter correction accepted on a cache hit
+};
+
+/**
+ * @brief Rolling ball prediction cache.
+ *
+ * Predicts the ball every DT seconds for a fixed horizon with the
+ * same (allocation-free) ball kernel as the filter models.
+ * When updated k ticks later, the filter mean is compared with the
+ * cached prediction for the current tick. If the correction is within
+ * tolerance, the path is shifted by k columns and only the last k columns
+ * are predicted. Otherwise the path is predicted again from the filter mean.
+ * The racket strategy (for FP) is cached and shifted in the same way.
+ */
+class PredictionCache {
+
+private:
+
+	bool SPIN_MODE; // predict with a spin model (constant topspin)
+	double tol; // max. deviation of the filter mean from cached prediction (inf-norm)
+	int N; // number of predicted balls
+	ball_params params; // ball prediction parameters
+	double spin[NCART]; // constant angular velocity if SPIN_MODE is ON
+	int tick_pred = -1; // tick of the ball state the path is predicted from, -1 if empty
+	double ball_pred0[2*NCART] = {0.0}; // ball state the path is predicted from
+	mat balls; // predicted ball states, column i is at tick_pred + i + 1
+	optim::optim_des racket_des; // cached racket strategy
+	int num_racket_valid = 0; // number of leading columns of racket strategy that are up to date
+	double land_des[2] = {0.0}; // desired landing position of cached racket strategy
+	double time_land = 0.0; // desired landing time of cached racket strategy
+	cache_stats stats;
+
+	/** @brief Predict columns col_start,...,N-1 starting from given ball state. */
+	void predict(const double ball_state[2*NCART], const int col_start);
+
+	/** @brief Drop the first k columns of the matrix (in place). */
+	static void shift_cols(const int k, mat & M);
+
+public:
+
+	/**
+	 * @brief Initialize an empty cache.
+	 *
+	 * @param spin_flag Turn ON for spin modelling (same as filter).
+	 * @param time_pred Prediction horizon (predicted every DT seconds).
+	 * @param tolerance Max. correction of the filter mean (w.r.t. cached
+	 * prediction) to keep using the cached path.
+	 */
+	PredictionCache(const bool spin_flag = false,
+	                const double time_pred = 2.0,
+	                const double tolerance = 1e-3);
+
+	/** @brief Empty the cache, e.g. after filter is reset. */
+	void reset();
+
+	/**
+	 * @brief Set topspin of the spin model (revolutions/sec). Ignored if spin is OFF.
+	 *
+	 * Cache is emptied if the topspin changed.
+	 */
+	void set_topspin(const double val);
+
+	/**
+	 * @brief Update cached path given the current filter mean.
+	 *
+	 * @param ball_est Current filter mean.
+	 * @param tick Current tick (incremented every DT seconds).
+	 * @return TRUE if the path was predicted from scratch.
+	 */
+	bool update(const vec6 & ball_est, const int tick);
+
+	/** @return Predicted ball states (6 x N matrix as in predict_ball()). */
+	const mat & get_balls() const { return balls; }
+
+	/**
+	 * @brief Racket strategy on the cached path.
+	 *
+	 * Same as optim::calc_racket_strategy(), but only the columns
+	 * added since the last call are computed (unless desired landing changed).
+	 */
+	void calc_racket_strategy(const arma::vec2 & ball_land_des,
+	                          const double time_land_des,
+	                          optim::optim_des & racket_params);
+
+	/** @return Cache hit and recompute statistics. */
+	const cache_stats & get_stats() const { return stats; }
+};
+
+}
+
+#endif /* PRED_CACHE_H_ */
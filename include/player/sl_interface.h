@@ -28,6 +28,32 @@ extern void play(const SL_Jstate joint_state[],
 		         const blob_state blobs[],
 				 SL_DJstate joint_des_state[]);
 
+/**
+ * @brief Push the ball observation of the blobs to the play() loop.
+ *
+ * To be called from a (single) vision thread whenever new blobs arrive.
+ * Blobs are fused as in play(), stamped with their capture time (push time
+ * minus the vision_latency option) and added to a wait-free
+ * queue that play() drains every tick if the obs_queue option is set.
+ *
+ * @param blobs Two ball 3d-positions from 4-cameras are stored in blobs[1] and blobs[3]
+ * @return TRUE if the observation was valid and the queue was not full.
+ */
+extern int push_blobs(const blob_state blobs[]);
+
+/**
+ * @brief Push the positions of several balls seen in one camera frame.
+ *
+ * Multi-ball variant of push_blobs() for ball-gun bursts and drills
+ * (multi_ball option): all positions get the same capture time, so that
+ * play() associates them with the ball tracks as one batch.
+ *
+ * @param num_balls Number of balls detected.
+ * @param pos Ball positions stacked as [x1,y1,z1,x2,y2,z2,...].
+ * @return Number of positions added to the queue.
+ */
+extern int push_balls(const int num_balls, const double pos[]);
+
 /**
  * @brief CHEAT with exact knowledge of ball state.
  *
@@ -0,0 +1,114 @@
+/**
+ * @file snapshot.h
+ *
+ * @brief Seqlock-protected snapshots shared between background threads and the play loop.
+ *
+ * Background threads (ball state estimation, trajectory optimization) publish
+ * their results as a whole, and the servo thread reads a consistent copy
+ * without locking. A read that overlaps with a publish fails instead of
+ * waiting, and the servo thread tries again in the next tick.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+namespace player {
+
+/**
+ * @brief Seqlock around a trivially copyable value.
+ *
+ * The sequence number is odd while a publish is in progress. The value is
+ * stored as relaxed atomic words, so that a reader overlapping with a
+ * writer reads a torn (but well-defined) copy which it then discards
+ * after checking the sequence number. Writers are serialized with a
+ * compare-and-swap on the sequence number, readers never block.
+ *
+ * Copying a snapshot is not atomic, copies are meant for initialization only.
+ *
+ * @tparam T Type of the published value (e.g. plain struct of arrays).
+ */
+template <typename T>
+class Snapshot {
+
+	static_assert(std::is_trivially_copyable<T>::value,
+	              "Snapshot value must be trivially copyable!");
+
+private:
+
+	typedef unsigned long word;
+	static const unsigned long NWORDS = (sizeof(T) + sizeof(word) - 1) / sizeof(word);
+
+	std::atomic<unsigned long> seq; // twice the number of publishes (+1 while publishing)
+	std::atomic<word> data[NWORDS]; // value as atomic words
+
+	void copy(const Snapshot & other) {
+		seq.store(other.seq.load(std::memory_order_acquire) & ~1UL, std::memory_order_relaxed);
+		for (unsigned long i = 0; i < NWORDS; i++)
+			data[i].store(other.data[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+public:
+
+	Snapshot() : seq(0) {
+		for (unsigned long i = 0; i < NWORDS; i++)
+			data[i].store(0, std::memory_order_relaxed);
+	}
+
+	Snapshot(const Snapshot & other) : seq(0) { copy(other); }
+
+	Snapshot & operator=(const Snapshot & other) {
+		if (this != &other)
+			copy(other);
+		return *this;
+	}
+
+	/** @brief Publish a new value (e.g. from a background thread). */
+	void publish(const T & val) {
+		word buf[NWORDS] = {0};
+		std::memcpy(buf,&val,sizeof(T));
+		unsigned long s = seq.load(std::memory_order_relaxed);
+		while ((s & 1) || !seq.compare_exchange_weak(s,s+1,std::memory_order_acquire,
+		                                             std::memory_order_relaxed)) {
+			std::this_thread::yield(); // another writer is publishing
+			s = seq.load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_release);
+		for (unsigned long i = 0; i < NWORDS; i++)
+			data[i].store(buf[i], std::memory_order_relaxed);
+		seq.store(s+2, std::memory_order_release);
+	}
+
+	/**
+	 * @brief Read the last published value without blocking.
+	 *
+	 * @param val Last published value (output, unchanged on failure).
+	 * @return FALSE if nothing was published yet or a publish overlapped with the read.
+	 */
+	bool read(T & val) const {
+		const unsigned long s = seq.load(std::memory_order_acquire);
+		if (s == 0 || (s & 1))
+			return false;
+		word buf[NWORDS];
+		for (unsigned long i = 0; i < NWORDS; i++)
+			buf[i] = data[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (seq.load(std::memory_order_relaxed) != s)
+			return false;
+		std::memcpy(&val,buf,sizeof(T));
+		return true;
+	}
+
+	/** @return Number of completed publishes. */
+	unsigned long version() const {
+		return seq.load(std::memory_order_acquire) / 2;
+	}
+};
+
+}
+
+#endif /* SNAPSHOT_H_ */
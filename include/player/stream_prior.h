@@ -0,0 +1,87 @@
+/**
+ * @file stream_prior.h
+ *
+ * @brief Streaming estimator of the initial ball state.
+ *
+ * Instead of buffering min_obs observations and running a batch
+ * estimation (estimate_prior) on them, the observations are folded
+ * into a quadratic polynomial fit in O(1) as they arrive. The filter can
+ * then be started with the state and covariance of the fit as soon as
+ * a few (3-4) observations are available.
+ */
+
+#ifndef STREAM_PRIOR_H_
+#define STREAM_PRIOR_H_
+
+#include <armadillo>
+#include "constants.h"
+
+namespace player {
+
+/**
+ * @brief Recursive least squares fit of a quadratic polynomial (in time)
+ * to the ball positions.
+ *
+ * The information matrix and vector of the normal equations are
+ * updated with each observation. The acceleration (quadratic coefficient)
+ * has a Gaussian prior around gravity, so that the velocities are not
+ * dominated by the curvature of a few noisy points. Same regressors are
+ * used for every axis, hence the information matrix is shared. Times are
+ * taken relative to the first observation in units of DT to keep the
+ * normal equations well conditioned.
+ */
+class StreamPrior {
+
+private:
+
+	static const int NCOEF = 3; // coefficients of the quadratic polynomial
+
+	double var_noise; // observation noise variance
+	double var_acc; // variance of the acceleration prior (m/s^2)^2
+	double t0 = 0.0; // time of the first observation
+	int num_obs = 0; // number of observations
+	double info[NCOEF][NCOEF]; // information matrix
+	double info_vec[NCART][NCOEF]; // information vector of each axis
+
+public:
+
+	/**
+	 * @brief Initialize an empty estimator.
+	 *
+	 * @param var_noise Observation noise variance (e.g. var_noise of the filter).
+	 * @param var_acc Variance of the ball acceleration around gravity
+	 * (covers air drag and Magnus forces).
+	 */
+	StreamPrior(const double var_noise = 0.001, const double var_acc = 25.0);
+
+	/** @brief Remove all observations (e.g. new ball). */
+	void reset();
+
+	/**
+	 * @brief Add a ball observation in O(1).
+	 *
+	 * @param time Time of the observation.
+	 * @param obs Observed ball position.
+	 */
+	void add(const double time, const arma::vec3 & obs);
+
+	/** @return Number of observations added since last reset. */
+	int size() const { return num_obs; }
+
+	/**
+	 * @brief Ball state and its covariance at given time.
+	 *
+	 * Thanks to the acceleration prior, the state is observable
+	 * after two observations. Covariances of different axes are zero.
+	 *
+	 * @param time Time of the state (e.g. time of the last observation).
+	 * @param x Ball state estimate (output).
+	 * @param P Covariance of the estimate (output).
+	 * @return FALSE if fewer than two observations were added.
+	 */
+	bool get_state(const double time, arma::vec6 & x, arma::mat66 & P) const;
+};
+
+}
+
+#endif /* STREAM_PRIOR_H_ */
@@ -14,6 +14,7 @@
 
 #include "constants.h"
 #include "table.h"
+#include "ball_kernel.h"
 
 using arma::mat;
 using arma::vec;
@@ -48,26 +49,6 @@ struct status {
 	bool touched_ground = false; //!< the ball touched the ground level (vel. zeroed)
 };
 
-/**
- * @brief Ball parameters used to predict future ball path
- * and to calculate desired racket parameters.
- */
-struct ball_params {
-
-	/* Contact Coefficients */
-	double CRT = 0.88; //!< coefficient of restitution for the table (i.e. rebound z-velocity multiplier)
-	double CFTY = 0.72; //!< coefficient of table contact model on Y-direction
-	double CFTX = 0.68; //!< coefficient of table contact model on X-direction
-	double CRR = 0.78; //!< coefficent of restitution for racket
-
-	double Cdrag = 0.1414; 	//!< Air drag coefficient
-	double gravity = -9.802; //!< gravity
-	double Clift = 0.001; //!< coefficient of lift for the magnus force
-	double mu = 0.10; //!< dynamic coefficient of friction
-	double init_topspin = -50.0; //!< initial topspin amount
-};
-
-
 /**
  * @brief Table Tennis ball prediction methods
  *
@@ -85,9 +66,8 @@ private:
 	status stats;
 
 	ball_params params; // ball prediction parameters
-	vec3 ball_pos;
-	vec3 ball_vel;
-	vec3 ball_spin; // ball angular velocity = 0 if spin mode is turned OFF
+	ball_pod ball; // ball positions and velocities
+	double ball_spin[NCART]; // ball angular velocity = 0 if spin mode is turned OFF
 
 	/**
 	 * @brief Initialize constant angular velocity (a.k.a. spin)
@@ -95,54 +75,8 @@ private:
 	 */
 	void init_topspin(const double val = -50);
 
-	/**
-	 * @brief Spinning nonlinear ball flight model.
-	 *
-	 * Flight model including including airdrag and Magnus force (for spin).
-	 *
-	 * @return Ball accelerations as a 3-vector.
-	 *
-	 */
-	vec3 flight_model() const;
-
-	/**
-	 * @brief Spin free nonlinear flight model including airdrag
-	 *
-	 * Cdrag is a parameter used to add drag force.
-	 *
-	 * @return Ball accelerations as 3-vector.
-	 */
-	vec3 drag_flight_model() const;
-
-	/**
-	 * @brief Simple contact model that uses spin if spin mode is turned on.
-	 *
-	 * Linear contact model that updates the outgoing rebound velocities only.
-	 * Checks if the contact is of roll or slide type. Based on a spin model
-	 * from a Japanese table tennis paper.
-	 *
-	 * Note: Spin is not changed!
-	 * Coeff of restitution and friction used.
-	 *
-	 */
-	vec3 table_contact_model(const vec3 & ball_vel_in) const;
-
-	/**
-	 * @brief FIRST ORDER Symplectic Euler integration for dt seconds.
-	 *
-	 * First integrating the accelerations to velocities by dt
-	 * Then integrating the velocities to positions by dt
-	 * These (pos and vel) are kept in the ball candidate vector
-	 *
-	 * We dont directly update the ball states, this is done in
-	 * integrate_ball_state. This way we can check for contacts
-	 * in between.
-	 *
-	 * @param dt Prediction horizon.
-	 * @param ball_next_pos Next position using calculated ball accelerations.
-	 * @param ball_next_vel Next velocity using calculated ball accelerations.
-	 */
-	void symplectic_euler(const double dt, vec3 & ball_cand_pos, vec3 & ball_cand_vel) const;
+	/** @brief Ball angular velocity passed to the kernel, nullptr if spin mode is OFF. */
+	const double *spin() const { return SPIN_MODE ? ball_spin : nullptr; }
 
 	/**
 	 * @brief Checks if a contact will occur.
@@ -151,12 +85,10 @@ private:
 	 * a simulated human opponent!
 	 *
 	 * @param robot_racket Racket centre positions,velocities and normal of the robot
-	 * @param ball_cand_pos Balls next candidate positions (after symplectic int.).
-	 * @param ball_cand_vel Balls next candidate vels. (after symplectic int.).
+	 * @param ball_cand Balls next candidate state (after symplectic int.).
 	 */
 	void check_contact(const racket & robot_racket,
-			           vec3 & ball_cand_pos,
-			           vec3 & ball_cand_vel); // calls the contact functions below
+			           ball_pod & ball_cand); // calls the contact functions below
 
 	/**
 	 * @brief Checks for legal bounce on robot court
@@ -169,7 +101,7 @@ private:
 	 * then the bounce location is checked and if it is on the opponent's court
 	 * and if LEGAL_BOUNCE is TRUE then it is a LAND.
 	 */
-	void check_legal_bounce(const vec3 & ball_cand_pos, const vec3 & ball_cand_vel);
+	void check_legal_bounce(const ball_pod & ball_cand);
 
 	/**
 	 * @brief Checks for legal LAND on opponents court.
@@ -179,8 +111,7 @@ private:
 	 * then if bounce location is on the opponent's court it is a LEGAL LAND.
 	 *
 	*/
-	void check_legal_land(const vec3 & ball_cand_pos,
-	                      const vec3 & ball_cand_vel);
+	void check_legal_land(const ball_pod & ball_cand);
 
 	/**
 	 * @brief Condition to determine if ball hits the table.
@@ -190,10 +121,9 @@ private:
 	 * If contact is detected, then a table contact model (with constant
 	 * parameters) will update the next candidate ball velocities.
 	 *
-	 * @param ball_cand_pos Next candidate ball positions. Used to check contact only.
-	 * @param ball_cand_vel Next candidate ball velocities. Updated if contact happens.
+	 * @param ball_cand Next candidate ball state. Velocities updated if contact happens.
 	 */
-	void check_ball_table_contact(const vec3 & ball_cand_pos, vec3 & ball_cand_vel);
+	void check_ball_table_contact(ball_pod & ball_cand);
 
 	/**
 	 * @brief Checks contact with net.
@@ -204,10 +134,9 @@ private:
 	 * Then the ball candidate velocities are updated according to a (simplistic)
 	 * net contact model.
 	 *
-	 * @param ball_cand_pos Next candidate ball positions. Updated if contact happens.
-	 * @param ball_cand_vel Next candidate ball velocities. Updated if contact happens.
+	 * @param ball_cand Next candidate ball state. Updated if contact happens.
 	 */
-	void check_ball_net_contact(vec3 & ball_cand_pos, vec3 & ball_cand_vel) const;
+	void check_ball_net_contact(ball_pod & ball_cand) const;
 
 	/**
 	 * @brief  Checks contact with racket.
@@ -217,11 +146,9 @@ private:
 	 * we do not hit it the next time.
 	 *
 	 * @param robot_racket Racket center pos,vel and normals of the robot
-	 * @param ball_cand_pos Next candidate ball positions. Used to check contact only.
-	 * @param ball_cand_vel Next candidate ball velocities. Updated if contact happens.
+	 * @param ball_cand Next candidate ball state. Velocities updated if contact happens.
 	 */
-	void check_ball_racket_contact(const racket & robot,
-			       const vec3 & ball_cand_pos, vec3 & ball_cand_vel);
+	void check_ball_racket_contact(const racket & robot, ball_pod & ball_cand);
 
 	/**
 	 *
@@ -230,12 +157,10 @@ private:
 	 * Checking contact with ground. Zeros the velocities and
 	 * hardsets the next candidate positions to ground level!
 	 *
-	 * @param ball_cand_pos Next candidate ball positions.
-	 * If contact occurs, z-position is set to floor level.
-	 * @param ball_cand_vel Next candidate ball velocities.
-	 * If contact occurs, velocities are set to zero.
+	 * @param ball_cand Next candidate ball state.
+	 * If contact occurs, z-position is set to floor level and velocities are set to zero.
 	 */
-	void check_ball_ground_contact(vec3 & ball_cand_pos, vec3 & ball_cand_vel);
+	void check_ball_ground_contact(ball_pod & ball_cand);
 
 public:
 
@@ -366,6 +291,9 @@ public:
 	 */
 	void integrate_ball_state(const racket & robot, const double dt);
 
+	/** @return Ball positions and velocities as plain arrays. */
+	const ball_pod & get_ball_pod() const { return ball; }
+
 	/**
 	 * @brief Calculate desired racket normal assuming mirror law
 	 *
@@ -413,6 +341,7 @@ public:
  *
  * Function exposes the table tennis integration to filters, e.g. an EKF.
  * They can use then to apply predict() using the this function pointer.
+ * Integrates through the allocation-free ball kernel (see ball_kernel.h).
  *
  * Warning: spin is turned OFF!
  * Prediction with a spin model assumes that spin is kept constant
@@ -463,6 +392,35 @@ vec calc_spin_ball(const vec & xnow,
                    const double dt,
                    const void *fp);
 
+/**
+ * @brief Closed-form Jacobian of calc_next_ball() w.r.t. the ball state.
+ *
+ * Differentiates the drag flight model and (if the ball bounces during dt)
+ * the table contact model, so that an EKF does not need finite differences.
+ *
+ * @param xnow Consists of current ball position and velocity.
+ * @param dt Prediction horizon.
+ * @param fp Function parameters, not used.
+ * @return 6x6 Jacobian of the next ball state.
+ */
+mat calc_next_ball_jacobian(const vec & xnow,
+                            const double dt,
+                            const void *fp);
+
+/**
+ * @brief Closed-form Jacobian of calc_spin_ball() w.r.t. the ball state.
+ *
+ * Includes the Magnus force and the spin-based table contact model.
+ *
+ * @param xnow Consists of current ball position and velocity.
+ * @param dt Prediction horizon.
+ * @param fp Function parameters are in this case the topspin value.
+ * @return 6x6 Jacobian of the next ball state.
+ */
+mat calc_spin_ball_jacobian(const vec & xnow,
+                            const double dt,
+                            const void *fp);
+
 /**
  * @brief Predict ball state FORWARDS till net
  *
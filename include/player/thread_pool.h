@@ -0,0 +1,79 @@
+/**
+ * @file thread_pool.h
+ *
+ * @brief Fixed-size pool of worker threads for data-parallel loops.
+ *
+ * Workers are started once and wait on a condition variable, so that
+ * splitting a loop across cores does not create threads at every tick.
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace player {
+
+/**
+ * @brief Fixed-size thread pool.
+ *
+ * run() calls the task once for every thread index 0,...,size()-1.
+ * The calling thread runs index 0 and blocks until all the workers
+ * are finished. Concurrent calls to run() are serialized.
+ */
+class ThreadPool {
+
+private:
+
+	int num_threads; // including the calling thread
+	std::vector<std::thread> workers;
+	std::mutex run_mtx; // serializes calls to run()
+	std::mutex mtx;
+	std::condition_variable cv_start;
+	std::condition_variable cv_done;
+	const std::function<void(int)> *task = nullptr; // current task
+	long generation = 0; // incremented for every new task
+	int num_pending = 0; // number of workers still running the current task
+	bool stop = false;
+
+	/** @brief Worker loop, waits for new tasks until the pool is destroyed. */
+	void work(const int idx);
+
+public:
+
+	/**
+	 * @brief Start the workers.
+	 * @param num_threads Number of threads including the calling thread.
+	 * If zero or negative, uses the number of hardware threads.
+	 */
+	ThreadPool(const int num_threads = 0);
+
+	/** @brief Stop and join the workers. */
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool & operator=(const ThreadPool &) = delete;
+
+	/** @return Number of threads including the calling thread. */
+	int size() const { return num_threads; }
+
+	/**
+	 * @brief Run the task on all threads and wait until finished.
+	 * @param fun Task called with the thread index.
+	 */
+	void run(const std::function<void(int)> & fun);
+
+	/**
+	 * @brief Split the range [0,n) into size() contiguous chunks
+	 * and run fun(idx,begin,end) for each chunk in parallel.
+	 */
+	void parallel_for(const int n, const std::function<void(int,int,int)> & fun);
+};
+
+}
+
+#endif /* THREAD_POOL_H_ */
@@ -0,0 +1,116 @@
+/**
+ * @file ukf.h
+ *
+ * @brief Unscented Kalman Filter for the table tennis ball.
+ *
+ * Instead of linearizing the ball model around the mean (which is
+ * inaccurate across table bounces), 2n+1 sigma points are propagated
+ * through the (nonlinear) ball model. The sigma points are integrated
+ * together with the batched ball simulator, i.e. in one vectorized call.
+ */
+
+#ifndef UKF_H_
+#define UKF_H_
+
+#include "kalman.h"
+#include "ball_batch.h"
+
+namespace player {
+
+/**
+ * @brief Unscented Kalman Filter for the ball.
+ *
+ * Same interface as the EKF and can be used through an EKF reference
+ * (e.g. the filter of the Player class). Only the prediction is unscented:
+ * the observations are linear in the state, so the KF update is exact.
+ * predict_path() and predict() with lin_flag FALSE propagate only the mean
+ * with the function pointer of the EKF.
+ */
+class UKF : public EKF {
+
+private:
+
+	static const int DIMX = 2*NCART; // state dimension
+	static const int NUM_SIGMA = 2*DIMX + 1; // number of sigma points
+
+	bool SPIN_MODE; // predict with the spin model
+	double alpha; // spread of the sigma points around the mean
+	double beta; // prior knowledge of the distribution (2 for Gaussians)
+	double kappa; // secondary scaling parameter
+	double lambda; // alpha^2 * (n + kappa) - n
+	vec wm; // weights of the sigma points for the mean
+	vec wc; // weights of the sigma points for the covariance
+	double topspin; // topspin used by the function pointer (if spin is ON)
+	BallBatch sigma_balls; // sigma points are integrated together
+
+	/** @brief Sigma points around the current mean as columns of a 6 x (2n+1) matrix. */
+	mat calc_sigma_points() const;
+
+public:
+
+	/**
+	 * @brief Initialize the UKF with given noise covariance matrices.
+	 *
+	 * State is left uninitialized. Default scaling parameters place
+	 * the sigma points sqrt(n) standard deviations away from the mean
+	 * with nonnegative weights.
+	 *
+	 * @param spin Use spin model if true.
+	 * @param Cin Observation matrix C.
+	 * @param Qin Process noise covariance Q.
+	 * @param Rin Observation noise covariance R.
+	 * @param rej_mult Outlier rejection standard deviation multiplier.
+	 * @param alpha Spread of the sigma points.
+	 * @param beta Prior knowledge of the distribution (2 is optimal for Gaussians).
+	 * @param kappa Secondary scaling parameter.
+	 */
+	UKF(const bool spin,
+	    mat & Cin,
+	    mat & Qin,
+	    mat & Rin,
+	    double rej_mult = 2.0,
+	    double alpha = 1.0,
+	    double beta = 2.0,
+	    double kappa = 0.0);
+
+	/** @brief Copy filter and point the function parameters to own topspin. */
+	UKF(const UKF & other);
+
+	/** @brief Copy filter and point the function parameters to own topspin. */
+	UKF & operator=(const UKF & other);
+
+	/** @brief Set topspin of the ball model (revolutions/sec). Ignored if spin is OFF. */
+	void set_topspin(const double val);
+
+	/**
+	 * @brief Set topspin estimate (params points to a double).
+	 *
+	 * Function parameters of the EKF keep pointing to the filter's own topspin.
+	 */
+	void set_fun_params(void *params);
+
+	/**
+	 * @brief Predict dt seconds for mean x and (if flag is true) variance P.
+	 *
+	 * Propagates the sigma points with the batched ball simulator and
+	 * computes the weighted mean and covariance of the propagated points.
+	 *
+	 * @param dt Prediction horizon.
+	 * @param lin_flag If false, only the mean is predicted (as in EKF).
+	 */
+	void predict(const double dt, const bool lin_flag = true);
+};
+
+/**
+ * @brief Initialize a UKF (same arguments as init_filter).
+ *
+ * @return UKF Unscented Kalman Filter (state uninitialized!)
+ */
+UKF init_ukf(const double var_model = 0.001,
+             const double var_noise = 0.001,
+             const bool spin = false,
+             const double out_reject_mult = 2.0);
+
+}
+
+#endif /* UKF_H_ */
@@ -0,0 +1,110 @@
+/**
+ * @file worker_pool.h
+ *
+ * @brief Long-lived worker threads for background jobs (optimization, ball state estimation).
+ *
+ * Instead of spawning a thread for every optimization (every 1/freq_mpc seconds
+ * in MPC mode) or initial ball state estimation, jobs are queued and run
+ * by workers that are started once (and optionally pinned to given cores).
+ */
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <chrono>
+
+namespace player {
+
+/**
+ * @brief Priorities of the jobs, higher priority jobs are started first.
+ */
+enum job_priority {
+	PRIORITY_LOW = 0, //!< e.g. rest posture optimization
+	PRIORITY_NORMAL = 1, //!< e.g. striking trajectory optimization
+	PRIORITY_HIGH = 2, //!< jobs that should start before the queued optimizations
+};
+
+/**
+ * @brief Pool of worker threads running queued jobs.
+ *
+ * Jobs are started in the order of decreasing priority (FIFO among the same
+ * priority). A job that is not started before its deadline is dropped.
+ * The returned future tells when the job is finished (or dropped), so that
+ * the caller can poll it without blocking.
+ */
+class WorkerPool {
+
+private:
+
+	typedef std::chrono::steady_clock clock;
+
+	struct job {
+		int priority;
+		long seq; // submission order
+		clock::time_point deadline; // job is dropped if not started before
+		std::packaged_task<bool(bool)> task; // called with TRUE if dropped
+	};
+
+	std::vector<std::thread> workers;
+	std::vector<job> queue; // heap ordered by priority and submission order
+	std::mutex mtx;
+	std::condition_variable cv_job;
+	std::condition_variable cv_idle;
+	long num_submitted = 0;
+	int num_busy = 0; // number of workers running a job
+	bool stop = false;
+
+	/** @brief Heap order: TRUE if job a is started after job b. */
+	static bool later(const job & a, const job & b);
+
+	/** @brief Worker loop, runs jobs until the pool is destroyed. */
+	void work();
+
+	/** @brief Drop the queued jobs (their futures read FALSE) and join the workers. */
+	void shutdown();
+
+public:
+
+	/**
+	 * @brief Start the workers.
+	 *
+	 * @param num_workers Number of worker threads (at least one).
+	 * @param cpus Cores the workers are pinned to, worker i runs on cpus[i % cpus.size()].
+	 * Workers are not pinned if empty (Linux only otherwise).
+	 */
+	WorkerPool(const int num_workers = 1, const std::vector<int> & cpus = std::vector<int>());
+
+	/** @brief Drop the queued jobs, wait for the running jobs and join the workers. */
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool & operator=(const WorkerPool &) = delete;
+
+	/** @return Number of worker threads. */
+	int size() const { return workers.size(); }
+
+	/**
+	 * @brief Queue a job.
+	 *
+	 * @param fun Job to run on a worker.
+	 * @param priority Higher priority jobs are started first.
+	 * @param timeout Job is dropped if not started within timeout seconds (no deadline if not positive).
+	 * @return Future that is ready when the job is finished, its value is FALSE if it was dropped.
+	 */
+	std::shared_future<bool> submit(const std::function<void()> & fun,
+	                                const int priority = PRIORITY_NORMAL,
+	                                const double timeout = 0.0);
+
+	/** @brief Block until the queue is empty and no job is running. */
+	void wait_idle();
+};
+
+}
+
+#endif /* WORKER_POOL_H_ */
@@ -10,6 +10,7 @@
 
 #include <armadillo>
 #include <iostream>
+#include <atomic>
 #include "constants.h"
 #include "table.h"
 #include "utils.h"
@@ -17,6 +18,7 @@
 #include "math.h"
 #include "kinematics.h"
 #include "optim.h"
+#include "ball_path.h"
 #include "lookup.h"
 
 #define INEQ_HIT_CONSTR_DIM 3
@@ -25,6 +27,8 @@
 
 namespace optim {
 
+typedef DefensiveOptim::dvar dvar;
+
 /*
  * Calculates the cost function for table tennis Lazy Player (LP)
  * to find spline (3rd order strike+return) polynomials
@@ -67,12 +71,14 @@ static void hit_ineq_constr(unsigned m,
  * The outgoing ball velocity is post-multiplied by some constants \mu < 1
  * to account for ball drag
  *
+ * Templated on the scalar type to propagate the derivatives (dual numbers)
  *
  */
-static void racket_contact_model(const double* racketVel,
-		                         const double* racketNormal,
+template <typename Scalar>
+static void racket_contact_model(const Scalar* racketVel,
+		                         const Scalar* racketNormal,
 								 const std::vector<double> & mult_vel,
-								 double* ballVel);
+								 Scalar* ballVel);
 
 /*
  * First order hold to interpolate linearly at time T
@@ -81,11 +87,43 @@ static void racket_contact_model(const double* racketVel,
  * IF T is nan, racket variables are assigned to zero-element of
  * relevant racket entries
  *
+ * If a dense ball path is given, it is evaluated at T instead
+ *
+ * If dpos and dvel are not NULL, derivatives w.r.t. T are also returned
+ * (slopes of the interpolation or central differences on the ball path)
+ *
  */
 static void interp_ball(const optim_des *params,
                         const double T,
 		                double *ballpos,
-		                double *ballvel);
+		                double *ballvel,
+		                double *dpos = nullptr,
+		                double *dvel = nullptr);
+
+/*
+ * Racket and ball states at hitting time as dual numbers,
+ * i.e. with their derivatives w.r.t. the optim. variables x
+ *
+ * Racket derivatives are the closed-form kinematics derivatives,
+ * ball derivatives are w.r.t. the hitting time only
+ */
+static void calc_hit_states(const optim_des *params,
+                            const double x[],
+                            dvar racket_pos[],
+                            dvar racket_vel[],
+                            dvar racket_normal[],
+                            dvar ball_pos[],
+                            dvar ball_vel[]);
+
+/*
+ * Copy the values of the (dual) constraints to result
+ * and their derivatives to the NLOPT gradient if grad is not NULL
+ */
+static void copy_constr(unsigned m,
+                        unsigned n,
+                        const dvar constr[],
+                        double *result,
+                        double *grad);
 
 DefensiveOptim::DefensiveOptim(const vec7 & qrest_,
                                 double lb_[],
@@ -119,6 +157,38 @@ DefensiveOptim::DefensiveOptim(const vec7 & qrest_,
 	}
 }
 
+Optim* DefensiveOptim::clone() const {
+
+	DefensiveOptim *copy = new DefensiveOptim(*this);
+	if (land) // NLOPT instance of the copy calls back the copy
+		copy->set_land_constr();
+	else
+		copy->set_hit_constr();
+	return copy;
+}
+
+void DefensiveOptim::copy_problem(Optim & racer) const {
+
+	Optim::copy_problem(racer);
+	// landing is cached for the last x, which may be a start again
+	static_cast<DefensiveOptim&>(racer).x_last[0] = NAN;
+}
+
+double DefensiveOptim::calc_cost(const double x[], double grad[]) {
+
+	return costfunc(OPTIM_DIM,x,grad,(void*)this);
+}
+
+int DefensiveOptim::calc_ineq_constr(const double x[], double result[], double grad[]) {
+
+	if (land) {
+		land_ineq_constr(INEQ_LAND_CONSTR_DIM,result,OPTIM_DIM,x,grad,(void*)this);
+		return INEQ_LAND_CONSTR_DIM;
+	}
+	hit_ineq_constr(INEQ_HIT_CONSTR_DIM,result,OPTIM_DIM,x,grad,(void*)this);
+	return INEQ_HIT_CONSTR_DIM;
+}
+
 void DefensiveOptim::set_weights(const std::vector<double> & weights) {
 
 	w.R_net = weights[1];
@@ -192,34 +262,26 @@ void DefensiveOptim::finalize_soln(const double x[], double time_elapsed) {
 		T = x[2*NDOF];
 		if (detach)
 			T -= (time_elapsed/1e3);
-		update = true;
+		publish_soln(T);
 	}
 	//trigger_optim();
 }
 
 void DefensiveOptim::calc_times(const double x[]) { // ball projected to racket plane
 
-	static double qf[NDOF];
-	static double qfdot[NDOF];
-	static double vel[NCART];
-	static double normal[NCART];
-	static double pos[NCART];
-	static double ballpos[NCART];
-	static double ballvel[NCART];
-	static double g = -9.8;
-	static double net_y = dist_to_table - table_length/2.0;
-	static double table_z = floor_level - table_height;
-	double discr = 0.0;
-	double d;
+	const double g = -9.8;
+	const double net_y = dist_to_table - table_length/2.0;
+	const double table_z = floor_level - table_height;
+	dvar vel[NCART];
+	dvar normal[NCART];
+	dvar pos[NCART];
+	dvar ballpos[NCART];
+	dvar ballvel[NCART];
+	dvar discr = 0.0;
+	dvar d;
 
 	if (!vec_is_equal(OPTIM_DIM,x,x_last)) {
-		// extract state information from optimization variables
-		for (int i = 0; i < NDOF; i++) {
-			qf[i] = x[i];
-			qfdot[i] = x[i + NDOF];
-		}
-		calc_racket_state(qf, qfdot, pos, vel, normal);
-		interp_ball(this->param_des, x[2*NDOF], ballpos, ballvel);
+		calc_hit_states(this->param_des, x, pos, vel, normal, ballpos, ballvel);
 		// calculate deviation of ball to racket - hitting constraints
 		calc_hit_distance(ballpos,pos,normal);
 		racket_contact_model(vel, normal, mult_vel, ballvel);
@@ -241,10 +303,10 @@ void DefensiveOptim::calc_times(const double x[]) { // ball projected to racket
 	}
 }
 
-double DefensiveOptim::calc_punishment() {
+dvar DefensiveOptim::calc_punishment() {
 
-	double Jhit = 0;
-	double Jland = 0;
+	dvar Jhit = 0;
+	dvar Jland = 0;
 	if (land) {
 		Jland = sqr(x_net[X] - penalty_loc[0])*w.R_net + sqr(x_net[Z] - penalty_loc[1])*w.R_net +
 				sqr(x_land[X] - penalty_loc[2]*w.R_land + sqr(x_land[Y] - penalty_loc[3])*w.R_land);
@@ -253,16 +315,19 @@ double DefensiveOptim::calc_punishment() {
 	return Jhit + Jland;
 }
 
-void DefensiveOptim::calc_hit_distance(const double ball_pos[],
-		                          const double racket_pos[],
-								  const double racket_normal[]) {
+void DefensiveOptim::calc_hit_distance(const dvar ball_pos[],
+		                          const dvar racket_pos[],
+								  const dvar racket_normal[]) {
 
-	double e[NCART];
+	dvar e[NCART];
+	dvar sq_dist = 0.0;
+	dist_b2r_norm = 0.0;
 	for (int i = 0; i < NCART; i++) {
 		e[i] = ball_pos[i] - racket_pos[i];
+		dist_b2r_norm += racket_normal[i] * e[i];
+		sq_dist += e[i] * e[i];
 	}
-	dist_b2r_norm = inner_prod(NCART,racket_normal,e);
-	dist_b2r_proj = sqrt(inner_prod(NCART,e,e) - dist_b2r_norm*dist_b2r_norm);
+	dist_b2r_proj = sqrt(sq_dist - dist_b2r_norm*dist_b2r_norm);
 
 }
 
@@ -270,16 +335,16 @@ double DefensiveOptim::test_soln(const double x[]) const {
 
 	double max_viol;
 	// give info on constraint violation
-	static double table_xmax = table_width/2.0;
-	static double table_ymax = dist_to_table - table_length;
-	static double wall_z = 1.0;
-	static double net_y = dist_to_table - table_length/2.0;
-	static double net_z = floor_level - table_height + net_height;
-	static int count = 0;
+	const double table_xmax = table_width/2.0;
+	const double table_ymax = dist_to_table - table_length;
+	const double wall_z = 1.0;
+	const double net_y = dist_to_table - table_length/2.0;
+	const double net_z = floor_level - table_height + net_height;
+	static std::atomic<int> count(0); // shared by the optimizers running in other threads
 	double *grad = 0;
-	static double max_acc_violation; // at hitting time
-	static double land_violation[INEQ_LAND_CONSTR_DIM];
-	static double lim_violation[INEQ_JOINT_CONSTR_DIM]; // joint limit violations on strike and return
+	double max_acc_violation; // at hitting time
+	double land_violation[INEQ_LAND_CONSTR_DIM];
+	double lim_violation[INEQ_JOINT_CONSTR_DIM]; // joint limit violations on strike and return
 	joint_limits_ineq_constr(INEQ_JOINT_CONSTR_DIM, lim_violation, OPTIM_DIM, x, grad, (void*)this);
 	land_ineq_constr(INEQ_LAND_CONSTR_DIM, land_violation, OPTIM_DIM, x, grad, (void*)this);
 	double cost = costfunc(OPTIM_DIM, x, grad, (void*)this);
@@ -290,15 +355,15 @@ double DefensiveOptim::test_soln(const double x[]) const {
 		print_optim_vec(x);
 		printf("f = %.2f\n",cost);
 		printf("Hitting constraints (b2r):\n");
-		printf("Distance along normal: %.2f\n",dist_b2r_norm);
-		printf("Distance along racket: %.2f\n",dist_b2r_proj);
+		printf("Distance along normal: %.2f\n",dist_b2r_norm.val);
+		printf("Distance along racket: %.2f\n",dist_b2r_proj.val);
 		printf("Landing constraints:\n");
-		printf("NetTime: %f\n", t_net);
-	    printf("LandTime: %f\n", t_land);
-		printf("Below wall by : %f\n", wall_z - x_net[Z]);
-		printf("Above net by: %f\n", x_net[Z] - net_z);
-		printf("X: between table limits by [%f, %f]\n", table_xmax - x_land[X], x_land[X] + table_xmax);
-		printf("Y: between table limits by [%f, %f]\n", net_y - x_land[Y], x_land[Y] - table_ymax);
+		printf("NetTime: %f\n", t_net.val);
+	    printf("LandTime: %f\n", t_land.val);
+		printf("Below wall by : %f\n", wall_z - x_net[Z].val);
+		printf("Above net by: %f\n", x_net[Z].val - net_z);
+		printf("X: between table limits by [%f, %f]\n", table_xmax - x_land[X].val, x_land[X].val + table_xmax);
+		printf("Y: between table limits by [%f, %f]\n", net_y - x_land[Y].val, x_land[Y].val - table_ymax);
 		for (int i = 0; i < INEQ_JOINT_CONSTR_DIM; i++) {
 			if (lim_violation[i] > 0.0) {
 				printf("Joint limit violated by %.2f on joint %d\n", lim_violation[i], i%NDOF + 1);
@@ -317,46 +382,42 @@ static double costfunc(unsigned n,
                         double *grad,
                         void *my_func_params) {
 
-	static double J1, Jland;
-	static double a1[NDOF], a2[NDOF];
-	double T = x[2*NDOF];
+	dvar xd[2*NDOF+1];
+	dvar a1[NDOF], a2[NDOF];
+	dvar J1 = 0.0;
 
 	DefensiveOptim* opt = (DefensiveOptim*) my_func_params;
 	double *q0 = opt->q0;
 	double *q0dot = opt->q0dot;
 	weights w = opt->w;
 
+	// seed the optim. variables to differentiate the cost
+	for (unsigned i = 0; i < n; i++)
+		xd[i] = dvar::variable(x[i],i);
+	const dvar & T = xd[2*NDOF];
+
 	// calculate the polynomial coeffs which are used in the cost calculation
-	calc_strike_poly_coeff(q0,q0dot,x,a1,a2);
+	calc_strike_poly_coeff(q0,q0dot,xd,a1,a2);
 
 	// calculate the landing time
 	opt->calc_times(x);
 
 	// calculate the punishments;
-	Jland = opt->calc_punishment();
+	dvar Jland = opt->calc_punishment();
 
-	J1 = T * (3*T*T*inner_w_prod(NDOF,w.R_strike,a1,a1) +
-			3*T*inner_w_prod(NDOF,w.R_strike,a1,a2) +
-			inner_w_prod(NDOF,w.R_strike,a2,a2));
+	for (int i = 0; i < NDOF; i++)
+		J1 += w.R_strike[i] * (3*T*T*a1[i]*a1[i] + 3*T*a1[i]*a2[i] + a2[i]*a2[i]);
+	J1 *= T;
 
+	const dvar J = J1 + Jland;
 	if (grad) {
-		static double h = 1e-6;
-		static double val_plus, val_minus;
-		static double xx[2*NDOF+1];
 		for (unsigned i = 0; i < n; i++)
-			xx[i] = x[i];
-		for (unsigned i = 0; i < n; i++) {
-			xx[i] += h;
-			val_plus = costfunc(n, xx, NULL, my_func_params);
-			xx[i] -= 2*h;
-			val_minus = costfunc(n, xx, NULL, my_func_params);
-			grad[i] = (val_plus - val_minus) / (2*h);
-			xx[i] += h;
-		}
+			grad[i] = J.der[i];
 	}
 
 	//std::cout << J1 << "\t" << Jhit << "\t" << Jland << std::endl;
-	return J1 + Jland;
+	opt->track_cost(x,J.val);
+	return J.val;
 }
 
 static void land_ineq_constr(unsigned m,
@@ -366,40 +427,26 @@ static void land_ineq_constr(unsigned m,
                             double *grad,
 		                    void *my_func_params) {
 
-	static double table_xmax = table_width/2.0;
-	//static double table_ymax = dist_to_table - table_length;
-	static double wall_z = 1.0;
-	//static double net_y = dist_to_table - table_length/2.0;
-	static double net_z = floor_level - table_height + net_height;
+	const double table_xmax = table_width/2.0;
+	//const double table_ymax = dist_to_table - table_length;
+	const double wall_z = 1.0;
+	//const double net_y = dist_to_table - table_length/2.0;
+	const double net_z = floor_level - table_height + net_height;
 
 	DefensiveOptim* opt = (DefensiveOptim*)my_func_params;
 	opt->calc_times(x);
 
-	result[0] = -opt->dist_b2r_norm;
-	result[1] = opt->dist_b2r_norm - ball_radius;
-	result[2] = opt->dist_b2r_proj - racket_radius;
-	result[3] = opt->x_net[Z] - wall_z;
-	result[4] = -opt->x_net[Z] + net_z;
-	result[5] = opt->x_net[X] - table_xmax;
-	result[6] = -opt->x_net[X] - table_xmax;
-	result[7] = -opt->t_net;
-
-	if (grad) {
-		static double h = 1e-6;
-		static double res_plus[INEQ_LAND_CONSTR_DIM], res_minus[INEQ_LAND_CONSTR_DIM];
-		static double xx[2*NDOF+1];
-		for (unsigned i = 0; i < n; i++)
-			xx[i] = x[i];
-		for (unsigned i = 0; i < n; i++) {
-			xx[i] += h;
-			land_ineq_constr(m, res_plus, n, xx, NULL, my_func_params);
-			xx[i] -= 2*h;
-			land_ineq_constr(m, res_minus, n, xx, NULL, my_func_params);
-			xx[i] += h;
-			for (unsigned j = 0; j < m; j++)
-				grad[j*n + i] = (res_plus[j] - res_minus[j]) / (2*h);
-		}
-	}
+	dvar constr[INEQ_LAND_CONSTR_DIM];
+	constr[0] = -opt->dist_b2r_norm;
+	constr[1] = opt->dist_b2r_norm - ball_radius;
+	constr[2] = opt->dist_b2r_proj - racket_radius;
+	constr[3] = opt->x_net[Z] - wall_z;
+	constr[4] = -opt->x_net[Z] + net_z;
+	constr[5] = opt->x_net[X] - table_xmax;
+	constr[6] = -opt->x_net[X] - table_xmax;
+	constr[7] = -opt->t_net;
+	copy_constr(m,n,constr,result,grad);
+	opt->track_violation(x,m,result,false);
 }
 
 static void hit_ineq_constr(unsigned m,
@@ -409,67 +456,41 @@ static void hit_ineq_constr(unsigned m,
                             double *grad,
 		                     void *my_func_params) {
 
-	static double qf[NDOF];
-	static double qfdot[NDOF];
-	static double vel[NCART];
-	static double normal[NCART];
-	static double pos[NCART];
-	static double ballpos[NCART];
-	static double ballvel[NCART];
+	dvar vel[NCART];
+	dvar normal[NCART];
+	dvar pos[NCART];
+	dvar ballpos[NCART];
+	dvar ballvel[NCART];
 
 	DefensiveOptim* opt = (DefensiveOptim*)my_func_params;
 
-	for (unsigned i = 0; i < NDOF; i++) {
-		qf[i] = x[i];
-		qfdot[i] = x[i + NDOF];
-	}
-	interp_ball(opt->param_des, x[2*NDOF], ballpos, ballvel);
-	calc_racket_state(qf, qfdot, pos, vel, normal);
+	calc_hit_states(opt->param_des, x, pos, vel, normal, ballpos, ballvel);
 	// calculate deviation of ball to racket - hitting constraints
 	opt->calc_hit_distance(ballpos,pos,normal);
 
-	if (grad) {
-		static double h = 1e-6;
-		static double res_plus[INEQ_HIT_CONSTR_DIM], res_minus[INEQ_HIT_CONSTR_DIM];
-		static double xx[2*NDOF+1];
-		for (unsigned i = 0; i < n; i++)
-			xx[i] = x[i];
-		for (unsigned i = 0; i < n; i++) {
-			xx[i] += h;
-			hit_ineq_constr(m, res_plus, n, xx, NULL, my_func_params);
-			xx[i] -= 2*h;
-			hit_ineq_constr(m, res_minus, n, xx, NULL, my_func_params);
-			xx[i] += h;
-			for (unsigned j = 0; j < m; j++)
-				grad[j*n + i] = (res_plus[j] - res_minus[j]) / (2*h);
-		}
-	}
-
-	result[0] = -opt->dist_b2r_norm;
-	result[1] = opt->dist_b2r_norm - ball_radius;
-	result[2] = opt->dist_b2r_proj - racket_radius;
+	dvar constr[INEQ_HIT_CONSTR_DIM];
+	constr[0] = -opt->dist_b2r_norm;
+	constr[1] = opt->dist_b2r_norm - ball_radius;
+	constr[2] = opt->dist_b2r_proj - racket_radius;
+	copy_constr(m,n,constr,result,grad);
+	opt->track_violation(x,m,result,false);
 }
 
-static void racket_contact_model(const double* racketVel,
-		                         const double* racketNormal,
+template <typename Scalar>
+static void racket_contact_model(const Scalar* racketVel,
+		                         const Scalar* racketNormal,
 		                         const std::vector<double> & mult_vel,
-		                         double* ballVel) {
+		                         Scalar* ballVel) {
 
 	static const double racket_param = 0.78;
-	static double diffVel[NCART];
-	static double normalMultSpeed[NCART];
-	double speed;
+	Scalar speed = 0.0;
 
 	for (int i = 0; i < NCART; i++)
-		diffVel[i] = racketVel[i] - ballVel[i];
-
-	speed = (1 + racket_param) * inner_prod(NCART, racketNormal, diffVel);
+		speed += racketNormal[i] * (racketVel[i] - ballVel[i]);
+	speed *= (1 + racket_param);
 
-	for (int i = 0; i < NCART; i++) {
-		normalMultSpeed[i] = speed * racketNormal[i];
-	}
-	vec_plus(NCART,normalMultSpeed,ballVel);
 	for (int i = 0; i < NCART; i++ ) {
+		ballVel[i] += speed * racketNormal[i];
 		ballVel[i] *= mult_vel[i];
 	}
 }
@@ -477,14 +498,33 @@ static void racket_contact_model(const double* racketVel,
 static void interp_ball(const optim_des *data,
                         const double T,
                         double *ballpos,
-                        double *ballvel) {
+                        double *ballvel,
+                        double *dpos,
+                        double *dvel) {
 
     const double dt = data->dt;
+    const bool deriv = (dpos != nullptr && dvel != nullptr);
 	if (std::isnan(T)) {
 		printf("Warning: T value is nan!\n");
 		for(int i = 0; i < NCART; i++) {
 			ballpos[i] = data->ball_pos(i,0);
 			ballvel[i] = data->ball_vel(i,0);
+			if (deriv)
+				dpos[i] = dvel[i] = 0.0;
+		}
+	}
+	else if (data->ball_path != nullptr) {
+		data->ball_path->eval(T,ballpos,ballvel);
+		if (deriv) {
+			const double h = 1e-4;
+			double pos_plus[NCART], vel_plus[NCART];
+			double pos_minus[NCART], vel_minus[NCART];
+			data->ball_path->eval(T+h,pos_plus,vel_plus);
+			data->ball_path->eval(T-h,pos_minus,vel_minus);
+			for (int i = 0; i < NCART; i++) {
+				dpos[i] = (pos_plus[i] - pos_minus[i]) / (2*h);
+				dvel[i] = (vel_plus[i] - vel_minus[i]) / (2*h);
+			}
 		}
 	}
 	else {
@@ -497,13 +537,66 @@ static void interp_ball(const optim_des *data,
 						(Tdiff/dt) * (data->ball_pos(i,N+1) - data->ball_pos(i,N));
 				ballvel[i] = data->ball_vel(i,N) +
 						(Tdiff/dt) * (data->ball_vel(i,N+1) - data->ball_vel(i,N));
+				if (deriv) { // slopes of the linear interpolation
+					dpos[i] = (data->ball_pos(i,N+1) - data->ball_pos(i,N)) / dt;
+					dvel[i] = (data->ball_vel(i,N+1) - data->ball_vel(i,N)) / dt;
+				}
 			}
 			else {
 				ballpos[i] = data->ball_pos(i,Nmax-1);
 				ballvel[i] = data->ball_vel(i,Nmax-1);
+				if (deriv)
+					dpos[i] = dvel[i] = 0.0;
 			}
 		}
 	}
 }
 
+static void calc_hit_states(const optim_des *params,
+                            const double x[],
+                            dvar racket_pos[],
+                            dvar racket_vel[],
+                            dvar racket_normal[],
+                            dvar ball_pos[],
+                            dvar ball_vel[]) {
+
+	double pos[NCART], vel[NCART], normal[NCART];
+	double dpos[NCART][NDOF], dvel[NCART][NDOF], dnormal[NCART][NDOF];
+	double bpos[NCART], bvel[NCART], dbpos[NCART], dbvel[NCART];
+
+	calc_racket_state(x, x + NDOF, pos, vel, normal, dpos, dvel, dnormal);
+	interp_ball(params, x[2*NDOF], bpos, bvel, dbpos, dbvel);
+
+	for (int i = 0; i < NCART; i++) {
+		racket_pos[i] = pos[i];
+		racket_vel[i] = vel[i];
+		racket_normal[i] = normal[i];
+		for (int j = 0; j < NDOF; j++) {
+			racket_pos[i].der[j] = dpos[i][j];
+			racket_vel[i].der[j] = dvel[i][j];
+			racket_vel[i].der[j+NDOF] = dpos[i][j]; // racket jacobian
+			racket_normal[i].der[j] = dnormal[i][j];
+		}
+		ball_pos[i] = bpos[i];
+		ball_vel[i] = bvel[i];
+		ball_pos[i].der[2*NDOF] = dbpos[i];
+		ball_vel[i].der[2*NDOF] = dbvel[i];
+	}
+}
+
+static void copy_constr(unsigned m,
+                        unsigned n,
+                        const dvar constr[],
+                        double *result,
+                        double *grad) {
+
+	for (unsigned j = 0; j < m; j++) {
+		result[j] = constr[j].val;
+		if (grad) {
+			for (unsigned i = 0; i < n; i++)
+				grad[j*n + i] = constr[j].der[i];
+		}
+	}
+}
+
 }
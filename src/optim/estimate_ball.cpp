@@ -6,14 +6,13 @@
  */
 
 #include <armadillo>
-#include "nlopt.h"
 #include "optim.h"
 #include "tabletennis.h"
 #include "kalman.h"
 
 using namespace arma;
 
-#define fitnorm 2
+static const int NPARAMS = 2*NCART + 1; // initial ball state and topspin
 
 /*
  * Least squares to estimate prior given
@@ -30,21 +29,41 @@ static void estimate_ball_linear(const mat & observations,
 		                          vec6 & init_est);
 
 /*
+ * Levenberg-Marquardt estimation of the initial ball state and topspin.
  * Returns the estimated topspin value
  */
-static double nlopt_estimate_ball(const mat & obs,
-                                    const vec & times,
-                                    const bool verbose,
-                                    vec6 & est);
+static double lm_estimate_ball(const mat & obs,
+                               const vec & times,
+                               const bool verbose,
+                               vec6 & est);
 
 /*
- * Cost function
- * Calculates also the gradient if grad is TRUE
+ * Sum of squared position residuals of the spin model integrated from
+ * the parameters (initial state and topspin). If JtJ and Jtr are not NULL
+ * the Gauss-Newton normal equations are also formed with the sensitivities
+ * of the ball positions propagated along the integration.
  */
-static double calc_residual(unsigned n,
-                            const double *x,
-                            double *grad,
-                            void *data);
+static double calc_residual(const mat & obs,
+                            const vec & times,
+                            const double params[NPARAMS],
+                            double JtJ[NPARAMS][NPARAMS],
+                            double Jtr[NPARAMS]);
+
+/*
+ * Solves A x = b in place (b is overwritten with x) with Cholesky decomposition.
+ * Returns FALSE if A is not positive definite
+ */
+static bool solve_chol(double A[NPARAMS][NPARAMS], double b[NPARAMS]);
+
+/*
+ * Estimate the initial ball state and topspin, and filter the observations
+ * starting from the estimate. Filter keeps a pointer to topspin.
+ */
+static void fit_prior(const mat & observations,
+                      const mat & times,
+                      const int verbose,
+                      player::EKF & filter,
+                      double & topspin);
 
 /*
  * Return time of day as micro seconds
@@ -53,26 +72,53 @@ static long get_time();
 
 namespace optim {
 
-/**
- * @brief Initial ball data time stamps and position observations
- */
-struct init_ball_data {
-	vec times;
-	mat obs;
-};
-
 void estimate_prior(const mat & observations,
         			const mat & times,
 					const int & verbose,
-					bool & NLOPT_FINISHED,
-					player::EKF & filter) {
+					bool & init_ball,
+					player::EKF & filter,
+					double & topspin) {
+
+	init_ball = false;
+	fit_prior(observations,times,verbose,filter,topspin);
+	init_ball = true;
+}
+
+void estimate_prior_snapshot(const mat & observations,
+                             const mat & times,
+                             const int verbose,
+                             const int id,
+                             const player::EKF & filter_,
+                             player::Snapshot<ball_prior> & prior) {
+
+	player::EKF filter = filter_;
+	ball_prior est;
+	fit_prior(observations,times,verbose,filter,est.topspin);
+	vec6 x = filter.get_mean();
+	mat66 P = filter.get_covar();
+	est.id = id;
+	est.time = times(times.n_elem-1);
+	for (int i = 0; i < 2*NCART; i++) {
+		est.x[i] = x(i);
+		for (int j = 0; j < 2*NCART; j++)
+			est.P[i][j] = P(i,j);
+	}
+	prior.publish(est);
+	//cout << "Detached ball state estimation finished!\n";
+}
+
+}
+
+static void fit_prior(const mat & observations,
+                      const mat & times,
+                      const int verbose,
+                      player::EKF & filter,
+                      double & topspin) {
 
-	NLOPT_FINISHED = false;
-	static double topspin;
 	vec6 x;
 	vec times_z = times - times(0); // times zeroed
 	estimate_ball_linear(observations,times_z,verbose > 2,x);
-	topspin = nlopt_estimate_ball(observations,times_z,verbose > 2,x);
+	topspin = lm_estimate_ball(observations,times_z,verbose > 2,x);
 	mat P;
 	P.eye(6,6);
 	filter.set_prior(x,P);
@@ -85,10 +131,6 @@ void estimate_prior(const mat & observations,
 		filter.predict(dt,true);
 		filter.update(observations.col(i));
 	}
-	//cout << "Detached ball state estimation finished!\n";
-	NLOPT_FINISHED = true;
-}
-
 }
 
 static long get_time() {
@@ -125,100 +167,167 @@ static void estimate_ball_linear(const mat & observations,
     }
 }
 
-static double nlopt_estimate_ball(const mat & obs,
-                                    const vec & times,
-                                    const bool verbose,
-                                    vec6 & est) {
-
-    static const int TS = 6; // topspin
-    double lb[7], ub[7];
-    double x[7];  /* some initial guess */
-    double minf; /* the minimum objective value, upon return */
-    double init_time;
-    int res; // error code
-    nlopt_opt opt;
-    optim::init_ball_data data;
-    data.obs = obs;
-    data.times = times;
-
-    ub[X] = 1.0; ub[Y] = 0.5; ub[Z] = 2.0; ub[DX] = 2.0; ub[DY] = 5.0; ub[DZ] = 4.0; ub[TS] = 1.0;
-    lb[X] = -1.0; lb[Y] = -5.0; lb[Z] = -2.0; lb[DX] = -2.0; lb[DY] = -5.0; lb[DZ] = -4.0; lb[TS] = -1.0;
-
-    opt = nlopt_create(NLOPT_LD_TNEWTON, 7);
-    nlopt_set_min_objective(opt, calc_residual, (void*)&data);
-    nlopt_set_lower_bounds(opt, lb);
-    nlopt_set_upper_bounds(opt, ub);
-    nlopt_set_xtol_rel(opt, 1e-2);
-    //nlopt_set_maxtime(opt, 0.002);
-    for(int i = 0; i < 6; i++) {
-        x[i] = est(i);
-    }
-    x[6] = -0.5;
+static double lm_estimate_ball(const mat & obs,
+                               const vec & times,
+                               const bool verbose,
+                               vec6 & est) {
 
-    init_time = get_time();
-    if ((res = nlopt_optimize(opt, x, &minf)) < 0) {
-        printf("NLOPT failed in ball state estimation!\n");
-    }
-    else {
-        for(int i = 0; i < 6; i++) {
-            est(i) = x[i];
+    static const int MAX_ITER = 20;
+    static const double TOPSPIN_MAX = 100.0;
+    static const int TS = 2*NCART; // topspin
+    double params[NPARAMS], params_new[NPARAMS];
+    double JtJ[NPARAMS][NPARAMS], Jtr[NPARAMS];
+    double A[NPARAMS][NPARAMS], step[NPARAMS];
+    double lambda = 1e-3; // damping
+    double cost, cost_new = 0.0;
+    long init_time = get_time();
+    int iter;
+    player::ball_params ball_par;
+
+    for (int i = 0; i < TS; i++)
+        params[i] = est(i);
+    params[TS] = ball_par.init_topspin;
+    cost = calc_residual(obs,times,params,JtJ,Jtr);
+
+    for (iter = 0; iter < MAX_ITER; iter++) {
+        bool improved = false;
+        while (!improved && lambda < 1e10) {
+            for (int i = 0; i < NPARAMS; i++) {
+                for (int j = 0; j < NPARAMS; j++)
+                    A[i][j] = JtJ[i][j];
+                A[i][i] += lambda * (JtJ[i][i] + 1e-12); // Marquardt scaling
+                step[i] = -Jtr[i];
+            }
+            if (solve_chol(A,step)) {
+                for (int i = 0; i < NPARAMS; i++)
+                    params_new[i] = params[i] + step[i];
+                params_new[TS] = std::max(-TOPSPIN_MAX,std::min(TOPSPIN_MAX,params_new[TS]));
+                cost_new = calc_residual(obs,times,params_new,nullptr,nullptr);
+                improved = cost_new < cost;
+            }
+            if (!improved)
+                lambda *= 10;
+        }
+        if (!improved)
+            break;
+        double step_norm = 0.0, param_norm = 0.0;
+        for (int i = 0; i < NPARAMS; i++) {
+            step_norm += pow(params_new[i] - params[i],2);
+            param_norm += pow(params_new[i],2);
+            params[i] = params_new[i];
         }
-        if (verbose) {
-            printf("NLOPT took %f ms\n", (get_time() - init_time)/1e3);
-            printf("Found minimum at f = %0.10g\n", minf);
-            cout << "Initial state est:" << est.t();
-            printf("Topspin est: %f\n", 100*x[6]);
+        lambda = std::max(lambda/10,1e-9);
+        const double cost_last = cost;
+        cost = calc_residual(obs,times,params,JtJ,Jtr);
+        if (sqrt(step_norm) < 1e-6 * (sqrt(param_norm) + 1e-6) ||
+                cost_last - cost < 1e-12 * cost_last) {
+            break;
         }
     }
-    nlopt_destroy(opt);
-    return 100*x[6];
+
+    for (int i = 0; i < TS; i++)
+        est(i) = params[i];
+    if (verbose) {
+        printf("LM took %f ms and %d iterations\n", (get_time() - init_time)/1e3, iter);
+        printf("Found minimum at f = %0.10g\n", cost);
+        cout << "Initial state est:" << est.t();
+        printf("Topspin est: %f\n", params[TS]);
+    }
+    return params[TS];
 }
 
-static double calc_residual(unsigned n,
-                            const double *x,
-                            double *grad,
-                            void *void_data) {
+static double calc_residual(const mat & obs,
+                            const vec & times,
+                            const double params[NPARAMS],
+                            double JtJ[NPARAMS][NPARAMS],
+                            double Jtr[NPARAMS]) {
 
     using namespace player;
-    using namespace optim;
-    /*const double lambda_spin = 1e-5;
-    const double lambda_zvel = 5e-2;
-    const double lambda_yvel = 5e-2;*/
-    static TableTennis tt = TableTennis(true,false);
-    tt.set_topspin(100*x[6]);
-    init_ball_data *data = (init_ball_data*) void_data;
-    int num_samples = data->times.n_elem;
-
-    if (grad) {
-        static double h = 1e-6;
-        static double val_plus, val_minus;
-        static double xx[7];
-        for (unsigned i = 0; i < n; i++)
-            xx[i] = x[i];
-        for (unsigned i = 0; i < n; i++) {
-            xx[i] += h;
-            val_plus = calc_residual(n, xx, NULL, data);
-            xx[i] -= 2*h;
-            val_minus = calc_residual(n, xx, NULL, data);
-            grad[i] = (val_plus - val_minus) / (2*h);
-            xx[i] += h;
+    static const int N = 2*NCART;
+    const bool sens = (JtJ != nullptr && Jtr != nullptr);
+    ball_params ball_par;
+    ball_pod ball;
+    double spin[NCART];
+    double S[N][NPARAMS]; // sensitivities of the ball state w.r.t. parameters
+    double cost = 0.0;
+    double t = 0.0;
+
+    topspin_to_spin(params[N],spin);
+    ball_from_array(params,ball);
+    for (int i = 0; i < N; i++)
+        for (int j = 0; j < NPARAMS; j++)
+            S[i][j] = (i == j);
+    if (sens) {
+        for (int i = 0; i < NPARAMS; i++) {
+            Jtr[i] = 0.0;
+            for (int j = 0; j < NPARAMS; j++)
+                JtJ[i][j] = 0.0;
         }
     }
 
-    vec7 state(x);
-    vec6 init_state = state.head(6);
-    tt.set_ball_state(init_state);
-    tt.integrate_ball_state(data->times(0));
-    double dt;
-    double residual = norm(tt.get_ball_position() - data->obs.col(0),fitnorm);
-    for (int i = 1; i < num_samples; i++) {
-        dt = data->times(i) - data->times(i-1);
-        tt.integrate_ball_state(dt);
-        residual += norm(tt.get_ball_position() - data->obs.col(i),fitnorm);
+    for (unsigned n = 0; n < times.n_elem; n++) {
+        const double dt = times(n) - t;
+        t = times(n);
+        if (dt > 0.0 && sens) {
+            double dxdw[N], jac[N*N], S_next[N][NPARAMS];
+            ball_step_spin_derivative(ball_par,spin,dt,ball,dxdw);
+            ball_step_jacobian(ball_par,spin,dt,ball,jac);
+            for (int i = 0; i < N; i++)
+                for (int j = 0; j < NPARAMS; j++) {
+                    S_next[i][j] = 0.0;
+                    for (int k = 0; k < N; k++)
+                        S_next[i][j] += jac[i + N*k] * S[k][j];
+                }
+            for (int i = 0; i < N; i++) {
+                S_next[i][N] += 2 * M_PI * dxdw[i]; // spin[X] = 2*pi*topspin
+                for (int j = 0; j < NPARAMS; j++)
+                    S[i][j] = S_next[i][j];
+            }
+        }
+        else if (dt > 0.0) {
+            ball_step(ball_par,spin,dt,ball);
+        }
+        for (int i = 0; i < NCART; i++) {
+            const double res = ball.pos[i] - obs(i,n);
+            cost += res * res;
+            if (sens) {
+                for (int j = 0; j < NPARAMS; j++) {
+                    Jtr[j] += S[i][j] * res;
+                    for (int k = 0; k < NPARAMS; k++)
+                        JtJ[j][k] += S[i][j] * S[i][k];
+                }
+            }
+        }
     }
-    // add regularization to prevent overfitting in spin estimation
-    //residual += lambda_spin * pow(x[6] - 0.5,2) + lambda_zvel * pow(x[DZ]-2.5,2) + lambda_yvel * pow(x[DY]-4.5,2);
+    return cost;
+}
 
-    return residual;
+static bool solve_chol(double A[NPARAMS][NPARAMS], double b[NPARAMS]) {
 
+    // A = L L', L stored in the lower triangle of A
+    for (int j = 0; j < NPARAMS; j++) {
+        double d = A[j][j];
+        for (int k = 0; k < j; k++)
+            d -= A[j][k] * A[j][k];
+        if (d <= 0.0)
+            return false;
+        A[j][j] = sqrt(d);
+        for (int i = j + 1; i < NPARAMS; i++) {
+            double v = A[i][j];
+            for (int k = 0; k < j; k++)
+                v -= A[i][k] * A[j][k];
+            A[i][j] = v / A[j][j];
+        }
+    }
+    for (int i = 0; i < NPARAMS; i++) { // L y = b
+        for (int k = 0; k < i; k++)
+            b[i] -= A[i][k] * b[k];
+        b[i] /= A[i][i];
+    }
+    for (int i = NPARAMS - 1; i >= 0; i--) { // L' x = y
+        for (int k = i + 1; k < NPARAMS; k++)
+            b[i] -= A[k][i] * b[k];
+        b[i] /= A[i][i];
+    }
+    return true;
 }
@@ -14,13 +14,15 @@
 #include "kinematics.h"
 #include "optim.h"
 #include "tabletennis.h"
+#include "ball_path.h"
 #include "lookup.h"
 
 namespace optim {
 
 /*
  * Calculates the cost function for table tennis trajectory generation optimization
- * to find spline (3rd order strike+return) polynomials
+ * to find spline (3rd order strike+return) polynomials.
+ * Gradient is computed in closed form (cost is a polynomial in qf,qfdot and 1/T)
  */
 static double costfunc(unsigned n,
                         const double *x,
@@ -28,7 +30,9 @@ static double costfunc(unsigned n,
                         void *my_func_data);
 
 /*
- * This is the constraint that makes sure we hit the ball
+ * This is the constraint that makes sure we hit the ball.
+ * Gradient is computed from the closed-form derivatives of the racket state
+ * and the derivatives of the desired racket state w.r.t. hitting time T
  */
 static void kinematics_eq_constr(unsigned m,
                                 double *result,
@@ -44,12 +48,21 @@ static void kinematics_eq_constr(unsigned m,
  * IF T is nan, racket variables are assigned to zero-element of
  * relevant racket entries
  *
+ * If a dense ball path is given, racket variables are computed
+ * from the ball state at time T instead
+ *
+ * If the derivative arrays are not NULL, derivatives of the racket
+ * variables w.r.t. T are also computed (exact for the interpolation,
+ * central differences in T for the dense ball path)
  */
 static void first_order_hold(const optim_des* racketdata,
                             const double T,
                             double racket_pos[NCART],
                             double racket_vel[NCART],
-                            double racket_n[NCART]);
+                            double racket_n[NCART],
+                            double dpos[NCART] = nullptr,
+                            double dvel[NCART] = nullptr,
+                            double dn[NCART] = nullptr);
 
 FocusedOptim::FocusedOptim(const vec7 & qrest_,
                             double lb_[2*NDOF+1],
@@ -57,38 +70,46 @@ FocusedOptim::FocusedOptim(const vec7 & qrest_,
 
 	//lookup = true;
 	//load_lookup_table(lookup_table);
+	for (int i = 0; i < NDOF; i++) {
+		qrest[i] = qrest_(i);
+	}
+	for (int i = 0; i < OPTIM_DIM; i++) {
+		ub[i] = ub_[i];
+		lb[i] = lb_[i];
+	}
+	init_nlopt();
+}
+
+void FocusedOptim::init_nlopt() {
+
 	double tol_eq[EQ_CONSTR_DIM];
 	double tol_ineq[INEQ_CONSTR_DIM];
 	const_vec(EQ_CONSTR_DIM,1e-2,tol_eq);
 	const_vec(INEQ_CONSTR_DIM,1e-3,tol_ineq);
 	// set tolerances equal to second argument
 
-	//for (int i = 0; i < 2*NDOF+1; i++)
-	//	printf("ub[%d] = %d, lb[%d] = %d\n", ub_[i], i, lb_[i], i);
-
-	// LN = does not require gradients //
+	// LD = requires gradients (cost and kinematics constraints in closed form) //
 	/*opt = nlopt_create(NLOPT_AUGLAG_EQ, 2*NDOF+1);
 	nlopt_opt local_opt = nlopt_create(NLOPT_LD_MMA, 2*NDOF+1);
 	nlopt_set_xtol_rel(local_opt, 1e-2);
-	nlopt_set_lower_bounds(local_opt, lb_);
-	nlopt_set_upper_bounds(local_opt, ub_);
+	nlopt_set_lower_bounds(local_opt, lb);
+	nlopt_set_upper_bounds(local_opt, ub);
 	nlopt_add_inequality_mconstraint(local_opt, INEQ_CONSTR_DIM, joint_limits_ineq_constr, this, tol_ineq);
 	nlopt_set_local_optimizer(opt, local_opt);*/
-	opt = nlopt_create(NLOPT_LN_COBYLA, OPTIM_DIM);
+	opt = nlopt_create(NLOPT_LD_SLSQP, OPTIM_DIM);
 	nlopt_set_xtol_rel(opt, 1e-2);
-	nlopt_set_lower_bounds(opt, lb_);
-	nlopt_set_upper_bounds(opt, ub_);
+	nlopt_set_lower_bounds(opt, lb);
+	nlopt_set_upper_bounds(opt, ub);
 	nlopt_set_min_objective(opt, costfunc, this);
 	nlopt_add_inequality_mconstraint(opt, INEQ_CONSTR_DIM, joint_limits_ineq_constr, this, tol_ineq);
 	nlopt_add_equality_mconstraint(opt, EQ_CONSTR_DIM, kinematics_eq_constr, this, tol_eq);
+}
 
-	for (int i = 0; i < NDOF; i++) {
-		qrest[i] = qrest_(i);
-	}
-	for (int i = 0; i < OPTIM_DIM; i++) {
-		ub[i] = ub_[i];
-		lb[i] = lb_[i];
-	}
+Optim* FocusedOptim::clone() const {
+
+	FocusedOptim *copy = new FocusedOptim(*this);
+	copy->init_nlopt(); // NLOPT instance of the copy calls back the copy
+	return copy;
 }
 
 void FocusedOptim::init_last_soln(double x[]) const {
@@ -124,7 +145,7 @@ void FocusedOptim::finalize_soln(const double x[], double time_elapsed) {
 		T = x[2*NDOF];
 		if (detach)
 			T -= (time_elapsed/1e3);
-		update = true;
+		publish_soln(T);
 	}
 }
 
@@ -132,9 +153,9 @@ double FocusedOptim::test_soln(const double x[]) const {
 
 	// give info on constraint violation
 	double *grad = 0;
-	static double max_acc_violation; // at hitting time
-	static double kin_violation[EQ_CONSTR_DIM];
-	static double lim_violation[INEQ_CONSTR_DIM]; // joint limit violations on strike and return
+	double max_acc_violation; // at hitting time
+	double kin_violation[EQ_CONSTR_DIM];
+	double lim_violation[INEQ_CONSTR_DIM]; // joint limit violations on strike and return
 	kinematics_eq_constr(EQ_CONSTR_DIM, kin_violation,
 			             OPTIM_DIM, x, grad, (void*)this);
 	joint_limits_ineq_constr(INEQ_CONSTR_DIM, lim_violation,
@@ -169,31 +190,33 @@ static double costfunc(unsigned n,
 	double a2[NDOF];
 	double T = x[2*NDOF];
 
-	if (grad) {
-		static double h = 1e-6;
-		static double val_plus, val_minus;
-		static double xx[2*NDOF+1];
-		for (unsigned i = 0; i < n; i++)
-			xx[i] = x[i];
-		for (unsigned i = 0; i < n; i++) {
-			xx[i] += h;
-			val_plus = costfunc(n, xx, NULL, my_func_params);
-			xx[i] -= 2*h;
-			val_minus = costfunc(n, xx, NULL, my_func_params);
-			grad[i] = (val_plus - val_minus) / (2*h);
-			xx[i] += h;
-		}
-	}
-
 	FocusedOptim *opt = (FocusedOptim*) my_func_params;
 	double *q0 = opt->q0;
 	double *q0dot = opt->q0dot;
 
 	// calculate the polynomial coeffs which are used in the cost calculation
 	calc_strike_poly_coeff(q0,q0dot,x,a1,a2);
+	const double a11 = inner_prod(NDOF,a1,a1);
+	const double a12 = inner_prod(NDOF,a1,a2);
+	const double a22 = inner_prod(NDOF,a2,a2);
 
-	return T * (3*T*T*inner_prod(NDOF,a1,a1) +
-			3*T*inner_prod(NDOF,a1,a2) + inner_prod(NDOF,a2,a2));
+	if (grad) {
+		grad[2*NDOF] = 9*T*T*a11 + 6*T*a12 + a22;
+		for (int i = 0; i < NDOF; i++) {
+			// derivatives of the cost w.r.t. coeffs and of the coeffs w.r.t. qf,qfdot,T
+			const double dJda1 = 6*T*T*T*a1[i] + 3*T*T*a2[i];
+			const double dJda2 = 3*T*T*a1[i] + 2*T*a2[i];
+			const double da1dT = -6*(q0[i]-x[i])/pow(T,4) - 2*(q0dot[i]+x[i+NDOF])/pow(T,3);
+			const double da2dT = -6*(x[i]-q0[i])/pow(T,3) + (x[i+NDOF]+2*q0dot[i])/(T*T);
+			grad[i] = dJda1 * (-2/pow(T,3)) + dJda2 * (3/(T*T));
+			grad[i+NDOF] = dJda1 / (T*T) - dJda2 / T;
+			grad[2*NDOF] += dJda1 * da1dT + dJda2 * da2dT;
+		}
+	}
+
+	const double cost = T * (3*T*T*a11 + 3*T*a12 + a22);
+	opt->track_cost(x,cost);
+	return cost;
 }
 
 static void kinematics_eq_constr(unsigned m,
@@ -203,47 +226,57 @@ static void kinematics_eq_constr(unsigned m,
                                 double *grad,
                                 void *my_function_data) {
 
-	static double racket_des_pos[NCART];
-	static double racket_des_vel[NCART];
-	static double racket_des_normal[NCART];
-	static double pos[NCART];
-	static double qfdot[NDOF];
-	static double vel[NCART];
-	static double normal[NCART];
-	static double qf[NDOF];
+	double racket_des_pos[NCART];
+	double racket_des_vel[NCART];
+	double racket_des_normal[NCART];
+	double pos[NCART];
+	double qfdot[NDOF];
+	double vel[NCART];
+	double normal[NCART];
+	double qf[NDOF];
 	double T = x[2*NDOF];
 
 	FocusedOptim *opt = (FocusedOptim*) my_function_data;
 	optim_des* racket_data = opt->param_des;
 
-	if (grad) {
-		static double h = 1e-6;
-		static double res_plus[EQ_CONSTR_DIM], res_minus[EQ_CONSTR_DIM];
-		static double xx[2*NDOF+1];
-		for (unsigned i = 0; i < n; i++)
-			xx[i] = x[i];
-		for (unsigned i = 0; i < n; i++) {
-			xx[i] += h;
-			kinematics_eq_constr(m, res_plus, n, xx, NULL, my_function_data);
-			xx[i] -= 2*h;
-			kinematics_eq_constr(m, res_minus, n, xx, NULL, my_function_data);
-			xx[i] += h;
-			for (unsigned j = 0; j < m; j++)
-				grad[j*n + i] = (res_plus[j] - res_minus[j]) / (2*h);
-		}
-	}
-
-	// interpolate at time T to get the desired racket parameters
-	first_order_hold(racket_data,T,racket_des_pos,racket_des_vel,racket_des_normal);
-
 	// extract state information from optimization variables
 	for (int i = 0; i < NDOF; i++) {
 		qf[i] = x[i];
 		qfdot[i] = x[i+NDOF];
 	}
 
-	// compute the actual racket pos,vel and normal
-	calc_racket_state(qf,qfdot,pos,vel,normal);
+	if (grad) {
+		// interpolate at time T to get the desired racket parameters and their derivatives
+		double dpos_des[NCART], dvel_des[NCART], dnormal_des[NCART];
+		first_order_hold(racket_data,T,racket_des_pos,racket_des_vel,racket_des_normal,
+		                 dpos_des,dvel_des,dnormal_des);
+
+		// compute the actual racket pos,vel and normal and their derivatives w.r.t. qf
+		double dpos[NCART][NDOF], dvel[NCART][NDOF], dnormal[NCART][NDOF];
+		calc_racket_state(qf,qfdot,pos,vel,normal,dpos,dvel,dnormal);
+
+		for (unsigned j = 0; j < m; j++)
+			for (unsigned i = 0; i < n; i++)
+				grad[j*n + i] = 0.0;
+		for (int i = 0; i < NCART; i++) {
+			for (int j = 0; j < NDOF; j++) {
+				grad[i*n + j] = dpos[i][j];
+				grad[(i+NCART)*n + j] = dvel[i][j];
+				grad[(i+NCART)*n + j + NDOF] = dpos[i][j]; // racket vel. is linear in qfdot
+				grad[(i+2*NCART)*n + j] = dnormal[i][j];
+			}
+			grad[i*n + 2*NDOF] = -dpos_des[i];
+			grad[(i+NCART)*n + 2*NDOF] = -dvel_des[i];
+			grad[(i+2*NCART)*n + 2*NDOF] = -dnormal_des[i];
+		}
+	}
+	else {
+		// interpolate at time T to get the desired racket parameters
+		first_order_hold(racket_data,T,racket_des_pos,racket_des_vel,racket_des_normal);
+
+		// compute the actual racket pos,vel and normal
+		calc_racket_state(qf,qfdot,pos,vel,normal);
+	}
 
 	// deviations from the desired racket frame
 	for (int i = 0; i < NCART; i++) {
@@ -251,15 +284,19 @@ static void kinematics_eq_constr(unsigned m,
 		result[i + NCART] = vel[i] - racket_des_vel[i];
 		result[i + 2*NCART] = normal[i] - racket_des_normal[i];
 	}
-
+	opt->track_violation(x,m,result,true);
 }
 
 static void first_order_hold(const optim_des* data,
                             const double T,
                             double racket_pos[NCART],
                             double racket_vel[NCART],
-                            double racket_n[NCART]) {
+                            double racket_n[NCART],
+                            double dpos[NCART],
+                            double dvel[NCART],
+                            double dn[NCART]) {
 
+	const bool deriv = (dpos != nullptr && dvel != nullptr && dn != nullptr);
 	double deltat = data->dt;
 	if (std::isnan(T)) {
 		printf("Warning: T value is nan!\n");
@@ -268,6 +305,26 @@ static void first_order_hold(const optim_des* data,
 			racket_pos[i] = data->racket_pos(i,0);
 			racket_vel[i] = data->racket_vel(i,0);
 			racket_n[i] = data->racket_normal(i,0);
+			if (deriv)
+				dpos[i] = dvel[i] = dn[i] = 0.0;
+		}
+	}
+	else if (data->ball_path != nullptr) {
+		double ball_pos[NCART], ball_vel[NCART];
+		data->ball_path->eval(T,ball_pos,ball_vel);
+		calc_racket_des(ball_pos,ball_vel,data->ball_land_des,data->time_land_des,
+		                racket_pos,racket_vel,racket_n);
+		if (deriv) {
+			const double h = 1e-4;
+			double pos_plus[NCART], vel_plus[NCART], n_plus[NCART];
+			double pos_minus[NCART], vel_minus[NCART], n_minus[NCART];
+			first_order_hold(data,T+h,pos_plus,vel_plus,n_plus);
+			first_order_hold(data,T-h,pos_minus,vel_minus,n_minus);
+			for (int i = 0; i < NCART; i++) {
+				dpos[i] = (pos_plus[i] - pos_minus[i]) / (2*h);
+				dvel[i] = (vel_plus[i] - vel_minus[i]) / (2*h);
+				dn[i] = (n_plus[i] - n_minus[i]) / (2*h);
+			}
 		}
 	}
 	else {
@@ -283,11 +340,18 @@ static void first_order_hold(const optim_des* data,
 						(Tdiff/deltat) * (data->racket_vel(i,N+1) - data->racket_vel(i,N));
 				racket_n[i] = data->racket_normal(i,N) +
 						(Tdiff/deltat) * (data->racket_normal(i,N+1) - data->racket_normal(i,N));
+				if (deriv) { // slopes of the linear interpolation
+					dpos[i] = (data->racket_pos(i,N+1) - data->racket_pos(i,N)) / deltat;
+					dvel[i] = (data->racket_vel(i,N+1) - data->racket_vel(i,N)) / deltat;
+					dn[i] = (data->racket_normal(i,N+1) - data->racket_normal(i,N)) / deltat;
+				}
 			}
 			else {
 				racket_pos[i] = data->racket_pos(i,Nmax-1);
 				racket_vel[i] = data->racket_vel(i,Nmax-1);
 				racket_n[i] = data->racket_normal(i,Nmax-1);
+				if (deriv)
+					dpos[i] = dvel[i] = dn[i] = 0.0;
 			}
 		}
 	}
@@ -300,15 +364,15 @@ void joint_limits_ineq_constr(unsigned m,
                             double *grad,
                             void *my_func_params) {
 
-	static double a1[NDOF];
-	static double a2[NDOF];
-	static double a1ret[NDOF]; // coefficients for the returning polynomials
-	static double a2ret[NDOF];
-	static double qdot_rest[NDOF];
-	static double joint_strike_max_cand[NDOF];
-	static double joint_strike_min_cand[NDOF];
-	static double joint_return_max_cand[NDOF];
-	static double joint_return_min_cand[NDOF];
+	double a1[NDOF];
+	double a2[NDOF];
+	double a1ret[NDOF]; // coefficients for the returning polynomials
+	double a2ret[NDOF];
+	double qdot_rest[NDOF] = {0.0};
+	double joint_strike_max_cand[NDOF];
+	double joint_strike_min_cand[NDOF];
+	double joint_return_max_cand[NDOF];
+	double joint_return_min_cand[NDOF];
 
 	FocusedOptim *opt = (FocusedOptim*) my_func_params;
 	double *q0 = opt->q0;
@@ -319,9 +383,9 @@ void joint_limits_ineq_constr(unsigned m,
 	double Tret = opt->time2return;
 
 	if (grad) {
-		static double h = 1e-6;
-		static double res_plus[INEQ_CONSTR_DIM], res_minus[INEQ_CONSTR_DIM];
-		static double xx[2*NDOF+1];
+		const double h = 1e-6;
+		double res_plus[INEQ_CONSTR_DIM], res_minus[INEQ_CONSTR_DIM];
+		double xx[2*NDOF+1];
 		for (unsigned i = 0; i < n; i++)
 			xx[i] = x[i];
 		for (unsigned i = 0; i < n; i++) {
@@ -351,23 +415,7 @@ void joint_limits_ineq_constr(unsigned m,
 		result[i+3*NDOF] = lb[i] - joint_return_min_cand[i];
 		//printf("%f %f %f %f\n", result[i],result[i+DOF],result[i+2*DOF],result[i+3*DOF]);
 	}
-
-}
-
-void calc_strike_poly_coeff(const double *q0,
-                            const double *q0dot,
-                            const double *x,
-		                    double *a1,
-		                    double *a2) {
-
-	double T = x[2*NDOF];
-
-	for (int i = 0; i < NDOF; i++) {
-		a1[i] = (2/pow(T,3))*(q0[i]-x[i]) + (1/(T*T))*(q0dot[i] + x[i+NDOF]);
-		a2[i] = (3/(T*T))*(x[i]-q0[i]) - (1/T)*(x[i+NDOF] + 2*q0dot[i]);
-	}
-
-	return;
+	opt->track_violation(x,m,result,false);
 }
 
 void calc_return_poly_coeff(const double *q0,
@@ -392,7 +440,7 @@ void calc_strike_extrema_cand(const double *a1,
 		                        double *joint_max_cand,
 		                        double *joint_min_cand) {
 
-	static double cand1, cand2;
+	double cand1, cand2;
 
 	for (int i = 0; i < NDOF; i++) {
 		cand1 = fmin(T,fmax(0,(-a2[i] + sqrt(a2[i]*a2[i] - 3*a1[i]*q0dot[i]))/(3*a1[i])));
@@ -411,7 +459,7 @@ void calc_return_extrema_cand(const double *a1,
 		                        double *joint_max_cand,
 		                        double *joint_min_cand) {
 
-	static double cand1, cand2;
+	double cand1, cand2;
 
 	for (int i = 0; i < NDOF; i++) {
 		cand1 = fmin(Tret, fmax(0,(-a2[i] + sqrt(a2[i]*a2[i] - 3*a1[i]*x[i+NDOF]))/(3*a1[i])));
@@ -44,6 +44,11 @@ static void jacobian(const double link[NLINK+1][4],
 		            const double axis[NDOF+1][4],
 		            double jac[2*NCART][NDOF]);
 
+/*
+ * Cross product c = a x b of 3-vectors
+ */
+static void cross_prod(const double a[NCART], const double b[NCART], double c[NCART]);
+
 void calc_racket_state(const double q[NDOF],
 		               const double qdot[NDOF],
 					   double pos[NCART],
@@ -52,11 +57,11 @@ void calc_racket_state(const double q[NDOF],
 
 	static const int PALM = 6;
 
-	static double link[NLINK+1][3+1];
-	static double origin[NDOF+1][3+1];
-	static double axis[NDOF+1][3+1];
-	static double amats[NDOF+1][4+1][4+1];
-	static double jacobi[2*NCART][NDOF];
+	double link[NLINK+1][3+1];
+	double origin[NDOF+1][3+1];
+	double axis[NDOF+1][3+1];
+	double amats[NDOF+1][4+1][4+1];
+	double jacobi[2*NCART][NDOF];
 
 	kinematics(q,link,origin,axis,amats);
 	//rotate_to_quat(amats.slice(PALM)(span(X,Z),span(X,Z)),quat);
@@ -76,10 +81,10 @@ void calc_racket_state(const double q[NDOF],
                       double jacobi[2*NCART][NDOF]) {
 
 	static const int PALM = 6;
-	static double link[NLINK+1][3+1];
-	static double origin[NDOF+1][3+1];
-	static double axis[NDOF+1][3+1];
-	static double amats[NDOF+1][4+1][4+1];
+	double link[NLINK+1][3+1];
+	double origin[NDOF+1][3+1];
+	double axis[NDOF+1][3+1];
+	double amats[NDOF+1][4+1][4+1];
 	kinematics(q,link,origin,axis,amats);
 	jacobian(link,origin,axis,jacobi);
 	for (int i = 0; i < NCART; i++) {
@@ -88,14 +93,59 @@ void calc_racket_state(const double q[NDOF],
 	}
 }
 
+void calc_racket_state(const double q[NDOF],
+                       const double qdot[NDOF],
+                       double pos[NCART],
+                       double vel[NCART],
+                       double normal[NCART],
+                       double dpos[NCART][NDOF],
+                       double dvel[NCART][NDOF],
+                       double dnormal[NCART][NDOF]) {
+
+	double jac[2*NCART][NDOF];
+	double axis[NDOF][NCART]; // rotation axis of each joint
+	double lin[NDOF][NCART]; // linear velocity jacobian column of each joint
+	double vel_dist[NDOF+1][NCART]; // racket velocity due to joints k,...,NDOF-1
+	double omega_prox[NCART] = {0.0}; // angular velocity due to joints 0,...,k-1
+	double c1[NCART], c2[NCART];
+
+	calc_racket_state(q,pos,normal,jac);
+	for (int j = 0; j < NDOF; j++) {
+		for (int i = 0; i < NCART; i++) {
+			lin[j][i] = jac[i][j];
+			axis[j][i] = jac[i+NCART][j];
+		}
+	}
+	for (int i = 0; i < NCART; i++)
+		vel_dist[NDOF][i] = 0.0;
+	for (int j = NDOF-1; j >= 0; j--)
+		for (int i = 0; i < NCART; i++)
+			vel_dist[j][i] = vel_dist[j+1][i] + lin[j][i] * qdot[j];
+
+	// joint k rotates the racket and the distal joint axes around its axis
+	for (int k = 0; k < NDOF; k++) {
+		cross_prod(axis[k],vel_dist[k],c1);
+		cross_prod(omega_prox,lin[k],c2);
+		for (int i = 0; i < NCART; i++) {
+			vel[i] = vel_dist[0][i];
+			dpos[i][k] = lin[k][i];
+			dvel[i][k] = c1[i] + c2[i];
+			omega_prox[i] += axis[k][i] * qdot[k];
+		}
+		cross_prod(axis[k],normal,c1);
+		for (int i = 0; i < NCART; i++)
+			dnormal[i][k] = c1[i];
+	}
+}
+
 /**
  * @brief Returns the cartesian racket positions
  */
 void get_position(double q[NDOF]) {
-	static double link[NLINK+1][3+1];
-	static double origin[NDOF+1][3+1];
-	static double axis[NDOF+1][3+1];
-	static double amats[NDOF+1][4+1][4+1];
+	double link[NLINK+1][3+1];
+	double origin[NDOF+1][3+1];
+	double axis[NDOF+1][3+1];
+	double amats[NDOF+1][4+1][4+1];
 	kinematics(q,link,origin,axis,amats);
 }
 
@@ -117,58 +167,53 @@ static void kinematics(const double state[NDOF],
 		                double Xaxis[NDOF+1][4],
 		                double Ahmat[NDOF+1][5][5]) {
 
-	static int firsttime = TRUE;
-	static double basec[3+1] = {0.0};
-	static double baseo[4+1] = {0.0};
-	static double eff_a[NCART+1];
-	static double eff_x[NCART+1];
-
-	if (firsttime) {
-		firsttime = FALSE;
-		eff_x[3] = 0.3; // attach the racket
-		baseo[2] = 1.0;
-	}
-
-	static double  sstate1th;
-	static double  cstate1th;
-	static double  sstate2th;
-	static double  cstate2th;
-	static double  sstate3th;
-	static double  cstate3th;
-	static double  sstate4th;
-	static double  cstate4th;
-	static double  sstate5th;
-	static double  cstate5th;
-	static double  sstate6th;
-	static double  cstate6th;
-	static double  sstate7th;
-	static double  cstate7th;
-
-	static double  rseff1a1;
-	static double  rceff1a1;
-	static double  rseff1a2;
-	static double  rceff1a2;
-	static double  rseff1a3;
-	static double  rceff1a3;
-
-	static double  Hi00[4+1][4+1];
-	static double  Hi01[4+1][4+1];
-	static double  Hi12[4+1][4+1];
-	static double  Hi23[4+1][4+1];
-	static double  Hi34[4+1][4+1];
-	static double  Hi45[4+1][4+1];
-	static double  Hi56[4+1][4+1];
-	static double  Hi67[4+1][4+1];
-	static double  Hi78[4+1][4+1];
-
-	static double  Ai01[4+1][4+1];
-	static double  Ai02[4+1][4+1];
-	static double  Ai03[4+1][4+1];
-	static double  Ai04[4+1][4+1];
-	static double  Ai05[4+1][4+1];
-	static double  Ai06[4+1][4+1];
-	static double  Ai07[4+1][4+1];
-	static double  Ai08[4+1][4+1];
+	// base and racket (endeffector) offsets
+	const double basec[3+1] = {0.0};
+	const double baseo[4+1] = {0.0, 0.0, 1.0, 0.0, 0.0};
+	const double eff_a[NCART+1] = {0.0};
+	const double eff_x[NCART+1] = {0.0, 0.0, 0.0, 0.3}; // attach the racket
+
+	// local workspace, kinematics can run in several threads
+	double  sstate1th;
+	double  cstate1th;
+	double  sstate2th;
+	double  cstate2th;
+	double  sstate3th;
+	double  cstate3th;
+	double  sstate4th;
+	double  cstate4th;
+	double  sstate5th;
+	double  cstate5th;
+	double  sstate6th;
+	double  cstate6th;
+	double  sstate7th;
+	double  cstate7th;
+
+	double  rseff1a1;
+	double  rceff1a1;
+	double  rseff1a2;
+	double  rceff1a2;
+	double  rseff1a3;
+	double  rceff1a3;
+
+	double  Hi00[4+1][4+1] = {{0.0}};
+	double  Hi01[4+1][4+1] = {{0.0}};
+	double  Hi12[4+1][4+1] = {{0.0}};
+	double  Hi23[4+1][4+1] = {{0.0}};
+	double  Hi34[4+1][4+1] = {{0.0}};
+	double  Hi45[4+1][4+1] = {{0.0}};
+	double  Hi56[4+1][4+1] = {{0.0}};
+	double  Hi67[4+1][4+1] = {{0.0}};
+	double  Hi78[4+1][4+1] = {{0.0}};
+
+	double  Ai01[4+1][4+1] = {{0.0}};
+	double  Ai02[4+1][4+1] = {{0.0}};
+	double  Ai03[4+1][4+1] = {{0.0}};
+	double  Ai04[4+1][4+1] = {{0.0}};
+	double  Ai05[4+1][4+1] = {{0.0}};
+	double  Ai06[4+1][4+1] = {{0.0}};
+	double  Ai07[4+1][4+1] = {{0.0}};
+	double  Ai08[4+1][4+1] = {{0.0}};
 
 	/* Need [n_joints+1]x[3+1] matrices: Xorigin,Xmcog,Xaxis, and Xlink[nLinks+1][3+1] */
 
@@ -677,7 +722,7 @@ static void jacobian(const double link[NLINK+1][4],
 		            double jac[2*NCART][NDOF]) {
 
 	static const int PALM = 6;
-	static double c[2*NCART];
+	double c[2*NCART];
 	for (int j = 1; j <= NDOF; ++j) {
 		c[0] = axis[j][2] * (link[PALM][3] - origin[j][3]) - axis[j][3] * (link[PALM][2]-origin[j][2]);
 		c[1] = axis[j][3] * (link[PALM][1] - origin[j][1]) - axis[j][1] * (link[PALM][3]-origin[j][3]);
@@ -690,3 +735,10 @@ static void jacobian(const double link[NLINK+1][4],
 			jac[i][j-1] = c[i];
 	}
 }
+
+static void cross_prod(const double a[NCART], const double b[NCART], double c[NCART]) {
+
+	c[0] = a[1]*b[2] - a[2]*b[1];
+	c[1] = a[2]*b[0] - a[0]*b[2];
+	c[2] = a[0]*b[1] - a[1]*b[0];
+}
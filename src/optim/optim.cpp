@@ -6,6 +6,9 @@
  */
 
 #include <armadillo>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
 #include "constants.h"
 #include "utils.h"
 #include "stdlib.h"
@@ -14,6 +17,7 @@
 #include "optim.h"
 #include "tabletennis.h"
 #include "lookup.h"
+#include "ball_path.h"
 
 namespace optim {
 
@@ -36,11 +40,11 @@ void Optim::update_init_state(const joint & qact) {
 }
 
 bool Optim::check_running() {
-    return running;
+    return job.valid() && job.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
 }
 
 bool Optim::check_update() {
-    return update;
+    return soln.version() != soln_version;
 }
 
 void Optim::set_moving(bool flag_move) {
@@ -51,6 +55,10 @@ void Optim::set_detach(bool flag_detach) {
     detach = flag_detach;
 }
 
+void Optim::set_worker_pool(const std::shared_ptr<player::WorkerPool> & pool_) {
+    pool = pool_;
+}
+
 void Optim::set_return_time(const double & ret_time) {
     time2return = ret_time;
 }
@@ -59,14 +67,37 @@ void Optim::set_verbose(bool flag_verbose) {
     verbose = flag_verbose;
 }
 
+void Optim::set_multi_start(const int num_starts_,
+                            const int num_threads,
+                            const double deadline) {
+
+    if (num_starts_ < 1 || deadline <= 0.0) {
+        throw std::runtime_error("Multi-start optim needs at least one start and a positive deadline!");
+    }
+    num_starts = num_starts_;
+    start_deadline = deadline;
+    racers.clear(); // cloned again with the new configuration
+    start_pool.reset();
+    if (num_starts > 1) {
+        start_pool = std::make_shared<player::ThreadPool>(std::min(num_threads,num_starts));
+    }
+}
+
+race_result Optim::get_race_result() const {
+    return race;
+}
+
 bool Optim::get_params(const joint & qact, spline_params & p) {
 
     bool flag = false;
-    if (update && !running) {
+    optim_soln s;
+    if (check_update() && (anytime || !check_running()) && soln.read(s)) {
+        soln_version = soln.version();
+        const double T = s.T;
         vec7 qf_, qfdot_, qrest_;
         for (int i = 0; i < NDOF; i++) {
-            qf_(i) = qf[i];
-            qfdot_(i) = qfdot[i];
+            qf_(i) = s.qf[i];
+            qfdot_(i) = s.qfdot[i];
             qrest_(i) = qrest[i];
         }
         vec7 qnow = qact.q;
@@ -81,13 +112,25 @@ bool Optim::get_params(const joint & qact, spline_params & p) {
         p.b.col(2) = qfdot_;
         p.b.col(3) = qf_;
         p.time2hit = T;
+        p.cost = s.cost;
         //cout << "B = \n" << p.b << endl;
         flag = true;
-        update = false;
     }
     return flag;
 }
 
+void Optim::publish_soln(const double T_hit) {
+
+    optim_soln s;
+    for (int i = 0; i < NDOF; i++) {
+        s.qf[i] = qf[i];
+        s.qfdot[i] = qfdot[i];
+    }
+    s.T = T_hit;
+    s.cost = best_cost;
+    soln.publish(s);
+}
+
 void Optim::update_rest_state(const vec7 & q_rest_new) {
 
     for (int i = 0; i < NDOF; i++)
@@ -117,21 +160,264 @@ void Optim::init_lookup_soln(double *x) {
     }
 }
 
-void Optim::run() {
+void Optim::set_anytime(bool flag, const double margin) {
 
-    std::thread t = std::thread(&Optim::optim,this);
-    if (detach) {
-        t.detach();
+    if (margin < 0.0) {
+        throw std::runtime_error("Actuation margin of the anytime optim cannot be negative!");
     }
-    else {
-        t.join();
+    anytime = flag;
+    act_margin = margin;
+}
+
+double Optim::get_anytime_budget() const {
+    return predict_time2hit() - act_margin;
+}
+
+double Optim::predict_time2hit() const {
+
+    // the ball is hit (at the latest) when it reaches the racket at rest posture
+    double qdot[NDOF] = {0.0};
+    double pos[NCART], vel[NCART], normal[NCART];
+    calc_racket_state(qrest,qdot,pos,vel,normal);
+
+    if (param_des->ball_path != nullptr) {
+        const double horizon = param_des->ball_path->get_horizon();
+        double ball_pos[NCART], ball_vel[NCART];
+        for (double t = 0.0; t < horizon; t += param_des->dt) {
+            param_des->ball_path->eval(t,ball_pos,ball_vel);
+            if (ball_pos[Y] >= pos[Y])
+                return t;
+        }
+        return horizon;
+    }
+    const int N = param_des->ball_pos.n_cols;
+    for (int i = 0; i < N; i++) {
+        if (param_des->ball_pos(Y,i) >= pos[Y])
+            return i * param_des->dt;
+    }
+    return N * param_des->dt;
+}
+
+void Optim::track_cost(const double *x, const double cost) {
+
+    if (race_stop != nullptr && race_stop->load(std::memory_order_relaxed))
+        nlopt_force_stop(opt); // from the optim thread of this instance
+    if (!tracking)
+        return;
+    check_iterate(); // all constraints of the previous iterate are evaluated
+    const int n = nlopt_get_dimension(opt);
+    for (int i = 0; i < n; i++)
+        iterate.x[i] = x[i];
+    iterate.cost = cost;
+    iterate.violation = 0.0;
+    iterate.pending = true;
+}
+
+void Optim::track_violation(const double *x,
+                            const unsigned m,
+                            const double *result,
+                            const bool eq) {
+
+    if (!tracking || !iterate.pending)
+        return;
+    const int n = nlopt_get_dimension(opt);
+    for (int i = 0; i < n; i++)
+        if (x[i] != iterate.x[i]) // e.g. finite differences
+            return;
+    for (unsigned j = 0; j < m; j++)
+        iterate.violation = fmax(iterate.violation, eq ? fabs(result[j]) : result[j]);
+}
+
+void Optim::check_iterate() {
+
+    if (!iterate.pending)
+        return;
+    iterate.pending = false;
+    if (iterate.violation >= 1e-2 || iterate.cost >= best_cost)
+        return;
+
+    // test_soln() calls the callbacks, which should not track
+    const bool verb = verbose;
+    tracking = false;
+    verbose = false;
+    const bool feasible = test_soln(iterate.x) < 1e-2;
+    verbose = verb;
+    tracking = true;
+    if (feasible) {
+        best_cost = iterate.cost;
+        finalize_soln(iterate.x,(get_time() - t_start)/1e3);
+        if (verbose) {
+            printf("Anytime optim published f = %0.10g\n", best_cost);
+        }
+    }
+}
+
+void Optim::init_multi_start(mat & starts) {
+
+    const int n = nlopt_get_dimension(opt);
+    double x[OPTIM_DIM];
+    double lb_[OPTIM_DIM];
+    double ub_[OPTIM_DIM];
+    nlopt_get_lower_bounds(opt,lb_);
+    nlopt_get_upper_bounds(opt,ub_);
+    starts = zeros<mat>(n,num_starts);
+
+    int k = 0;
+    init_rest_soln(x);
+    starts.col(k++) = vec(x,n);
+    if (moving && k < num_starts) {
+        init_last_soln(x);
+        starts.col(k++) = vec(x,n);
+    }
+    if (lookup && k < num_starts) {
+        vec6 ball_params;
+        for (int i = 0; i < NCART; i++) {
+            ball_params(i) = param_des->ball_pos(i,0);
+            ball_params(i+NCART) = param_des->ball_vel(i,0);
+        }
+        player::predict_till_net(ball_params);
+        mat neighbours;
+        player::knn_neighbours(lookup_table,ball_params,num_starts-k,neighbours);
+        for (unsigned j = 0; j < neighbours.n_cols; j++) {
+            starts.col(k++) = neighbours(arma::span(0,n-1),j);
+        }
+    }
+
+    // perturb the guesses found so far: 0.1 rad for joint pos., 0.5 rad/s for vels, 50 ms for time
+    vec scale = 0.5 * arma::ones<vec>(n);
+    scale.head(NDOF).fill(0.1);
+    if (n > 2*NDOF)
+        scale(2*NDOF) = 0.05;
+    const int num_seeds = k;
+    for (; k < num_starts; k++) {
+        vec guess = starts.col(k % num_seeds) + scale % arma::randn<vec>(n);
+        for (int i = 0; i < n; i++) {
+            guess(i) = fmin(fmax(guess(i),lb_[i]),ub_[i]);
+        }
+        starts.col(k) = guess;
+    }
+}
+
+void Optim::copy_problem(Optim & racer) const {
+
+    for (int i = 0; i < NDOF; i++) {
+        racer.q0[i] = q0[i];
+        racer.q0dot[i] = q0dot[i];
+        racer.qrest[i] = qrest[i];
+        racer.qf[i] = qf[i];
+        racer.qfdot[i] = qfdot[i];
     }
+    racer.T = T;
+    racer.time2return = time2return;
+    racer.moving = moving;
+    racer.param_des = param_des;
+}
+
+void Optim::optim_multi_start() {
+
+    const int n = nlopt_get_dimension(opt);
+    mat starts;
+    init_multi_start(starts);
+
+    if ((int)racers.size() != num_starts) {
+        racers.clear(); // clones should not copy the racers
+        std::vector<std::shared_ptr<Optim>> copies(num_starts);
+        for (int k = 0; k < num_starts; k++) {
+            copies[k].reset(clone());
+            copies[k]->verbose = false;
+            copies[k]->anytime = false;
+        }
+        racers.swap(copies);
+    }
+    std::atomic<bool> stop(false);
+    for (int k = 0; k < num_starts; k++) {
+        copy_problem(*racers[k]);
+        racers[k]->race_stop = &stop;
+    }
+
+    std::mutex mtx;
+    int winner = -1;
+    double x_best[OPTIM_DIM];
+    double f_best = INFINITY;
+    double init_time = get_time();
+    const int num_threads = start_pool->size();
+    race = race_result();
+    race.exit_codes.assign(num_starts,0); // each start writes only its own entries
+    race.stop_times.assign(num_starts,0.0);
+
+    start_pool->run([&](int idx) {
+        for (int k = idx; k < num_starts; k += num_threads) {
+            // a start launched right before the race is won stops at its first callback
+            const double time_left = start_deadline - (get_time() - init_time)/1e6;
+            if (stop.load() || time_left <= 0.0)
+                return;
+            double x[OPTIM_DIM];
+            double minf;
+            for (int i = 0; i < n; i++)
+                x[i] = starts(i,k);
+            nlopt_set_maxtime(racers[k]->opt, time_left);
+            const int res = nlopt_optimize(racers[k]->opt, x, &minf);
+            race.exit_codes[k] = res;
+            race.stop_times[k] = (get_time() - init_time)/1e3;
+            if (res < 0 || stop.load())
+                continue;
+            if (racers[k]->test_soln(x) < 1e-2) {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (winner < 0) {
+                    winner = k;
+                    race.time_won = (get_time() - init_time)/1e3;
+                    f_best = minf;
+                    for (int i = 0; i < n; i++)
+                        x_best[i] = x[i];
+                    stop.store(true);
+                }
+            }
+        }
+    });
+    race.winner = winner;
+    for (int k = 0; k < num_starts; k++)
+        racers[k]->race_stop = nullptr;
+
+    double past_time = (get_time() - init_time)/1e3;
+    if (verbose) {
+        if (winner >= 0)
+            printf("Start %d of %d won the race in %f ms\n", winner, num_starts, past_time);
+        else
+            printf("None of the %d starts converged to a feasible solution in %f ms\n", num_starts, past_time);
+    }
+    if (winner >= 0) {
+        best_cost = f_best;
+        finalize_soln(x_best,past_time);
+    }
+}
+
+std::shared_future<bool> Optim::submit(const std::function<void()> & fun,
+                                       const int priority,
+                                       const double timeout) {
+
+    if (!pool) {
+        pool = std::make_shared<player::WorkerPool>(1);
+    }
+    std::shared_future<bool> result = pool->submit(fun,priority,timeout);
+    if (!detach) {
+        result.wait();
+    }
+    return result;
+}
+
+void Optim::run() {
+
+    soln_version = soln.version(); // drop solutions not used yet
+    job = submit(std::bind(&Optim::optim,this),player::PRIORITY_NORMAL);
 }
 
 void Optim::optim() {
 
-    update = false;
-    running = true;
+    if (num_starts > 1) {
+        optim_multi_start();
+        return;
+    }
+
     double x[OPTIM_DIM];
 
     if (moving) {
@@ -154,7 +440,27 @@ void Optim::optim() {
     double minf; // the minimum objective value, upon return //
     int res; // error code
 
-    if ((res = nlopt_optimize(opt, x, &minf)) < 0) {
+    if (anytime) {
+        // solver budget is the predicted time-to-hit minus actuation
+        const double budget = get_anytime_budget();
+        if (budget <= 0.0) {
+            if (verbose)
+                printf("No time left for anytime optim!\n");
+            return;
+        }
+        nlopt_set_maxtime(opt, budget);
+        iterate.pending = false;
+        best_cost = INFINITY;
+        t_start = init_time;
+        tracking = true;
+    }
+    res = nlopt_optimize(opt, x, &minf);
+    if (anytime) {
+        check_iterate();
+        tracking = false;
+    }
+
+    if (res < 0) {
         past_time = (get_time() - init_time)/1e3;
         if (verbose) {
             printf("NLOPT failed with exit code %d!\n", res);
@@ -168,12 +474,14 @@ void Optim::optim() {
             printf("NLOPT took %f ms\n", past_time);
             printf("Found minimum at f = %0.10g\n", minf);
         }
-        if (test_soln(x) < 1e-2)
+        // anytime optim may have already published this solution
+        if ((!anytime || minf < best_cost) && test_soln(x) < 1e-2) {
+            best_cost = minf;
             finalize_soln(x,past_time);
+        }
     }
     if (verbose)
         check_optim_result(res);
-    running = false;
 }
 
 static bool check_optim_result(const int res) {
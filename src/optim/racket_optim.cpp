@@ -22,6 +22,7 @@
 #include <armadillo>
 // table tennis prediction functions
 #include "tabletennis.h"
+#include "ball_path.h"
 #include "player.hpp"
 #include "utils.h"
 
@@ -42,7 +43,8 @@ struct des_ball_data {
 /*
  * Cost function for computing the residual (norm squared)
  * of the outgoing ball landing error
- * Calculates also the gradient if grad is TRUE
+ * Calculates also the (exact) gradient if grad is TRUE
+ * by integrating the ball with dual numbers
  *
  */
 static double calc_landing_res(unsigned n,
@@ -128,15 +130,76 @@ optim_des calc_racket_strategy(const mat & balls_predicted,
 	return racket_params;
 }
 
+optim_des calc_racket_strategy(const player::BallPath & ball_path,
+                               const vec2 & ball_land_des,
+                               const double time_land_des,
+                               optim_des & racket_params) {
+
+	racket_params.ball_path = &ball_path;
+	racket_params.ball_land_des[X] = ball_land_des(X);
+	racket_params.ball_land_des[Y] = ball_land_des(Y);
+	racket_params.time_land_des = time_land_des;
+	racket_params.Nmax = 1;
+
+	// initial values are used for lookup and in case T is nan
+	racket_params.ball_pos.set_size(NCART,1);
+	racket_params.ball_vel.set_size(NCART,1);
+	racket_params.racket_pos.set_size(NCART,1);
+	racket_params.racket_vel.set_size(NCART,1);
+	racket_params.racket_normal.set_size(NCART,1);
+	ball_path.eval(0.0,racket_params.ball_pos.memptr(),racket_params.ball_vel.memptr());
+	calc_racket_des(racket_params.ball_pos.memptr(),racket_params.ball_vel.memptr(),
+	                racket_params.ball_land_des,time_land_des,
+	                racket_params.racket_pos.memptr(),
+	                racket_params.racket_vel.memptr(),
+	                racket_params.racket_normal.memptr());
+	return racket_params;
+}
+
+void calc_racket_des(const double ball_pos[NCART],
+                     const double ball_vel[NCART],
+                     const double ball_land_des[2],
+                     const double time_land_des,
+                     double racket_pos[NCART],
+                     double racket_vel[NCART],
+                     double racket_normal[NCART]) {
+
+	static const player::ball_params params;
+	static const double hack[NCART] = {1.1, 1.1, 1.2}; // consider only air drag
+	double ball_out_vel[NCART];
+
+	ball_out_vel[X] = (ball_land_des[X] - ball_pos[X]) / time_land_des;
+	ball_out_vel[Y] = (ball_land_des[Y] - ball_pos[Y]) / time_land_des;
+	ball_out_vel[Z] = (player::contact_table_level - ball_pos[Z] -
+	                   0.5 * params.gravity * time_land_des * time_land_des) / time_land_des;
+	double norm = 0.0;
+	for (int i = 0; i < NCART; i++) {
+		ball_out_vel[i] *= hack[i];
+		racket_normal[i] = ball_out_vel[i] - ball_vel[i];
+		norm += racket_normal[i] * racket_normal[i];
+	}
+	norm = sqrt(norm);
+	double speed = 0.0;
+	for (int i = 0; i < NCART; i++) {
+		racket_normal[i] /= norm;
+		speed += racket_normal[i] * (ball_out_vel[i] + params.CRR * ball_vel[i]) / (1 + params.CRR);
+	}
+	// place racket centre on the predicted ball
+	for (int i = 0; i < NCART; i++) {
+		racket_pos[i] = ball_pos[i];
+		racket_vel[i] = speed * racket_normal[i];
+	}
+}
+
 static void optim_spin_outgoing_ball_vel(const des_ball_data & data,
                                          const bool verbose,
                                          vec3 & est) {
 
-	static double x[3];  /* some initial guess */
-	static double minf; /* the minimum objective value, upon return */
-	static double init_time;
-	static int res; // error code
-	static nlopt_opt opt = nlopt_create(NLOPT_LD_MMA, 3);
+	double x[3];  /* some initial guess */
+	double minf; /* the minimum objective value, upon return */
+	double init_time;
+	int res; // error code
+	static thread_local nlopt_opt opt = nlopt_create(NLOPT_LD_MMA, 3); // one instance per thread
 	nlopt_set_min_objective(opt, calc_landing_res, (void*)&data);
 	nlopt_set_xtol_rel(opt, 1e-2);
 
@@ -166,44 +229,36 @@ static double calc_landing_res(unsigned n,
                                 double *grad,
                                 void *data) {
 
-	static double dt = 0.02;
-    static player::TableTennis tt = player::TableTennis(true,false,false); // no contact checking!
-    static vec3 vel_out;
-    static vec3 out_pos;
-
-    des_ball_data *mydata = (des_ball_data*) data;
-    tt.set_topspin(mydata->topspin);
-    vel_out(X) = x[0];
-    vel_out(Y) = x[1];
-    vel_out(Z) = x[2];
-    tt.set_ball_state(join_vert(mydata->ball_incoming,vel_out));
-	for (int i = 0; i < mydata->time_land_des/dt; i++)
-		tt.integrate_ball_state(dt);
-
-	out_pos = tt.get_ball_position();
-
-    if (grad) {
-
-    	grad[0] = mydata->time_land_des * (out_pos(X) - mydata->ball_land_des(X));
-    	grad[1] = mydata->time_land_des * (out_pos(Y) - mydata->ball_land_des(Y));
-    	grad[2] = mydata->time_land_des * (out_pos(Z) - mydata->ball_land_des(Z));
-    	// Finite difference
-		/*static double h = 1e-6;
-		static double val_plus, val_minus;
-		static double xx[3];
+	static const double dt = 0.02;
+	static const player::ball_params params;
+	typedef dual<NCART> dvar;
+
+	des_ball_data *mydata = (des_ball_data*) data;
+	double spin[NCART];
+	player::topspin_to_spin(mydata->topspin,spin);
+
+	// integrate the flight model (no contact checking!) with the
+	// outgoing ball velocities seeded as the variables
+	player::basic_ball_pod<dvar> ball, ball_cand;
+	for (int i = 0; i < NCART; i++) {
+		ball.pos[i] = mydata->ball_incoming(i);
+		ball.vel[i] = dvar::variable(x[i],i);
+	}
+	for (int i = 0; i < mydata->time_land_des/dt; i++) {
+		player::ball_symplectic_euler(params,spin,dt,ball,ball_cand);
+		ball = ball_cand;
+	}
+
+	dvar res = 0.0;
+	for (int i = 0; i < NCART; i++)
+		res += sqr(ball.pos[i] - mydata->ball_land_des(i));
+
+	if (grad) {
 		for (unsigned i = 0; i < n; i++)
-			xx[i] = x[i];
-		for (unsigned i = 0; i < n; i++) {
-			xx[i] += h;
-			val_plus = calc_landing_res(n, xx, NULL, data);
-			xx[i] -= 2*h;
-			val_minus = calc_landing_res(n, xx, NULL, data);
-			grad[i] = (val_plus - val_minus) / (2*h);
-			xx[i] += h;
-		}*/
-    }
-
-	return pow(norm(out_pos - mydata->ball_land_des),2);
+			grad[i] = res.der[i];
+	}
+
+	return res.val;
 }
 
 }
@@ -9,6 +9,7 @@
 
 #include <armadillo>
 #include "optim.h"
+#include "ball_path.h"
 #include "utils.h"
 #include "kinematics.hpp"
 
@@ -42,13 +43,8 @@ static double cost_fnc(unsigned n,
 		                void *data);
 
 void Optim::run_qrest_optim(vec7 & q_rest_des) {
-	std::thread t = std::thread(&Optim::optim_rest_posture,this,std::ref(q_rest_des));
-	if (detach) {
-		t.detach();
-	}
-	else {
-		t.join();
-	}
+	submit(std::bind(&Optim::optim_rest_posture,this,std::ref(q_rest_des)),
+	       player::PRIORITY_LOW,time2return);
 }
 
 void Optim::optim_rest_posture(vec7 & q_rest_des) {
@@ -57,7 +53,14 @@ void Optim::optim_rest_posture(vec7 & q_rest_des) {
 	double tol_eq[NCART];
 	const_vec(NCART,1e-2,tol_eq);
 	rest_optim_data rest_data;
-	rest_data.ball_pred = param_des->ball_pos;
+	if (param_des->ball_path != nullptr) {
+		// sample the dense ball path on the time grid of the matrices
+		const player::BallPath *path = param_des->ball_path;
+		rest_data.ball_pred = path->sample(DT,(int)(path->get_horizon()/DT)).rows(X,Z);
+	}
+	else {
+		rest_data.ball_pred = param_des->ball_pos;
+	}
 	double lb_[NDOF+1], ub_[NDOF+1];
 	for (int i = 0; i < NDOF; i++) {
 		rest_data.q_hit(i) = qf[i];
@@ -120,14 +123,14 @@ static double cost_fnc(unsigned n,
 		                void *data) {
 
 	rest_optim_data *rest_data = (rest_optim_data*)data;
-	static mat::fixed<6,7> jac = zeros<mat>(6,7);
+	mat::fixed<6,7> jac = zeros<mat>(6,7);
 	vec q_rest(x,NDOF);
 	player::get_jacobian(q_rest,jac);
 
 	if (grad) {
-		static double h = 1e-6;
-		static double val_plus, val_minus;
-		static double xx[NDOF+1];
+		const double h = 1e-6;
+		double val_plus, val_minus;
+		double xx[NDOF+1];
 		for (unsigned i = 0; i < n; i++)
 			xx[i] = x[i];
 		for (unsigned i = 0; i < n; i++) {
@@ -155,7 +158,7 @@ static void intersect_ball_path(unsigned m,
 	vec3 ball_pos;
 	vec q_rest(x,NDOF);
 	double T = x[NDOF];
-	static mat::fixed<6,7> jac = zeros<mat>(6,7);
+	mat::fixed<6,7> jac = zeros<mat>(6,7);
 	vec3 robot_pos = player::get_jacobian(q_rest,jac);
 	interp_ball(rest_data->ball_pred,T,ball_pos);
 
@@ -51,6 +51,19 @@ HittingPlane::HittingPlane(const vec7 & qrest_,
                             double lb_[],
                             double ub_[]) {
 
+	for (int i = 0; i < NDOF; i++) {
+		qrest[i] = qrest_(i);
+		limit_avg[i] = (ub_[i] + lb_[i])/2.0;
+	}
+	for (int i = 0; i < OPTIM_DIM; i++) {
+		ub[i] = ub_[i];
+		lb[i] = lb_[i];
+	}
+	init_nlopt();
+}
+
+void HittingPlane::init_nlopt() {
+
 	double tol_eq[EQ_CONSTR_DIM];
 	const_vec(EQ_CONSTR_DIM,1e-2,tol_eq);
 	// set tolerances equal to second argument
@@ -58,17 +71,17 @@ HittingPlane::HittingPlane(const vec7 & qrest_,
 	// LN = does not require gradients //
 	opt = nlopt_create(NLOPT_LN_COBYLA, OPTIM_DIM);
 	nlopt_set_xtol_rel(opt, 1e-2);
-	nlopt_set_lower_bounds(opt, lb_);
-	nlopt_set_upper_bounds(opt, ub_);
+	nlopt_set_lower_bounds(opt, lb);
+	nlopt_set_upper_bounds(opt, ub);
 	nlopt_set_min_objective(opt, penalize_dist_to_limits, this);
 	nlopt_add_equality_mconstraint(opt,EQ_CONSTR_DIM,kinematics_eq_constr,this,tol_eq);
+}
 
-	for (int i = 0; i < NDOF; i++) {
-		qrest[i] = qrest_(i);
-		ub[i] = ub_[i];
-		lb[i] = lb_[i];
-		limit_avg[i] = (ub[i] + lb[i])/2.0;
-	}
+Optim* HittingPlane::clone() const {
+
+	HittingPlane *copy = new HittingPlane(*this);
+	copy->init_nlopt(); // NLOPT instance of the copy calls back the copy
+	return copy;
 }
 
 void HittingPlane::fix_hitting_time(double time_pred) {
@@ -76,6 +89,10 @@ void HittingPlane::fix_hitting_time(double time_pred) {
 		T = time_pred;
 }
 
+double HittingPlane::predict_time2hit() const {
+	return T;
+}
+
 void HittingPlane::init_last_soln(double x[2*NDOF]) const {
 
 	// initialize first dof entries to q0
@@ -103,10 +120,12 @@ void HittingPlane::finalize_soln(const double x[2*NDOF],
 			qf[i] = x[i];
 			qfdot[i] = x[i+NDOF];
 		}
+		// T stays fixed for the next (anytime) iterates
+		double T_hit = T;
 		if (detach) {
-			T -= (time_elapsed/1e3);
+			T_hit -= (time_elapsed/1e3);
 		}
-		update = true;
+		publish_soln(T_hit);
 	}
 }
 
@@ -163,6 +182,7 @@ static double penalize_dist_to_limits(unsigned n,
 		cost += pow(x[i] - vhp->limit_avg[i],2);
 		cost += pow(x[i + NDOF], 2);
 	}
+	vhp->track_cost(x,cost);
 	return cost;
 }
 
@@ -181,11 +201,11 @@ static void kinematics_eq_constr(unsigned m,
                                  double *grad,
                                  void *my_function_data) {
 
-	static double pos[NCART];
-	static double qfdot[NDOF];
-	static double vel[NCART];
-	static double normal[NCART];
-	static double qf[NDOF];
+	double pos[NCART];
+	double qfdot[NDOF];
+	double vel[NCART];
+	double normal[NCART];
+	double qf[NDOF];
 
 	HittingPlane * vhp = (HittingPlane*)my_function_data;
 
@@ -204,6 +224,7 @@ static void kinematics_eq_constr(unsigned m,
 		result[i + NCART] = vel[i] - vhp->param_des->racket_vel(i);
 		result[i + 2*NCART] = normal[i] - vhp->param_des->racket_normal(i);
 	}
+	vhp->track_violation(x,m,result,true);
 }
 
 }
@@ -0,0 +1,261 @@
+/**
+ * @file ball_batch.cpp
+ *
+ * @brief Batched (structure-of-arrays) table tennis ball simulator.
+ *
+ * The integration loop is kept free of branches: every contact model is
+ * evaluated for all the balls and selected with masks, so that GCC
+ * vectorizes the loop (-O3) with the widest SIMD instructions the target
+ * architecture allows (see BALL_BATCH_NATIVE option in src/CMakeLists.txt).
+ * Vectorization needs -fno-math-errno and -fno-trapping-math for this file.
+ */
+
+#include <armadillo>
+#include "ball_batch.h"
+
+using namespace arma;
+
+namespace player {
+
+BallBatch::BallBatch(const int num_balls,
+                     const bool spin_flag,
+                     const ball_params & params_)
+                     : SPIN_MODE(spin_flag), N(num_balls), params(params_) {
+
+	if (N <= 0) {
+		throw std::runtime_error("Number of balls must be positive!");
+	}
+	for (int i = 0; i < NCART; i++) {
+		pos[i].assign(N,0.0);
+		vel[i].assign(N,0.0);
+		spin[i].assign(N,0.0);
+	}
+	contacts.assign(N,NO_CONTACT);
+	reset_stats();
+	if (SPIN_MODE) {
+		set_topspin(params.init_topspin);
+	}
+}
+
+void BallBatch::set_ball_state(const int idx, const vec6 & ball_state) {
+
+	for (int i = 0; i < NCART; i++) {
+		pos[i][idx] = ball_state(i);
+		vel[i][idx] = ball_state(i+NCART);
+	}
+}
+
+vec6 BallBatch::get_ball_state(const int idx) const {
+
+	vec6 ball_state;
+	for (int i = 0; i < NCART; i++) {
+		ball_state(i) = pos[i][idx];
+		ball_state(i+NCART) = vel[i][idx];
+	}
+	return ball_state;
+}
+
+void BallBatch::set_ball_states(const mat & ball_states) {
+
+	if (ball_states.n_rows != 2*NCART || (int)ball_states.n_cols != N) {
+		throw std::runtime_error("Ball states must be a 6 x N matrix!");
+	}
+	for (int j = 0; j < N; j++) {
+		for (int i = 0; i < NCART; i++) {
+			pos[i][j] = ball_states(i,j);
+			vel[i][j] = ball_states(i+NCART,j);
+		}
+	}
+}
+
+mat BallBatch::get_ball_states() const {
+
+	mat ball_states(2*NCART,N);
+	for (int j = 0; j < N; j++) {
+		for (int i = 0; i < NCART; i++) {
+			ball_states(i,j) = pos[i][j];
+			ball_states(i+NCART,j) = vel[i][j];
+		}
+	}
+	return ball_states;
+}
+
+void BallBatch::set_topspin(const double val) {
+
+	SPIN_MODE = true;
+	double ball_spin[NCART];
+	topspin_to_spin(val,ball_spin);
+	for (int i = 0; i < NCART; i++) {
+		spin[i].assign(N,ball_spin[i]);
+	}
+}
+
+void BallBatch::set_spin(const int idx, const vec3 & ball_spin) {
+
+	SPIN_MODE = true;
+	for (int i = 0; i < NCART; i++) {
+		spin[i][idx] = ball_spin(i);
+	}
+}
+
+void BallBatch::reset_stats() {
+
+	hit.assign(N,0);
+	has_bounced.assign(N,0);
+	legal_bounce.assign(N,0);
+	has_landed.assign(N,0);
+	legal_land.assign(N,0);
+	touched_ground.assign(N,0);
+}
+
+void BallBatch::integrate_ball_states(const double dt) {
+	step(nullptr,dt);
+}
+
+void BallBatch::integrate_ball_states(const racket & robot, const double dt) {
+	step(&robot,dt);
+}
+
+status BallBatch::get_status(const int idx) const {
+
+	status stats;
+	stats.hit = hit[idx];
+	stats.has_bounced = has_bounced[idx];
+	stats.legal_bounce = legal_bounce[idx];
+	stats.has_landed = has_landed[idx];
+	stats.legal_land = legal_land[idx];
+	stats.touched_ground = touched_ground[idx];
+	return stats;
+}
+
+int BallBatch::count_legal_lands() const {
+
+	int num_lands = 0;
+	for (int i = 0; i < N; i++)
+		num_lands += legal_land[i];
+	return num_lands;
+}
+
+void BallBatch::step(const racket *robot, const double dt) {
+
+	static const double table_human_end = dist_to_table - table_length;
+	static const double net_offset = 0.5 * net_thickness + ball_radius;
+	const double Cdrag = params.Cdrag;
+	const double Clift = params.Clift;
+	const double gravity = params.gravity;
+	const double k_slide = params.mu * (1 + params.CRT);
+	// table contact model coefficients, spin model: v - alpha * vb, otherwise: CFT * v
+	const double slide = SPIN_MODE ? 1.0 : 0.0;
+	const double CFTX = SPIN_MODE ? 1.0 : params.CFTX;
+	const double CFTY = SPIN_MODE ? 1.0 : params.CFTY;
+	const double CRT = params.CRT;
+	const double CRR = params.CRR;
+	const int num_balls = N;
+	const int check_racket = (robot != nullptr);
+	double rp[NCART] = {0.0}, rv[NCART] = {0.0}, rn[NCART] = {0.0};
+	if (check_racket) {
+		for (int i = 0; i < NCART; i++) {
+			rp[i] = robot->pos(i);
+			rv[i] = robot->vel(i);
+			rn[i] = robot->normal(i);
+		}
+	}
+
+	double * __restrict__ px = pos[X].data();
+	double * __restrict__ py = pos[Y].data();
+	double * __restrict__ pz = pos[Z].data();
+	double * __restrict__ vx = vel[X].data();
+	double * __restrict__ vy = vel[Y].data();
+	double * __restrict__ vz = vel[Z].data();
+	const double * __restrict__ wx = spin[X].data();
+	const double * __restrict__ wy = spin[Y].data();
+	const double * __restrict__ wz = spin[Z].data();
+	int * __restrict__ flags = contacts.data();
+	int * __restrict__ hit_ = hit.data();
+	int * __restrict__ bounced = has_bounced.data();
+	int * __restrict__ legal_bounce_ = legal_bounce.data();
+	int * __restrict__ landed = has_landed.data();
+	int * __restrict__ legal_land_ = legal_land.data();
+	int * __restrict__ ground_ = touched_ground.data();
+
+#pragma GCC ivdep
+	for (int i = 0; i < num_balls; i++) {
+
+		// symplectic euler with drag and magnus force (spin is zero if spin mode is off)
+		const double speed = sqrt(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]);
+		double cvx = vx[i] + dt * (-Cdrag * speed * vx[i] + Clift * (wy[i]*vz[i] - wz[i]*vy[i]));
+		double cvy = vy[i] + dt * (-Cdrag * speed * vy[i] + Clift * (wz[i]*vx[i] - wx[i]*vz[i]));
+		double cvz = vz[i] + dt * (gravity - Cdrag * speed * vz[i] + Clift * (wx[i]*vy[i] - wy[i]*vx[i]));
+		double cpx = px[i] + dt * cvx;
+		double cpy = py[i] + dt * cvy;
+		double cpz = pz[i] + dt * cvz;
+
+		// table contact
+		const int table = (cpy > table_human_end) & (cpy < dist_to_table) &
+		                  (fabs(cpx - table_center) <= table_width/2.0) &
+		                  (cpz <= contact_table_level) & (cvz < 0.0);
+		const int robot_court = (cpy > net_y);
+		const int incoming = table & (cvy > 0.0);
+		const int good_bounce = robot_court & !bounced[i];
+		legal_bounce_[i] = (incoming & good_bounce) | ((!incoming) & legal_bounce_[i]);
+		bounced[i] |= incoming & good_bounce;
+		const int outgoing = table & (cvy < 0.0) & hit_[i] & !landed[i];
+		legal_land_[i] = (outgoing & (!robot_court)) | ((!outgoing) & legal_land_[i]);
+		landed[i] |= outgoing;
+
+		const double vbx = cvx - ball_radius * wy[i];
+		const double vby = cvy + ball_radius * wx[i];
+		const double alpha = table * slide * k_slide * fabs(cvz) / sqrt(vbx*vbx + vby*vby + 1e-300);
+		cvx = (table ? CFTX : 1.0) * cvx - alpha * vbx;
+		cvy = (table ? CFTY : 1.0) * cvy - alpha * vby;
+		cvz = (table ? -CRT : 1.0) * cvz;
+
+		// net contact
+		const int net_zone = (cpz <= contact_table_level + net_height) &
+		                     (fabs(cpx) <= table_width/2.0 + net_overhang);
+		const double dist_state_net = net_y - py[i];
+		const double dist_cand_net = net_y - cpy;
+		const int net_front = net_zone & (dist_state_net >= 0.0) & (dist_cand_net < 0.0);
+		const int net_back = net_zone & (dist_state_net < 0.0) & (dist_cand_net >= 0.0);
+		const int net = net_front | net_back;
+		cvy = (net ? -net_restitution : 1.0) * cvy;
+		cpy = net_front ? net_y + net_offset : (net_back ? net_y - net_offset : cpy);
+
+		// racket contact (mirror law)
+		const double r2bx = rp[X] - cpx;
+		const double r2by = rp[Y] - cpy;
+		const double r2bz = rp[Z] - cpz;
+		const double normal_dist = rn[X]*r2bx + rn[Y]*r2by + rn[Z]*r2bz;
+		const double parallel_dist = sqrt(fabs(r2bx*r2bx + r2by*r2by + r2bz*r2bz
+		                                       - normal_dist*normal_dist));
+		const int racket_hit = check_racket & !hit_[i] &
+		                       (parallel_dist < racket_radius) & (fabs(normal_dist) < ball_radius);
+		const double speed_racket = racket_hit * (1 + CRR) *
+		             (rn[X]*(rv[X] - cvx) + rn[Y]*(rv[Y] - cvy) + rn[Z]*(rv[Z] - cvz));
+		cvx += speed_racket * rn[X];
+		cvy += speed_racket * rn[Y];
+		cvz += speed_racket * rn[Z];
+		hit_[i] |= racket_hit;
+
+		// ground contact
+		const int ground = (cpz <= floor_level);
+		cpx = ground ? px[i] : cpx;
+		cpy = ground ? py[i] : cpy;
+		cpz = ground ? floor_level : cpz;
+		cvx = ground ? 0.0 : cvx;
+		cvy = ground ? 0.0 : cvy;
+		cvz = ground ? 0.0 : cvz;
+		ground_[i] |= ground;
+
+		flags[i] = table * TABLE_CONTACT + net * NET_CONTACT +
+		           racket_hit * RACKET_CONTACT + ground * GROUND_CONTACT;
+		px[i] = cpx;
+		py[i] = cpy;
+		pz[i] = cpz;
+		vx[i] = cvx;
+		vy[i] = cvy;
+		vz[i] = cvz;
+	}
+}
+
+}
@@ -0,0 +1,72 @@
+/**
+ * @file ball_log.cpp
+ *
+ * @brief Offline processing of recorded ball data.
+ */
+
+#include <armadillo>
+#include <atomic>
+#include "constants.h"
+#include "thread_pool.h"
+#include "ball_log.h"
+
+using namespace arma;
+
+namespace player {
+
+mat ball_log_observations(const mat & log) {
+
+	// columns of each row: 1, status1, pos1, 3, status3, pos3, filter estimate
+	const int STATUS1 = 1, POS1 = 2, STATUS3 = 6, POS3 = 7;
+	if (log.n_cols < POS3 + NCART) {
+		throw std::runtime_error("Ball log should have the blob status and positions!");
+	}
+	mat observations(NCART,log.n_rows);
+	for (unsigned i = 0; i < log.n_rows; i++) {
+		const int pos = (log(i,STATUS3) != 0.0 || log(i,STATUS1) == 0.0) ? POS3 : POS1;
+		for (int j = 0; j < NCART; j++)
+			observations(j,i) = log(i,pos + j);
+	}
+	return observations;
+}
+
+std::vector<mat> segment_rallies(const mat & observations,
+                                 const double jump_tol,
+                                 const int min_length) {
+
+	std::vector<mat> rallies;
+	const int N = observations.n_cols;
+	int start = 0;
+	for (int i = 1; i <= N; i++) {
+		if (i == N || norm(observations.col(i) - observations.col(i-1)) > jump_tol) {
+			if (i - start >= std::max(min_length,2)) {
+				rallies.push_back(observations.cols(start,i-1));
+			}
+			start = i;
+		}
+	}
+	return rallies;
+}
+
+std::vector<mat> smooth_rallies(const std::vector<mat> & rallies,
+                                const EKF & filter,
+                                const double dt,
+                                const int num_threads) {
+
+	std::vector<mat> smoothed(rallies.size());
+	ThreadPool pool(num_threads);
+	std::atomic<int> next_rally(0);
+	pool.run([&](int) {
+		EKF rally_filter = filter;
+		int n;
+		while ((n = next_rally++) < (int)rallies.size()) {
+			const mat & obs = rallies[n];
+			vec6 x0 = join_vert(obs.col(0),(obs.col(1) - obs.col(0))/dt);
+			rally_filter.set_prior(x0,eye<mat>(2*NCART,2*NCART));
+			smoothed[n] = rally_filter.smoothen(obs,dt);
+		}
+	});
+	return smoothed;
+}
+
+}
@@ -0,0 +1,326 @@
+/**
+ * @file ball_path.cpp
+ *
+ * @brief Adaptive-step ball prediction with contact events and dense output.
+ *
+ * Bogacki-Shampine 3(2) embedded Runge-Kutta pair (FSAL) integrates the
+ * continuous flight model. Contacts are located on the cubic Hermite
+ * interpolant of each accepted step with the Illinois (regula falsi) method.
+ */
+
+#include <armadillo>
+#include <algorithm>
+#include "ball_path.h"
+
+using namespace arma;
+
+namespace player {
+
+/*
+ * Event function whose sign change marks a (potential) contact.
+ * Side is used for the racket plane: ball approaches from that side.
+ */
+static double event_fun(const contact type,
+                        const ball_pod & ball,
+                        const racket *robot,
+                        const double side);
+
+/*
+ * Check if the located contact is valid, e.g. ball is over the table
+ * (and not next to it) when crossing the table plane.
+ */
+static bool check_event(const contact type,
+                        const ball_pod & ball,
+                        const racket *robot);
+
+BallPath::BallPath(const bool spin_flag, const double tolerance)
+                   : SPIN_MODE(spin_flag), tol(tolerance) {
+
+	topspin_to_spin(params.init_topspin,spin);
+}
+
+void BallPath::set_topspin(const double val) {
+
+	SPIN_MODE = true;
+	topspin_to_spin(val,spin);
+}
+
+void BallPath::calc_deriv(const ball_pod & ball, ball_pod & deriv) {
+
+	num_evals++;
+	for (int i = 0; i < NCART; i++)
+		deriv.pos[i] = ball.vel[i];
+	ball_flight_model(params,SPIN_MODE ? spin : nullptr,ball.vel,deriv.vel);
+}
+
+void BallPath::add_knot(const double t, const ball_pod & ball, const ball_pod & deriv) {
+
+	times.push_back(t);
+	states.push_back(ball);
+	derivs.push_back(deriv);
+}
+
+void BallPath::interp(const double t0, const ball_pod & x0, const ball_pod & f0,
+                      const double t1, const ball_pod & x1, const ball_pod & f1,
+                      const double t, ball_pod & ball) const {
+
+	const double h = t1 - t0;
+	const double s = (t - t0) / h;
+	const double h00 = (1 + 2*s) * (1 - s) * (1 - s);
+	const double h10 = s * (1 - s) * (1 - s);
+	const double h01 = s * s * (3 - 2*s);
+	const double h11 = s * s * (s - 1);
+	for (int i = 0; i < NCART; i++) {
+		ball.pos[i] = h00 * x0.pos[i] + h * h10 * f0.pos[i] +
+		              h01 * x1.pos[i] + h * h11 * f1.pos[i];
+		ball.vel[i] = h00 * x0.vel[i] + h * h10 * f0.vel[i] +
+		              h01 * x1.vel[i] + h * h11 * f1.vel[i];
+	}
+}
+
+void BallPath::predict(const vec6 & ball_est, const double time_pred, const racket *robot) {
+
+	static const double hmax = 0.1;
+	static const double hmin = 1e-6;
+	static const double time_tol = 1e-9;
+	static const contact event_types[4] = {TABLE_CONTACT, NET_CONTACT,
+	                                       RACKET_CONTACT, GROUND_CONTACT};
+	times.clear();
+	states.clear();
+	derivs.clear();
+	events.clear();
+	num_evals = 0;
+
+	ball_pod x, f, x1, f1, y, k2, k3;
+	ball_from_array(ball_est.memptr(),x);
+	calc_deriv(x,f);
+	add_knot(0.0,x,f);
+
+	double side = 1.0;
+	bool racket_hit = (robot == nullptr);
+	double t = 0.0;
+	double h = std::min(0.01,time_pred);
+
+	while (time_pred - t > time_tol) {
+
+		h = std::min(h,time_pred - t);
+		// Bogacki-Shampine stages
+		for (int i = 0; i < NCART; i++) {
+			y.pos[i] = x.pos[i] + 0.5 * h * f.pos[i];
+			y.vel[i] = x.vel[i] + 0.5 * h * f.vel[i];
+		}
+		calc_deriv(y,k2);
+		for (int i = 0; i < NCART; i++) {
+			y.pos[i] = x.pos[i] + 0.75 * h * k2.pos[i];
+			y.vel[i] = x.vel[i] + 0.75 * h * k2.vel[i];
+		}
+		calc_deriv(y,k3);
+		for (int i = 0; i < NCART; i++) {
+			x1.pos[i] = x.pos[i] + h * (2*f.pos[i] + 3*k2.pos[i] + 4*k3.pos[i]) / 9.0;
+			x1.vel[i] = x.vel[i] + h * (2*f.vel[i] + 3*k2.vel[i] + 4*k3.vel[i]) / 9.0;
+		}
+		calc_deriv(x1,f1);
+
+		// local error estimate (difference to the 2nd order solution)
+		double err = 0.0;
+		for (int i = 0; i < NCART; i++) {
+			const double e_pos = h * (-5*f.pos[i]/72.0 + k2.pos[i]/12.0 + k3.pos[i]/9.0 - f1.pos[i]/8.0);
+			const double e_vel = h * (-5*f.vel[i]/72.0 + k2.vel[i]/12.0 + k3.vel[i]/9.0 - f1.vel[i]/8.0);
+			err = std::max(err,fabs(e_pos) / (tol * (1.0 + std::max(fabs(x.pos[i]),fabs(x1.pos[i])))));
+			err = std::max(err,fabs(e_vel) / (tol * (1.0 + std::max(fabs(x.vel[i]),fabs(x1.vel[i])))));
+		}
+		if (err > 1.0 && h > hmin) {
+			h = std::max(hmin, h * std::max(0.2,0.9*pow(err,-1/3.0)));
+			continue;
+		}
+
+		// locate the first contact in [t,t+h]
+		if (!racket_hit) {
+			side = (event_fun(RACKET_CONTACT,x,robot,1.0) + ball_radius >= 0.0) ? 1.0 : -1.0;
+		}
+		contact type = NO_CONTACT;
+		double te = t + h;
+		for (int k = 0; k < 4; k++) {
+			if (event_types[k] == RACKET_CONTACT && racket_hit)
+				continue;
+			double g0 = event_fun(event_types[k],x,robot,side);
+			double g1 = event_fun(event_types[k],x1,robot,side);
+			bool crossing = (g0 > 0.0 && g1 <= 0.0) ||
+			                (event_types[k] == NET_CONTACT && g0 < 0.0 && g1 >= 0.0);
+			if (!crossing)
+				continue;
+			// Illinois method on the interpolant
+			double a = t, b = t + h, ga = g0, gb = g1;
+			int last = 0;
+			ball_pod xm;
+			while (b - a > time_tol) {
+				double m = (a*gb - b*ga) / (gb - ga);
+				interp(t,x,f,t+h,x1,f1,m,xm);
+				double gm = event_fun(event_types[k],xm,robot,side);
+				if ((gm > 0.0) == (ga > 0.0)) {
+					a = m; ga = gm;
+					if (last == -1) gb *= 0.5;
+					last = -1;
+				}
+				else {
+					b = m; gb = gm;
+					if (last == 1) ga *= 0.5;
+					last = 1;
+				}
+				if (gm == 0.0) {
+					a = b = m;
+				}
+			}
+			interp(t,x,f,t+h,x1,f1,b,xm);
+			if (b < te && check_event(event_types[k],xm,robot)) {
+				te = b;
+				type = event_types[k];
+			}
+		}
+
+		if (type == NO_CONTACT) {
+			add_knot(t + h,x1,f1);
+			x = x1;
+			f = f1;
+			t += h;
+			h = std::min(hmax, h * std::min(5.0,0.9*pow(std::max(err,1e-10),-1/3.0)));
+			continue;
+		}
+
+		// contact: store state before and after contact at the same time
+		interp(t,x,f,t+h,x1,f1,te,x);
+		calc_deriv(x,f);
+		add_knot(te,x,f);
+		switch (type) {
+			case TABLE_CONTACT:
+				ball_table_rebound(params,SPIN_MODE ? spin : nullptr,x.vel);
+				break;
+			case NET_CONTACT: {
+				double offset = 0.5 * net_thickness + ball_radius;
+				x.pos[Y] = (x.vel[Y] > 0.0) ? net_y + offset : net_y - offset;
+				x.vel[Y] *= -net_restitution;
+				break; }
+			case RACKET_CONTACT: {
+				double speed = 0.0;
+				for (int i = 0; i < NCART; i++)
+					speed += robot->normal(i) * (robot->vel(i) - x.vel[i]);
+				for (int i = 0; i < NCART; i++)
+					x.vel[i] += (1 + params.CRR) * speed * robot->normal(i);
+				racket_hit = true;
+				break; }
+			default: // ground
+				for (int i = 0; i < NCART; i++)
+					x.vel[i] = 0.0;
+				x.pos[Z] = floor_level;
+		}
+		calc_deriv(x,f);
+		if (type == GROUND_CONTACT) {
+			for (int i = 0; i < NCART; i++)
+				f.vel[i] = 0.0; // ball stays on the ground
+		}
+		add_knot(te,x,f);
+		ball_event event = {te, type};
+		events.push_back(event);
+		t = te;
+		if (type == GROUND_CONTACT)
+			break;
+	}
+}
+
+void BallPath::eval(const double t, double pos[NCART], double vel[NCART]) const {
+
+	if (times.empty()) {
+		throw std::runtime_error("Ball path is empty! Call predict first!");
+	}
+	ball_pod ball;
+	const int n = times.size();
+	int idx = std::upper_bound(times.begin(),times.end(),t) - times.begin();
+	if (idx == 0) {
+		ball = states[0];
+	}
+	else if (idx == n) {
+		ball = states[n-1];
+	}
+	else {
+		interp(times[idx-1],states[idx-1],derivs[idx-1],
+		       times[idx],states[idx],derivs[idx],t,ball);
+	}
+	for (int i = 0; i < NCART; i++) {
+		pos[i] = ball.pos[i];
+		vel[i] = ball.vel[i];
+	}
+}
+
+vec6 BallPath::get_ball_state(const double t) const {
+
+	vec6 ball_state;
+	eval(t,ball_state.memptr(),ball_state.memptr() + NCART);
+	return ball_state;
+}
+
+mat BallPath::sample(const double dt, const int N) const {
+
+	mat balls(2*NCART,N);
+	for (int i = 0; i < N; i++) {
+		eval((i+1)*dt,balls.colptr(i),balls.colptr(i) + NCART);
+	}
+	return balls;
+}
+
+int BallPath::count_events(const contact type) const {
+
+	int num = 0;
+	for (unsigned i = 0; i < events.size(); i++)
+		num += (events[i].type == type);
+	return num;
+}
+
+double BallPath::get_horizon() const {
+
+	return times.empty() ? 0.0 : times.back();
+}
+
+static double event_fun(const contact type,
+                        const ball_pod & ball,
+                        const racket *robot,
+                        const double side) {
+
+	switch (type) {
+		case TABLE_CONTACT:
+			return ball.pos[Z] - contact_table_level;
+		case NET_CONTACT:
+			return net_y - ball.pos[Y];
+		case RACKET_CONTACT: {
+			double normal_dist = 0.0;
+			for (int i = 0; i < NCART; i++)
+				normal_dist += robot->normal(i) * (ball.pos[i] - robot->pos(i));
+			return side * normal_dist - ball_radius; }
+		default:
+			return ball.pos[Z] - floor_level;
+	}
+}
+
+static bool check_event(const contact type,
+                        const ball_pod & ball,
+                        const racket *robot) {
+
+	switch (type) {
+		case TABLE_CONTACT:
+			return ball_hits_table(ball.pos,ball.vel);
+		case NET_CONTACT:
+			return (ball.pos[Z] <= contact_table_level + net_height) &&
+			       (fabs(ball.pos[X]) <= table_width/2.0 + net_overhang);
+		case RACKET_CONTACT: {
+			double normal_dist = 0.0, sq_dist = 0.0;
+			for (int i = 0; i < NCART; i++) {
+				double diff = robot->pos(i) - ball.pos[i];
+				normal_dist += robot->normal(i) * diff;
+				sq_dist += diff * diff;
+			}
+			return sqrt(fabs(sq_dist - normal_dist*normal_dist)) < racket_radius; }
+		default:
+			return true;
+	}
+}
+
+}
@@ -0,0 +1,183 @@
+/**
+ * @file ball_tracker.cpp
+ *
+ * @brief Multi-ball tracker with gated nearest-neighbour data association.
+ */
+
+#include <armadillo>
+#include "ball_tracker.h"
+
+using namespace arma;
+
+namespace player {
+
+/* Max. ball speed used to gate observations of single-observation tracks (m/s) */
+static const double MAX_BALL_SPEED = 10.0;
+
+BallTracker::BallTracker(const double var_model,
+                         const double var_noise_,
+                         const int max_tracks_,
+                         const int min_obs_,
+                         const double t_lost_,
+                         const double gate_)
+                         : max_tracks(max_tracks_), min_obs(min_obs_), var_noise(var_noise_),
+                           t_lost(t_lost_), gate(gate_),
+                           filter_init(DragBallModel(),eye<mat>(NCART,2*NCART),
+                                       var_model * eye<mat>(2*NCART,2*NCART),
+                                       var_noise_ * eye<mat>(NCART,NCART)) {
+
+	if (max_tracks < 1 || max_tracks > MAX_TRACKS) {
+		throw std::runtime_error("Number of ball tracks must be between 1 and MAX_TRACKS!");
+	}
+	if (min_obs < 2) {
+		throw std::runtime_error("At least two observations are needed to confirm a ball track!");
+	}
+	if (gate <= 0.0 || t_lost <= 0.0) {
+		throw std::runtime_error("Association gate and track lifetime must be positive!");
+	}
+	tracks.reserve(max_tracks);
+}
+
+int BallTracker::find_track(const int id) const {
+
+	for (unsigned i = 0; i < tracks.size(); i++)
+		if (tracks[i].id == id)
+			return i;
+	return -1;
+}
+
+double BallTracker::calc_distance(const ball_track & track, const ball_obs & obs) const {
+
+	// predicted position and its covariance
+	vec3 pos;
+	mat33 S;
+	if (track.confirmed) {
+		double x[2*NCART];
+		double P[2*NCART][2*NCART];
+		track.filter.get_state(x,P);
+		for (int i = 0; i < NCART; i++) {
+			pos(i) = x[i];
+			for (int j = 0; j < NCART; j++)
+				S(i,j) = P[i][j];
+		}
+	}
+	else if (track.prior.size() >= 2) {
+		vec6 x;
+		mat66 P;
+		track.prior.get_state(obs.time,x,P);
+		pos = x.head(NCART);
+		S = P.submat(0,0,NCART-1,NCART-1);
+	}
+	else { // noisy last observation, ball can be anywhere within reach of max. speed
+		const double reach = MAX_BALL_SPEED * (obs.time - track.t_last_obs);
+		pos = vec3(track.last_obs);
+		S = (reach * reach / gate + var_noise) * eye<mat>(NCART,NCART);
+	}
+	S.diag() += var_noise;
+
+	vec3 e;
+	for (int i = 0; i < NCART; i++)
+		e(i) = obs.pos[i] - pos(i);
+	return as_scalar(e.t() * solve(S,e));
+}
+
+void BallTracker::associate(ball_track & track, const ball_obs & obs) {
+
+	track.t_last_obs = obs.time;
+	for (int i = 0; i < NCART; i++)
+		track.last_obs[i] = obs.pos[i];
+	if (track.confirmed) {
+		track.filter.update(obs.pos);
+		return;
+	}
+	track.prior.add(obs.time,vec3(track.last_obs));
+	if (track.prior.size() >= min_obs) {
+		vec6 x;
+		mat66 P;
+		track.prior.get_state(obs.time,x,P);
+		track.filter.set_prior(x,P);
+		track.t_filter = obs.time;
+		track.confirmed = true;
+	}
+}
+
+void BallTracker::update(const ball_obs obs[], const int num_obs) {
+
+	const int num = (num_obs < MAX_BATCH) ? num_obs : MAX_BATCH;
+	if (num <= 0)
+		return;
+	const double time = obs[0].time;
+	if (time <= t_batch)
+		return;
+	t_batch = time;
+
+	// drop lost tracks (swap-remove keeps the pool contiguous)
+	for (unsigned i = 0; i < tracks.size(); ) {
+		if (time - tracks[i].t_last_obs > t_lost) {
+			std::swap(tracks[i],tracks.back());
+			tracks.pop_back();
+		}
+		else {
+			i++;
+		}
+	}
+
+	// predict confirmed tracks to the capture time and gate the distances
+	const int num_tracks = tracks.size();
+	double dist[MAX_TRACKS][MAX_BATCH];
+	for (int i = 0; i < num_tracks; i++) {
+		if (tracks[i].confirmed) {
+			tracks[i].filter.predict(time - tracks[i].t_filter,true);
+			tracks[i].t_filter = time;
+		}
+		for (int j = 0; j < num; j++)
+			dist[i][j] = calc_distance(tracks[i],obs[j]);
+	}
+
+	// greedy assignment in the order of increasing distance
+	bool track_used[MAX_TRACKS] = {false};
+	bool obs_used[MAX_BATCH] = {false};
+	while (true) {
+		int i_min = -1, j_min = -1;
+		double d_min = gate;
+		for (int i = 0; i < num_tracks; i++) {
+			if (track_used[i])
+				continue;
+			for (int j = 0; j < num; j++) {
+				if (!obs_used[j] && dist[i][j] < d_min) {
+					d_min = dist[i][j];
+					i_min = i;
+					j_min = j;
+				}
+			}
+		}
+		if (i_min < 0)
+			break;
+		associate(tracks[i_min],obs[j_min]);
+		track_used[i_min] = true;
+		obs_used[j_min] = true;
+	}
+
+	// unassigned observations start new tracks
+	for (int j = 0; j < num && (int)tracks.size() < max_tracks; j++) {
+		if (obs_used[j])
+			continue;
+		tracks.push_back(ball_track(next_id++,StreamPrior(var_noise),filter_init));
+		associate(tracks.back(),obs[j]);
+	}
+}
+
+bool BallTracker::get_state(const int idx, const double time, vec6 & x, mat66 & P) const {
+
+	const ball_track & track = tracks[idx];
+	if (!track.confirmed)
+		return false;
+	DragBallFixedEKF filter = track.filter;
+	if (time > track.t_filter)
+		filter.predict(time - track.t_filter,true);
+	x = filter.get_mean();
+	P = filter.get_covar();
+	return true;
+}
+
+}
@@ -36,6 +36,9 @@ EKF::EKF(vec (*fp)(const vec &, const double, const void *p),
 
 mat EKF::linearize(const double dt, const double h) const {
 
+	if (df != nullptr) {
+		return this->df(x,dt,fparams);
+	}
 	int dimx = x.n_elem;
 	static mat delta = h * eye<mat>(dimx,dimx);
 	static mat dfdx = zeros<mat>(dimx,dimx);
@@ -50,13 +53,25 @@ mat EKF::linearize(const double dt, const double h) const {
 
 void EKF::predict(const double dt, const bool lin_flag) {
 
-	x = this->f(x,dt,fparams);
 	if (lin_flag) {
-		//cout << "A = \n" << linearize(dt,0.01);
-		mat A = linearize(dt,0.0001);
-		P = A * P * A.t() + Q;
-		//cout << "P = \n" << P << "A = \n" << A;
+		predict_step(dt);
 	}
+	else {
+		x = this->f(x,dt,fparams);
+	}
+}
+
+mat EKF::predict_step(const double dt) {
+
+	//cout << "A = \n" << linearize(dt,0.01);
+	mat A = linearize(dt,0.0001);
+	if (SQRT_MODE)
+		predict_sqrt(A);
+	else
+		P = A * P * A.t() + Q;
+	//cout << "P = \n" << P << "A = \n" << A;
+	x = this->f(x,dt,fparams);
+	return A;
 }
 
 mat EKF::predict_path(const double dt, const int N) {
@@ -64,16 +79,47 @@ mat EKF::predict_path(const double dt, const int N) {
 	int dimx = x.n_elem;
 	mat XX(dimx,N);
 
-	// save mean and covariance
+	// save mean (covariance is not changed without linearization)
 	vec x0 = x;
-	mat P0 = P;
 
 	for (int i = 0; i < N; i++) {
 		predict(dt,false);
 		XX.col(i) = x;
 	}
-	// load mean and variance
-	this->set_prior(x0,P0);
+	// load mean
+	x = x0;
+	return XX;
+}
+
+mat EKF::predict_path(const double dt, const int N, mat & pos_cov, const int decim) {
+
+	if (decim < 1) {
+		throw std::runtime_error("Covariance decimation must be positive!");
+	}
+	int dimx = x.n_elem;
+	mat XX(dimx,N);
+	pos_cov.set_size(2*NCART,N/decim);
+
+	vec x0 = x;
+	mat66 Pk = get_covar();
+	mat66 Qk = Q;
+	mat66 A;
+	for (int i = 0; i < N; i++) {
+		A = linearize(dt,0.0001);
+		Pk = A * Pk * A.t() + Qk;
+		predict(dt,false);
+		XX.col(i) = x;
+		if ((i+1) % decim == 0) {
+			const int j = (i+1)/decim - 1;
+			pos_cov(0,j) = Pk(X,X);
+			pos_cov(1,j) = Pk(Y,Y);
+			pos_cov(2,j) = Pk(Z,Z);
+			pos_cov(3,j) = Pk(X,Y);
+			pos_cov(4,j) = Pk(X,Z);
+			pos_cov(5,j) = Pk(Y,Z);
+		}
+	}
+	x = x0;
 	return XX;
 }
 
@@ -138,7 +184,8 @@ EKF init_filter(const double var_model,
                 const double var_noise,
                 const bool spin,
                 const double out_reject_mult,
-                const double *topspin) {
+                const double *topspin,
+                const bool sqrt_form) {
 
     mat C = eye<mat>(3,6);
     mat66 Q = var_model * eye<mat>(6,6);
@@ -146,10 +193,14 @@ EKF init_filter(const double var_model,
     if (spin) {
         EKF filter = EKF(calc_spin_ball,C,Q,R,out_reject_mult);
         filter.set_fun_params((void*)topspin);
+        filter.set_jacobian(calc_spin_ball_jacobian);
+        filter.set_sqrt_mode(sqrt_form);
         return filter;
     }
     else {
         EKF filter = EKF(calc_next_ball,C,Q,R,out_reject_mult);
+        filter.set_jacobian(calc_next_ball_jacobian);
+        filter.set_sqrt_mode(sqrt_form);
         return filter;
     }
 }
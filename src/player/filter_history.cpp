@@ -0,0 +1,85 @@
+/**
+ * @file filter_history.cpp
+ *
+ * @brief Short history of filter estimates for delayed (out-of-sequence) observations.
+ */
+
+#include <armadillo>
+#include "filter_history.h"
+
+using namespace arma;
+
+namespace player {
+
+void FilterHistory::save(const KF & filter, entry & e) {
+
+	e.x = filter.get_mean();
+	e.P = filter.get_covar();
+}
+
+void FilterHistory::push(const double time, const vec3 & obs, const KF & filter) {
+
+	if (num == SIZE) { // overwrite the oldest
+		first = (first + 1) % SIZE;
+		num--;
+	}
+	entry & e = at(num);
+	e.time = time;
+	e.obs = obs;
+	save(filter,e);
+	num++;
+}
+
+bool FilterHistory::apply_delayed(const double time,
+                                  const vec3 & obs,
+                                  const double time_now,
+                                  EKF & filter,
+                                  const bool outlier_detection) {
+
+	// last estimate before the capture time
+	int k = num - 1;
+	while (k >= 0 && at(k).time > time)
+		k--;
+	if (k < 0 || at(k).time == time) {
+		return false;
+	}
+
+	vec6 x_now = filter.get_mean();
+	mat66 P_now = filter.get_covar();
+	double t = at(k).time;
+	filter.set_prior(at(k).x,at(k).P);
+	filter.predict(time - t,true);
+	if (outlier_detection && filter.check_outlier(obs)) {
+		filter.set_prior(x_now,P_now);
+		return false;
+	}
+	filter.update(obs);
+
+	// insert the delayed observation after k
+	if (num == SIZE) {
+		first = (first + 1) % SIZE;
+		num--;
+		k--;
+	}
+	for (int i = num - 1; i > k; i--)
+		at(i+1) = at(i);
+	num++;
+	entry & e = at(k+1);
+	e.time = time;
+	e.obs = obs;
+	save(filter,e);
+
+	// replay the later observations
+	t = time;
+	for (int i = k + 2; i < num; i++) {
+		filter.predict(at(i).time - t,true);
+		filter.update(at(i).obs);
+		save(filter,at(i));
+		t = at(i).time;
+	}
+	if (time_now > t)
+		filter.predict(time_now - t,true);
+	return true;
+}
+
+}
@@ -0,0 +1,188 @@
+/**
+ * @file imm.cpp
+ *
+ * @brief Interacting multiple model (IMM) estimator for the ball.
+ *
+ * One IMM cycle: the model estimates are mixed with the Markov transition
+ * probabilities, each model filter predicts and updates its own (mixed)
+ * estimate, and the model probabilities are updated with the observation
+ * likelihoods of the filters. Mixing is done on plain arrays, so that
+ * filtering does not allocate.
+ */
+
+#include <armadillo>
+#include <cstring>
+#include "tabletennis.h"
+#include "imm.h"
+
+using namespace arma;
+
+namespace player {
+
+IMM::IMM(mat & Cin,
+         mat & Qin,
+         mat & Rin,
+         double rej_mult,
+         double prob_stay) : EKF(calc_next_ball,Cin,Qin,Rin,rej_mult),
+                             drag_filter(DragBallModel(),Cin,Qin,Rin,rej_mult),
+                             spin_filter(SpinBallModel(),Cin,Qin,Rin,rej_mult) {
+
+	if (prob_stay < 0.0 || prob_stay > 1.0) {
+		throw std::runtime_error("Model transition probability must be in [0,1]!");
+	}
+	for (int i = 0; i < NUM_MODELS; i++) {
+		mu[i] = 1.0 / NUM_MODELS;
+		for (int j = 0; j < NUM_MODELS; j++)
+			trans[i][j] = (i == j) ? prob_stay : (1.0 - prob_stay) / (NUM_MODELS - 1);
+	}
+	ball_params params;
+	topspin = params.init_topspin;
+	EKF::set_fun_params((void*)&topspin);
+}
+
+IMM::IMM(const IMM & other) : EKF(other), topspin(other.topspin),
+                              drag_model(other.drag_model), spin_model(other.spin_model),
+                              drag_filter(other.drag_filter), spin_filter(other.spin_filter) {
+	memcpy(trans,other.trans,sizeof(trans));
+	memcpy(mu,other.mu,sizeof(mu));
+	EKF::set_fun_params((void*)&topspin);
+}
+
+IMM & IMM::operator=(const IMM & other) {
+
+	EKF::operator=(other);
+	memcpy(trans,other.trans,sizeof(trans));
+	memcpy(mu,other.mu,sizeof(mu));
+	topspin = other.topspin;
+	drag_model = other.drag_model;
+	spin_model = other.spin_model;
+	drag_filter = other.drag_filter;
+	spin_filter = other.spin_filter;
+	EKF::set_fun_params((void*)&topspin);
+	return *this;
+}
+
+FixedKF & IMM::model_filter(const int idx) {
+
+	if (idx == DRAG)
+		return drag_filter;
+	return spin_filter;
+}
+
+void IMM::set_prior(const vec & x0, const mat & P0) {
+
+	EKF::set_prior(x0,P0);
+	drag_filter.set_prior(x0,P0);
+	spin_filter.set_prior(x0,P0);
+	for (int i = 0; i < NUM_MODELS; i++)
+		mu[i] = 1.0 / NUM_MODELS;
+}
+
+void IMM::set_fun_params(void *params) {
+
+	if (params != nullptr) {
+		topspin = *(const double*)params;
+		spin_model.set_topspin(topspin);
+		spin_filter.set_topspin(topspin);
+	}
+	EKF::set_fun_params((void*)&topspin);
+}
+
+void IMM::predict(const double dt, const bool lin_flag) {
+
+	if (!lin_flag) {
+		ball_pod ball;
+		ball_from_array(x.memptr(),ball);
+		if (get_active_model() == SPIN)
+			spin_model.step(dt,ball);
+		else
+			drag_model.step(dt,ball);
+		ball_to_array(ball,x.memptr());
+		return;
+	}
+	if (!x.is_finite()) {
+		throw std::runtime_error("IMM not initialized! Please set prior!");
+	}
+
+	// mixing
+	double xs[NUM_MODELS][DIMX], Ps[NUM_MODELS][DIMX][DIMX];
+	double c[NUM_MODELS];
+	for (int i = 0; i < NUM_MODELS; i++)
+		model_filter(i).get_state(xs[i],Ps[i]);
+	for (int j = 0; j < NUM_MODELS; j++) {
+		c[j] = 0.0;
+		for (int i = 0; i < NUM_MODELS; i++)
+			c[j] += trans[i][j] * mu[i];
+		double x0[DIMX] = {0.0}, P0[DIMX][DIMX] = {{0.0}};
+		for (int i = 0; i < NUM_MODELS; i++) {
+			const double w = trans[i][j] * mu[i] / c[j];
+			for (int r = 0; r < DIMX; r++)
+				x0[r] += w * xs[i][r];
+		}
+		for (int i = 0; i < NUM_MODELS; i++) {
+			const double w = trans[i][j] * mu[i] / c[j];
+			for (int r = 0; r < DIMX; r++)
+				for (int k = 0; k < DIMX; k++)
+					P0[r][k] += w * (Ps[i][r][k] + (xs[i][r] - x0[r]) * (xs[i][k] - x0[k]));
+		}
+		model_filter(j).set_prior(x0,P0);
+	}
+
+	drag_filter.predict(dt);
+	spin_filter.predict(dt);
+	for (int j = 0; j < NUM_MODELS; j++)
+		mu[j] = c[j];
+	combine();
+}
+
+void IMM::update(const vec & y) {
+
+	drag_filter.update(y);
+	spin_filter.update(y);
+
+	// model probabilities (likelihoods scaled with the max. to avoid underflow)
+	double loglik[NUM_MODELS], max_loglik = -datum::inf;
+	for (int j = 0; j < NUM_MODELS; j++) {
+		loglik[j] = model_filter(j).get_log_likelihood();
+		max_loglik = std::max(max_loglik,loglik[j]);
+	}
+	double sum = 0.0;
+	for (int j = 0; j < NUM_MODELS; j++) {
+		mu[j] *= exp(loglik[j] - max_loglik);
+		sum += mu[j];
+	}
+	for (int j = 0; j < NUM_MODELS; j++)
+		mu[j] = (sum > 0.0) ? mu[j] / sum : 1.0 / NUM_MODELS;
+	combine();
+}
+
+void IMM::combine() {
+
+	double xs[NUM_MODELS][DIMX], Ps[NUM_MODELS][DIMX][DIMX];
+	for (int i = 0; i < NUM_MODELS; i++)
+		model_filter(i).get_state(xs[i],Ps[i]);
+	for (int r = 0; r < DIMX; r++) {
+		x(r) = 0.0;
+		for (int i = 0; i < NUM_MODELS; i++)
+			x(r) += mu[i] * xs[i][r];
+	}
+	for (int r = 0; r < DIMX; r++)
+		for (int k = 0; k < DIMX; k++) {
+			double sum = 0.0;
+			for (int i = 0; i < NUM_MODELS; i++)
+				sum += mu[i] * (Ps[i][r][k] + (xs[i][r] - x(r)) * (xs[i][k] - x(k)));
+			P(r,k) = sum;
+		}
+}
+
+IMM init_imm(const double var_model,
+             const double var_noise,
+             const double out_reject_mult) {
+
+    mat C = eye<mat>(3,6);
+    mat Q = var_model * eye<mat>(6,6);
+    mat R = var_noise * eye<mat>(3,3);
+    return IMM(C,Q,R,out_reject_mult);
+}
+
+}
@@ -7,8 +7,8 @@
  * algebra library.
  * Compatible with continuous models by using discretize() method.
  * Can be extended easily (e.g. see EKF).
- *
- * TODO: add square-root form for stability!
+ * Covariance can optionally be propagated in square-root form for stability
+ * (see set_sqrt_mode()).
  *
  *  Created on: Jan 25, 2017
  *      Author: okoc
@@ -23,6 +23,13 @@ using namespace arma;
 
 namespace player {
 
+/*
+ * Upper triangular factor U of a positive semidefinite matrix, M = U' * U.
+ * Uses Cholesky decomposition if possible, otherwise takes the square root
+ * of the eigenvalues (clamped at zero) and triangularizes the result.
+ */
+static mat sqrt_upper(const mat & M);
+
 KF::KF(mat & Cin, mat & Qin, mat & Rin) {
 
 	// checking for correct noise covariances
@@ -88,6 +95,33 @@ void KF::set_prior(const vec & x0, const mat & P0) {
 
 	x = x0;
 	P = P0;
+	if (SQRT_MODE) {
+		S = sqrt_upper(P0);
+	}
+}
+
+void KF::reset() {
+
+	x.fill(datum::inf);
+	P.fill(datum::inf);
+	if (SQRT_MODE) {
+		S = P;
+	}
+}
+
+void KF::set_sqrt_mode(const bool flag) {
+
+	SQRT_MODE = flag;
+	if (flag) {
+		Qsqrt = sqrt_upper(Q);
+		Rsqrt = sqrt_upper(R);
+		if (P.is_finite()) {
+			S = sqrt_upper(P);
+		}
+		else {
+			S = P;
+		}
+	}
 }
 
 void KF::check_models(const mat & Ain,
@@ -160,11 +194,39 @@ void KF::discretize(const mat & Ac, const mat & Bc, double dt) {
 
 }
 
-mat KF::smoothen(const mat & observations) {
+mat KF::smoothen(const mat & observations, const double dt) {
 
-	// TODO: Only one iteration?
-	throw std::runtime_error("Unimplemented!");
+	if (!x.is_finite()) {
+		throw std::runtime_error("KF not initialized! Please set prior!");
+	}
+	const int N = observations.n_cols;
+	const int dimx = x.n_elem;
+	vec x0 = x;
+	mat P0 = P;
+	mat Xf(dimx,N), Xp(dimx,N);
+	cube Pf(dimx,dimx,N), Pp(dimx,dimx,N), Ad(dimx,dimx,N);
+
+	// forward pass
+	for (int k = 0; k < N; k++) {
+		if (k > 0) {
+			Ad.slice(k) = predict_step(dt);
+			Xp.col(k) = x;
+			Pp.slice(k) = P;
+		}
+		update(observations.col(k));
+		Xf.col(k) = x;
+		Pf.slice(k) = P;
+	}
+
+	// backward pass, smoother gain G = Pf * A' * inv(Pp)
+	mat Xs = Xf;
+	for (int k = N-2; k >= 0; k--) {
+		mat Gt = solve(Pp.slice(k+1), Ad.slice(k+1) * Pf.slice(k));
+		Xs.col(k) += Gt.t() * (Xs.col(k+1) - Xp.col(k+1));
+	}
 
+	KF::set_prior(x0,P0);
+	return Xs;
 }
 
 vec KF::get_mean() const {
@@ -213,7 +275,10 @@ mat KF::get_model(int idx) const {
 void KF::predict() {
 
 	x = A * x;
-	P = A * P * A + Q;
+	if (SQRT_MODE)
+		predict_sqrt(A);
+	else
+		P = A * P * A.t() + Q;
 }
 
 void KF::predict(const vec & u) {
@@ -222,7 +287,24 @@ void KF::predict(const vec & u) {
 		cerr << "Control input u should have the right size!" << endl;
 
 	x = A * x + B * u;
-	P = A * P * A + Q;
+	if (SQRT_MODE)
+		predict_sqrt(A);
+	else
+		P = A * P * A.t() + Q;
+}
+
+mat KF::predict_step(const double dt) {
+
+	predict();
+	return A;
+}
+
+void KF::predict_sqrt(const mat & Ad) {
+
+	mat Qr, Sr;
+	qr_econ(Qr, Sr, join_vert(S * Ad.t(), Qsqrt));
+	S = Sr;
+	P = S.t() * S;
 }
 
 void KF::update(const vec & y) {
@@ -230,6 +312,11 @@ void KF::update(const vec & y) {
 	if (y.n_elem != C.n_rows)
 		cerr << "Observation y should have the right size!" << endl;
 
+	if (SQRT_MODE) {
+		update_sqrt(y);
+		return;
+	}
+
 	// innovation sequence
 	vec z = y - C * x;
 	// innovation covariance
@@ -245,6 +332,25 @@ void KF::update(const vec & y) {
 	//cout << "x_post:" << "\t" << x.t();
 }
 
+void KF::update_sqrt(const vec & y) {
+
+	int dimy = C.n_rows;
+	int dimx = x.n_elem;
+
+	// pre-array [Rsqrt, 0; S*C', S] is triangularized as [W, Kbar'; 0, S_post]
+	// where W' * W = C * P * C' + R and K = Kbar * inv(W')
+	mat pre = join_vert(join_horiz(Rsqrt, zeros<mat>(dimy,dimx)),
+	                    join_horiz(S * C.t(), S));
+	mat Qr, post;
+	qr_econ(Qr, post, pre);
+	mat W = post(span(0,dimy-1),span(0,dimy-1));
+	mat Kbar = post(span(0,dimy-1),span(dimy,dimy+dimx-1)).t();
+	S = post(span(dimy,dimy+dimx-1),span(dimy,dimy+dimx-1));
+
+	x = x + Kbar * solve(trimatl(W.t()), y - C * x);
+	P = S.t() * S;
+}
+
 mat KF::sample_observations(int N) const {
 
 	// disable messages being printed to the err2 stream
@@ -268,4 +374,19 @@ mat KF::sample_observations(int N) const {
 	return Y;
 }
 
+static mat sqrt_upper(const mat & M) {
+
+	mat U;
+	if (M.n_elem > 0 && chol(U,M)) {
+		return U;
+	}
+	// semidefinite: M = V * D * V' = (sqrt(D) * V')' * (sqrt(D) * V')
+	vec eigval;
+	mat eigvec, Qr;
+	eig_sym(eigval, eigvec, M);
+	mat B = diagmat(sqrt(clamp(eigval,0.0,datum::inf))) * eigvec.t();
+	qr_econ(Qr, U, B);
+	return U;
+}
+
 }
@@ -0,0 +1,272 @@
+/**
+ * @file kalman_fixed.cpp
+ *
+ * @brief Fixed-size (6-state, 3-observation) Kalman filter updates.
+ *
+ * All the matrix operations are written out with plain arrays on the stack.
+ * ARMADILLO is used only at the interface (set_prior, get_mean, etc.).
+ */
+
+#include <iostream>
+#include <cstring>
+#include <armadillo>
+#include "kalman_fixed.h"
+
+using namespace arma;
+
+namespace player {
+
+/*
+ * Cholesky decomposition S = L * L' of a 3x3 symmetric matrix.
+ * Returns FALSE if S is not positive definite.
+ */
+static bool chol3(const double S[NCART][NCART], double L[NCART][NCART]);
+
+FixedKF::FixedKF(const mat & Cin,
+                 const mat & Qin,
+                 const mat & Rin,
+                 const double rej_mult) : outlier_reject_mult(rej_mult) {
+
+	if (Cin.n_rows != DIMY || Cin.n_cols != DIMX ||
+		Qin.n_rows != DIMX || Qin.n_cols != DIMX ||
+		Rin.n_rows != DIMY || Rin.n_cols != DIMY) {
+		throw std::runtime_error("Fixed-size filter needs 3x6 C, 6x6 Q and 3x3 R!");
+	}
+	if (eig_sym(Qin)(0) < 0.0 || eig_sym(Rin)(0) < 0.0) {
+		throw "Covariance matrix must be positive semidefinite!";
+	}
+	for (int i = 0; i < DIMX; i++) {
+		x[i] = datum::inf;
+		for (int j = 0; j < DIMX; j++) {
+			P[i][j] = datum::inf;
+			Q[i][j] = Qin(i,j);
+		}
+	}
+	for (int i = 0; i < DIMY; i++) {
+		for (int j = 0; j < DIMX; j++)
+			C[i][j] = Cin(i,j);
+		for (int j = 0; j < DIMY; j++)
+			R[i][j] = Rin(i,j);
+	}
+}
+
+void FixedKF::set_prior(const vec & x0, const mat & P0) {
+
+	for (int i = 0; i < DIMX; i++) {
+		x[i] = x0(i);
+		for (int j = 0; j < DIMX; j++)
+			P[i][j] = P0(i,j);
+	}
+	init = true;
+}
+
+void FixedKF::set_prior(const double x0[DIMX], const double P0[DIMX][DIMX]) {
+
+	memcpy(x,x0,sizeof(x));
+	memcpy(P,P0,sizeof(P));
+	init = true;
+}
+
+void FixedKF::get_state(double xout[DIMX], double Pout[DIMX][DIMX]) const {
+
+	memcpy(xout,x,sizeof(x));
+	memcpy(Pout,P,sizeof(P));
+}
+
+vec FixedKF::get_mean() const {
+
+	if (!init) {
+		throw std::runtime_error("KF not initialized! Please set prior!");
+	}
+	vec mean(DIMX);
+	for (int i = 0; i < DIMX; i++)
+		mean(i) = x[i];
+	return mean;
+}
+
+mat FixedKF::get_covar() const {
+
+	if (!init) {
+		throw std::runtime_error("KF not initialized! Please set prior!");
+	}
+	mat covar(DIMX,DIMX);
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMX; j++)
+			covar(i,j) = P[i][j];
+	return covar;
+}
+
+void FixedKF::predict_covar(const double *A) {
+
+	double AP[DIMX][DIMX];
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMX; j++) {
+			double sum = 0.0;
+			for (int k = 0; k < DIMX; k++)
+				sum += A[i + DIMX*k] * P[k][j];
+			AP[i][j] = sum;
+		}
+	for (int i = 0; i < DIMX; i++)
+		for (int j = i; j < DIMX; j++) {
+			double sum = 0.0;
+			for (int k = 0; k < DIMX; k++)
+				sum += AP[i][k] * A[j + DIMX*k];
+			P[i][j] = sum + 0.5 * (Q[i][j] + Q[j][i]);
+			P[j][i] = P[i][j];
+		}
+}
+
+void FixedKF::update(const vec & y) {
+
+	if (y.n_elem != DIMY) {
+		throw std::runtime_error("Observation y should have the right size!");
+	}
+	update(y.memptr());
+}
+
+void FixedKF::update(const double y[DIMY]) {
+
+	// innovation and P * C'
+	double z[DIMY];
+	double PCt[DIMX][DIMY];
+	for (int i = 0; i < DIMY; i++) {
+		z[i] = y[i];
+		for (int k = 0; k < DIMX; k++)
+			z[i] -= C[i][k] * x[k];
+	}
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMY; j++) {
+			double sum = 0.0;
+			for (int k = 0; k < DIMX; k++)
+				sum += P[i][k] * C[j][k];
+			PCt[i][j] = sum;
+		}
+
+	// innovation covariance S = C * P * C' + R
+	double S[DIMY][DIMY], L[DIMY][DIMY];
+	for (int i = 0; i < DIMY; i++)
+		for (int j = 0; j < DIMY; j++) {
+			double sum = R[i][j];
+			for (int k = 0; k < DIMX; k++)
+				sum += C[i][k] * PCt[k][j];
+			S[i][j] = sum;
+		}
+	if (!chol3(S,L)) {
+		throw std::runtime_error("Innovation covariance is not positive definite!");
+	}
+
+	// log-likelihood of the innovation, -0.5 * (z' * inv(S) * z + log det(S) + 3 log(2pi))
+	double v[DIMY], dist = 0.0, log_det = 0.0;
+	for (int i = 0; i < DIMY; i++) {
+		v[i] = z[i];
+		for (int k = 0; k < i; k++)
+			v[i] -= L[i][k] * v[k];
+		v[i] /= L[i][i];
+		dist += v[i] * v[i];
+		log_det += 2.0 * log(L[i][i]);
+	}
+	loglik = -0.5 * (dist + log_det + DIMY * log(2 * M_PI));
+
+	// Kalman gain K = P * C' * inv(S), i.e. S * K' = C * P, solved with L * L'
+	double K[DIMX][DIMY];
+	for (int r = 0; r < DIMX; r++) {
+		double w[DIMY];
+		for (int i = 0; i < DIMY; i++) {
+			w[i] = PCt[r][i];
+			for (int k = 0; k < i; k++)
+				w[i] -= L[i][k] * w[k];
+			w[i] /= L[i][i];
+		}
+		for (int i = DIMY-1; i >= 0; i--) {
+			for (int k = i+1; k < DIMY; k++)
+				w[i] -= L[k][i] * w[k];
+			w[i] /= L[i][i];
+		}
+		for (int i = 0; i < DIMY; i++)
+			K[r][i] = w[i];
+	}
+
+	// state update
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMY; j++)
+			x[i] += K[i][j] * z[j];
+
+	// Joseph form: P = (I - K*C) * P * (I - K*C)' + K * R * K'
+	double IKC[DIMX][DIMX], T[DIMX][DIMX], KR[DIMX][DIMY];
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMX; j++) {
+			double sum = (i == j);
+			for (int k = 0; k < DIMY; k++)
+				sum -= K[i][k] * C[k][j];
+			IKC[i][j] = sum;
+		}
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMX; j++) {
+			double sum = 0.0;
+			for (int k = 0; k < DIMX; k++)
+				sum += IKC[i][k] * P[k][j];
+			T[i][j] = sum;
+		}
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMY; j++) {
+			double sum = 0.0;
+			for (int k = 0; k < DIMY; k++)
+				sum += K[i][k] * R[k][j];
+			KR[i][j] = sum;
+		}
+	for (int i = 0; i < DIMX; i++)
+		for (int j = i; j < DIMX; j++) {
+			double sum = 0.0;
+			for (int k = 0; k < DIMX; k++)
+				sum += T[i][k] * IKC[j][k];
+			for (int k = 0; k < DIMY; k++)
+				sum += KR[i][k] * K[j][k];
+			P[i][j] = sum;
+			P[j][i] = sum;
+		}
+}
+
+bool FixedKF::check_outlier(const vec & y, const bool verbose) const {
+
+	bool outlier = false;
+	double inno[DIMY], threshold[DIMY];
+	for (int i = 0; i < DIMY; i++) {
+		inno[i] = y(i);
+		for (int k = 0; k < DIMX; k++)
+			inno[i] -= C[i][k] * x[k];
+		inno[i] = std::min(std::max(inno[i],-10.0),10.0);
+		threshold[i] = outlier_reject_mult * sqrt(P[i][i]);
+		if (!(fabs(inno[i]) < threshold[i]))
+			outlier = true;
+	}
+	if (outlier && verbose) {
+		std::cout << "Outlier:" << y.t()
+		          << "Inno:  " << inno[X] << " " << inno[Y] << " " << inno[Z] << std::endl
+		          << "Thresh: " << threshold[X] << " " << threshold[Y] << " " << threshold[Z] << std::endl;
+	}
+	return outlier;
+}
+
+static bool chol3(const double S[NCART][NCART], double L[NCART][NCART]) {
+
+	for (int i = 0; i < NCART; i++) {
+		for (int j = 0; j <= i; j++) {
+			double sum = S[i][j];
+			for (int k = 0; k < j; k++)
+				sum -= L[i][k] * L[j][k];
+			if (i == j) {
+				if (sum <= 0.0)
+					return false;
+				L[i][i] = sqrt(sum);
+			}
+			else {
+				L[i][j] = sum / L[j][j];
+			}
+		}
+		for (int j = i+1; j < NCART; j++)
+			L[i][j] = 0.0;
+	}
+	return true;
+}
+
+}
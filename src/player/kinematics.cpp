@@ -99,11 +99,11 @@ namespace player {
 void calc_racket_state(const optim::joint & robot_joint,
                         racket & robot_racket) {
 
-    static mat::fixed<3,7> origin = zeros<mat>(3,7);
-    static mat::fixed<3,7> axis = zeros<mat>(3,7);
-    static mat::fixed<3,6> link = zeros<mat>(3,6);
-    static mat::fixed<6,7> jac = zeros<mat>(6,7);
-    static cube::fixed<4,4,7> amats = zeros<cube>(4,4,7);
+    mat::fixed<3,7> origin = zeros<mat>(3,7);
+    mat::fixed<3,7> axis = zeros<mat>(3,7);
+    mat::fixed<3,6> link = zeros<mat>(3,6);
+    mat::fixed<6,7> jac = zeros<mat>(6,7);
+    cube::fixed<4,4,7> amats = zeros<cube>(4,4,7);
 
     kinematics(robot_joint.q,link,origin,axis,amats);
     //rotate_to_quat(amats.slice(PALM)(span(X,Z),span(X,Z)),quat);
@@ -116,10 +116,10 @@ void calc_racket_state(const optim::joint & robot_joint,
 
 vec3 get_jacobian(const vec7 & q, mat::fixed<6,7> & jac) {
 
-    static mat::fixed<3,7> origin = zeros<mat>(3,7);
-    static mat::fixed<3,7> axis = zeros<mat>(3,7);
-    static mat::fixed<3,6> link = zeros<mat>(3,6);
-    static cube::fixed<4,4,7> amats = zeros<cube>(4,4,7);
+    mat::fixed<3,7> origin = zeros<mat>(3,7);
+    mat::fixed<3,7> axis = zeros<mat>(3,7);
+    mat::fixed<3,6> link = zeros<mat>(3,6);
+    cube::fixed<4,4,7> amats = zeros<cube>(4,4,7);
     kinematics(q,link,origin,axis,amats);
     jacobian(link,origin,axis,jac);
     return link.col(PALM);
@@ -211,46 +211,46 @@ static void kinematics(const vec7 & q,
                         cube & Amats) {
 
     using namespace player;
-    static double  ss0th;
-    static double  cs0th;
-    static double  ss1th;
-    static double  cs1th;
-    static double  ss2th;
-    static double  cs2th;
-    static double  ss3th;
-    static double  cs3th;
-    static double  ss4th;
-    static double  cs4th;
-    static double  ss5th;
-    static double  cs5th;
-    static double  ss6th;
-    static double  cs6th;
-
-    static double  rseff0a0;
-    static double  rceff0a0;
-    static double  rseff0a1;
-    static double  rceff0a1;
-    static double  rseff0a2;
-    static double  rceff0a2;
-
-    static mat::fixed<3,4>  Hi00 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Hi01 = zeros<mat>(3,4);
-    static mat::fixed<3,2>  Hi12 = zeros<mat>(3,2);
-    static mat::fixed<3,4>  Hi23 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Hi34 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Hi45 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Hi56 = zeros<mat>(3,4);
-    static mat::fixed<3,2>  Hi67 = zeros<mat>(3,2);
-    static mat::fixed<3,4>  Hi78 = zeros<mat>(3,4);
-
-    static mat::fixed<3,4>  Ai01 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Ai02 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Ai03 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Ai04 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Ai05 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Ai06 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Ai07 = zeros<mat>(3,4);
-    static mat::fixed<3,4>  Ai08 = zeros<mat>(3,4);
+    double  ss0th;
+    double  cs0th;
+    double  ss1th;
+    double  cs1th;
+    double  ss2th;
+    double  cs2th;
+    double  ss3th;
+    double  cs3th;
+    double  ss4th;
+    double  cs4th;
+    double  ss5th;
+    double  cs5th;
+    double  ss6th;
+    double  cs6th;
+
+    double  rseff0a0;
+    double  rceff0a0;
+    double  rseff0a1;
+    double  rceff0a1;
+    double  rseff0a2;
+    double  rceff0a2;
+
+    mat::fixed<3,4>  Hi00 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Hi01 = zeros<mat>(3,4);
+    mat::fixed<3,2>  Hi12 = zeros<mat>(3,2);
+    mat::fixed<3,4>  Hi23 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Hi34 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Hi45 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Hi56 = zeros<mat>(3,4);
+    mat::fixed<3,2>  Hi67 = zeros<mat>(3,2);
+    mat::fixed<3,4>  Hi78 = zeros<mat>(3,4);
+
+    mat::fixed<3,4>  Ai01 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Ai02 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Ai03 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Ai04 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Ai05 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Ai06 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Ai07 = zeros<mat>(3,4);
+    mat::fixed<3,4>  Ai08 = zeros<mat>(3,4);
 
     vec3 pos = {0.0, 0.0, 0.30};
     vec3 orient = zeros<vec>(3);
@@ -43,27 +43,26 @@ void knn(const mat & lookupt,
          const int k,
          vec & val) {
 
-	// find the closest entry
-	static int coparam_length = testpoint.n_rows;
-	static bool firsttime = true;
-	static vec dots = zeros<vec>(lookupt.n_rows);
-	static mat A = zeros<mat>(lookupt.n_rows,coparam_length);
+	mat neighbours;
+	knn_neighbours(lookupt,testpoint,k,neighbours);
+	val = mean(neighbours,1);
+}
 
-	if (firsttime) {
-		firsttime = false;
-		A = lookupt.cols(span(0,coparam_length-1));
-		for (unsigned i = 0; i < A.n_rows; i++) {
-			dots(i) = dot(A.row(i), A.row(i));
-		}
-	}
+void knn_neighbours(const mat & lookupt,
+                    const vec & testpoint,
+                    const int k,
+                    mat & params) {
 
-	uvec idx = sort_index(dots - 2*A*testpoint, "descend");
-	vec fullvec = zeros<vec>(lookupt.n_cols);
+	// find the closest entry (no cached table, kNN can run in several threads)
+	const int coparam_length = testpoint.n_rows;
+	const mat A = lookupt.cols(span(0,coparam_length-1));
+	const vec dots = sum(square(A),1);
+
+	uvec idx = sort_index(dots - 2*A*testpoint, "ascend"); // squared distances minus |testpoint|^2
+	params = zeros<mat>(lookupt.n_cols - coparam_length,k);
 	for (int i = 0; i < k; i++) {
-		fullvec += lookupt.row(idx(i)).t();
+		params.col(i) = lookupt(idx(i),span(coparam_length,lookupt.n_cols-1)).t();
 	}
-	val = fullvec(span(coparam_length,lookupt.n_cols-1))/k;
 }
 
 }
-
@@ -0,0 +1,327 @@
+/**
+ * @file particle_filter.cpp
+ *
+ * @brief Particle filter estimating the ball state and topspin.
+ *
+ * Particles are stored contiguously and split into one contiguous
+ * chunk per thread. Each thread has its own random number generator
+ * and writes its own partial sums, so threads never write to the same
+ * cache lines. Resampling is serial (linear in N).
+ */
+
+#include <armadillo>
+#include <cstring>
+#include "tabletennis.h"
+#include "particle_filter.h"
+
+using namespace arma;
+
+namespace player {
+
+ParticleFilter::ParticleFilter(mat & Cin,
+                               mat & Qin,
+                               mat & Rin,
+                               const int num_particles,
+                               const int num_threads,
+                               const double rej_mult,
+                               const double var_topspin_,
+                               const double var_topspin_walk_,
+                               const unsigned seed)
+                               : EKF(calc_spin_ball,Cin,Qin,Rin,rej_mult),
+                                 N(num_particles),
+                                 var_topspin(var_topspin_),
+                                 var_topspin_walk(var_topspin_walk_),
+                                 resample_thresh(0.5),
+                                 eff_sample_size(num_particles),
+                                 pool(new ThreadPool(num_threads)) {
+
+	if (N <= 0) {
+		throw std::runtime_error("Number of particles must be positive!");
+	}
+	if (Cin.n_cols != DIMX || Cin.n_rows != NCART) {
+		throw std::runtime_error("Particle filter needs 3x6 observation matrix!");
+	}
+	mat L = chol(Qin + 1e-12 * eye<mat>(DIMX,DIMX),"lower");
+	mat Ri = inv_sympd(Rin);
+	for (int i = 0; i < DIMX; i++)
+		for (int j = 0; j < DIMX; j++)
+			Lq[i][j] = L(i,j);
+	for (int i = 0; i < NCART; i++) {
+		for (int j = 0; j < NCART; j++)
+			Rinv[i][j] = Ri(i,j);
+		for (int j = 0; j < DIMX; j++)
+			Cd[i][j] = Cin(i,j);
+	}
+
+	topspin_prior = topspin = params.init_topspin;
+	particles.assign(N*DIMP,0.0);
+	particles_resampled.assign(N*DIMP,0.0);
+	weights.assign(N,1.0/N);
+	loglik.assign(N,0.0);
+	partials.resize(pool->size());
+	for (int i = 0; i < pool->size(); i++) {
+		rngs.push_back(std::mt19937(seed + i));
+	}
+	EKF::set_fun_params((void*)&topspin);
+}
+
+ParticleFilter::ParticleFilter(const ParticleFilter & other) : EKF(other) {
+
+	*this = other;
+}
+
+ParticleFilter & ParticleFilter::operator=(const ParticleFilter & other) {
+
+	EKF::operator=(other);
+	N = other.N;
+	var_topspin = other.var_topspin;
+	var_topspin_walk = other.var_topspin_walk;
+	resample_thresh = other.resample_thresh;
+	topspin_prior = other.topspin_prior;
+	topspin = other.topspin;
+	eff_sample_size = other.eff_sample_size;
+	num_resamples = other.num_resamples;
+	params = other.params;
+	memcpy(Lq,other.Lq,sizeof(Lq));
+	memcpy(Rinv,other.Rinv,sizeof(Rinv));
+	memcpy(Cd,other.Cd,sizeof(Cd));
+	particles = other.particles;
+	particles_resampled = other.particles_resampled;
+	weights = other.weights;
+	loglik = other.loglik;
+	rngs = other.rngs;
+	partials = other.partials;
+	pool = other.pool;
+	EKF::set_fun_params((void*)&topspin);
+	return *this;
+}
+
+void ParticleFilter::set_prior(const vec & x0, const mat & P0) {
+
+	EKF::set_prior(x0,P0);
+	mat L;
+	if (!chol(L,P0,"lower")) {
+		vec eigval;
+		mat eigvec;
+		eig_sym(eigval,eigvec,P0);
+		L = eigvec * diagmat(sqrt(clamp(eigval,0.0,datum::inf)));
+	}
+	const double std_topspin = sqrt(var_topspin);
+	pool->parallel_for(N, [&](int idx, int begin, int end) {
+		std::normal_distribution<double> randn;
+		std::mt19937 & rng = rngs[idx];
+		double z[DIMX];
+		for (int i = begin; i < end; i++) {
+			double *p = &particles[i*DIMP];
+			for (int k = 0; k < DIMX; k++)
+				z[k] = randn(rng);
+			for (int r = 0; r < DIMX; r++) {
+				p[r] = x0(r);
+				for (int k = 0; k <= r; k++)
+					p[r] += L(r,k) * z[k];
+			}
+			p[DIMX] = topspin_prior + std_topspin * randn(rng);
+			weights[i] = 1.0/N;
+		}
+	});
+	topspin = topspin_prior;
+	eff_sample_size = N;
+}
+
+void ParticleFilter::set_fun_params(void *fp) {
+
+	if (fp != nullptr) {
+		const double topspin_new = *(const double*)fp;
+		if (x.is_finite()) {
+			const double shift = topspin_new - topspin;
+			for (int i = 0; i < N; i++)
+				particles[i*DIMP + DIMX] += shift;
+		}
+		topspin_prior = topspin = topspin_new;
+	}
+	EKF::set_fun_params((void*)&topspin);
+}
+
+void ParticleFilter::predict(const double dt, const bool lin_flag) {
+
+	if (!lin_flag) {
+		EKF::predict(dt,false);
+		return;
+	}
+	if (!x.is_finite()) {
+		throw std::runtime_error("Particle filter not initialized! Please set prior!");
+	}
+	const double std_walk = sqrt(var_topspin_walk * dt);
+	pool->parallel_for(N, [&](int idx, int begin, int end) {
+		std::normal_distribution<double> randn;
+		std::mt19937 & rng = rngs[idx];
+		double spin[NCART], z[DIMX];
+		ball_pod ball;
+		for (int i = begin; i < end; i++) {
+			double *p = &particles[i*DIMP];
+			topspin_to_spin(p[DIMX],spin);
+			ball_from_array(p,ball);
+			ball_step(params,spin,dt,ball);
+			ball_to_array(ball,p);
+			for (int k = 0; k < DIMX; k++)
+				z[k] = randn(rng);
+			for (int r = 0; r < DIMX; r++)
+				for (int k = 0; k <= r; k++)
+					p[r] += Lq[r][k] * z[k];
+			p[DIMX] += std_walk * randn(rng);
+		}
+	});
+	calc_moments();
+}
+
+void ParticleFilter::update(const vec & y) {
+
+	if (y.n_elem != NCART) {
+		throw std::runtime_error("Observation y should have the right size!");
+	}
+
+	// log-likelihood of the observation for each particle
+	pool->parallel_for(N, [&](int idx, int begin, int end) {
+		double max_loglik = -datum::inf;
+		double inno[NCART];
+		for (int i = begin; i < end; i++) {
+			const double *p = &particles[i*DIMP];
+			for (int r = 0; r < NCART; r++) {
+				inno[r] = y(r);
+				for (int k = 0; k < DIMX; k++)
+					inno[r] -= Cd[r][k] * p[k];
+			}
+			double dist = 0.0;
+			for (int r = 0; r < NCART; r++)
+				for (int k = 0; k < NCART; k++)
+					dist += inno[r] * Rinv[r][k] * inno[k];
+			loglik[i] = -0.5 * dist;
+			max_loglik = std::max(max_loglik,loglik[i]);
+		}
+		partials[idx].max_loglik = max_loglik;
+	});
+	double max_loglik = -datum::inf;
+	for (int k = 0; k < pool->size(); k++)
+		max_loglik = std::max(max_loglik,partials[k].max_loglik);
+
+	// reweight (scaled with the max. likelihood to avoid underflow)
+	pool->parallel_for(N, [&](int idx, int begin, int end) {
+		double sum_w = 0.0, sum_w2 = 0.0;
+		for (int i = begin; i < end; i++) {
+			weights[i] *= exp(loglik[i] - max_loglik);
+			sum_w += weights[i];
+			sum_w2 += weights[i] * weights[i];
+		}
+		partials[idx].sum_w = sum_w;
+		partials[idx].sum_w2 = sum_w2;
+	});
+	double sum_w = 0.0, sum_w2 = 0.0;
+	for (int k = 0; k < pool->size(); k++) {
+		sum_w += partials[k].sum_w;
+		sum_w2 += partials[k].sum_w2;
+	}
+	if (!(sum_w > 0.0)) {
+		// all particles are too far, keep them with equal weights
+		weights.assign(N,1.0/N);
+		eff_sample_size = N;
+	}
+	else {
+		for (int i = 0; i < N; i++)
+			weights[i] /= sum_w;
+		eff_sample_size = sum_w * sum_w / sum_w2;
+	}
+	if (eff_sample_size < resample_thresh * N) {
+		resample();
+	}
+	calc_moments();
+}
+
+void ParticleFilter::resample() {
+
+	std::uniform_real_distribution<double> unif(0.0,1.0/N);
+	const double u = unif(rngs[0]);
+	double cum_weight = weights[0];
+	int j = 0;
+	for (int i = 0; i < N; i++) {
+		const double thresh = u + (double)i / N;
+		while (thresh > cum_weight && j < N-1) {
+			j++;
+			cum_weight += weights[j];
+		}
+		memcpy(&particles_resampled[i*DIMP],&particles[j*DIMP],DIMP*sizeof(double));
+	}
+	particles.swap(particles_resampled);
+	weights.assign(N,1.0/N);
+	eff_sample_size = N;
+	num_resamples++;
+}
+
+void ParticleFilter::calc_moments() {
+
+	// deviations from a reference state to avoid cancellation
+	double ref[DIMX];
+	for (int k = 0; k < DIMX; k++)
+		ref[k] = x.is_finite() ? x(k) : particles[k];
+
+	pool->parallel_for(N, [&](int idx, int begin, int end) {
+		partial_sums & ps = partials[idx];
+		ps.sum_w = 0.0;
+		for (int r = 0; r < DIMP; r++)
+			ps.sum_wx[r] = 0.0;
+		for (int r = 0; r < DIMX; r++)
+			for (int k = 0; k < DIMX; k++)
+				ps.sum_wxx[r][k] = 0.0;
+		double d[DIMX];
+		for (int i = begin; i < end; i++) {
+			const double *p = &particles[i*DIMP];
+			const double w = weights[i];
+			for (int k = 0; k < DIMX; k++)
+				d[k] = p[k] - ref[k];
+			ps.sum_w += w;
+			for (int r = 0; r < DIMX; r++) {
+				ps.sum_wx[r] += w * d[r];
+				for (int k = 0; k <= r; k++)
+					ps.sum_wxx[r][k] += w * d[r] * d[k];
+			}
+			ps.sum_wx[DIMX] += w * p[DIMX];
+		}
+	});
+
+	double sum_w = 0.0, mean[DIMP] = {0.0}, second[DIMX][DIMX] = {{0.0}};
+	for (int k = 0; k < pool->size(); k++) {
+		const partial_sums & ps = partials[k];
+		sum_w += ps.sum_w;
+		for (int r = 0; r < DIMP; r++)
+			mean[r] += ps.sum_wx[r];
+		for (int r = 0; r < DIMX; r++)
+			for (int c = 0; c <= r; c++)
+				second[r][c] += ps.sum_wxx[r][c];
+	}
+	for (int r = 0; r < DIMP; r++)
+		mean[r] /= sum_w;
+	for (int r = 0; r < DIMX; r++) {
+		x(r) = ref[r] + mean[r];
+		for (int c = 0; c <= r; c++) {
+			P(r,c) = second[r][c] / sum_w - mean[r] * mean[c];
+			P(c,r) = P(r,c);
+		}
+	}
+	topspin = mean[DIMX];
+	if (SQRT_MODE) {
+		KF::set_prior(x,P);
+	}
+}
+
+ParticleFilter init_particle_filter(const double var_model,
+                                    const double var_noise,
+                                    const int num_particles,
+                                    const int num_threads,
+                                    const double out_reject_mult) {
+
+    mat C = eye<mat>(3,6);
+    mat Q = var_model * eye<mat>(6,6);
+    mat R = var_noise * eye<mat>(3,3);
+    return ParticleFilter(C,Q,R,num_particles,num_threads,out_reject_mult);
+}
+
+}
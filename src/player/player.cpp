@@ -30,12 +30,28 @@ using namespace optim;
 
 namespace player {
 
+/*
+ * Trial is legal if exactly one bounce is predicted before an actual bounce
+ * or no bounce is predicted after a legal bounce
+ */
+static bool check_num_bounces(const int num_bounces, const game & game_state);
+
 Player::Player(const vec7 & q0, EKF & filter_, player_flags & flags)
-                   : filter(filter_), pflags(flags) {
+                   : filter(filter_), pflags(flags), ball_path(flags.spin),
+                     pred_cache(flags.spin,2.0,flags.pred_cache_tol),
+                     stream_prior(flags.var_noise),
+                     tracker(flags.var_model,flags.var_noise,flags.max_tracks,
+                             std::max(flags.min_obs,2),flags.t_reset_thresh),
+                     pool(std::make_shared<WorkerPool>(flags.num_workers,flags.worker_cpus)),
+                     prior_pool(std::make_shared<WorkerPool>(1,flags.prior_cpu < 0 ? std::vector<int>() :
+                                                             std::vector<int>(1,flags.prior_cpu))) {
 
 	ball_land_des(X) += pflags.ball_land_des_offset[X];
 	ball_land_des(Y) = dist_to_table - 3*table_length/4 + pflags.ball_land_des_offset[Y];
 	q_rest_des = q0;
+	if (pflags.stream_prior && pflags.min_obs < 2) {
+		throw std::runtime_error("Streaming prior needs at least two observations (min_obs)!");
+	}
 	observations = zeros<mat>(3,pflags.min_obs); // for initializing filter
 	times = zeros<vec>(pflags.min_obs); // for initializing filter
 	//load_lookup_table(lookup_table);
@@ -68,10 +84,21 @@ Player::Player(const vec7 & q0, EKF & filter_, player_flags & flags)
 	opt->set_return_time(pflags.time2return);
 	opt->set_verbose(pflags.verbosity > 1);
 	opt->set_detach(pflags.detach);
+	opt->set_worker_pool(pool);
+	opt->set_multi_start(pflags.num_starts,pflags.start_threads,pflags.start_deadline);
+	opt->set_anytime(pflags.anytime,pflags.act_margin);
 }
 
 Player::~Player() {
 
+	if (pflags.verbosity >= 2) {
+		const cache_stats & stats = pred_cache.get_stats();
+		cout << "Ball prediction cache: " << stats.num_hits << " hits, "
+		     << stats.num_recomputes << " recomputes, max. correction: "
+		     << stats.max_correction << endl;
+	}
+	pool->wait_idle(); // detached jobs may still use the optimizer
+	prior_pool->wait_idle();
 	delete opt;
 }
 
@@ -81,14 +108,14 @@ bool Player::filter_is_initialized() const {
 
 void Player::estimate_ball_state(const vec3 & obs) {
 
-	using std::thread;
-	using std::ref;
 	int verb = pflags.verbosity;
 	bool newball = check_new_obs(obs,1e-3);
 	valid_obs = false;
 
 	if (check_reset_filter(newball,verb,pflags.t_reset_thresh)) {
-		filter = init_filter(pflags.var_model,pflags.var_noise,pflags.spin,pflags.out_reject_mult);
+		filter.reset();
+		pred_cache.reset();
+		stream_prior.reset();
 		num_obs = 0;
 		init_ball_state = false;
 		game_state = AWAITING;
@@ -96,19 +123,20 @@ void Player::estimate_ball_state(const vec3 & obs) {
 		t_obs = 0.0; // t_cumulative
 	}
 
+	double t_prior;
+	if (check_prior_estimate(t_prior) && t_obs - DT > t_prior) {
+		filter.predict(t_obs - DT - t_prior,true); // estimate_prior finished later
+	}
+
 	if (num_obs < pflags.min_obs && newball) {
 		times(num_obs) = t_obs;
 		observations.col(num_obs) = obs;
 		num_obs++;
+		if (pflags.stream_prior)
+			stream_prior.add(t_obs,obs);
 		if (num_obs == pflags.min_obs) {
-			if (verb >= 1)
-				cout << "Estimating initial ball state\n";
-			thread t = thread(estimate_prior,ref(observations),ref(times),
-					          ref(pflags.verbosity),ref(init_ball_state),ref(filter));
-			if (pflags.detach)
-				t.detach();
-			else
-				t.join();
+			start_filter(t_obs);
+			check_prior_estimate(t_prior); // if not detached
 			//estimate_prior(observations,times,pflags.verbosity > 2,filter);
 			//cout << OBS << TIMES << filter.get_mean() << endl;
 		}
@@ -132,6 +160,216 @@ void Player::estimate_ball_state(const vec3 & obs) {
 	t_obs += DT;
 }
 
+void Player::estimate_ball_state(ObsQueue & obs_queue, const double time) {
+
+	if (pflags.multi_ball) {
+		track_balls(obs_queue,time);
+		return;
+	}
+
+	int verb = pflags.verbosity;
+	ball_obs obs;
+	double t_prior;
+	valid_obs = false;
+
+	while (obs_queue.pop(obs)) {
+		if (check_prior_estimate(t_prior)) {
+			t_filter = t_first_obs + t_prior;
+			history.push(t_filter,observations.col(num_obs-1),filter);
+		}
+		if (t_last_obs < 0.0 || obs.time - t_last_obs > pflags.t_reset_thresh) {
+			if (verb > 0)
+				cout << "Resetting filter!\n";
+			reset_filter();
+		}
+		else if (obs.time == t_last_obs) { // duplicate
+			continue;
+		}
+		const bool in_sequence = obs.time > t_last_obs;
+		t_last_obs = std::max(t_last_obs,obs.time);
+		vec3 pos(obs.pos);
+
+		if (num_obs < pflags.min_obs) {
+			if (!in_sequence)
+				continue;
+			if (num_obs == 0)
+				t_first_obs = obs.time;
+			times(num_obs) = obs.time - t_first_obs;
+			observations.col(num_obs) = pos;
+			num_obs++;
+			if (pflags.stream_prior)
+				stream_prior.add(times(num_obs-1),pos);
+			if (num_obs == pflags.min_obs) {
+				t_filter = obs.time; // estimate is at the last observation
+				start_filter(times(num_obs-1));
+				if (init_ball_state) // seed the history for delayed observations
+					history.push(t_filter,pos,filter);
+			}
+		}
+		else if (init_ball_state) {
+			if (obs.time < t_filter) { // delayed, apply at capture time
+				if (history.apply_delayed(obs.time,pos,t_filter,filter,pflags.outlier_detection))
+					valid_obs = true;
+				continue;
+			}
+			if (obs.time > t_filter) {
+				filter.predict(obs.time - t_filter,true);
+				t_filter = obs.time;
+			}
+			bool valid = true;
+			if (pflags.outlier_detection)
+				valid = !filter.check_outlier(pos,verb > 2);
+			if (valid) {
+				filter.update(pos);
+				history.push(obs.time,pos,filter);
+				valid_obs = true;
+			}
+		}
+	}
+
+	if (check_prior_estimate(t_prior)) {
+		t_filter = t_first_obs + t_prior;
+		history.push(t_filter,observations.col(num_obs-1),filter);
+	}
+	if (init_ball_state && time > t_filter) {
+		filter.predict(time - t_filter,true);
+		t_filter = time;
+	}
+}
+
+void Player::track_balls(ObsQueue & obs_queue, const double time) {
+
+	ball_obs batch[BallTracker::MAX_BATCH];
+	ball_obs obs;
+	int num = 0;
+	double t_batch = -1.0; // capture time of the last batch
+	valid_obs = false;
+
+	while (obs_queue.pop(obs)) {
+		if (num > 0 && obs.time != batch[0].time) {
+			tracker.update(batch,num);
+			filter_target(batch[0].time);
+			num = 0;
+		}
+		if (num < BallTracker::MAX_BATCH)
+			batch[num++] = obs;
+		t_batch = obs.time;
+	}
+	if (num > 0) {
+		tracker.update(batch,num);
+		filter_target(batch[0].time);
+	}
+
+	// keep the target while it is incoming, otherwise switch to the closest incoming ball
+	vec6 x;
+	mat66 P;
+	int idx = tracker.find_track(target_id);
+	if (idx < 0 || !tracker.get_state(idx,time,x,P) || x(DY) <= 0.0) {
+		idx = -1;
+		double y_max = -datum::inf;
+		for (int i = 0; i < tracker.num_tracks(); i++) {
+			vec6 xi;
+			mat66 Pi;
+			if (tracker.get_state(i,time,xi,Pi) && xi(DY) > 0.0 && xi(Y) > y_max) {
+				y_max = xi(Y);
+				idx = i;
+				x = xi;
+				P = Pi;
+			}
+		}
+		const int id = (idx < 0) ? -1 : tracker.get_track(idx).id;
+		if (id != target_id) {
+			if (pflags.verbosity > 0)
+				cout << "Switching to ball track " << id << endl;
+			pred_cache.reset();
+			game_state = AWAITING;
+			target_id = id;
+			init_ball_state = false; // primed again with the new target
+		}
+	}
+	if (idx < 0) {
+		init_ball_state = false;
+		return;
+	}
+	if (!init_ball_state) {
+		// prime the filter at the time of the track estimate
+		const ball_track & track = tracker.get_track(idx);
+		tracker.get_state(idx,track.t_filter,x,P);
+		filter.set_prior(x,P);
+		t_filter = track.t_filter;
+		history.clear();
+		if (track.t_last_obs == track.t_filter) // seed the history for delayed observations
+			history.push(t_filter,vec3(track.last_obs),filter);
+		init_ball_state = true;
+		valid_obs = (track.t_last_obs == t_batch);
+	}
+	if (time > t_filter) {
+		filter.predict(time - t_filter,true);
+		t_filter = time;
+	}
+}
+
+void Player::filter_target(const double t_batch) {
+
+	if (!init_ball_state)
+		return;
+	const int idx = tracker.find_track(target_id);
+	if (idx < 0 || tracker.get_track(idx).t_last_obs != t_batch)
+		return;
+	vec3 pos(tracker.get_track(idx).last_obs);
+	if (t_batch < t_filter) { // delayed, apply at capture time
+		if (history.apply_delayed(t_batch,pos,t_filter,filter,pflags.outlier_detection))
+			valid_obs = true;
+		return;
+	}
+	if (t_batch > t_filter) {
+		filter.predict(t_batch - t_filter,true);
+		t_filter = t_batch;
+	}
+	filter.update(pos); // observation is gated by the tracker
+	history.push(t_batch,pos,filter);
+	valid_obs = true;
+}
+
+void Player::start_filter(const double time) {
+
+	if (pflags.verbosity >= 1)
+		cout << "Estimating initial ball state\n";
+	if (pflags.stream_prior) {
+		vec6 x;
+		mat66 P;
+		stream_prior.get_state(time,x,P);
+		filter.set_prior(x,P);
+		init_ball_state = true;
+		return;
+	}
+	// observations and filter are copied to the job
+	prior_id++;
+	std::shared_future<bool> job = prior_pool->submit(std::bind(estimate_prior_snapshot,observations,times,
+	                                                            pflags.verbosity,prior_id,filter,std::ref(prior_est)));
+	if (!pflags.detach)
+		job.wait();
+}
+
+bool Player::check_prior_estimate(double & time) {
+
+	ball_prior est;
+	if (init_ball_state || num_obs < pflags.min_obs || pflags.stream_prior ||
+			!prior_est.read(est) || est.id != prior_id)
+		return false;
+	vec6 x(est.x);
+	mat66 P(&est.P[0][0]); // symmetric, storage order does not matter
+	topspin = est.topspin;
+	filter.set_prior(x,P);
+	filter.set_fun_params((void*)&topspin);
+	pred_cache.set_topspin(topspin);
+	if (pflags.spin) // set_topspin turns ON spin of the dense prediction
+		ball_path.set_topspin(topspin);
+	init_ball_state = true;
+	time = est.time;
+	return true;
+}
+
 vec6 Player::filt_ball_state(const vec3 & obs) {
 
 	estimate_ball_state(obs);
@@ -143,38 +381,58 @@ vec6 Player::filt_ball_state(const vec3 & obs) {
 	}
 }
 
+vec6 Player::filt_ball_state(ObsQueue & obs_queue, const double time) {
+
+	estimate_ball_state(obs_queue,time);
+	if (!init_ball_state)
+		return zeros<vec>(6);
+	return filter.get_mean();
+}
+
 void Player::play(const joint & qact,const vec3 & ball_obs, joint & qdes) {
 
+	num_ticks++;
 	estimate_ball_state(ball_obs);
 
-	switch (pflags.alg) {
-		case FOCUS:
-			optim_fp_param(qact);
-			break;
-		case VHP:
-			optim_vhp_param(qact);
-			break;
-		case DP:
-			optim_dp_param(qact);
-			break;
-		default:
-			throw ("Algorithm is not recognized!\n");
-	}
+	calc_opt_params(qact);
 
 	// generate movement or calculate next desired step
 	calc_next_state(qact, qdes);
 
 }
 
+void Player::play(const joint & qact,
+                  ObsQueue & obs_queue,
+                  const double time,
+                  joint & qdes) {
+
+	num_ticks++;
+	estimate_ball_state(obs_queue,time);
+
+	calc_opt_params(qact);
+
+	// generate movement or calculate next desired step
+	calc_next_state(qact, qdes);
+}
+
 void Player::cheat(const joint & qact,
                     const vec6 & ballstate,
                     joint & qdes) {
 
+	num_ticks++;
 	// resetting legal ball detecting to AWAITING state
 	if (ballstate(Y) < (dist_to_table - table_length) && ballstate(DY) > 2.0)
 		game_state = AWAITING;
 	filter.set_prior(ballstate,0.01*eye<mat>(6,6));
 
+	calc_opt_params(qact);
+
+	// generate movement or calculate next desired step
+	calc_next_state(qact, qdes);
+}
+
+void Player::calc_opt_params(const joint & qact) {
+
 	switch (pflags.alg) {
 		case FOCUS:
 			optim_fp_param(qact);
@@ -188,9 +446,6 @@ void Player::cheat(const joint & qact,
 		default:
 			throw ("Algorithm is not recognized!\n");
 	}
-
-	// generate movement or calculate next desired step
-	calc_next_state(qact, qdes);
 }
 
 void Player::optim_vhp_param(const joint & qact) {
@@ -199,7 +454,7 @@ void Player::optim_vhp_param(const joint & qact) {
 	double time_pred;
 
 	// if ball is fast enough and robot is not moving consider optimization
-	if (check_update(qact)) {
+	if (check_update(qact) && check_uncertainty()) {
 		if (predict_hitting_point(pflags.VHPY,pflags.check_bounce,ball_pred,time_pred,filter,game_state)) { // ball is legal and reaches VHP
 			calc_racket_strategy(ball_pred,ball_land_des,pflags.time_land_des,pred_params);
 			HittingPlane *vhp = static_cast<HittingPlane*>(opt);
@@ -213,14 +468,23 @@ void Player::optim_vhp_param(const joint & qact) {
 
 void Player::optim_fp_param(const joint & qact) {
 
-	mat balls_pred;
-
 	// if ball is fast enough and robot is not moving consider optimization
-	if (check_update(qact)) {
-		predict_ball(2.0,balls_pred,filter);
-		if (!pflags.check_bounce || check_legal_ball(filter.get_mean(),balls_pred,game_state)) { // ball is legal
+	if (check_update(qact) && check_uncertainty()) {
+		if (pflags.dense_pred) {
+			predict_ball(2.0,ball_path,filter);
+			if (!pflags.check_bounce || check_legal_ball(filter.get_mean(),ball_path,game_state)) {
+				calc_racket_strategy(ball_path,ball_land_des,pflags.time_land_des,pred_params);
+				FocusedOptim *fp = static_cast<FocusedOptim*>(opt);
+				fp->set_des_params(&pred_params);
+				fp->update_init_state(qact);
+				fp->run();
+			}
+			return;
+		}
+		pred_cache.update(filter.get_mean(),num_ticks);
+		if (!pflags.check_bounce || check_legal_ball(filter.get_mean(),pred_cache.get_balls(),game_state)) { // ball is legal
 			//lookup_soln(filter.get_mean(),1,qact);
-			calc_racket_strategy(balls_pred,ball_land_des,pflags.time_land_des,pred_params);
+			pred_cache.calc_racket_strategy(ball_land_des,pflags.time_land_des,pred_params);
 			FocusedOptim *fp = static_cast<FocusedOptim*>(opt);
 			fp->set_des_params(&pred_params);
 			fp->update_init_state(qact);
@@ -234,14 +498,28 @@ void Player::optim_fp_param(const joint & qact) {
 
 void Player::optim_dp_param(const joint & qact) {
 
-	mat balls_pred;
-
 	// if ball is fast enough and robot is not moving consider optimization
-	if (check_update(qact)) {
-		predict_ball(2.0,balls_pred,filter);
+	if (check_update(qact) && check_uncertainty()) {
+		if (pflags.dense_pred) {
+			predict_ball(2.0,ball_path,filter);
+			if (!pflags.check_bounce || check_legal_ball(filter.get_mean(),ball_path,game_state)) {
+				pred_params.ball_path = &ball_path;
+				pred_params.ball_pos = ball_path.get_ball_state(0.0).head(NCART);
+				pred_params.ball_vel = ball_path.get_ball_state(0.0).tail(NCART);
+				pred_params.Nmax = 1;
+				DefensiveOptim *dp = static_cast<DefensiveOptim*>(opt);
+				dp->set_des_params(&pred_params);
+				dp->update_init_state(qact);
+				dp->run();
+			}
+			return;
+		}
+		pred_cache.update(filter.get_mean(),num_ticks);
+		const mat & balls_pred = pred_cache.get_balls();
 		if (!pflags.check_bounce || check_legal_ball(filter.get_mean(),balls_pred,game_state)) { // ball is legal
 			//lookup_soln(filter.get_mean(),1,qact);
 			//calc_racket_strategy(balls_pred,ball_land_des,time_land_des,pred_params);
+			pred_params.ball_path = nullptr;
 			pred_params.ball_pos = balls_pred.rows(X,Z);
 			pred_params.ball_vel = balls_pred.rows(DX,DZ);
 			pred_params.Nmax = balls_pred.n_cols;
@@ -301,6 +579,26 @@ bool Player::check_update(const joint & qact) const {
 	return update;
 }
 
+bool Player::check_uncertainty() {
+
+	static const int COV_DECIM = 10;
+	if (pflags.max_pred_std <= 0.0)
+		return true;
+	// crossing of the VHP on the rolling path (also used by FP and DP)
+	pred_cache.update(filter.get_mean(),num_ticks);
+	const mat & balls_cached = pred_cache.get_balls();
+	unsigned idx = 0;
+	while (idx < balls_cached.n_cols && balls_cached(Y,idx) < pflags.VHPY)
+		idx++;
+	if (idx == balls_cached.n_cols)
+		return false; // does not reach the VHP
+	// covariance only up to the crossing, one more column in case the filter model is slower
+	const int N = (idx / COV_DECIM + 2) * COV_DECIM;
+	pred_params.cov_decim = COV_DECIM;
+	mat balls_pred = filter.predict_path(DT,N,pred_params.ball_pos_cov,COV_DECIM);
+	return check_pred_uncertainty(balls_pred,pred_params,pflags.VHPY,pflags.max_pred_std);
+}
+
 void Player::calc_next_state(const joint & qact, joint & qdes) {
 
 	using std::thread;
@@ -326,9 +624,14 @@ void Player::calc_next_state(const joint & qact, joint & qdes) {
 
 }
 
-void Player::reset_filter(double var_model, double var_noise) {
+void Player::reset_filter() {
 
-	filter = init_filter(var_model,var_noise,pflags.spin,pflags.out_reject_mult);
+	filter.reset();
+	pred_cache.reset();
+	history.clear();
+	stream_prior.reset();
+	tracker.reset();
+	target_id = -1;
 	init_ball_state = false;
 	num_obs = 0;
 	game_state = AWAITING;
@@ -411,6 +714,30 @@ void predict_ball(const double & time_pred,
 	//cout << "Pred. ball time: " << 1000 * timer.toc() << " ms." << endl;
 }
 
+void predict_ball(const double & time_pred,
+                    BallPath & ball_path,
+                    const EKF & filter) {
+
+	ball_path.predict(filter.get_mean(),time_pred);
+}
+
+bool check_pred_uncertainty(const mat & balls_pred,
+                            const optim_des & pred_params,
+                            const double vhpy,
+                            const double max_std) {
+
+	const mat & pos_cov = pred_params.ball_pos_cov;
+	for (unsigned j = 0; j < pos_cov.n_cols; j++) {
+		const unsigned idx = (j+1) * pred_params.cov_decim - 1;
+		if (idx >= balls_pred.n_cols)
+			break;
+		if (balls_pred(Y,idx) >= vhpy) {
+			return sqrt(pos_cov(0,j) + pos_cov(1,j) + pos_cov(2,j)) <= max_std;
+		}
+	}
+	return false; // does not reach the VHP
+}
+
 void check_legal_bounce(const vec6 & ball_est, game & game_state) {
 
 	static double last_y_pos = 0.0;
@@ -454,6 +781,18 @@ bool check_legal_ball(const vec6 & ball_est,
 			num_bounces++;
 		}
 	}
+	return check_num_bounces(num_bounces,game_state);
+}
+
+bool check_legal_ball(const vec6 & ball_est,
+                        const BallPath & ball_path,
+                        game & game_state) {
+
+	check_legal_bounce(ball_est, game_state);
+	return check_num_bounces(ball_path.count_events(TABLE_CONTACT),game_state);
+}
+
+static bool check_num_bounces(const int num_bounces, const game & game_state) {
 
 	// one bounce is predicted before an actual bounce has happened
 	if (game_state == AWAITING && num_bounces == 1) {
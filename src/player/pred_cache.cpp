@@ -0,0 +1,140 @@
+/**
+ * @file pred_cache.cpp
+ *
+ * @brief Rolling ball prediction cache used by the Player class.
+ *
+ * Shifting is done in place (columns are contiguous in memory) and
+ * new columns are predicted with the ball kernel, so that a cache hit
+ * does not allocate.
+ */
+
+#include <armadillo>
+#include <cstring>
+#include "pred_cache.h"
+
+using namespace arma;
+
+namespace player {
+
+PredictionCache::PredictionCache(const bool spin_flag,
+                                 const double time_pred,
+                                 const double tolerance)
+                                 : SPIN_MODE(spin_flag), tol(tolerance),
+                                   N((int)(time_pred/DT)) {
+
+	if (N <= 0) {
+		throw std::runtime_error("Prediction horizon must be positive!");
+	}
+	topspin_to_spin(params.init_topspin,spin);
+	balls.zeros(2*NCART,N);
+}
+
+void PredictionCache::reset() {
+
+	tick_pred = -1;
+	num_racket_valid = 0;
+}
+
+void PredictionCache::set_topspin(const double val) {
+
+	if (!SPIN_MODE)
+		return;
+	double spin_new[NCART];
+	topspin_to_spin(val,spin_new);
+	if (memcmp(spin,spin_new,sizeof(spin)) != 0) {
+		memcpy(spin,spin_new,sizeof(spin));
+		reset();
+	}
+}
+
+bool PredictionCache::update(const vec6 & ball_est, const int tick) {
+
+	const int k = tick - tick_pred;
+	if (tick_pred >= 0 && k >= 0 && k < N) {
+		// cached prediction of the current ball state
+		const double *ball_cached = (k == 0) ? ball_pred0 : balls.colptr(k-1);
+		double correction = 0.0;
+		for (int i = 0; i < 2*NCART; i++)
+			correction = std::max(correction,fabs(ball_est(i) - ball_cached[i]));
+		if (correction <= tol) {
+			if (k > 0) {
+				memcpy(ball_pred0,ball_cached,sizeof(ball_pred0));
+				shift_cols(k,balls);
+				predict(balls.colptr(N-k-1),N-k);
+				if (num_racket_valid > 0) {
+					shift_cols(k,racket_des.racket_pos);
+					shift_cols(k,racket_des.racket_vel);
+					shift_cols(k,racket_des.racket_normal);
+					num_racket_valid = std::max(num_racket_valid - k,0);
+				}
+				tick_pred = tick;
+			}
+			stats.num_hits++;
+			stats.max_correction = std::max(stats.max_correction,correction);
+			return false;
+		}
+	}
+
+	// predict from scratch
+	memcpy(ball_pred0,ball_est.memptr(),sizeof(ball_pred0));
+	predict(ball_pred0,0);
+	tick_pred = tick;
+	num_racket_valid = 0;
+	stats.num_recomputes++;
+	return true;
+}
+
+void PredictionCache::calc_racket_strategy(const vec2 & ball_land_des,
+                                           const double time_land_des,
+                                           optim::optim_des & racket_params) {
+
+	const bool same_strategy = (land_des[X] == ball_land_des(X)) &&
+	                           (land_des[Y] == ball_land_des(Y)) &&
+	                           (time_land == time_land_des);
+	if (num_racket_valid == 0 || !same_strategy) {
+		optim::calc_racket_strategy(balls,ball_land_des,time_land_des,racket_des);
+		land_des[X] = ball_land_des(X);
+		land_des[Y] = ball_land_des(Y);
+		time_land = time_land_des;
+		stats.num_racket_recomputes++;
+	}
+	else if (num_racket_valid < N) {
+		for (int i = num_racket_valid; i < N; i++) {
+			optim::calc_racket_des(balls.colptr(i),balls.colptr(i) + NCART,
+			                       land_des,time_land,
+			                       racket_des.racket_pos.colptr(i),
+			                       racket_des.racket_vel.colptr(i),
+			                       racket_des.racket_normal.colptr(i));
+		}
+		stats.num_racket_extends++;
+	}
+	num_racket_valid = N;
+
+	racket_params.ball_path = nullptr;
+	racket_params.ball_pos = balls.rows(X,Z);
+	racket_params.ball_vel = balls.rows(DX,DZ);
+	racket_params.racket_pos = racket_des.racket_pos;
+	racket_params.racket_vel = racket_des.racket_vel;
+	racket_params.racket_normal = racket_des.racket_normal;
+	racket_params.Nmax = N;
+}
+
+void PredictionCache::predict(const double ball_state[2*NCART], const int col_start) {
+
+	ball_pod ball;
+	ball_from_array(ball_state,ball);
+	for (int i = col_start; i < N; i++) {
+		ball_step(params,SPIN_MODE ? spin : nullptr,DT,ball);
+		ball_to_array(ball,balls.colptr(i));
+	}
+}
+
+void PredictionCache::shift_cols(const int k, mat & M) {
+
+	const int n = M.n_cols;
+	if (k <= 0 || k >= n)
+		return;
+	memmove(M.memptr(),M.colptr(k),(n-k) * M.n_rows * sizeof(double));
+}
+
+}
@@ -0,0 +1,92 @@
+/**
+ * @file stream_prior.cpp
+ *
+ * @brief Streaming estimator of the initial ball state.
+ */
+
+#include <armadillo>
+#include "ball_kernel.h"
+#include "stream_prior.h"
+
+using namespace arma;
+
+namespace player {
+
+StreamPrior::StreamPrior(const double var_noise_,
+                         const double var_acc_) : var_noise(var_noise_), var_acc(var_acc_) {
+
+	if (var_noise <= 0.0 || var_acc <= 0.0) {
+		throw std::runtime_error("Variances of the streaming estimator must be positive!");
+	}
+	reset();
+}
+
+void StreamPrior::reset() {
+
+	// quadratic coefficient is a*DT^2/2 with times in units of DT
+	static const ball_params params;
+	const double acc_prior[NCART] = {0.0, 0.0, params.gravity};
+	const double var_coef = var_acc * pow(DT,4) / 4.0;
+
+	num_obs = 0;
+	t0 = 0.0;
+	for (int i = 0; i < NCOEF; i++)
+		for (int j = 0; j < NCOEF; j++)
+			info[i][j] = 0.0;
+	info[2][2] = 1.0 / var_coef;
+	for (int k = 0; k < NCART; k++) {
+		info_vec[k][0] = 0.0;
+		info_vec[k][1] = 0.0;
+		info_vec[k][2] = acc_prior[k] * DT * DT / 2.0 / var_coef;
+	}
+}
+
+void StreamPrior::add(const double time, const vec3 & obs) {
+
+	if (num_obs == 0)
+		t0 = time;
+	const double tau = (time - t0) / DT;
+	const double phi[NCOEF] = {1.0, tau, tau*tau};
+	for (int i = 0; i < NCOEF; i++) {
+		for (int j = 0; j < NCOEF; j++)
+			info[i][j] += phi[i] * phi[j] / var_noise;
+		for (int k = 0; k < NCART; k++)
+			info_vec[k][i] += phi[i] * obs(k) / var_noise;
+	}
+	num_obs++;
+}
+
+bool StreamPrior::get_state(const double time, vec6 & x, mat66 & P) const {
+
+	if (num_obs < 2)
+		return false;
+
+	mat33 A;
+	for (int i = 0; i < NCOEF; i++)
+		for (int j = 0; j < NCOEF; j++)
+			A(i,j) = info[i][j];
+	const mat33 Sigma = inv_sympd(A); // covariance of the coefficients
+
+	const double tau = (time - t0) / DT;
+	vec3 g, h; // position and velocity regressors
+	g << 1.0 << tau << tau*tau;
+	h << 0.0 << 1.0/DT << 2.0*tau/DT;
+	const double var_pos = as_scalar(g.t() * Sigma * g);
+	const double cov_pos_vel = as_scalar(g.t() * Sigma * h);
+	const double var_vel = as_scalar(h.t() * Sigma * h);
+
+	P.zeros();
+	for (int k = 0; k < NCART; k++) {
+		vec3 eta;
+		eta << info_vec[k][0] << info_vec[k][1] << info_vec[k][2];
+		const vec3 coef = Sigma * eta;
+		x(k) = dot(g,coef);
+		x(k+NCART) = dot(h,coef);
+		P(k,k) = var_pos;
+		P(k,k+NCART) = P(k+NCART,k) = cov_pos_vel;
+		P(k+NCART,k+NCART) = var_vel;
+	}
+	return true;
+}
+
+}
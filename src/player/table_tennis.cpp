@@ -25,32 +25,14 @@ using namespace arma;
 /* Forms the rotation matrix that corresponds to the quaternion */
 //static mat33 quat2mat(const vec4 & q);
 
-/*
- * Update the incoming ball velocity with outgoing ball velocity using MIRROR LAW
- *
- * The racket contact model in vector form is O = I + (1 + eps_R)*N*N'*(V - I)
- * where I is the incoming ball velocity
- *       N is the racket normal
- *       V is the racket velocity
- *       eps_R is the coefficient of restitution of the racket
- *
- * TODO: add a spinning contact model
- *
- */
-static void racket_contact_model(const vec3 & racket_vel,
-                                 const vec3 & racket_normal,
-		                         const double & racket_param,
-		                         vec3 & ball_vel);
-
 namespace player {
 
 TableTennis::TableTennis(const vec6 & ball_state,
                          bool spin_flag,
                          bool verbosity)
 							: SPIN_MODE(spin_flag), VERBOSE(verbosity) {
-	ball_pos = ball_state(span(X,Z));
-	ball_vel = ball_state(span(DX,DZ));
-	ball_spin = zeros<vec>(3);
+	ball_from_array(ball_state.memptr(),ball);
+	topspin_to_spin(0.0,ball_spin);
 	init_topspin(params.init_topspin);
 	//load_params("ball.cfg");
 	//init_topspin(params.init_topspin);
@@ -61,9 +43,11 @@ TableTennis::TableTennis(bool spin_flag,
                          bool check_contacts) :
 	                         SPIN_MODE(spin_flag), VERBOSE(verbosity) {
 
-	ball_pos = zeros<vec>(3);
-	ball_vel = zeros<vec>(3);
-	ball_spin = zeros<vec>(3);
+	for (int i = 0; i < NCART; i++) {
+		ball.pos[i] = 0.0;
+		ball.vel[i] = 0.0;
+	}
+	topspin_to_spin(0.0,ball_spin);
 	init_topspin(params.init_topspin);
 	CHECK_CONTACTS = check_contacts;
 	//load_params("ball.cfg");
@@ -74,7 +58,7 @@ void TableTennis::init_topspin(const double val) {
 
 	if (SPIN_MODE) {
 		//std::cout << "Initializing with spin" << std::endl;
-		ball_spin(X) = val*2*datum::pi;
+		topspin_to_spin(val,ball_spin);
 		// others are zero
 	}
 	else {
@@ -85,7 +69,7 @@ void TableTennis::init_topspin(const double val) {
 
 void TableTennis::set_topspin(const double val) {
 	SPIN_MODE = true;
-	ball_spin(X) = val*2*datum::pi;
+	topspin_to_spin(val,ball_spin);
 }
 
 void TableTennis::reset_stats() {
@@ -169,287 +153,156 @@ void TableTennis::set_ball_gun(double std, int ballgun_side) {
 	vec3 rand_ball_pos = ballgun + std * randn<vec>(3);
 	vec3 rand_ball_vel = good_ball_vel + std * randn<vec>(3);
 
-	this->ball_pos = rand_ball_pos;
-	this->ball_vel = rand_ball_vel;
+	for (int i = 0; i < NCART; i++) {
+		ball.pos[i] = rand_ball_pos(i);
+		ball.vel[i] = rand_ball_vel(i);
+	}
 }
 
 vec3 TableTennis::get_ball_position() const {
 
-	return this->ball_pos;
+	return vec3(ball.pos);
 }
 
 vec6 TableTennis::get_ball_state() const {
 
-	return join_vert(this->ball_pos,this->ball_vel);
+	vec6 ball_state;
+	ball_to_array(ball,ball_state.memptr());
+	return ball_state;
 }
 
 void TableTennis::set_ball_state(const vec6 & ball_state) {
 
-	this->ball_pos = ball_state(span(X,Z));
-	this->ball_vel = ball_state(span(DX,DZ));
+	ball_from_array(ball_state.memptr(),ball);
 }
 
 vec3 TableTennis::get_ball_velocity() const {
 
-	return this->ball_vel;
+	return vec3(ball.vel);
 }
 
 void TableTennis::integrate_ball_state(const racket & robot_racket,
 		                               const double dt) {
 
 	// Symplectic Euler for No-Contact-Situation (Flight model)
-	vec3 ball_cand_pos, ball_cand_vel;
-	symplectic_euler(dt,ball_cand_pos, ball_cand_vel);
+	ball_pod ball_cand;
+	ball_symplectic_euler(params,spin(),dt,ball,ball_cand);
 
 	if (CHECK_CONTACTS) {
-		check_contact(robot_racket,ball_cand_pos,ball_cand_vel);
+		check_contact(robot_racket,ball_cand);
 	}
 
 	// Pass the computed ball variables to ball pos and vel
-	ball_pos = ball_cand_pos;
-	ball_vel = ball_cand_vel;
+	ball = ball_cand;
 }
 
 void TableTennis::integrate_ball_state(const double dt) {
 
 	// Symplectic Euler for No-Contact-Situation (Flight model)
-	vec3 ball_cand_pos, ball_cand_vel;
-	symplectic_euler(dt, ball_cand_pos, ball_cand_vel);
+	ball_pod ball_cand;
+	ball_symplectic_euler(params,spin(),dt,ball,ball_cand);
 
 	if (CHECK_CONTACTS) {
-		check_ball_table_contact(ball_cand_pos,ball_cand_vel);
-		check_ball_net_contact(ball_cand_pos,ball_cand_vel);
-		check_ball_ground_contact(ball_cand_pos,ball_cand_vel);
+		check_ball_table_contact(ball_cand);
+		check_ball_net_contact(ball_cand);
+		check_ball_ground_contact(ball_cand);
 	}
 
 	// Pass the computed ball variables to ball pos and vel
-	ball_pos = ball_cand_pos;
-	ball_vel = ball_cand_vel;
+	ball = ball_cand;
 }
 
 void TableTennis::turn_off_contact_checking() {
 	CHECK_CONTACTS = false;
 }
 
-vec3 TableTennis::flight_model() const {
-
-	vec3 ball_acc = drag_flight_model();
-	// add Magnus force
-	if (SPIN_MODE) {
-		//std::cout << "Adding some spin force" << std::endl;
-		vec3 magnus = cross(ball_spin,ball_vel); // acceleration due to magnus force
-		magnus *= params.Clift;
-		ball_acc += magnus;
-		//std::cout << magnus << std::endl;
-	}
-	return ball_acc;
-}
-
-vec3 TableTennis::drag_flight_model() const {
-
-	double velBall = norm(ball_vel);
-	vec3 ball_acc;
-	ball_acc(X) = -ball_vel(X) * params.Cdrag * velBall;
-	ball_acc(Y) = -ball_vel(Y) * params.Cdrag * velBall;
-	ball_acc(Z) = params.gravity - ball_vel(Z) * params.Cdrag * velBall;
-
-	return ball_acc;
-}
-
-vec3 TableTennis::table_contact_model(const vec3 & ball_vel_in) const {
-
-	static double alpha;
-	vec3 ball_vel_out;
-
-	if (SPIN_MODE) { // if spin mode is on ballvec is not a null pointer
-		//cout << "Using a spin model for bounce..." << endl;
-		vec3 vbT = {ball_vel_in(X) - ball_radius*ball_spin(Y),
-				    ball_vel_in(Y) + ball_radius*ball_spin(X),
-					0.0};
-		alpha = params.mu * (1 + params.CRT) * abs(ball_vel_in(Z))/norm(vbT);
-		vec3 v = {1.0-alpha,1.0-alpha,-params.CRT};
-		mat Av = diagmat(v);
-		mat Bv = {{0, alpha * ball_radius, 0}, {-alpha*ball_radius, 0, 0}, {0, 0, 0}};
-		//cout << ball_vel;
-		ball_vel_out = Av * ball_vel_in + Bv * ball_spin;
-		//cout << ball_vel;
-	}
-	else {
-		// reflect ball velocity
-		//cout << "Coming here!\n" << ball_vel << endl;
-		ball_vel_out(Z) = -params.CRT * ball_vel_in(Z);
-		ball_vel_out(Y) = params.CFTY * ball_vel_in(Y);
-		ball_vel_out(X) = params.CFTX * ball_vel_in(X);
-	}
-	return ball_vel_out;
-}
-
-void TableTennis::symplectic_euler(const double dt,
-                                    vec3 & ball_next_pos,
-                                    vec3 & ball_next_vel) const {
-
-	vec3 ball_acc = flight_model();
-	// ball candidate velocities
-	ball_next_vel(X) = ball_vel(X) + ball_acc(X) * dt;
-	ball_next_vel(Y) = ball_vel(Y) + ball_acc(Y) * dt;
-	ball_next_vel(Z) = ball_vel(Z) + ball_acc(Z) * dt;
-
-	// ball candidate positions
-	ball_next_pos(X) = ball_pos(X) + ball_next_vel(X) * dt;
-	ball_next_pos(Y) = ball_pos(Y) + ball_next_vel(Y) * dt;
-	ball_next_pos(Z) = ball_pos(Z) + ball_next_vel(Z) * dt;
-}
-
 void TableTennis::symplectic_int_fourth(const double dt) {
 
-	static vec3 ball_acc;
-	static double speed_ball;
-	static double two_power_third = pow(2.0,1/3.0);
-	static double c1 = 1/(2*(2-two_power_third));
-	static double c4 = c1;
-	static double c2 = (1 - two_power_third) * c1;
-	static double c3 = c2;
-	static double d1 = 2 * c1;
-	static double d3 = d1;
-	static double d2 = -two_power_third * d1;
-	static vec4 c = {c1, c2, c3, c4};
-	static vec4 d = {d1, d2, d3, 0.0};
-	static vec3 ball_next_pos;
-	static vec3 ball_next_vel;
-
-	ball_next_vel = ball_vel;
-	ball_next_pos = ball_pos;
+	static const double two_power_third = pow(2.0,1/3.0);
+	static const double c1 = 1/(2*(2-two_power_third));
+	static const double c2 = (1 - two_power_third) * c1;
+	static const double d1 = 2 * c1;
+	static const double d2 = -two_power_third * d1;
+	static const double c[4] = {c1, c2, c2, c1};
+	static const double d[4] = {d1, d2, d1, 0.0};
+	double ball_acc[NCART];
 
 	for (int i = 0; i < 4; i++) {
-		speed_ball = norm(ball_next_vel);
-		ball_acc(X) = -ball_next_vel(X) * params.Cdrag * speed_ball;
-		ball_acc(Y) = -ball_next_vel(Y) * params.Cdrag * speed_ball;
-		ball_acc(Z) = params.gravity - ball_next_vel(Z) * params.Cdrag * speed_ball;
-		if (SPIN_MODE) {// add Magnus force
-			ball_acc += params.Clift * cross(ball_spin,ball_next_vel);
-		}
+		ball_flight_model(params,spin(),ball.vel,ball_acc);
 		// ball candidate velocities and positions
-		ball_next_vel += c(i) * ball_acc * dt;
-		ball_next_pos += d(i) * ball_next_vel * dt;
+		for (int j = 0; j < NCART; j++) {
+			ball.vel[j] += c[i] * ball_acc[j] * dt;
+			ball.pos[j] += d[i] * ball.vel[j] * dt;
+		}
 	}
-	ball_vel = ball_next_vel;
-	ball_pos = ball_next_pos;
-
 }
 
 void TableTennis::check_contact(const racket & robot_racket,
-		                        vec3 & ball_cand_pos,
-		                        vec3 & ball_cand_vel) {
+		                        ball_pod & ball_cand) {
 
 	// Check contact to table
-	check_ball_table_contact(ball_cand_pos,ball_cand_vel);
+	check_ball_table_contact(ball_cand);
 	// Check contact with net
-	check_ball_net_contact(ball_cand_pos,ball_cand_vel);
+	check_ball_net_contact(ball_cand);
 	// Check contact with racket
-	check_ball_racket_contact(robot_racket,ball_cand_pos,ball_cand_vel);
+	check_ball_racket_contact(robot_racket,ball_cand);
 	// Check if it hits the ground...
-	check_ball_ground_contact(ball_cand_pos,ball_cand_vel);
+	check_ball_ground_contact(ball_cand);
 }
 
-void TableTennis::check_ball_table_contact(const vec3 & ball_cand_pos,
-                                            vec3 & ball_cand_vel) {
-
-	static const double contact_table_level = floor_level - table_height + ball_radius;
-	static const double table_human_end = dist_to_table - table_length;
+void TableTennis::check_ball_table_contact(ball_pod & ball_cand) {
 
-	// check to see if ball is over the table
-	if ((ball_cand_pos(Y) > table_human_end) && (ball_cand_pos(Y) < dist_to_table) &&
-			(fabs(ball_cand_pos(X) - table_center) <= table_width/2.0)) {
-		// check if the ball hits the table coming from above
-		if ((ball_cand_pos(Z) <= contact_table_level) && (ball_cand_vel(Z) < 0.0)) {
-			//std::cout << "Bounce predicted!" << std::endl;
-			check_legal_bounce(ball_cand_pos,ball_cand_vel);
-			check_legal_land(ball_cand_pos,ball_cand_vel);
-			ball_cand_vel = table_contact_model(ball_cand_vel);
-		}
+	// check to see if ball is over the table and hits it coming from above
+	if (ball_hits_table(ball_cand.pos,ball_cand.vel)) {
+		//std::cout << "Bounce predicted!" << std::endl;
+		check_legal_bounce(ball_cand);
+		check_legal_land(ball_cand);
+		ball_table_rebound(params,spin(),ball_cand.vel);
 	}
 }
 
-void TableTennis::check_ball_net_contact(vec3 & ball_cand_pos,
-                                         vec3 & ball_cand_vel) const {
-
-
-	static const double contact_table_level = floor_level - table_height + ball_radius;
-	static const double net_dist_robot = dist_to_table - 0.5 * table_length;
-	static double dist_state_net;
-	static double dist_cand_net;
+void TableTennis::check_ball_net_contact(ball_pod & ball_cand) const {
 
-	// Check contact with net
-	if ((ball_cand_pos(Z) <= contact_table_level + net_height)
-			&& (fabs(ball_cand_pos(X)) <= table_width/2.0 + net_overhang)) {
-		dist_state_net = net_dist_robot - ball_pos(Y);
-		dist_cand_net = net_dist_robot - ball_cand_pos(Y);
-
-		// If on the other side of the net after integration
-		// apply super simplistic model for contact with net
-		if (dist_state_net >= 0.0 && dist_cand_net < 0.0) {
-			if (VERBOSE)
-				std::cout << "Touches the net!" << std::endl;
-			// Reflect to Front
-			ball_cand_vel(Y) *= -net_restitution;
-			ball_cand_pos(Y) = net_dist_robot + (0.5 * net_thickness + ball_radius);
-		}
-		else if (dist_state_net < 0.0 && dist_cand_net >= 0.0){
-			if (VERBOSE)
-				std::cout << "Touches the net!" << std::endl;
-			// Reflect to Back
-			ball_cand_vel(Y) *= -net_restitution;
-			ball_cand_pos(Y) = net_dist_robot - (0.5 * net_thickness + ball_radius);
-		}
+	// apply super simplistic model for contact with net
+	if (ball_net_contact(ball.pos[Y],ball_cand) && VERBOSE) {
+		std::cout << "Touches the net!" << std::endl;
 	}
 }
 
 void TableTennis::check_ball_racket_contact(const racket & robot_racket,
-		                                    const vec3 & ball_cand_pos,
-		                                    vec3 & ball_cand_vel) {
-
-	vec3 racket2ball = robot_racket.pos - ball_cand_pos;
-	double normal_dist_ball2racket = dot(robot_racket.normal,racket2ball);
-	double parallel_dist_ball2racket = sqrt(fabs(dot(racket2ball,racket2ball)
-							- normal_dist_ball2racket*normal_dist_ball2racket));
+		                                    ball_pod & ball_cand) {
 
 	// check for contact with racket
-	if ((parallel_dist_ball2racket < racket_radius) &&
-			(fabs(normal_dist_ball2racket) < ball_radius) && !stats.hit) {
+	if (!stats.hit && ball_racket_contact(params,robot_racket.pos.memptr(),
+			                              robot_racket.vel.memptr(),
+			                              robot_racket.normal.memptr(),
+			                              ball_cand)) {
 		stats.hit = true;
 		if (VERBOSE)
 			std::cout << "Contact with racket!" << std::endl;
-		// Reflect to back
-		racket_contact_model(robot_racket.vel, robot_racket.normal, params.CRR, ball_cand_vel);
 	}
 }
 
-void TableTennis::check_ball_ground_contact(vec3 & ball_cand_pos, vec3 & ball_cand_vel) {
+void TableTennis::check_ball_ground_contact(ball_pod & ball_cand) {
 
-	if (ball_cand_pos(Z) <= floor_level) {
+	if (ball_ground_contact(ball,ball_cand)) {
 		if (VERBOSE && !stats.touched_ground) {// we dont want to print all the time
 			std::cout << "Contact with ground Zeroing the velocities!" << std::endl;
 			stats.touched_ground = true;
 		}
-		// zero the velocities
-		ball_cand_vel = zeros<vec>(3);
-		ball_cand_pos = ball_pos;
-		ball_cand_pos(Z) = floor_level;
 	}
-
 }
 
-void TableTennis::check_legal_bounce(const vec3 & ball_cand_pos, const vec3 & ball_cand_vel) {
+void TableTennis::check_legal_bounce(const ball_pod & ball_cand) {
 
-	static const double net_y = dist_to_table - table_length/2.0;
 	if (VERBOSE) {
-		if (ball_cand_pos(Y) < net_y)
+		if (ball_cand.pos[Y] < net_y)
 			std::cout << "Bounces on opponents court!" << std::endl;
 		else
 			std::cout << "Bounces on robot court!" << std::endl;
 	}
-	if (ball_cand_vel(Y) > 0) { // incoming ball
-		if (ball_cand_pos(Y) > net_y && !stats.has_bounced) {
+	if (ball_cand.vel[Y] > 0) { // incoming ball
+		if (ball_cand.pos[Y] > net_y && !stats.has_bounced) {
 			stats.legal_bounce = true;
 			stats.has_bounced = true;
 		}
@@ -459,23 +312,22 @@ void TableTennis::check_legal_bounce(const vec3 & ball_cand_pos, const vec3 & ba
 	}
 }
 
-void TableTennis::check_legal_land(const vec3 & ball_cand_pos, const vec3 & ball_cand_vel) {
+void TableTennis::check_legal_land(const ball_pod & ball_cand) {
 
-	static const double net_y = dist_to_table - table_length/2.0;
-	if (ball_cand_vel(Y) < 0 && stats.hit && !stats.has_landed) { // outgoing ball
+	if (ball_cand.vel[Y] < 0 && stats.hit && !stats.has_landed) { // outgoing ball
 		// checking for legal landing
-		if (ball_cand_pos(Y) < net_y) { // on the human side
+		if (ball_cand.pos[Y] < net_y) { // on the human side
 			stats.legal_land = true;
 			if (VERBOSE) {
 				std::cout << "Legal land! ";
-				std::cout << "Landing pos: " << ball_cand_pos.t() << std::endl;
+				std::cout << "Landing pos: " << vec3(ball_cand.pos).t() << std::endl;
 			}
 		}
 		else {
 			stats.legal_land = false;
 			if (VERBOSE) {
 				std::cout << "Illegal land! ";
-				std::cout << "Landing pos: " << ball_cand_pos.t() << std::endl;
+				std::cout << "Landing pos: " << vec3(ball_cand.pos).t() << std::endl;
 			}
 		}
 		stats.has_landed = true;
@@ -511,7 +363,7 @@ void TableTennis::calc_des_ball_out_vel(const vec2 & ball_land_des,
 						                const mat & balls_predicted,
 						                mat & balls_out_vel) const {
 
-	static double z_table = floor_level - table_height + ball_radius;
+	const double z_table = floor_level - table_height + ball_radius;
 
 	// elementwise division
 	balls_out_vel.row(X) = (ball_land_des(X) - balls_predicted.row(X)) / time_land_des;
@@ -542,40 +394,86 @@ void TableTennis::calc_des_racket_vel(const mat & vel_ball_in,
 
 vec calc_next_ball(const vec & xnow, const double dt, const void *fp) {
 
-	TableTennis tennis = TableTennis(xnow,false,false);
-	tennis.integrate_ball_state(dt);
-	return tennis.get_ball_state();
+	static const ball_params params;
+	ball_pod ball;
+	ball_from_array(xnow.memptr(),ball);
+	ball_step(params,nullptr,dt,ball);
+	vec next(2*NCART);
+	ball_to_array(ball,next.memptr());
+	return next;
 }
 
 vec calc_spin_ball(const vec & xnow, const double dt, const void *fp) {
 
-	TableTennis tennis = TableTennis(xnow,true,false);
+	static const ball_params params;
+	double spin[NCART];
 	if (fp != nullptr) {
-		double *topspin = (double*)fp;
-		tennis.set_topspin(*topspin);
+		topspin_to_spin(*(const double*)fp,spin);
+	}
+	else {
+		topspin_to_spin(params.init_topspin,spin);
 	}
-	//tennis.set_ball_state(xnow);
-	tennis.integrate_ball_state(dt);
-	return tennis.get_ball_state();
+	ball_pod ball;
+	ball_from_array(xnow.memptr(),ball);
+	ball_step(params,spin,dt,ball);
+	vec next(2*NCART);
+	ball_to_array(ball,next.memptr());
+	return next;
+}
+
+mat calc_next_ball_jacobian(const vec & xnow, const double dt, const void *fp) {
+
+	static const ball_params params;
+	ball_pod ball;
+	ball_from_array(xnow.memptr(),ball);
+	mat jac(2*NCART,2*NCART);
+	ball_step_jacobian(params,nullptr,dt,ball,jac.memptr());
+	return jac;
+}
+
+mat calc_spin_ball_jacobian(const vec & xnow, const double dt, const void *fp) {
+
+	static const ball_params params;
+	double spin[NCART];
+	if (fp != nullptr) {
+		topspin_to_spin(*(const double*)fp,spin);
+	}
+	else {
+		topspin_to_spin(params.init_topspin,spin);
+	}
+	ball_pod ball;
+	ball_from_array(xnow.memptr(),ball);
+	mat jac(2*NCART,2*NCART);
+	ball_step_jacobian(params,spin,dt,ball,jac.memptr());
+	return jac;
 }
 
 vec calc_next_ball(const racket & robot, const vec & xnow, double dt) {
 
-	TableTennis tennis = TableTennis(xnow,false,false);
-	//tennis.set_ball_state(xnow);
-	tennis.integrate_ball_state(robot,dt);
-	return tennis.get_ball_state();
+	static const ball_params params;
+	ball_pod ball, ball_cand;
+	ball_from_array(xnow.memptr(),ball);
+	ball_symplectic_euler(params,nullptr,dt,ball,ball_cand);
+	if (ball_hits_table(ball_cand.pos,ball_cand.vel))
+		ball_table_rebound(params,nullptr,ball_cand.vel);
+	ball_net_contact(ball.pos[Y],ball_cand);
+	ball_racket_contact(params,robot.pos.memptr(),robot.vel.memptr(),
+			            robot.normal.memptr(),ball_cand);
+	ball_ground_contact(ball,ball_cand);
+	vec next(2*NCART);
+	ball_to_array(ball_cand,next.memptr());
+	return next;
 }
 
 void predict_till_net(vec6 & ball_est) {
 
-	const double net_y = dist_to_table - (table_length/2.0);
-	TableTennis tennis = TableTennis(ball_est,false,false);
-	while (ball_est(Y) < net_y) {
-		tennis.integrate_ball_state(DT);
-		ball_est = tennis.get_ball_state();
-		//cout << ball_est << endl;
+	static const ball_params params;
+	ball_pod ball;
+	ball_from_array(ball_est.memptr(),ball);
+	while (ball.pos[Y] < net_y) {
+		ball_step(params,nullptr,DT,ball);
 	}
+	ball_to_array(ball,ball_est.memptr());
 }
 
 }
@@ -595,12 +493,3 @@ void predict_till_net(vec6 & ball_est) {
     return R;
 }*/
 
-static void racket_contact_model(const vec3 & racket_vel,
-                                 const vec3 & racket_normal,
-                                 const double & racket_param,
-                                 vec3 & ball_vel) {
-
-    double speed = (1 + racket_param) * dot(racket_normal, racket_vel - ball_vel);
-    ball_vel += speed * racket_normal;
-}
-
@@ -0,0 +1,82 @@
+/**
+ * @file thread_pool.cpp
+ *
+ * @brief Fixed-size pool of worker threads for data-parallel loops.
+ */
+
+#include <algorithm>
+#include "thread_pool.h"
+
+namespace player {
+
+ThreadPool::ThreadPool(const int num_threads_) : num_threads(num_threads_) {
+
+	if (num_threads <= 0) {
+		num_threads = std::max((int)std::thread::hardware_concurrency(),1);
+	}
+	for (int i = 1; i < num_threads; i++) {
+		workers.push_back(std::thread(&ThreadPool::work,this,i));
+	}
+}
+
+ThreadPool::~ThreadPool() {
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv_start.notify_all();
+	for (unsigned i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+void ThreadPool::work(const int idx) {
+
+	long last_generation = 0;
+	while (true) {
+		const std::function<void(int)> *fun;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv_start.wait(lock, [&]{ return stop || generation != last_generation; });
+			if (stop)
+				return;
+			last_generation = generation;
+			fun = task;
+		}
+		(*fun)(idx);
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			num_pending--;
+		}
+		cv_done.notify_one();
+	}
+}
+
+void ThreadPool::run(const std::function<void(int)> & fun) {
+
+	std::lock_guard<std::mutex> run_lock(run_mtx);
+	if (num_threads > 1) {
+		std::lock_guard<std::mutex> lock(mtx);
+		task = &fun;
+		num_pending = num_threads - 1;
+		generation++;
+	}
+	cv_start.notify_all();
+	fun(0);
+	if (num_threads > 1) {
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_done.wait(lock, [&]{ return num_pending == 0; });
+	}
+}
+
+void ThreadPool::parallel_for(const int n, const std::function<void(int,int,int)> & fun) {
+
+	run([&](int idx) {
+		const int begin = (int)((long)n * idx / num_threads);
+		const int end = (int)((long)n * (idx + 1) / num_threads);
+		fun(idx,begin,end);
+	});
+}
+
+}
@@ -0,0 +1,149 @@
+/**
+ * @file ukf.cpp
+ *
+ * @brief Unscented Kalman Filter for the table tennis ball.
+ *
+ * Sigma points are propagated with the batched ball simulator, so that
+ * a prediction costs one (vectorized) integration of 13 balls instead of
+ * 13 separate calls to the ball model.
+ */
+
+#include <armadillo>
+#include "ukf.h"
+
+using namespace arma;
+
+namespace player {
+
+UKF::UKF(const bool spin,
+         mat & Cin,
+         mat & Qin,
+         mat & Rin,
+         double rej_mult,
+         double alpha_,
+         double beta_,
+         double kappa_) : EKF(spin ? calc_spin_ball : calc_next_ball,Cin,Qin,Rin,rej_mult),
+                          SPIN_MODE(spin), alpha(alpha_), beta(beta_), kappa(kappa_),
+                          sigma_balls(NUM_SIGMA,spin) {
+
+	if (Cin.n_cols != DIMX) {
+		throw std::runtime_error("UKF state must be the ball position and velocity!");
+	}
+	lambda = alpha * alpha * (DIMX + kappa) - DIMX;
+	if (DIMX + lambda <= 0.0) {
+		throw std::runtime_error("UKF scaling parameters must give positive spread!");
+	}
+	wm = 1.0 / (2.0 * (DIMX + lambda)) * ones<vec>(NUM_SIGMA);
+	wm(0) = lambda / (DIMX + lambda);
+	wc = wm;
+	wc(0) += 1.0 - alpha * alpha + beta;
+
+	ball_params params;
+	topspin = params.init_topspin;
+	EKF::set_fun_params((void*)&topspin);
+}
+
+UKF::UKF(const UKF & other) : EKF(other), SPIN_MODE(other.SPIN_MODE),
+                              alpha(other.alpha), beta(other.beta),
+                              kappa(other.kappa), lambda(other.lambda),
+                              wm(other.wm), wc(other.wc), topspin(other.topspin),
+                              sigma_balls(other.sigma_balls) {
+	EKF::set_fun_params((void*)&topspin);
+}
+
+UKF & UKF::operator=(const UKF & other) {
+
+	EKF::operator=(other);
+	SPIN_MODE = other.SPIN_MODE;
+	alpha = other.alpha;
+	beta = other.beta;
+	kappa = other.kappa;
+	lambda = other.lambda;
+	wm = other.wm;
+	wc = other.wc;
+	topspin = other.topspin;
+	sigma_balls = other.sigma_balls;
+	EKF::set_fun_params((void*)&topspin);
+	return *this;
+}
+
+void UKF::set_topspin(const double val) {
+
+	if (SPIN_MODE) {
+		topspin = val;
+		sigma_balls.set_topspin(val);
+	}
+}
+
+void UKF::set_fun_params(void *params) {
+
+	if (params != nullptr)
+		set_topspin(*(const double*)params);
+	EKF::set_fun_params((void*)&topspin);
+}
+
+mat UKF::calc_sigma_points() const {
+
+	// L * L' = P
+	mat L;
+	if (SQRT_MODE) {
+		L = S.t();
+	}
+	else if (!chol(L,P,"lower")) {
+		vec eigval;
+		mat eigvec;
+		eig_sym(eigval,eigvec,P);
+		L = eigvec * diagmat(sqrt(clamp(eigval,0.0,datum::inf)));
+	}
+	L *= sqrt(DIMX + lambda);
+
+	mat X(DIMX,NUM_SIGMA);
+	X.col(0) = x;
+	X.cols(1,DIMX) = L.each_col() + x;
+	X.cols(DIMX+1,2*DIMX) = (-L).each_col() + x;
+	return X;
+}
+
+void UKF::predict(const double dt, const bool lin_flag) {
+
+	if (!lin_flag) {
+		EKF::predict(dt,false);
+		return;
+	}
+	if (!x.is_finite()) {
+		throw std::runtime_error("UKF not initialized! Please set prior!");
+	}
+
+	sigma_balls.set_ball_states(calc_sigma_points());
+	sigma_balls.integrate_ball_states(dt);
+	mat Y = sigma_balls.get_ball_states();
+
+	x = Y * wm;
+	mat dY = Y.each_col() - x;
+	if (SQRT_MODE && wc(0) >= 0.0) {
+		// triangularize the weighted deviations together with the process noise factor
+		mat Qr, Sr;
+		qr_econ(Qr, Sr, join_vert((dY * diagmat(sqrt(wc))).t(), Qsqrt));
+		S = Sr;
+		P = S.t() * S;
+	}
+	else {
+		P = dY * diagmat(wc) * dY.t() + Q;
+		if (SQRT_MODE) {
+			set_prior(x,P);
+		}
+	}
+}
+
+UKF init_ukf(const double var_model,
+             const double var_noise,
+             const bool spin,
+             const double out_reject_mult) {
+
+    mat C = eye<mat>(3,6);
+    mat Q = var_model * eye<mat>(6,6);
+    mat R = var_noise * eye<mat>(3,3);
+    return UKF(spin,C,Q,R,out_reject_mult);
+}
+
+}
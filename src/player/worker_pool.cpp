@@ -0,0 +1,141 @@
+/**
+ * @file worker_pool.cpp
+ *
+ * @brief Long-lived worker threads for background jobs (optimization, ball state estimation).
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "worker_pool.h"
+
+namespace player {
+
+/*
+ * Pin the thread to the given core
+ */
+static void pin_thread(std::thread & t, const int cpu);
+
+WorkerPool::WorkerPool(const int num_workers, const std::vector<int> & cpus) {
+
+	if (num_workers < 1) {
+		throw std::runtime_error("Worker pool needs at least one worker!");
+	}
+	for (int i = 0; i < num_workers; i++) {
+		workers.push_back(std::thread(&WorkerPool::work,this));
+	}
+	try {
+		for (int i = 0; i < num_workers && !cpus.empty(); i++) {
+			pin_thread(workers[i],cpus[i % cpus.size()]);
+		}
+	}
+	catch (const std::runtime_error &) {
+		shutdown(); // join the workers before rethrowing
+		throw;
+	}
+}
+
+WorkerPool::~WorkerPool() {
+
+	shutdown();
+}
+
+void WorkerPool::shutdown() {
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+		for (unsigned i = 0; i < queue.size(); i++) {
+			queue[i].task(true); // future of the dropped job reads FALSE
+		}
+		queue.clear();
+	}
+	cv_job.notify_all();
+	for (unsigned i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	workers.clear();
+}
+
+bool WorkerPool::later(const job & a, const job & b) {
+
+	if (a.priority != b.priority)
+		return a.priority < b.priority;
+	return a.seq > b.seq;
+}
+
+std::shared_future<bool> WorkerPool::submit(const std::function<void()> & fun,
+                                            const int priority,
+                                            const double timeout) {
+
+	job j;
+	j.priority = priority;
+	j.deadline = clock::time_point::max();
+	if (timeout > 0.0) {
+		j.deadline = clock::now() +
+				std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(timeout));
+	}
+	j.task = std::packaged_task<bool(bool)>([fun](bool dropped) -> bool {
+		if (dropped)
+			return false;
+		fun();
+		return true;
+	});
+	std::shared_future<bool> result = j.task.get_future().share();
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		j.seq = num_submitted++;
+		queue.push_back(std::move(j));
+		std::push_heap(queue.begin(),queue.end(),later);
+	}
+	cv_job.notify_one();
+	return result;
+}
+
+void WorkerPool::wait_idle() {
+
+	std::unique_lock<std::mutex> lock(mtx);
+	cv_idle.wait(lock, [&]{ return queue.empty() && num_busy == 0; });
+}
+
+void WorkerPool::work() {
+
+	while (true) {
+		job j;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv_job.wait(lock, [&]{ return stop || !queue.empty(); });
+			if (stop)
+				return;
+			std::pop_heap(queue.begin(),queue.end(),later);
+			j = std::move(queue.back());
+			queue.pop_back();
+			num_busy++;
+		}
+		j.task(clock::now() > j.deadline);
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			num_busy--;
+		}
+		cv_idle.notify_all();
+	}
+}
+
+static void pin_thread(std::thread & t, const int cpu) {
+
+#ifdef __linux__
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu,&cpuset);
+	if (pthread_setaffinity_np(t.native_handle(),sizeof(cpu_set_t),&cpuset) != 0) {
+		throw std::runtime_error("Could not pin worker thread to the given core!");
+	}
+#else
+	throw std::runtime_error("Pinning worker threads is only supported on Linux!");
+#endif
+}
+
+}
@@ -15,7 +15,11 @@
 #include <armadillo>
 #include <cmath>
 #include <sys/time.h>
+#include <chrono>
 #include "kalman.h"
+#include "ukf.h"
+#include "particle_filter.h"
+#include "imm.h"
 #include "player.hpp"
 #include "tabletennis.h"
 
@@ -64,6 +68,7 @@ struct blob_state {
 };
 
 player_flags flags; //!< global structure for setting Player options
+static ObsQueue obs_queue; // time-stamped observations from the vision thread to play()
 
 /*
  *
@@ -101,6 +106,21 @@ static void save_ball_data(const blob_state blobs[NBLOBS],
                            const KF & filter,
                            std::ofstream & stream);
 
+/*
+ * Builds the ball filters again with the noise and outlier rejection flags
+ * and returns the filter selected by the flags (for the player).
+ * The particle filter is allocated only if selected.
+ */
+static EKF* init_ball_filters(EKF & filter,
+                              UKF & ukf,
+                              IMM & imm,
+                              ParticleFilter *& pf);
+
+/*
+ * Seconds on the monotonic clock shared by push_blobs() and play()
+ */
+static double get_clock_time();
+
 /*
  *  Set algorithm to initialize Player with.
  *  alg_num selects between three algorithms: VHP/FOCUSED/DEFENSIVE.
@@ -162,6 +182,34 @@ void load_options() {
 				 "corrections (MPC)")
 			("spin", po::value<bool>(&flags.spin)->default_value(false),
 						 "apply spin model")
+			("dense_pred", po::value<bool>(&flags.dense_pred)->default_value(false),
+						 "adaptive-step dense ball prediction")
+			("sqrt_filter", po::value<bool>(&flags.sqrt_filter)->default_value(false),
+						 "square-root form of the ball filter")
+			("ukf", po::value<bool>(&flags.ukf)->default_value(false),
+						 "unscented ball filter")
+			("particle_filter", po::value<bool>(&flags.particle_filter)->default_value(false),
+						 "particle filter estimating ball state and topspin")
+			("num_particles", po::value<int>(&flags.num_particles), "number of particles")
+			("imm", po::value<bool>(&flags.imm)->default_value(false),
+						 "mix spin and spin-free filters (IMM)")
+			("obs_queue", po::value<bool>(&flags.obs_queue)->default_value(false),
+						 "ball observations pushed by vision thread")
+			("stream_prior", po::value<bool>(&flags.stream_prior)->default_value(false),
+						 "start filter from streaming fit of first observations")
+			("multi_ball", po::value<bool>(&flags.multi_ball)->default_value(false),
+						 "track several balls and play the closest incoming one")
+			("max_tracks", po::value<int>(&flags.max_tracks), "max. number of balls tracked")
+			("num_workers", po::value<int>(&flags.num_workers), "number of optim worker threads")
+			("worker_cpus", po::value<std::vector<int>>(&flags.worker_cpus)->multitoken(),
+						 "cores the worker threads are pinned to")
+			("prior_cpu", po::value<int>(&flags.prior_cpu), "core the ball state estimation worker is pinned to")
+			("num_starts", po::value<int>(&flags.num_starts), "number of initial guesses raced by the optim")
+			("start_threads", po::value<int>(&flags.start_threads), "number of threads racing the initial guesses")
+			("start_deadline", po::value<double>(&flags.start_deadline), "max. time of the race of initial guesses")
+			("anytime", po::value<bool>(&flags.anytime)->default_value(false),
+						 "optim within time-to-hit and publish best feasible iterates")
+			("act_margin", po::value<double>(&flags.act_margin), "time left for actuation before hit (anytime optim)")
 			("verbose", po::value<int>(&flags.verbosity)->default_value(1),
 		         "verbosity level")
 		    ("save_data", po::value<bool>(&flags.save)->default_value(false),
@@ -181,7 +229,12 @@ void load_options() {
 		    ("var_noise", po::value<double>(&flags.var_noise), "std of filter obs noise")
 		    ("var_model", po::value<double>(&flags.var_model), "std of filter process noise")
 		    ("t_reset_threshold", po::value<double>(&flags.t_reset_thresh), "filter reset threshold time")
-		    ("VHPY", po::value<double>(&flags.VHPY), "location of VHP");
+		    ("vision_latency", po::value<double>(&flags.vision_latency), "latency of pushed ball observations")
+		    ("VHPY", po::value<double>(&flags.VHPY), "location of VHP")
+		    ("pred_cache_tol", po::value<double>(&flags.pred_cache_tol),
+		    		"max. filter correction to shift cached prediction")
+		    ("max_pred_std", po::value<double>(&flags.max_pred_std),
+		    		"max. std of predicted ball on VHP to start optim");
         po::variables_map vm;
         ifstream ifs(config_file.c_str());
         if (!ifs) {
@@ -211,7 +264,12 @@ void play(const SL_Jstate joint_state[NDOF+1],
 	static std::ofstream stream_balls;
 	static std::string home = std::getenv("HOME");
 	static std::string ball_file = home + "/polyoptim/balls.txt";
-	static EKF filter = init_filter(0.3,0.001,flags.spin);
+	static EKF filter = init_filter(flags.var_model,flags.var_noise,flags.spin,
+	                                flags.out_reject_mult,nullptr,flags.sqrt_filter);
+	static UKF ukf = init_ukf(flags.var_model,flags.var_noise,flags.spin,flags.out_reject_mult);
+	static IMM imm = init_imm(flags.var_model,flags.var_noise,flags.out_reject_mult);
+	static ParticleFilter *pf = nullptr;
+	static EKF *ball_filter = &filter; // filter used by the player
 	static int firsttime = true;
 
 	if (firsttime && flags.save) {
@@ -225,9 +283,9 @@ void play(const SL_Jstate joint_state[NDOF+1],
 			qdes.qd(i) = 0.0;
 			qdes.qdd(i) = 0.0;
 		}
-		filter = init_filter(0.3,0.001,flags.spin);
 		delete robot;
-		robot = new Player(q0,filter,flags);
+		ball_filter = init_ball_filters(filter,ukf,imm,pf);
+		robot = new Player(q0,*ball_filter,flags);
 		flags.reset = false;
 	}
 	else {
@@ -236,9 +294,14 @@ void play(const SL_Jstate joint_state[NDOF+1],
 			qact.qd(i) = joint_state[i+1].thd;
 			qact.qdd(i) = joint_state[i+1].thdd;
 		}
-		fuse_blobs(blobs,ball_obs);
-		robot->play(qact,ball_obs,qdes);
-		save_ball_data(blobs,robot,filter,stream_balls);
+		if (flags.obs_queue) {
+			robot->play(qact,obs_queue,get_clock_time(),qdes);
+		}
+		else {
+			fuse_blobs(blobs,ball_obs);
+			robot->play(qact,ball_obs,qdes);
+		}
+		save_ball_data(blobs,robot,*ball_filter,stream_balls);
 	}
 
 	// update desired joint state
@@ -249,6 +312,31 @@ void play(const SL_Jstate joint_state[NDOF+1],
 	}
 }
 
+int push_blobs(const blob_state blobs[NBLOBS]) {
+
+	ball_obs obs;
+	vec3 pos;
+	obs.time = get_clock_time() - flags.vision_latency; // capture time
+	if (!fuse_blobs(blobs,pos))
+		return false;
+	for (int i = X; i <= Z; i++)
+		obs.pos[i] = pos(i);
+	return obs_queue.push(obs);
+}
+
+int push_balls(const int num_balls, const double pos[]) {
+
+	ball_obs obs;
+	int num_pushed = 0;
+	obs.time = get_clock_time() - flags.vision_latency; // capture time
+	for (int j = 0; j < num_balls; j++) {
+		for (int i = X; i <= Z; i++)
+			obs.pos[i] = pos[NCART*j + i];
+		num_pushed += obs_queue.push(obs);
+	}
+	return num_pushed;
+}
+
 void cheat(const SL_Jstate joint_state[NDOF+1],
           const SL_Cstate sim_ball_state,
           SL_DJstate joint_des_state[NDOF+1]) {
@@ -290,6 +378,38 @@ void cheat(const SL_Jstate joint_state[NDOF+1],
     }
 }
 
+static double get_clock_time() {
+
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static EKF* init_ball_filters(EKF & filter,
+                              UKF & ukf,
+                              IMM & imm,
+                              ParticleFilter *& pf) {
+
+	filter = init_filter(flags.var_model,flags.var_noise,flags.spin,
+	                     flags.out_reject_mult,nullptr,flags.sqrt_filter);
+	ukf = init_ukf(flags.var_model,flags.var_noise,flags.spin,flags.out_reject_mult);
+	ukf.set_sqrt_mode(flags.sqrt_filter);
+	imm = init_imm(flags.var_model,flags.var_noise,flags.out_reject_mult);
+	delete pf;
+	pf = nullptr;
+	if (flags.particle_filter) {
+		pf = new ParticleFilter(init_particle_filter(flags.var_model,flags.var_noise,
+		                                             flags.num_particles,0,flags.out_reject_mult));
+		return pf;
+	}
+	else if (flags.imm) {
+		return &imm;
+	}
+	else if (flags.ukf) {
+		return &ukf;
+	}
+	return &filter;
+}
+
 static void save_ball_data(const blob_state blobs[NBLOBS],
                             const Player *robot,
                             const KF & filter,
@@ -16,6 +16,15 @@
 #include "kalman.h"
 #include "player.hpp"
 #include "tabletennis.h"
+#include "ball_model.h"
+#include "kalman_fixed.h"
+#include "ukf.h"
+#include "particle_filter.h"
+#include "imm.h"
+#include "ball_log.h"
+#include "filter_history.h"
+#include "stream_prior.h"
+#include "ball_tracker.h"
 
 using namespace std;
 using namespace arma;
@@ -200,6 +209,600 @@ void check_ekf() {
 	//BOOST_TEST(true);
 }
 
+/*
+ * Compare the closed-form ball jacobians used in EKF::linearize
+ * with central differences, in flight and during a bounce
+ */
+void check_ball_jacobian() {
+
+	BOOST_TEST_MESSAGE("Checking closed-form ball jacobians with finite differences...");
+	const double dt = DT;
+	const double h = 1e-6;
+	double topspin = -50.0;
+	vec6 x_flight = {0.1, -3.0, -0.5, 0.3, 4.0, 1.0};
+	vec6 x_bounce = {0.1, -2.5, contact_table_level + 0.001, 0.3, 4.0, -3.0};
+	vec6 states[2] = {x_flight, x_bounce};
+
+	for (int k = 0; k < 2; k++) {
+		mat66 jac_next = calc_next_ball_jacobian(states[k],dt,nullptr);
+		mat66 jac_spin = calc_spin_ball_jacobian(states[k],dt,&topspin);
+		mat66 diff_next, diff_spin;
+		for (int i = 0; i < 6; i++) {
+			vec6 delta = zeros<vec>(6);
+			delta(i) = h;
+			diff_next.col(i) = (calc_next_ball(states[k] + delta,dt,nullptr) -
+					            calc_next_ball(states[k] - delta,dt,nullptr)) / (2*h);
+			diff_spin.col(i) = (calc_spin_ball(states[k] + delta,dt,&topspin) -
+					            calc_spin_ball(states[k] - delta,dt,&topspin)) / (2*h);
+		}
+		BOOST_TEST(norm(jac_next - diff_next,"inf") < 1e-6);
+		BOOST_TEST(norm(jac_spin - diff_spin,"inf") < 1e-6);
+	}
+}
+
+/*
+ * Checking whether the EKF specialized on the (templated) spin model
+ * filters the same way as the runtime EKF with function pointers
+ */
+void check_model_ekf() {
+
+	BOOST_TEST_MESSAGE("Comparing templated model EKF with runtime EKF...");
+	const double var_model = 0.03;
+	const double var_noise = 0.001;
+	TableTennis tt = TableTennis(true,false);
+	tt.set_ball_gun(0.05);
+	EKF filter = init_filter(var_model,var_noise,true);
+	mat C = eye<mat>(3,6);
+	mat Q = var_model * eye<mat>(6,6);
+	mat R = var_noise * eye<mat>(3,3);
+	SpinBallEKF model_filter = SpinBallEKF(SpinBallModel(),C,Q,R);
+	filter.set_prior(tt.get_ball_state(),eye<mat>(6,6));
+	model_filter.set_prior(tt.get_ball_state(),eye<mat>(6,6));
+
+	for (int i = 0; i < 300; i++) {
+		tt.integrate_ball_state(DT);
+		filter.predict(DT);
+		model_filter.predict(DT);
+		filter.update(tt.get_ball_position());
+		model_filter.update(tt.get_ball_position());
+	}
+	BOOST_TEST(tt.has_legally_bounced());
+	BOOST_TEST(norm(filter.get_mean() - model_filter.get_mean(),"inf") < 1e-10);
+	BOOST_TEST(norm(filter.get_covar() - model_filter.get_covar(),"inf") < 1e-10);
+	BOOST_TEST(norm(filter.predict_path(DT,100) - model_filter.predict_path(DT,100),"inf") < 1e-10);
+}
+
+/*
+ * Micro-benchmark of the fixed-size EKF against the runtime EKF
+ *
+ * Both filters track the same (noisy) ball observations and should give
+ * the same estimates. Time per predict+update is printed in nanoseconds.
+ */
+void bench_fixed_ekf() {
+
+	BOOST_TEST_MESSAGE("Benchmarking fixed-size EKF against runtime EKF...");
+	const double var_model = 0.03;
+	const double var_noise = 0.001;
+	const int N = 500;
+	const int num_trials = 20;
+	arma_rng::set_seed(1);
+	mat C = eye<mat>(3,6);
+	mat Q = var_model * eye<mat>(6,6);
+	mat R = var_noise * eye<mat>(3,3);
+	EKF filter = init_filter(var_model,var_noise,false);
+	DragBallFixedEKF fixed_filter = DragBallFixedEKF(DragBallModel(),C,Q,R);
+
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	vec6 x0 = tt.get_ball_state();
+	mat obs(3,N);
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		obs.col(i) = tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3);
+	}
+
+	wall_clock timer;
+	timer.tic();
+	for (int n = 0; n < num_trials; n++) {
+		filter.set_prior(x0,eye<mat>(6,6));
+		for (int i = 0; i < N; i++) {
+			filter.predict(DT);
+			filter.update(obs.col(i));
+		}
+	}
+	double time_ekf = timer.toc() * 1e9 / (N*num_trials);
+	timer.tic();
+	for (int n = 0; n < num_trials; n++) {
+		fixed_filter.set_prior(x0,eye<mat>(6,6));
+		for (int i = 0; i < N; i++) {
+			fixed_filter.predict(DT);
+			fixed_filter.update(obs.colptr(i));
+		}
+	}
+	double time_fixed = timer.toc() * 1e9 / (N*num_trials);
+	BOOST_TEST_MESSAGE("EKF: " << time_ekf << " ns, fixed-size EKF: " << time_fixed << " ns per predict+update.");
+
+	BOOST_TEST(norm(filter.get_mean() - fixed_filter.get_mean(),"inf") < 1e-8);
+	BOOST_TEST(norm(filter.get_covar() - fixed_filter.get_covar(),"inf") < 1e-8);
+	BOOST_TEST(fixed_filter.check_outlier(obs.col(N-1)) == filter.check_outlier(obs.col(N-1)));
+}
+
+/*
+ * Checking whether the square-root form of the EKF gives the same
+ * estimates as the standard form and keeps the covariance positive definite
+ */
+void check_sqrt_ekf() {
+
+	BOOST_TEST_MESSAGE("Comparing square-root EKF with standard EKF...");
+	const double var_model = 0.03;
+	const double var_noise = 1e-6;
+	const int N = 500;
+	arma_rng::set_seed(2);
+	EKF filter = init_filter(var_model,var_noise,false);
+	EKF sqrt_filter = init_filter(var_model,var_noise,false,2.0,nullptr,true);
+	BOOST_TEST(sqrt_filter.get_sqrt_mode());
+
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	filter.set_prior(tt.get_ball_state(),eye<mat>(6,6));
+	sqrt_filter.set_prior(tt.get_ball_state(),eye<mat>(6,6));
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		vec3 obs = tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3);
+		filter.predict(DT);
+		sqrt_filter.predict(DT);
+		filter.update(obs);
+		sqrt_filter.update(obs);
+	}
+	mat P = sqrt_filter.get_covar();
+	BOOST_TEST(norm(filter.get_mean() - sqrt_filter.get_mean(),"inf") < 1e-6);
+	BOOST_TEST(norm(filter.get_covar() - P,"inf") < 1e-6);
+	BOOST_TEST(norm(P - P.t(),"inf") < 1e-12);
+	BOOST_TEST(eig_sym(P)(0) > 0.0);
+}
+
+/*
+ * Checking whether the UKF (used through an EKF reference) tracks
+ * a bouncing ball as well as the EKF and comparing the prediction times
+ * with the finite-difference EKF
+ */
+void check_ukf() {
+
+	BOOST_TEST_MESSAGE("Comparing UKF with EKF on a bouncing ball...");
+	const double var_model = 0.03;
+	const double var_noise = 0.001;
+	const int N = 500;
+	arma_rng::set_seed(3);
+	mat C = eye<mat>(3,6);
+	mat Q = var_model * eye<mat>(6,6);
+	mat R = var_noise * eye<mat>(3,3);
+	UKF ukf = init_ukf(var_model,var_noise);
+	EKF ekf = init_filter(var_model,var_noise);
+	EKF ekf_fd = EKF(calc_next_ball,C,Q,R); // finite differences
+	EKF & filter = ukf;
+
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	vec6 x0 = tt.get_ball_state();
+	mat obs(3,N);
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		obs.col(i) = tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3);
+	}
+	double time_filter[2];
+	EKF *filters[2] = {&filter, &ekf_fd};
+	wall_clock timer;
+	for (int k = 0; k < 2; k++) {
+		filters[k]->set_prior(x0,eye<mat>(6,6));
+		timer.tic();
+		for (int i = 0; i < N; i++) {
+			filters[k]->predict(DT);
+			filters[k]->update(obs.col(i));
+		}
+		time_filter[k] = timer.toc() * 1e6 / N;
+	}
+	ekf.set_prior(x0,eye<mat>(6,6));
+	for (int i = 0; i < N; i++) {
+		ekf.predict(DT);
+		ekf.update(obs.col(i));
+	}
+	BOOST_TEST_MESSAGE("UKF: " << time_filter[0] << " us, finite-difference EKF: "
+	                   << time_filter[1] << " us per predict+update.");
+
+	double err_ukf = norm(ukf.get_mean() - tt.get_ball_state());
+	double err_ekf = norm(ekf.get_mean() - tt.get_ball_state());
+	BOOST_TEST_MESSAGE("UKF error: " << err_ukf << ", EKF error: " << err_ekf);
+	BOOST_TEST(tt.has_legally_bounced());
+	BOOST_TEST(err_ukf < 0.1);
+}
+
+/*
+ * Tracking a spinning ball with the particle filter (used through an EKF reference)
+ * with 10000 particles on 4 threads. Time per tick is printed in microseconds
+ * (should be below DT = 2 ms).
+ */
+void check_particle_filter() {
+
+	BOOST_TEST_MESSAGE("Tracking spinning ball with particle filter...");
+	const double var_model = 1e-4;
+	const double var_noise = 1e-4;
+	const int N = 300;
+	arma_rng::set_seed(4);
+	ParticleFilter pf = init_particle_filter(var_model,var_noise,10000,4);
+	EKF & filter = pf;
+
+	TableTennis tt = TableTennis(true,false);
+	tt.set_ball_gun(0.05);
+	filter.set_prior(tt.get_ball_state(),0.01 * eye<mat>(6,6));
+	wall_clock timer;
+	timer.tic();
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		filter.predict(DT);
+		filter.update(tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3));
+	}
+	double time_tick = timer.toc() * 1e6 / N;
+	BOOST_TEST_MESSAGE("Particle filter: " << time_tick << " us per predict+update, "
+	                   << pf.get_num_resamples() << " resamples, topspin est: " << pf.get_topspin());
+
+	vec6 ball_state = tt.get_ball_state();
+	BOOST_TEST(tt.has_legally_bounced());
+	BOOST_TEST(norm(filter.get_mean().head(3) - ball_state.head(3)) < 0.05);
+	BOOST_TEST(filter.get_covar().is_finite());
+	BOOST_TEST(filter.predict_path(DT,10).is_finite());
+}
+
+/*
+ * Checking whether the IMM estimator (used through an EKF reference)
+ * picks the spin model for a spinning ball and the spin-free model
+ * for a ball without spin. Both model filters together should take
+ * less time per tick than the runtime EKF.
+ */
+void check_imm() {
+
+	BOOST_TEST_MESSAGE("Checking IMM model probabilities...");
+	const double var_model = 1e-4;
+	const double var_noise = 1e-4;
+	const int N = 300;
+	const int num_reps = 5;
+	arma_rng::set_seed(5);
+	for (int spin = 0; spin < 2; spin++) {
+		IMM imm = init_imm(var_model,var_noise);
+		EKF ekf = init_filter(var_model,var_noise,spin);
+		EKF & filter = imm;
+		TableTennis tt = TableTennis(spin,false);
+		tt.set_ball_gun(0.05);
+		mat obs(3,N);
+		vec6 x0 = tt.get_ball_state();
+		for (int i = 0; i < N; i++) {
+			tt.integrate_ball_state(DT);
+			obs.col(i) = tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3);
+		}
+		wall_clock timer;
+		double time_imm = datum::inf, time_ekf = datum::inf;
+		for (int rep = 0; rep < num_reps; rep++) { // best of several runs against timing noise
+			filter.set_prior(x0,eye<mat>(6,6)); // resets the model probabilities
+			timer.tic();
+			for (int i = 0; i < N; i++) {
+				filter.predict(DT);
+				filter.update(obs.col(i));
+			}
+			time_imm = fmin(time_imm,timer.toc() * 1e6 / N);
+			ekf.set_prior(x0,eye<mat>(6,6));
+			timer.tic();
+			for (int i = 0; i < N; i++) {
+				ekf.predict(DT);
+				ekf.update(obs.col(i));
+			}
+			time_ekf = fmin(time_ekf,timer.toc() * 1e6 / N);
+		}
+		BOOST_TEST_MESSAGE("Spin: " << spin << ", spin model prob: " << imm.get_model_prob(IMM::SPIN)
+		                   << ", IMM: " << time_imm << " us, EKF: " << time_ekf << " us per predict+update.");
+		BOOST_TEST(imm.get_active_model() == (spin ? IMM::SPIN : IMM::DRAG));
+		BOOST_TEST(norm(filter.get_mean() - tt.get_ball_state()) < 0.1);
+		BOOST_TEST(time_imm < time_ekf);
+	}
+}
+
+/*
+ * Smoothing a log of several rallies with the RTS smoother in parallel
+ *
+ * The smoothed ball states should be more accurate than the filtered ones.
+ * Speed is printed as a multiple of real time.
+ */
+void check_rts_smoother() {
+
+	BOOST_TEST_MESSAGE("Smoothing ball rallies with RTS smoother...");
+	const double var_model = 0.001;
+	const double var_noise = 1e-4;
+	const int num_rallies = 16;
+	const int N = 400;
+	arma_rng::set_seed(6);
+	mat obs_log, balls;
+	for (int n = 0; n < num_rallies; n++) {
+		TableTennis tt = TableTennis(false,false);
+		tt.set_ball_gun(0.05);
+		mat obs(3,N), ball_states(6,N);
+		for (int i = 0; i < N; i++) {
+			tt.integrate_ball_state(DT);
+			ball_states.col(i) = tt.get_ball_state();
+			obs.col(i) = tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3);
+		}
+		obs_log = join_horiz(obs_log,obs);
+		balls = join_horiz(balls,ball_states);
+	}
+	std::vector<mat> rallies = segment_rallies(obs_log);
+	BOOST_TEST((int)rallies.size() == num_rallies);
+
+	EKF filter = init_filter(var_model,var_noise);
+	wall_clock timer;
+	timer.tic();
+	std::vector<mat> smoothed = smooth_rallies(rallies,filter,DT);
+	double time_smooth = timer.toc();
+	BOOST_TEST_MESSAGE("Smoothed " << num_rallies * N * DT << " s of data "
+	                   << num_rallies * N * DT / time_smooth << " times faster than real time.");
+
+	// compare with the filtered estimates on the first rally
+	mat Xf(6,N);
+	filter.set_prior(join_vert(rallies[0].col(0),(rallies[0].col(1) - rallies[0].col(0))/DT),eye<mat>(6,6));
+	for (int i = 0; i < N; i++) {
+		if (i > 0)
+			filter.predict(DT);
+		filter.update(rallies[0].col(i));
+		Xf.col(i) = filter.get_mean();
+	}
+	mat true_balls = balls.cols(0,N-1);
+	double err_filter = norm(Xf.rows(0,2) - true_balls.rows(0,2),"fro");
+	double err_smooth = norm(smoothed[0].rows(0,2) - true_balls.rows(0,2),"fro");
+	BOOST_TEST_MESSAGE("Filter pos. error: " << err_filter << ", smoother pos. error: " << err_smooth);
+	BOOST_TEST(err_smooth < err_filter);
+}
+
+/*
+ * Estimate the initial ball state (and topspin) from noiseless observations
+ * of the spin model. Filter should be initialized at the true state.
+ */
+void check_estimate_prior() {
+
+	BOOST_TEST_MESSAGE("Estimating initial ball state with Levenberg-Marquardt...");
+	const int N = 12;
+	const double topspin = -30.0;
+	TableTennis tt = TableTennis(true,false);
+	tt.set_topspin(topspin);
+	tt.set_ball_gun(0.05);
+	mat obs(3,N);
+	vec times(N);
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		obs.col(i) = tt.get_ball_position();
+		times(i) = i * DT;
+	}
+	EKF filter = init_filter(0.001,0.001,true);
+	bool init_ball = false;
+	double topspin_est = 0.0;
+	wall_clock timer;
+	timer.tic();
+	optim::estimate_prior(obs,times,0,init_ball,filter,topspin_est);
+	BOOST_TEST_MESSAGE("Estimation took " << timer.toc() * 1000 << " ms.");
+	BOOST_TEST(init_ball);
+	BOOST_TEST(norm(filter.get_mean() - tt.get_ball_state()) < 0.01);
+
+	// filter keeps predicting with the estimated topspin (owned by the caller)
+	tt.integrate_ball_state(DT);
+	filter.predict(DT,true);
+	BOOST_TEST(norm(filter.get_mean() - tt.get_ball_state()) < 0.01);
+}
+
+/*
+ * Start the filter from the streaming fit of the first 4 observations
+ * and check that it converges as well as the filter started from the
+ * (batch) estimate of 12 observations.
+ */
+void check_stream_prior() {
+
+	BOOST_TEST_MESSAGE("Starting filter with the streaming prior...");
+	const int N = 100;
+	const int MIN_OBS_STREAM = 4;
+	const int MIN_OBS_BATCH = 12;
+	const double var_noise = 1e-4;
+	arma_rng::set_seed(8);
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	mat obs(3,N), balls(6,N);
+	vec times(N);
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		balls.col(i) = tt.get_ball_state();
+		obs.col(i) = tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3);
+		times(i) = i * DT;
+	}
+
+	StreamPrior stream(var_noise);
+	vec6 x;
+	mat66 P;
+	BOOST_TEST(!stream.get_state(0.0,x,P));
+	for (int i = 0; i < MIN_OBS_STREAM; i++)
+		stream.add(times(i),obs.col(i));
+	BOOST_TEST(stream.get_state(times(MIN_OBS_STREAM-1),x,P));
+	BOOST_TEST(P.is_symmetric());
+	BOOST_TEST(eig_sym(P).min() > 0.0);
+
+	EKF filter_stream = init_filter(0.001,var_noise);
+	filter_stream.set_prior(x,P);
+	EKF filter_batch = init_filter(0.001,var_noise);
+	bool init_ball = false;
+	double topspin = 0.0;
+	optim::estimate_prior(obs.cols(0,MIN_OBS_BATCH-1),times.head(MIN_OBS_BATCH),0,init_ball,filter_batch,topspin);
+	for (int i = MIN_OBS_STREAM; i < N; i++) {
+		filter_stream.predict(DT,true);
+		filter_stream.update(obs.col(i));
+		if (i >= MIN_OBS_BATCH) {
+			filter_batch.predict(DT,true);
+			filter_batch.update(obs.col(i));
+		}
+	}
+	const double err_stream = norm(filter_stream.get_mean() - balls.col(N-1));
+	const double err_batch = norm(filter_batch.get_mean() - balls.col(N-1));
+	BOOST_TEST_MESSAGE("Final error, streaming prior: " << err_stream << ", batch prior: " << err_batch);
+	BOOST_TEST(err_stream < 2 * err_batch + 0.05);
+}
+
+/*
+ * Delay one of the observations and apply it at its capture time with the
+ * filter history. The estimates should be the same as filtering in order.
+ */
+void check_filter_history() {
+
+	BOOST_TEST_MESSAGE("Applying delayed observations with the filter history...");
+	const double var_noise = 1e-4;
+	const int N = 40;
+	const int DELAYED = 30; // observation index
+	const int ARRIVAL = 35; // delayed observation arrives after this observation
+	arma_rng::set_seed(7);
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	vec times(N);
+	mat obs(3,N);
+	double t = 0.0;
+	for (int i = 0; i < N; i++) {
+		const int ticks = 2 + i % 3; // irregular vision rate
+		for (int j = 0; j < ticks; j++)
+			tt.integrate_ball_state(DT);
+		t += ticks * DT;
+		times(i) = t;
+		obs.col(i) = tt.get_ball_position() + sqrt(var_noise) * randn<vec>(3);
+	}
+
+	EKF filter_in_order = init_filter(0.001,var_noise);
+	EKF filter = init_filter(0.001,var_noise);
+	vec6 x0 = join_vert(obs.col(0),(obs.col(1) - obs.col(0))/(times(1) - times(0)));
+	filter_in_order.set_prior(x0,eye<mat>(6,6));
+	filter.set_prior(x0,eye<mat>(6,6));
+	FilterHistory history;
+	mat X_in_order(6,N), X(6,N);
+	double t_filter = times(0);
+	for (int i = 0; i < N; i++) {
+		if (i > 0)
+			filter_in_order.predict(times(i) - times(i-1),true);
+		filter_in_order.update(obs.col(i));
+		X_in_order.col(i) = filter_in_order.get_mean();
+		if (i != DELAYED) {
+			if (times(i) > t_filter)
+				filter.predict(times(i) - t_filter,true);
+			filter.update(obs.col(i));
+			history.push(times(i),obs.col(i),filter);
+			t_filter = times(i);
+		}
+		if (i == ARRIVAL) {
+			BOOST_TEST(history.apply_delayed(times(DELAYED),obs.col(DELAYED),t_filter,filter));
+			BOOST_TEST(!history.apply_delayed(times(DELAYED),obs.col(DELAYED),t_filter,filter)); // applied already
+		}
+		X.col(i) = filter.get_mean();
+	}
+	BOOST_TEST(history.size() == FilterHistory::SIZE);
+	BOOST_TEST(!history.apply_delayed(times(0),obs.col(0),t_filter,filter)); // older than the history
+	BOOST_TEST(norm(X.cols(ARRIVAL,N-1) - X_in_order.cols(ARRIVAL,N-1),"inf") < 1e-8);
+	BOOST_TEST(norm(X.col(DELAYED) - X_in_order.col(DELAYED)) > 1e-8); // not yet applied
+}
+
+/*
+ * Uncertainty tube of the predicted path should match the covariances
+ * of the filter predicted step by step, and leave the filter unchanged.
+ */
+void check_path_covariance() {
+
+	BOOST_TEST_MESSAGE("Propagating covariances along the predicted ball path...");
+	const int N = 500;
+	const int DECIM = 10;
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	EKF filter = init_filter(0.001,0.001);
+	mat66 P0 = 0.01 * eye<mat>(6,6);
+	filter.set_prior(tt.get_ball_state(),P0);
+
+	mat pos_cov;
+	wall_clock timer;
+	timer.tic();
+	mat balls = filter.predict_path(DT,N,pos_cov,DECIM);
+	BOOST_TEST_MESSAGE("Predicting path with covariances took " << timer.toc() * 1000 << " ms.");
+	BOOST_TEST((int)pos_cov.n_cols == N/DECIM);
+	BOOST_TEST(norm(balls - filter.predict_path(DT,N),"inf") < 1e-10);
+	BOOST_TEST(norm(filter.get_mean() - tt.get_ball_state()) < 1e-10);
+	BOOST_TEST(norm(filter.get_covar() - P0,"inf") < 1e-10);
+
+	EKF filter_step = filter;
+	double max_err = 0.0;
+	for (int i = 0; i < N; i++) {
+		filter_step.predict(DT,true);
+		if ((i+1) % DECIM == 0) {
+			mat P = filter_step.get_covar();
+			vec packed = {P(X,X), P(Y,Y), P(Z,Z), P(X,Y), P(X,Z), P(Y,Z)};
+			max_err = std::max(max_err,norm(packed - pos_cov.col((i+1)/DECIM - 1),"inf"));
+		}
+	}
+	BOOST_TEST(max_err < 1e-8);
+	BOOST_TEST(pos_cov(2,N/DECIM-1) > pos_cov(2,0)); // uncertainty grows
+}
+
+/*
+ * Two balls of a ball-gun burst are observed in the same frames (in
+ * alternating order). Tracker should keep one track for each ball
+ * with stable ids and estimate both ball states.
+ */
+void check_ball_tracker() {
+
+	BOOST_TEST_MESSAGE("Tracking two balls of a ball-gun burst...");
+	const double var_noise = 1e-4;
+	const int N = 300;
+	const int LAUNCH = 100; // second ball is launched after this many ticks
+	arma_rng::set_seed(3);
+	TableTennis tt1 = TableTennis(false,false);
+	TableTennis tt2 = TableTennis(false,false);
+	tt1.set_ball_gun(0.05);
+	tt2.set_ball_gun(0.05);
+	BallTracker tracker(0.001,var_noise,4,3);
+
+	double max_err = 0.0;
+	int max_tracks = 0;
+	for (int i = 0; i < N; i++) {
+		tt1.integrate_ball_state(DT);
+		if (i >= LAUNCH)
+			tt2.integrate_ball_state(DT);
+		const int num = (i >= LAUNCH) ? 2 : 1;
+		vec3 pos[2] = {tt1.get_ball_position(), tt2.get_ball_position()};
+		ball_obs obs[2];
+		for (int j = 0; j < num; j++) {
+			const int k = (i % 2) ? num - 1 - j : j; // shuffle
+			obs[j].time = (i+1) * DT;
+			for (int n = 0; n < NCART; n++)
+				obs[j].pos[n] = pos[k](n) + sqrt(var_noise) * randn();
+		}
+		tracker.update(obs,num);
+		max_tracks = std::max(max_tracks,tracker.num_tracks());
+
+		if (i >= LAUNCH + 20) { // both tracks confirmed
+			const vec6 x_true[2] = {tt1.get_ball_state(), tt2.get_ball_state()};
+			for (int id = 0; id < 2; id++) {
+				vec6 x;
+				mat66 P;
+				BOOST_TEST(tracker.get_state(tracker.find_track(id),(i+1)*DT,x,P));
+				max_err = std::max(max_err,norm(x.head(3) - x_true[id].head(3)));
+			}
+		}
+	}
+	BOOST_TEST_MESSAGE("Max. position error of the tracks: " << max_err);
+	BOOST_TEST(max_tracks == 2);
+	BOOST_TEST(max_err < 0.05);
+
+	tracker.update(nullptr,0); // no observations
+	ball_obs late;
+	late.time = (N+200) * DT;
+	tracker.update(&late,1); // both balls lost, new track
+	BOOST_TEST(tracker.num_tracks() == 1);
+	BOOST_TEST(tracker.get_track(0).id == 2);
+	BOOST_TEST(!tracker.get_track(0).confirmed);
+}
+
 /*
  * Test predict path function of EKF with table tennis
  *
@@ -15,6 +15,7 @@
 #include "kinematics.h"
 #include "kinematics.hpp"
 #include "player.hpp"
+#include "ball_kernel.h"
 
 using namespace arma;
 using namespace optim;
@@ -135,6 +136,146 @@ void test_kin_deriv() {
 }
 
 
+/*
+ * Compare closed-form derivatives of racket pos, vel and normal
+ * w.r.t. joint positions with numerical differentiation
+ */
+void test_racket_state_deriv() {
+
+	BOOST_TEST_MESSAGE("Comparing closed-form racket state derivatives with numerical diff...");
+	arma_rng::set_seed(2);
+	double q[NDOF] = {1.0, -0.2, -0.1, 1.8, -1.57, 0.1, 0.3};
+	double qdot[NDOF];
+	for (int i = 0; i < NDOF; i++)
+		qdot[i] = randn();
+	double pos[NCART], vel[NCART], normal[NCART];
+	double dpos[NCART][NDOF], dvel[NCART][NDOF], dnormal[NCART][NDOF];
+	calc_racket_state(q,qdot,pos,vel,normal,dpos,dvel,dnormal);
+
+	const double h = 1e-6;
+	double max_diff = 0.0;
+	double pos1[NCART], vel1[NCART], normal1[NCART];
+	double pos2[NCART], vel2[NCART], normal2[NCART];
+	for (int j = 0; j < NDOF; j++) {
+		const double qj = q[j];
+		q[j] = qj + h;
+		calc_racket_state(q,qdot,pos1,vel1,normal1);
+		q[j] = qj - h;
+		calc_racket_state(q,qdot,pos2,vel2,normal2);
+		q[j] = qj;
+		for (int i = 0; i < NCART; i++) {
+			max_diff = fmax(max_diff,fabs((pos1[i] - pos2[i])/(2*h) - dpos[i][j]));
+			max_diff = fmax(max_diff,fabs((vel1[i] - vel2[i])/(2*h) - dvel[i][j]));
+			max_diff = fmax(max_diff,fabs((normal1[i] - normal2[i])/(2*h) - dnormal[i][j]));
+		}
+	}
+	BOOST_TEST(max_diff < 1e-6);
+}
+
+/*
+ * Compare derivatives computed with dual numbers (polynomial coefficients
+ * and ball flight model) with numerical diff. and the closed-form ball jacobian
+ */
+void test_dual_deriv() {
+
+	BOOST_TEST_MESSAGE("Comparing dual number derivatives with numerical diff...");
+	typedef dual<OPTIM_DIM> dvar;
+	double q0[NDOF] = {1.0, -0.2, -0.1, 1.8, -1.57, 0.1, 0.3};
+	double q0dot[NDOF] = {0.1, 0.0, -0.2, 0.3, 0.0, 0.1, 0.0};
+	double x[OPTIM_DIM] = {0.8, -0.1, 0.2, 1.5, -1.2, 0.3, 0.1,
+	                       0.5, -0.3, 0.2, 1.0, 0.4, -0.2, 0.1, 0.6};
+	dvar xd[OPTIM_DIM], a1d[NDOF], a2d[NDOF];
+	for (int i = 0; i < OPTIM_DIM; i++)
+		xd[i] = dvar::variable(x[i],i);
+	calc_strike_poly_coeff(q0,q0dot,xd,a1d,a2d);
+
+	const double h = 1e-6;
+	double max_diff = 0.0;
+	double a1p[NDOF], a2p[NDOF], a1m[NDOF], a2m[NDOF];
+	for (int j = 0; j < OPTIM_DIM; j++) {
+		const double xj = x[j];
+		x[j] = xj + h;
+		calc_strike_poly_coeff(q0,q0dot,x,a1p,a2p);
+		x[j] = xj - h;
+		calc_strike_poly_coeff(q0,q0dot,x,a1m,a2m);
+		x[j] = xj;
+		for (int i = 0; i < NDOF; i++) {
+			max_diff = fmax(max_diff,fabs((a1p[i] - a1m[i])/(2*h) - a1d[i].der[j]));
+			max_diff = fmax(max_diff,fabs((a2p[i] - a2m[i])/(2*h) - a2d[i].der[j]));
+		}
+	}
+	BOOST_TEST(max_diff < 1e-5);
+
+	// ball flight step w.r.t. the ball state
+	typedef dual<2*NCART> bvar;
+	player::ball_params params;
+	double spin[NCART];
+	player::topspin_to_spin(-50.0,spin);
+	const double ball[2*NCART] = {0.1, -3.0, -0.5, 0.3, 4.0, 1.0};
+	player::basic_ball_pod<bvar> ball_dual, cand_dual;
+	for (int i = 0; i < NCART; i++) {
+		ball_dual.pos[i] = bvar::variable(ball[i],i);
+		ball_dual.vel[i] = bvar::variable(ball[i+NCART],i+NCART);
+	}
+	player::ball_symplectic_euler(params,spin,DT,ball_dual,cand_dual);
+	double J[2*NCART][2*NCART];
+	player::ball_symplectic_euler_jacobian(params,spin,DT,ball+NCART,J);
+	max_diff = 0.0;
+	for (int i = 0; i < NCART; i++) {
+		for (int j = 0; j < 2*NCART; j++) {
+			max_diff = fmax(max_diff,fabs(cand_dual.pos[i].der[j] - J[i][j]));
+			max_diff = fmax(max_diff,fabs(cand_dual.vel[i].der[j] - J[i+NCART][j]));
+		}
+	}
+	BOOST_TEST(max_diff < 1e-10);
+
+	// DP cost and landing/hitting constraints (NLOPT callbacks) w.r.t. optim params
+	double lb[OPTIM_DIM], ub[OPTIM_DIM];
+	set_bounds(lb,ub,0.0,1.0);
+	vec6 ball_state = {0.1, -3.0, -0.5, 0.3, 4.0, 1.0};
+	player::EKF filter = player::init_filter();
+	mat66 P; P.eye();
+	filter.set_prior(ball_state,P);
+	mat balls_pred = filter.predict_path(DT,500);
+	optim_des ball_params;
+	ball_params.ball_pos = balls_pred.rows(X,Z);
+	ball_params.ball_vel = balls_pred.rows(DX,DZ);
+	ball_params.Nmax = 500;
+	DefensiveOptim dp = DefensiveOptim(q0,lb,ub,true,false);
+	dp.set_des_params(&ball_params);
+	for (int i = 0; i < NDOF; i++) {
+		dp.q0[i] = q0[i];
+		dp.q0dot[i] = q0dot[i];
+	}
+	x[2*NDOF] = 0.501; // away from the interpolation knots
+	double grad[OPTIM_DIM], grad_constr[16*OPTIM_DIM];
+	double constr[16], constr_plus[16], constr_minus[16];
+	for (int land = 1; land >= 0; land--) {
+		dp.land = land;
+		dp.calc_cost(x,grad);
+		const int m = dp.calc_ineq_constr(x,constr,grad_constr);
+		max_diff = 0.0;
+		for (int j = 0; j < OPTIM_DIM; j++) {
+			const double xj = x[j];
+			x[j] = xj + h;
+			const double cost_plus = dp.calc_cost(x,nullptr);
+			dp.calc_ineq_constr(x,constr_plus,nullptr);
+			x[j] = xj - h;
+			const double cost_minus = dp.calc_cost(x,nullptr);
+			dp.calc_ineq_constr(x,constr_minus,nullptr);
+			x[j] = xj;
+			const double fd = (cost_plus - cost_minus)/(2*h);
+			max_diff = fmax(max_diff,fabs(fd - grad[j])/fmax(1.0,fabs(grad[j])));
+			for (int i = 0; i < m; i++) {
+				const double fd_constr = (constr_plus[i] - constr_minus[i])/(2*h);
+				const double der = grad_constr[i*OPTIM_DIM + j];
+				max_diff = fmax(max_diff,fabs(fd_constr - der)/fmax(1.0,fabs(der)));
+			}
+		}
+		BOOST_TEST(max_diff < 1e-4);
+	}
+}
+
 /**
  * @brief Comparing with MATLAB the racket states calculated given q, qd
  *
@@ -39,6 +39,8 @@ static double calc_landing_res(unsigned n, const double *x, double *grad, void *
 static void optim_spin_outgoing_ball_vel(const des_ball_data & data, const bool verbose, vec3 & est); // spin based optimization
 static void init_right_posture(vec7 & q0);
 static void init_posture(vec7 & q0, int posture, bool verbose);
+static void init_strike_problem(const double Tmax, joint & qact, double *lb, double *ub,
+                                EKF & filter, mat & balls_pred, optim_des & racket_params);
 
 /*
  *
@@ -138,6 +140,237 @@ void test_fp_optim() {
 	BOOST_TEST(update);
 }
 
+/*
+ * Looking up a ball state stored in the table, the first neighbour
+ * should be the stored entry and the neighbours should get farther away
+ */
+void test_knn_lookup() {
+
+	BOOST_TEST_MESSAGE("Testing kNN lookup of the closest entries...");
+	const int num_entries = 50;
+	const int entry = 17;
+	const int k = 5;
+	mat lookup = randn<mat>(num_entries,LOOKUP_COLUMN_SIZE);
+	vec testpoint = lookup(entry,span(X,DZ)).t();
+	mat neighbours;
+	knn_neighbours(lookup,testpoint,k,neighbours);
+
+	vec params = lookup(entry,span(DZ+1,LOOKUP_COLUMN_SIZE-1)).t();
+	BOOST_TEST(approx_equal(neighbours.col(0),params,"absdiff",1e-12));
+	vec dist = zeros<vec>(k);
+	for (int j = 0; j < k; j++) {
+		uvec row = find(lookup.col(DZ+1) == neighbours(0,j)); // random entries are distinct
+		BOOST_TEST(row.n_elem == 1);
+		dist(j) = norm(lookup(row(0),span(X,DZ)).t() - testpoint);
+	}
+	BOOST_TEST(dist.is_sorted());
+}
+
+/*
+ * Testing FP with several initial guesses raced on two threads,
+ * the race should end within the deadline and the starts that were
+ * running when the race was won should stop right away
+ */
+void test_multi_start_optim() {
+
+	BOOST_TEST_MESSAGE("Testing multi-start FP Trajectory Optimizer...");
+	const int num_starts = 4;
+	const int num_threads = 2;
+	const double deadline = 0.5;
+	const double slack = 0.05; // sec.
+	const double stop_slack = 10.0; // ms
+	double lb[2*NDOF+1], ub[2*NDOF+1];
+	double Tmax = 1.0;
+	joint qact;
+	spline_params poly;
+	EKF filter = init_filter();
+	mat balls_pred;
+	optim_des racket_params;
+	init_strike_problem(Tmax,qact,lb,ub,filter,balls_pred,racket_params);
+
+	FocusedOptim opt = FocusedOptim(qact.q.memptr(),lb,ub);
+	opt.set_multi_start(num_starts,num_threads,deadline);
+	opt.set_des_params(&racket_params);
+	opt.update_init_state(qact);
+	for (int run = 0; run < 2; run++) { // racers are reused for the next optim
+		wall_clock timer;
+		timer.tic();
+		opt.run();
+		const double time_race = timer.toc();
+		BOOST_TEST(time_race <= deadline + slack);
+		BOOST_TEST(opt.get_params(qact,poly));
+		BOOST_TEST(poly.time2hit > 0.0);
+		BOOST_TEST(poly.time2hit <= Tmax);
+
+		race_result race = opt.get_race_result();
+		BOOST_TEST(race.winner >= 0);
+		for (int k = 0; k < num_starts; k++) {
+			if (k == race.winner || race.exit_codes[k] == 0)
+				continue; // skipped once the race was won
+			// a start still running at the win is stopped at its next callback
+			BOOST_TEST((race.exit_codes[k] == NLOPT_FORCED_STOP ||
+					race.stop_times[k] <= race.time_won + 1.0));
+			BOOST_TEST(race.stop_times[k] <= race.time_won + stop_slack);
+		}
+	}
+}
+
+/*
+ * Testing detached FP within the predicted time-to-hit: NLOPT should stop
+ * within the budget, feasible iterates should be published while it is still
+ * running and the published costs should not increase
+ */
+void test_anytime_optim() {
+
+	BOOST_TEST_MESSAGE("Testing anytime FP Trajectory Optimizer...");
+	const double act_margin = 0.05;
+	const double slack = 0.02; // sec.
+	double lb[2*NDOF+1], ub[2*NDOF+1];
+	double Tmax = 1.0;
+	joint qact;
+	spline_params poly;
+	EKF filter = init_filter();
+	mat balls_pred;
+	optim_des racket_params;
+	init_strike_problem(Tmax,qact,lb,ub,filter,balls_pred,racket_params);
+
+	FocusedOptim opt = FocusedOptim(qact.q.memptr(),lb,ub);
+	opt.set_anytime(true,act_margin);
+	opt.set_detach(true);
+	opt.set_verbose(false);
+	opt.set_des_params(&racket_params);
+	opt.update_init_state(qact);
+	const double budget = opt.get_anytime_budget();
+	BOOST_TEST(budget > 0.0);
+
+	std::vector<double> costs;
+	bool update_running = false;
+	wall_clock timer;
+	timer.tic();
+	opt.run();
+	while (opt.check_running()) {
+		if (opt.get_params(qact,poly)) {
+			costs.push_back(poly.cost);
+			if (opt.check_running()) // read before the job finished
+				update_running = true;
+		}
+		std::this_thread::yield();
+	}
+	const double time_optim = timer.toc();
+	if (opt.get_params(qact,poly)) // published at termination
+		costs.push_back(poly.cost);
+
+	BOOST_TEST(update_running);
+	BOOST_TEST(time_optim <= budget + slack);
+	BOOST_TEST(!costs.empty());
+	for (unsigned i = 1; i < costs.size(); i++)
+		BOOST_TEST(costs[i] <= costs[i-1]);
+	BOOST_TEST(poly.time2hit > 0.0);
+}
+
+/*
+ * Running FP, DP, VHP and rest posture optimizations concurrently
+ * (build with SANITIZE_THREAD to check for data races).
+ * Solutions should not change when the optimizations run in parallel.
+ */
+void test_concurrent_optim() {
+
+	BOOST_TEST_MESSAGE("Testing FP, DP, VHP and rest posture optim concurrently...");
+	const double VHPY = -0.3;
+	const int num_runs = 5;
+	double lb[2*NDOF+1], ub[2*NDOF+1];
+	double Tmax = 1.0;
+	joint qact;
+	EKF filter = init_filter();
+	mat balls_pred;
+	optim_des fp_params;
+	init_strike_problem(Tmax,qact,lb,ub,filter,balls_pred,fp_params);
+	const int N = balls_pred.n_cols;
+	vec2 ball_land_des = {0.0, dist_to_table - 3*table_length/4};
+	optim_des dp_params;
+	dp_params.ball_pos = balls_pred.rows(X,Z);
+	dp_params.ball_vel = balls_pred.rows(DX,DZ);
+	dp_params.Nmax = N;
+	double time_pred;
+	vec6 ball_pred;
+	game game_state = AWAITING;
+	predict_hitting_point(VHPY,false,ball_pred,time_pred,filter,game_state);
+	optim_des vhp_params;
+	calc_racket_strategy(ball_pred,ball_land_des,0.8,vhp_params);
+
+	FocusedOptim fp = FocusedOptim(qact.q.memptr(),lb,ub);
+	DefensiveOptim dp = DefensiveOptim(qact.q.memptr(),lb,ub,true,true);
+	HittingPlane vhp = HittingPlane(qact.q.memptr(),lb,ub);
+	FocusedOptim rest = FocusedOptim(qact.q.memptr(),lb,ub);
+	fp.set_des_params(&fp_params);
+	dp.set_des_params(&dp_params);
+	vhp.set_des_params(&vhp_params);
+	rest.set_des_params(&dp_params);
+	vhp.fix_hitting_time(time_pred);
+	Optim* opts[] = {&fp, &dp, &vhp, &rest};
+	for (Optim* opt : opts) {
+		opt->set_verbose(false);
+		opt->update_init_state(qact);
+	}
+
+	// reference solutions (one after the other)
+	spline_params fp_ref, dp_ref, vhp_ref;
+	fp.run();
+	bool fp_found = fp.get_params(qact,fp_ref);
+	dp.run();
+	bool dp_found = dp.get_params(qact,dp_ref);
+	vhp.run();
+	bool vhp_found = vhp.get_params(qact,vhp_ref);
+	vec7 q_rest_ref = qact.q;
+	rest.run_qrest_optim(q_rest_ref);
+
+	bool fp_same = true, dp_same = true, vhp_same = true, rest_same = true;
+	std::thread fp_thread([&]() {
+		spline_params poly;
+		for (int i = 0; i < num_runs; i++) {
+			fp.run();
+			if (fp.get_params(qact,poly) != fp_found ||
+					(fp_found && !approx_equal(poly.a,fp_ref.a,"absdiff",1e-8)))
+				fp_same = false;
+		}
+	});
+	std::thread dp_thread([&]() {
+		spline_params poly;
+		for (int i = 0; i < num_runs; i++) {
+			dp.run();
+			if (dp.get_params(qact,poly) != dp_found ||
+					(dp_found && !approx_equal(poly.a,dp_ref.a,"absdiff",1e-8)))
+				dp_same = false;
+		}
+	});
+	std::thread vhp_thread([&]() {
+		spline_params poly;
+		for (int i = 0; i < num_runs; i++) {
+			vhp.run();
+			if (vhp.get_params(qact,poly) != vhp_found ||
+					(vhp_found && !approx_equal(poly.a,vhp_ref.a,"absdiff",1e-8)))
+				vhp_same = false;
+		}
+	});
+	std::thread rest_thread([&]() {
+		for (int i = 0; i < num_runs; i++) {
+			vec7 q_rest_des = qact.q;
+			rest.run_qrest_optim(q_rest_des);
+			if (!approx_equal(q_rest_des,q_rest_ref,"absdiff",1e-8))
+				rest_same = false;
+		}
+	});
+	fp_thread.join();
+	dp_thread.join();
+	vhp_thread.join();
+	rest_thread.join();
+
+	BOOST_TEST(fp_same);
+	BOOST_TEST(dp_same);
+	BOOST_TEST(vhp_same);
+	BOOST_TEST(rest_same);
+}
+
 /*
  * Testing Lazy Player (or Defensive Player)
  */
@@ -532,6 +765,29 @@ static double calc_landing_res(unsigned n, const double *x, double *grad, void *
 /*
  * Initialize robot posture on the right size of the robot
  */
+/*
+ * Random ball entry of the lookup table, right-hand posture, joint limits
+ * and the desired racket parameters (FP) for the predicted ball path
+ */
+static void init_strike_problem(const double Tmax, joint & qact, double *lb, double *ub,
+                                EKF & filter, mat & balls_pred, optim_des & racket_params) {
+
+	const int N = 1000;
+	arma_rng::set_seed(randval);
+	vec::fixed<15> strike_params;
+	vec6 ball_state;
+	lookup_random_entry(ball_state,strike_params);
+	init_right_posture(qact.q);
+	set_bounds(lb,ub,0.01,Tmax);
+
+	mat66 P; P.eye();
+	filter.set_prior(ball_state,P);
+	balls_pred = filter.predict_path(DT,N);
+	vec2 ball_land_des = {0.0, dist_to_table - 3*table_length/4};
+	racket_params.Nmax = N;
+	racket_params = calc_racket_strategy(balls_pred,ball_land_des,0.8,racket_params);
+}
+
 static void init_right_posture(vec7 & q0) {
 
     q0(0) = 1.0;
@@ -22,6 +22,9 @@
 #include "player.hpp"
 #include "constants.h"
 #include "tabletennis.h"
+#include "ball_batch.h"
+#include "ball_path.h"
+#include "pred_cache.h"
 #include "kinematics.hpp"
 #include "kalman.h"
 
@@ -34,6 +37,10 @@ static void init_posture(vec7 & q0, int posture, bool verbose);
 // Optim tests
 void test_vhp_optim();
 void test_fp_optim();
+void test_knn_lookup();
+void test_multi_start_optim();
+void test_anytime_optim();
+void test_concurrent_optim();
 void test_dp_optim();
 //void test_time_efficiency();
 void find_rest_posture();
@@ -43,6 +50,8 @@ void test_symplectic_int_4th();
 
 // Kinematics tests
 void test_kin_deriv();
+void test_racket_state_deriv();
+void test_dual_deriv();
 void test_kinematics_calculations();
 
 // KF tests
@@ -51,14 +60,35 @@ void test_kf_discretize();
 void test_random_gen();
 void test_predict_update();
 void check_ekf();
+void check_ball_jacobian();
+void check_model_ekf();
+void bench_fixed_ekf();
+void check_sqrt_ekf();
+void check_ukf();
+void check_particle_filter();
+void check_imm();
+void check_rts_smoother();
+void check_estimate_prior();
+void check_stream_prior();
+void check_filter_history();
+void check_path_covariance();
+void check_ball_tracker();
 void test_predict_path();
 void check_mismatch_pred();
 //void test_outlier_detection();
 
 // Table tennis tests
 void test_touch_ground();
+void test_ball_kernel();
+void test_ball_batch();
+void test_ball_path();
+void test_pred_cache();
 void test_ball_ekf();
 void test_player_ekf_filter();
+void test_player_obs_queue();
+void test_player_obs_latency();
+void test_snapshot();
+void test_worker_pool();
 void count_land();
 void count_land_mpc();
 
@@ -74,6 +104,8 @@ test_suite* init_unit_test_suite(int /*argc*/, char* /*argv*/[]) {
     BOOST_TEST_MESSAGE("Testing kinematics functions...");
     ts->add(BOOST_TEST_CASE(&test_kinematics_calculations));
     ts->add(BOOST_TEST_CASE(&test_kin_deriv));
+    ts->add(BOOST_TEST_CASE(&test_racket_state_deriv));
+    ts->add(BOOST_TEST_CASE(&test_dual_deriv));
 
     BOOST_TEST_MESSAGE("Testing Kalman Filtering...");
     ts->add(BOOST_TEST_CASE(&test_kf_init));
@@ -81,6 +113,19 @@ test_suite* init_unit_test_suite(int /*argc*/, char* /*argv*/[]) {
     ts->add(BOOST_TEST_CASE(&test_random_gen));
     ts->add(BOOST_TEST_CASE(&test_predict_update));
     ts->add(BOOST_TEST_CASE(&check_ekf));
+    ts->add(BOOST_TEST_CASE(&check_ball_jacobian));
+    ts->add(BOOST_TEST_CASE(&check_model_ekf));
+    ts->add(BOOST_TEST_CASE(&bench_fixed_ekf));
+    ts->add(BOOST_TEST_CASE(&check_sqrt_ekf));
+    ts->add(BOOST_TEST_CASE(&check_ukf));
+    ts->add(BOOST_TEST_CASE(&check_particle_filter));
+    ts->add(BOOST_TEST_CASE(&check_imm));
+    ts->add(BOOST_TEST_CASE(&check_rts_smoother));
+    ts->add(BOOST_TEST_CASE(&check_estimate_prior));
+    ts->add(BOOST_TEST_CASE(&check_stream_prior));
+    ts->add(BOOST_TEST_CASE(&check_filter_history));
+    ts->add(BOOST_TEST_CASE(&check_path_covariance));
+    ts->add(BOOST_TEST_CASE(&check_ball_tracker));
     ts->add(BOOST_TEST_CASE(&test_predict_path));
     ts->add(BOOST_TEST_CASE(&check_mismatch_pred));
     //ts->add(BOOST_TEST_CASE(&test_outlier_detection)); // TOO LONG
@@ -88,6 +133,10 @@ test_suite* init_unit_test_suite(int /*argc*/, char* /*argv*/[]) {
     BOOST_TEST_MESSAGE("Testing optimization routines...");
     ts->add(BOOST_TEST_CASE(&test_vhp_optim));
     ts->add(BOOST_TEST_CASE(&test_fp_optim));
+    ts->add(BOOST_TEST_CASE(&test_knn_lookup));
+    ts->add(BOOST_TEST_CASE(&test_multi_start_optim));
+    ts->add(BOOST_TEST_CASE(&test_anytime_optim));
+    ts->add(BOOST_TEST_CASE(&test_concurrent_optim));
     ts->add(BOOST_TEST_CASE(&test_dp_optim));
     ts->add(BOOST_TEST_CASE(&find_rest_posture));
     //ts->add(BOOST_TEST_CASE(&test_time_efficiency)); // TOO LONG
@@ -97,8 +146,16 @@ test_suite* init_unit_test_suite(int /*argc*/, char* /*argv*/[]) {
 
     BOOST_TEST_MESSAGE("Finally testing table tennis tasks...");
     ts->add(BOOST_TEST_CASE(&test_touch_ground));
+    ts->add(BOOST_TEST_CASE(&test_ball_kernel));
+    ts->add(BOOST_TEST_CASE(&test_ball_batch));
+    ts->add(BOOST_TEST_CASE(&test_ball_path));
+    ts->add(BOOST_TEST_CASE(&test_pred_cache));
     ts->add(BOOST_TEST_CASE(&test_ball_ekf));
     ts->add(BOOST_TEST_CASE(&test_player_ekf_filter));
+    ts->add(BOOST_TEST_CASE(&test_player_obs_queue));
+    ts->add(BOOST_TEST_CASE(&test_player_obs_latency));
+    ts->add(BOOST_TEST_CASE(&test_snapshot));
+    ts->add(BOOST_TEST_CASE(&test_worker_pool));
     ts->add(BOOST_TEST_CASE(&count_land));
     ts->add(BOOST_TEST_CASE(&count_land_mpc));
 
@@ -153,7 +210,7 @@ void count_land_mpc() {
             robot = new Player(qact.q,filter,flags);
             tt.reset_stats();
             tt.set_ball_gun(0.05,ball_launch_side);
-            //robot.reset_filter(std_model,std_noise);
+            //robot.reset_filter();
             for (int i = 0; i < N; i++) { // one trial
                 obs = tt.get_ball_position() + std_noise * randn<vec>(3);
                 robot->play(qact, obs, qdes);
@@ -259,6 +316,134 @@ void test_touch_ground() {
 	BOOST_TEST(ball_pos(Z) == floor_level, boost::test_tools::tolerance(0.01));
 }
 
+/*
+ * Testing whether the allocation-free ball kernel (used by the EKF
+ * function pointers) predicts the same ball path as the Table Tennis class,
+ * including the bounce on the table
+ */
+void test_ball_kernel() {
+
+	BOOST_TEST_MESSAGE("Comparing ball kernel predictions with Table Tennis class...");
+	double topspin = -50.0;
+	TableTennis tt = TableTennis(true,false);
+	tt.set_topspin(topspin);
+	tt.set_ball_gun(0.05);
+	vec6 x = tt.get_ball_state();
+
+	int N = 500;
+	double dt = 0.002;
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(dt);
+		x = calc_spin_ball(x,dt,&topspin);
+	}
+	BOOST_TEST(tt.has_legally_bounced());
+	BOOST_TEST(norm(x - tt.get_ball_state()) < 1e-10);
+}
+
+/*
+ * Testing whether the batched ball simulator integrates each ball
+ * (and keeps its statistics) the same way as the Table Tennis class
+ */
+void test_ball_batch() {
+
+	BOOST_TEST_MESSAGE("Comparing batched ball simulator with Table Tennis class...");
+	const int num_balls = 20;
+	const int N = 1000;
+	const double dt = 0.002;
+	BallBatch batch = BallBatch(num_balls,true);
+	std::vector<TableTennis> balls(num_balls,TableTennis(true,false));
+	for (int j = 0; j < num_balls; j++) {
+		balls[j].set_ball_gun(0.05,j % 3);
+		batch.set_ball_state(j,balls[j].get_ball_state());
+	}
+	for (int i = 0; i < N; i++) {
+		batch.integrate_ball_states(dt);
+		for (int j = 0; j < num_balls; j++)
+			balls[j].integrate_ball_state(dt);
+	}
+	double max_err = 0.0;
+	int num_bounce_mismatch = 0;
+	for (int j = 0; j < num_balls; j++) {
+		max_err = std::max(max_err,norm(batch.get_ball_state(j) - balls[j].get_ball_state(),"inf"));
+		num_bounce_mismatch += (batch.get_status(j).legal_bounce != balls[j].has_legally_bounced());
+	}
+	BOOST_TEST(max_err < 1e-10);
+	BOOST_TEST(num_bounce_mismatch == 0);
+}
+
+/*
+ * Testing whether the adaptive-step dense ball path agrees with
+ * a fine-step Table Tennis prediction (including the bounce)
+ * while using much fewer flight model evaluations than fixed DT prediction
+ */
+void test_ball_path() {
+
+	BOOST_TEST_MESSAGE("Comparing dense ball path with fine-step Table Tennis prediction...");
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	BallPath path = BallPath(false);
+	path.predict(tt.get_ball_state(),2.0);
+
+	const double dt = 1e-5;
+	const int N = 100000; // compare for the first second
+	double max_err = 0.0;
+	for (int i = 1; i <= N; i++) {
+		tt.integrate_ball_state(dt);
+		if (i % 1000 == 0) {
+			vec6 ball_path_state = path.get_ball_state(i*dt);
+			max_err = std::max(max_err,norm(ball_path_state.head(3) - tt.get_ball_position(),"inf"));
+		}
+	}
+	BOOST_TEST(tt.has_legally_bounced());
+	BOOST_TEST(path.count_events(TABLE_CONTACT) == 1);
+	BOOST_TEST(max_err < 1e-3);
+	BOOST_TEST(path.get_num_evals() < (int)(2.0/DT)/10);
+}
+
+/*
+ * Testing whether the rolling prediction cache (shifted and extended
+ * every few ticks) agrees with predicting the ball from scratch
+ * and recomputes only when the ball state is corrected
+ */
+void test_pred_cache() {
+
+	BOOST_TEST_MESSAGE("Comparing rolling prediction cache with prediction from scratch...");
+	const double time_pred = 0.5;
+	const int N = (int)(time_pred/DT);
+	TableTennis tt = TableTennis(false,false);
+	tt.set_ball_gun(0.05);
+	PredictionCache cache = PredictionCache(false,time_pred,1e-3);
+	int tick;
+	for (tick = 0; tick < 200; tick++) {
+		if (tick % 5 == 0)
+			cache.update(tt.get_ball_state(),tick);
+		tt.integrate_ball_state(DT);
+	}
+	cache.update(tt.get_ball_state(),tick);
+	mat balls_pred = zeros<mat>(6,N);
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		balls_pred.col(i) = tt.get_ball_state();
+	}
+	BOOST_TEST(cache.get_stats().num_recomputes == 1);
+	BOOST_TEST(cache.get_stats().num_hits == 40);
+	BOOST_TEST(norm(cache.get_balls() - balls_pred,"inf") < 1e-10);
+
+	vec6 ball_corrected = cache.get_balls().col(0);
+	ball_corrected(DZ) += 0.01;
+	BOOST_TEST(cache.update(ball_corrected,tick+1));
+
+	// new topspin estimate invalidates the path of the spin model
+	PredictionCache spin_cache = PredictionCache(true,time_pred,1e-3);
+	spin_cache.update(ball_corrected,0);
+	const mat balls_init_spin = spin_cache.get_balls();
+	spin_cache.set_topspin(-30.0);
+	BOOST_TEST(spin_cache.update(ball_corrected,0));
+	BOOST_TEST(norm(spin_cache.get_balls() - balls_init_spin,"inf") > 1e-6);
+	spin_cache.set_topspin(-30.0);
+	BOOST_TEST(!spin_cache.update(ball_corrected,0));
+}
+
 /*
  * Testing whether the errors in the EKF filter estimate
  * are shrinking
@@ -338,6 +523,216 @@ void test_player_ekf_filter() {
 	//BOOST_TEST(filter_est[Z] == floor_level, boost::test_tools::tolerance(0.1));
 }
 
+/*
+ * Observations are pushed to the queue every 3 ticks (vision slower than
+ * the servo loop) and some are pushed twice. Player should drain them
+ * with their timestamps and track the ball state at the tick times.
+ */
+void test_player_obs_queue() {
+
+	BOOST_TEST_MESSAGE("Testing Player class's filtering with an observation queue...");
+
+	const int N = 150;
+	const int VISION_RATE = 3; // ticks per observation
+	const double std_noise = 0.001;
+	const double std_model = 0.001;
+	TableTennis tt = TableTennis(false,true);
+	EKF filter = init_filter(std_model,std_noise);
+	player_flags flags;
+	Player cp = Player(zeros<vec>(NDOF),filter,flags);
+	ObsQueue queue;
+	ball_obs obs;
+	vec err = zeros<vec>(N);
+	tt.set_ball_gun(0.2);
+
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		const double time = (i+1) * DT;
+		if (i % VISION_RATE == 0) {
+			obs.time = time;
+			vec3 pos = tt.get_ball_position() + std_noise * randn<vec>(3);
+			for (int j = 0; j < NCART; j++)
+				obs.pos[j] = pos(j);
+			BOOST_TEST(queue.push(obs));
+			if (i % (2*VISION_RATE) == 0)
+				queue.push(obs); // duplicate should be dropped
+		}
+		err(i) = norm(tt.get_ball_state() - cp.filt_ball_state(queue,time),2);
+		BOOST_TEST(queue.size() == 0);
+	}
+	cout << "Error of state estimate start: " << err(0) << " end: " << err(N-1) << endl;
+	BOOST_TEST(cp.filter_is_initialized());
+	BOOST_TEST(err(N-1) < err(0), boost::test_tools::tolerance(0.01));
+}
+
+/*
+ * Observations are pushed to the queue a few ticks after they are captured,
+ * so they are all older than the filter estimate (which is predicted to
+ * the current tick). Player should still update the filter with them
+ * at their capture times: the covariance should shrink after the filter
+ * is started.
+ */
+void test_player_obs_latency() {
+
+	BOOST_TEST_MESSAGE("Testing Player class's filtering with delayed observations...");
+
+	const int N = 150;
+	const int VISION_RATE = 3; // ticks per observation
+	const int LATENCY = 4; // ticks between capture and push
+	const double std_noise = 0.001;
+	const double std_model = 0.001;
+	TableTennis tt = TableTennis(false,true);
+	EKF filter = init_filter(std_model,std_noise);
+	player_flags flags;
+	flags.vision_latency = LATENCY * DT;
+	Player cp = Player(zeros<vec>(NDOF),filter,flags);
+	ObsQueue queue;
+	ball_obs obs;
+	mat balls = zeros<mat>(NCART,N); // captured positions
+	vec err = zeros<vec>(N);
+	int num_updates = 0;
+	double last_var = 0.0;
+	tt.set_ball_gun(0.2);
+
+	for (int i = 0; i < N; i++) {
+		tt.integrate_ball_state(DT);
+		const double time = (i+1) * DT;
+		balls.col(i) = tt.get_ball_position() + std_noise * randn<vec>(3);
+		const int i_capt = i - LATENCY;
+		if (i_capt >= 0 && i_capt % VISION_RATE == 0) {
+			obs.time = (i_capt+1) * DT;
+			for (int j = 0; j < NCART; j++)
+				obs.pos[j] = balls(j,i_capt);
+			BOOST_TEST(queue.push(obs));
+		}
+		err(i) = norm(tt.get_ball_state() - cp.filt_ball_state(queue,time),2);
+		if (cp.filter_is_initialized()) {
+			const double var = trace(filter.get_covar());
+			if (last_var > 0.0 && var < last_var)
+				num_updates++;
+			last_var = var;
+		}
+	}
+	cout << "Error of state estimate start: " << err(0) << " end: " << err(N-1) << endl;
+	cout << "Delayed observations applied: " << num_updates << endl;
+	BOOST_TEST(cp.filter_is_initialized());
+	BOOST_TEST(num_updates > 0);
+	BOOST_TEST(err(N-1) < err(0), boost::test_tools::tolerance(0.01));
+}
+
+/*
+ * Background thread publishes ball estimates while the main thread
+ * keeps reading them. Every successful read should be consistent
+ * (not torn) and reads should never go back in time.
+ */
+void test_snapshot() {
+
+	BOOST_TEST_MESSAGE("Testing seqlock snapshot between estimation thread and player...");
+
+	const int N = 20000;
+	Snapshot<optim::ball_prior> snapshot;
+	optim::ball_prior est;
+	BOOST_TEST(!snapshot.read(est)); // nothing published yet
+
+	std::thread writer([&snapshot]() {
+		optim::ball_prior val;
+		for (int k = 1; k <= N; k++) {
+			val.id = k;
+			val.time = val.topspin = k;
+			for (int i = 0; i < 2*NCART; i++) {
+				val.x[i] = k;
+				for (int j = 0; j < 2*NCART; j++)
+					val.P[i][j] = k;
+			}
+			snapshot.publish(val);
+			if (k % 100 == 0)
+				std::this_thread::yield();
+		}
+	});
+
+	int last_id = 0;
+	int num_reads = 0;
+	bool consistent = true;
+	while (last_id < N) {
+		if (snapshot.read(est)) {
+			num_reads++;
+			consistent = consistent && (est.id >= last_id) && (est.time == est.id) && (est.topspin == est.id);
+			for (int i = 0; i < 2*NCART; i++) {
+				consistent = consistent && (est.x[i] == est.id);
+				for (int j = 0; j < 2*NCART; j++)
+					consistent = consistent && (est.P[i][j] == est.id);
+			}
+			last_id = est.id;
+		}
+		std::this_thread::yield();
+	}
+	writer.join();
+	cout << "Consistent reads: " << num_reads << endl;
+	BOOST_TEST(consistent);
+	BOOST_TEST(snapshot.version() == (unsigned long)N);
+}
+
+/*
+ * Jobs queued behind a busy worker should start in the order of
+ * priority, and jobs that cannot start before their deadline
+ * (or before the pool shuts down) are dropped.
+ */
+void test_worker_pool() {
+
+	BOOST_TEST_MESSAGE("Testing priorities and deadlines of the worker pool jobs...");
+
+	WorkerPool pool(1);
+	std::mutex mtx;
+	std::vector<int> order;
+	std::atomic<bool> started(false), release(false);
+	auto record = [&](int id) { std::lock_guard<std::mutex> lock(mtx); order.push_back(id); };
+
+	std::shared_future<bool> busy = pool.submit([&]() {
+		started.store(true);
+		while (!release.load())
+			std::this_thread::yield();
+	});
+	while (!started.load())
+		std::this_thread::yield();
+	std::shared_future<bool> low = pool.submit(std::bind(record,0),PRIORITY_LOW);
+	std::shared_future<bool> expired = pool.submit(std::bind(record,1),PRIORITY_HIGH,0.001);
+	std::shared_future<bool> normal = pool.submit(std::bind(record,2),PRIORITY_NORMAL);
+	std::shared_future<bool> high = pool.submit(std::bind(record,3),PRIORITY_HIGH);
+	BOOST_TEST((low.wait_for(std::chrono::seconds(0)) != std::future_status::ready));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	release.store(true);
+	pool.wait_idle();
+
+	BOOST_TEST(busy.get());
+	BOOST_TEST(!expired.get());
+	BOOST_TEST((high.get() && normal.get() && low.get()));
+	BOOST_TEST((order == std::vector<int>({3, 2, 0})));
+
+	// jobs still queued when the pool shuts down are dropped
+	std::shared_future<bool> queued;
+	std::thread releaser;
+	started.store(false);
+	release.store(false);
+	{
+		WorkerPool pool_shut(1);
+		pool_shut.submit([&]() {
+			started.store(true);
+			while (!release.load())
+				std::this_thread::yield();
+		});
+		while (!started.load())
+			std::this_thread::yield();
+		queued = pool_shut.submit(std::bind(record,4));
+		releaser = std::thread([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			release.store(true);
+		});
+	} // busy job is released while the pool shuts down
+	releaser.join();
+	BOOST_TEST(!queued.get());
+}
+
 /*
  * Initialize robot posture
  */